@@ -70,4 +70,27 @@ LDFLAGS := \
   -arch x86_64 \
   -framework Hypervisor \
   -framework vmnet \
+  -lz \
   $(LDFLAGS_DBG)
+
+###############################################################################
+# blockif-bench                                                               #
+#                                                                             #
+# Built with the host toolchain so it also runs on machines without           #
+# Hypervisor.framework (e.g. Linux CI).                                       #
+###############################################################################
+
+BENCH_CC := cc
+
+BENCH_CFLAGS := \
+  -std=gnu11 \
+  -O2 \
+  -g \
+  -D_GNU_SOURCE \
+  -Wall \
+  -Wno-unknown-pragmas \
+  $(DEFINES)
+
+BENCH_LDFLAGS := \
+  -lpthread \
+  -lz
@@ -33,6 +33,7 @@ void initialize_machine_config(xhyve_virtual_machine_t *machine);
 void load_machine_config(xhyve_virtual_machine_t *machine, const char *machine_name, int newFile);
 void write_machine_config(xhyve_virtual_machine_t *machine, char *config_path);
 void parse_args(xhyve_virtual_machine_t *machine, const char *command, const char *param);
+int run_disk_command(const char *command, int argc, char **argv);
 int print_usage(void);
 void form_config_string(char **ret, const char* fmt, ...);
 void cleanup(void *ptr);
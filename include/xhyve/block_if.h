@@ -40,6 +40,11 @@
 
 #define BLOCKIF_IOV_MAX 33 /* not practical to be IOV_MAX */
 
+/* Values of the "cache=" option, see blockif_cache_mode() */
+#define BLOCKIF_CACHE_WRITEBACK 0 /* writes cached until flushed */
+#define BLOCKIF_CACHE_WRITETHROUGH 1 /* writes stable on completion */
+#define BLOCKIF_CACHE_UNSAFE 2 /* flushes ignored */
+
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
 struct blockif_req {
@@ -53,6 +58,9 @@ struct blockif_req {
 #pragma clang diagnostic pop
 
 struct blockif_ctxt;
+char *blockif_split_opts(const char *opts,
+	int (*match)(const char *opt, void *arg), void *arg);
+int blockif_opt_int(const char *opt, const char *name, int *val);
 struct blockif_ctxt *blockif_open(const char *optstr, const char *ident);
 off_t blockif_size(struct blockif_ctxt *bc);
 void blockif_chs(struct blockif_ctxt *bc, uint16_t *c, uint8_t *h, uint8_t *s);
@@ -61,6 +69,9 @@ void blockif_psectsz(struct blockif_ctxt *bc, int *size, int *off);
 int blockif_queuesz(struct blockif_ctxt *bc);
 int blockif_is_ro(struct blockif_ctxt *bc);
 int blockif_candelete(struct blockif_ctxt *bc);
+int blockif_cache_mode(struct blockif_ctxt *bc);
+int blockif_get_wce(struct blockif_ctxt *bc);
+void blockif_set_wce(struct blockif_ctxt *bc, int wce);
 int blockif_read(struct blockif_ctxt *bc, struct blockif_req *breq);
 int blockif_write(struct blockif_ctxt *bc, struct blockif_req *breq);
 int blockif_flush(struct blockif_ctxt *bc, struct blockif_req *breq);
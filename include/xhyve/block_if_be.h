@@ -0,0 +1,260 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Storage backends behind block_if.c. A plain image file is accessed
+ * directly; anything else is reached through a struct blockif_backend
+ * chosen by blockif_open(). The routines are only ever called from the
+ * blockif worker threads.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+struct blockif_backend {
+	const char *bb_name;
+	/* Return bytes transferred, or -1 with errno set */
+	ssize_t (*bb_preadv)(void *arg, const struct iovec *iov, int iovcnt,
+		off_t offset);
+	/* NULL for read-only backends */
+	ssize_t (*bb_pwritev)(void *arg, const struct iovec *iov, int iovcnt,
+		off_t offset);
+	/* Make completed writes stable; 0 or an errno value */
+	int (*bb_flush)(void *arg);
+	/*
+	 * Deallocate a range, which then reads as zeroes; 0 or an errno
+	 * value. NULL if not supported, as is an error for a zero length.
+	 */
+	int (*bb_delete)(void *arg, off_t offset, off_t len);
+	void (*bb_close)(void *arg);
+};
+
+/*
+ * Reads the disk from outside the block i/o thread, for the helpers
+ * below; 0 or an errno value.
+ */
+typedef int blockif_read_t(void *arg, void *buf, size_t len, off_t off);
+
+/*
+ * VMs exit without closing their disks. Layers with state that has to
+ * reach the disk embed one of these while open; ae_fn is called from
+ * atexit(3) for each, the most recently added first, so a layer goes
+ * before the ones it stacks on.
+ */
+struct blockif_atexit {
+	LIST_ENTRY(blockif_atexit) ae_link;
+	void (*ae_fn)(void *arg);
+	void *ae_arg;
+};
+
+void blockif_atexit_add(struct blockif_atexit *ae, void (*fn)(void *arg),
+	void *arg);
+void blockif_atexit_remove(struct blockif_atexit *ae);
+
+/*
+ * Scatter/gather for layers that split requests. blockif_iov_slice()
+ * describes len bytes at skip in iov with at most BLOCKIF_IOV_SLICE
+ * segments. blockif_iov_copy() copies len bytes between skip in iov
+ * and buf, which NULL reads as zeroes. blockif_iov_xfer() moves them
+ * to or from off of a plain file, or of a backend if be is set; 0 or
+ * an errno value.
+ */
+#define BLOCKIF_IOV_SLICE 64
+
+int blockif_iov_slice(const struct iovec *iov, int iovcnt, size_t skip,
+	size_t len, struct iovec *out);
+void blockif_iov_copy(const struct iovec *iov, int iovcnt, size_t skip,
+	uint8_t *buf, size_t len, int toiov);
+int blockif_iov_xfer(int fd, const struct blockif_backend *be, void *bearg,
+	const struct iovec *iov, int iovcnt, size_t skip, size_t len, off_t off,
+	int write);
+
+/*
+ * fdatasync(2) through to stable storage: on OS X that needs
+ * F_FULLFSYNC, without which the data may still sit in the drive's
+ * volatile write cache. -1 and errno on failure.
+ */
+int blockif_fdatasync(int fd);
+
+/*
+ * Image file formats, as given by format= or recorded in an overlay for
+ * its backing image. The format of an image is never guessed from its
+ * contents, which the guest may have written.
+ */
+#define BLOCKIF_FMT_RAW 0
+#define BLOCKIF_FMT_CZ 1
+#define BLOCKIF_FMT_OV 2
+#define BLOCKIF_FMT_DD 3
+
+int blockif_fmt_parse(const char *name);
+const char *blockif_fmt_name(int fmt);
+
+/*
+ * Seekable compressed read-only images, see block_if_cz.c
+ */
+extern const struct blockif_backend blockif_cz_backend;
+void *blockif_cz_open(const char *path, off_t *size);
+int blockif_cz_create(const char *src, const char *dst, int chunk_shift);
+
+/*
+ * Overlay images forming external snapshot chains, see block_if_ov.c
+ */
+#define BLOCKIF_OV_PATH_MAX 1024
+#define BLOCKIF_OV_NAME_MAX 64
+#define BLOCKIF_OV_MAXLAYERS 1024
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct blockif_ov_info {
+	int oi_overlay; /* 0 for the base of a chain */
+	int oi_backing_fmt;
+	off_t oi_size; /* virtual disk size */
+	off_t oi_used; /* host space taken by this file */
+	char oi_backing[BLOCKIF_OV_PATH_MAX];
+	char oi_name[BLOCKIF_OV_NAME_MAX];
+};
+#pragma clang diagnostic pop
+
+extern const struct blockif_backend blockif_ov_backend;
+void *blockif_ov_open(const char *path, int ro, off_t *size);
+int blockif_ov_create(const char *path, const char *backing, int backing_fmt,
+	const char *name);
+int blockif_ov_info(const char *path, int fmt, struct blockif_ov_info *info);
+off_t blockif_ov_seek(void *arg, off_t offset, int whence);
+
+/*
+ * Disks striped across several files, see block_if_stripe.c
+ */
+#define BLOCKIF_STRIPE_MAX 32
+
+extern const struct blockif_backend blockif_stripe_backend;
+int blockif_stripe_probe(const char *path);
+void *blockif_stripe_open(const char *spec, char **paths, int n, int ro,
+	int nocache, off_t *size);
+
+/*
+ * Disks on an NBD server, see block_if_nbd.c
+ */
+extern const struct blockif_backend blockif_nbd_backend;
+int blockif_nbd_probe(const char *path);
+void *blockif_nbd_open(const char *path, int *ro, off_t *size);
+
+/*
+ * Deduplicated images sharing a chunk store, see block_if_dd.c
+ */
+extern const struct blockif_backend blockif_dd_backend;
+void *blockif_dd_open(const char *path, const char *store, int ro,
+	off_t *size);
+int blockif_dd_create(const char *path, const char *store, off_t size);
+int blockif_dd_register(const char *path);
+int blockif_dd_unregister(const char *store, const char *path);
+int blockif_dd_gc(const char *store);
+
+/*
+ * Cache of a slow disk in a file on local SSD, see block_if_ssd.c.
+ * Stacks on the backend, or on fd if be is NULL, and closes the backend.
+ */
+extern const struct blockif_backend blockif_ssd_backend;
+void *blockif_ssd_open(const char *spec, const char *disk,
+	const struct blockif_backend *be, void *bearg, int fd, off_t size,
+	int writeable);
+
+/*
+ * Throwaway write overlay in memory, see block_if_eph.c. Stacks on the
+ * backend, or on fd if be is NULL, and closes the backend.
+ */
+extern const struct blockif_backend blockif_eph_backend;
+void *blockif_eph_open(const char *spec, const struct blockif_backend *be,
+	void *bearg, int fd, off_t size);
+
+/*
+ * Point in time NBD export of a running disk, see block_if_export.c
+ */
+struct blockif_export;
+
+struct blockif_export *blockif_export_open(const char *path, off_t size,
+	blockif_read_t *rd, void *arg);
+void blockif_export_cbw(struct blockif_export *ex, off_t off, off_t len);
+void blockif_export_close(struct blockif_export *ex);
+
+/*
+ * Boot prefetch profiles, see block_if_prefetch.c
+ */
+struct blockif_prefetch;
+struct blockif_prefetch *blockif_prefetch_open(const char *spec, off_t size,
+	blockif_read_t *rd, void *arg);
+void blockif_prefetch_record(struct blockif_prefetch *pf, off_t off,
+	off_t len);
+void blockif_prefetch_close(struct blockif_prefetch *pf);
+
+/*
+ * Allocation ahead of sequential writes to sparse images, see
+ * block_if_prealloc.c
+ */
+struct blockif_prealloc;
+struct blockif_prealloc *blockif_prealloc_open(const char *spec, int fd,
+	off_t size);
+void blockif_prealloc_write(struct blockif_prealloc *pa, off_t off,
+	off_t len);
+void blockif_prealloc_close(struct blockif_prealloc *pa);
+
+/*
+ * Capture of request traces, see block_if_trace.c
+ */
+struct blockif_trace;
+struct blockif_trace *blockif_trace_open(const char *path, off_t size,
+	int sectsz);
+uint64_t blockif_trace_clock(void);
+void blockif_trace_record(struct blockif_trace *tr, int op, off_t off,
+	size_t len, uint64_t start, int qd, int err);
+void blockif_trace_close(struct blockif_trace *tr);
+
+/*
+ * Persistent bitmaps of the blocks written since the last backup, see
+ * block_if_dirty.c
+ */
+struct blockif_dirty;
+struct blockif_dirty *blockif_dirty_open(const char *image, off_t size,
+	const char *gran);
+void blockif_dirty_mark(struct blockif_dirty *dt, off_t off, off_t len);
+void blockif_dirty_close(struct blockif_dirty *dt);
+struct blockif_dirty *blockif_dirty_load(const char *image, off_t size,
+	int *valid);
+off_t blockif_dirty_next(struct blockif_dirty *dt, off_t off, off_t *len);
+int blockif_dirty_checkpoint(struct blockif_dirty *dt);
+void blockif_dirty_unload(struct blockif_dirty *dt);
+
+/*
+ * Offline copy, conversion and compaction of images, see block_if_img.c
+ */
+int blockif_img_copy(const char *src, int srcfmt, const char *dst);
+int blockif_img_convert(const char *src, int srcfmt, const char *dst,
+	const char *fmt);
+int blockif_img_compact(const char *path, int fmt);
+int blockif_img_backup(const char *image, int fmt, const char *target);
@@ -0,0 +1,65 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Block i/o traces, written by the trace= disk option and read by
+ * blockif-replay. Host byte order:
+ *
+ *   struct blockif_trace_header
+ *   struct blockif_trace_rec	one per request, in completion order
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define BLOCKIF_TRACE_MAGIC "XHYVETR1"
+#define BLOCKIF_TRACE_VERSION 1
+
+/* tr_op */
+#define BLOCKIF_TRACE_READ 0
+#define BLOCKIF_TRACE_WRITE 1
+#define BLOCKIF_TRACE_FLUSH 2
+#define BLOCKIF_TRACE_DELETE 3
+
+struct blockif_trace_header {
+	char th_magic[8];
+	uint32_t th_version;
+	uint32_t th_sectsz;
+	uint64_t th_size; /* disk size */
+	uint64_t th_time; /* start, seconds since the epoch */
+};
+
+struct blockif_trace_rec {
+	uint64_t tr_time; /* submitted, ns since the start */
+	uint64_t tr_off;
+	uint32_t tr_len;
+	uint32_t tr_lat; /* submitted to completed, us */
+	uint16_t tr_qd; /* requests in flight, this one included */
+	uint8_t tr_op;
+	uint8_t tr_err; /* errno, 0 if it succeeded */
+	uint32_t tr_pad;
+};
@@ -0,0 +1,160 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Network Block Device protocol, fixed newstyle negotiation only.
+ * All fields are big endian on the wire.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define NBD_MAGIC		0x4e42444d41474943ULL	/* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC		0x49484156454f5054ULL	/* "IHAVEOPT" */
+#define NBD_REP_MAGIC		0x0003e889045565a9ULL
+
+/* handshake flags, from the server */
+#define NBD_FLAG_FIXED_NEWSTYLE	(1 << 0)
+#define NBD_FLAG_NO_ZEROES	(1 << 1)
+
+/* client flags */
+#define NBD_FLAG_C_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_C_NO_ZEROES	(1 << 1)
+
+/* options */
+#define NBD_OPT_EXPORT_NAME	1
+#define NBD_OPT_ABORT		2
+#define NBD_OPT_LIST		3
+#define NBD_OPT_INFO		6
+#define NBD_OPT_GO		7
+#define NBD_OPT_STRUCTURED_REPLY 8
+
+/* option replies */
+#define NBD_REP_ACK		1
+#define NBD_REP_SERVER		2
+#define NBD_REP_INFO		3
+#define NBD_REP_FLAG_ERROR	(1U << 31)
+#define NBD_REP_ERR_UNSUP	(NBD_REP_FLAG_ERROR | 1)
+#define NBD_REP_ERR_POLICY	(NBD_REP_FLAG_ERROR | 2)
+#define NBD_REP_ERR_INVALID	(NBD_REP_FLAG_ERROR | 3)
+#define NBD_REP_ERR_UNKNOWN	(NBD_REP_FLAG_ERROR | 6)
+
+/* information types of NBD_REP_INFO */
+#define NBD_INFO_EXPORT		0
+#define NBD_INFO_BLOCK_SIZE	3
+
+/* transmission flags */
+#define NBD_FLAG_HAS_FLAGS	(1 << 0)
+#define NBD_FLAG_READ_ONLY	(1 << 1)
+#define NBD_FLAG_SEND_FLUSH	(1 << 2)
+#define NBD_FLAG_SEND_FUA	(1 << 3)
+#define NBD_FLAG_ROTATIONAL	(1 << 4)
+#define NBD_FLAG_SEND_TRIM	(1 << 5)
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+#define NBD_FLAG_SEND_DF	(1 << 7)
+#define NBD_FLAG_CAN_MULTI_CONN	(1 << 8)
+
+/* transmission phase */
+#define NBD_REQUEST_MAGIC	0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC	0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+#define NBD_CMD_READ		0
+#define NBD_CMD_WRITE		1
+#define NBD_CMD_DISC		2
+#define NBD_CMD_FLUSH		3
+#define NBD_CMD_TRIM		4
+#define NBD_CMD_WRITE_ZEROES	6
+
+#define NBD_CMD_FLAG_FUA	(1 << 0)
+#define NBD_CMD_FLAG_NO_HOLE	(1 << 1)
+#define NBD_CMD_FLAG_DF		(1 << 2)
+
+#define NBD_REPLY_FLAG_DONE	(1 << 0)
+
+#define NBD_REPLY_TYPE_NONE	0
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_OFFSET_HOLE 2
+#define NBD_REPLY_TYPE_ERROR	((1 << 15) | 1)
+#define NBD_REPLY_TYPE_ERROR_OFFSET ((1 << 15) | 2)
+#define NBD_REPLY_TYPE_IS_ERR(t) (((t) & (1 << 15)) != 0)
+
+/* errors, independent of the host errno values */
+#define NBD_EPERM		1
+#define NBD_EIO			5
+#define NBD_ENOMEM		12
+#define NBD_EINVAL		22
+#define NBD_ENOSPC		28
+#define NBD_EOVERFLOW		75
+#define NBD_ENOTSUP		95
+#define NBD_ESHUTDOWN		108
+
+#define NBD_MAX_STRING		4096
+
+/* message sizes, fields at these offsets */
+#define NBD_REQUEST_SIZE	28	/* magic flags.16 type.16 handle offset.64 length */
+#define NBD_SIMPLE_REPLY_SIZE	16	/* magic error handle */
+#define NBD_STRUCTURED_REPLY_SIZE 20	/* magic flags.16 type.16 handle length */
+
+static inline void
+nbd_enc16(uint8_t *p, uint16_t v)
+{
+	p[0] = (uint8_t) (v >> 8);
+	p[1] = (uint8_t) v;
+}
+
+static inline void
+nbd_enc32(uint8_t *p, uint32_t v)
+{
+	nbd_enc16(p, (uint16_t) (v >> 16));
+	nbd_enc16(p + 2, (uint16_t) v);
+}
+
+static inline void
+nbd_enc64(uint8_t *p, uint64_t v)
+{
+	nbd_enc32(p, (uint32_t) (v >> 32));
+	nbd_enc32(p + 4, (uint32_t) v);
+}
+
+static inline uint16_t
+nbd_dec16(const uint8_t *p)
+{
+	return ((uint16_t) ((p[0] << 8) | p[1]));
+}
+
+static inline uint32_t
+nbd_dec32(const uint8_t *p)
+{
+	return ((((uint32_t) nbd_dec16(p)) << 16) | nbd_dec16(p + 2));
+}
+
+static inline uint64_t
+nbd_dec64(const uint8_t *p)
+{
+	return ((((uint64_t) nbd_dec32(p)) << 32) | nbd_dec32(p + 4));
+}
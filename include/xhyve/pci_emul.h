@@ -211,6 +211,8 @@ int pci_emul_alloc_bar(struct pci_devinst *pdi, int idx,
 	enum pcibar_type type, uint64_t size);
 int pci_emul_alloc_pbar(struct pci_devinst *pdi, int idx,
 	uint64_t hostbase, enum pcibar_type type, uint64_t size);
+int pci_emul_add_capability(struct pci_devinst *pi, u_char *capdata,
+	int caplen);
 int pci_emul_add_msicap(struct pci_devinst *pi, int msgnum);
 int pci_emul_add_pciecap(struct pci_devinst *pi, int pcie_device_type);
 void pci_generate_msi(struct pci_devinst *pi, int msgnum);
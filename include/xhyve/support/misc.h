@@ -12,7 +12,9 @@
 #define __aligned(x) __attribute__ ((aligned ((x))))
 #define __packed __attribute__ ((packed))
 #define nitems(x) (sizeof((x)) / sizeof((x)[0]))
+#ifndef powerof2
 #define powerof2(x)	((((x)-1)&(x))==0)
+#endif
 #define roundup2(x, y) (((x)+((y)-1))&(~((y)-1))) /* if y is powers of two */
 #define nitems(x) (sizeof((x)) / sizeof((x)[0]))
 #define min(x, y) (((x) < (y)) ? (x) : (y))
@@ -45,6 +47,9 @@
 
 #define	VM_SUCCESS 0
 
+/* lib/libutil/expand_number.c */
+int expand_number(const char *buf, uint64_t *num);
+
 /* sys/sys/types.h */
 typedef	unsigned char u_char;
 typedef	unsigned short u_short;
@@ -159,6 +159,55 @@ struct vring_used {
 /*	uint16_t vu_avail_event; -- after N ring entries */
 } __packed;
 
+/*
+ * With VIRTIO_F_RING_PACKED the three areas are replaced by a single
+ * ring of <N> 16-byte descriptors (<N> need not be a power of two)
+ * and two small event suppression structures, one written by the
+ * driver and one by the device.
+ *
+ * A packed descriptor has the guest physical <addr> and <len> of a
+ * split one, a 16-bit buffer <id> and 16-bit <flags>.  The driver
+ * makes a chain of descriptors available by filling consecutive ring
+ * slots (wrapping at <N>) with NEXT set in all but the last, which
+ * carries the buffer <id>, and marks the chain available by setting
+ * AVAIL to its wrap counter and USED to the inverse, in the first
+ * descriptor last.  The wrap counter starts at 1 and flips each time
+ * the ring wraps.  An INDIRECT descriptor points at a table of packed
+ * descriptors, all of which belong to the chain; NEXT is not used
+ * there.
+ *
+ * The device returns a buffer by overwriting the slot at its own
+ * position in the ring with the <id> and the number of bytes written,
+ * setting AVAIL and USED both to its wrap counter, and moving on by
+ * the number of slots the chain took.  So requests and completions
+ * travel through the same cache lines and there is no separate index
+ * to read or write.
+ *
+ * Each event suppression structure has 16-bit <off_wrap> and <flags>:
+ * ENABLE, DISABLE, or with VIRTIO_RING_F_EVENT_IDX, DESC, which asks
+ * for an event only once the ring slot and wrap counter in <off_wrap>
+ * have been used (by the device) or made available (by the driver).
+ */
+#define	VRING_PACKED_DESC_F_AVAIL	(1 << 7)
+#define	VRING_PACKED_DESC_F_USED	(1 << 15)
+
+struct virtio_packed_desc {
+	uint64_t vpd_addr; /* guest physical address */
+	uint32_t vpd_len; /* length of scatter/gather seg */
+	uint16_t vpd_id; /* buffer id, in the last desc of a chain */
+	uint16_t vpd_flags; /* VRING_DESC_F_*, VRING_PACKED_DESC_F_* */
+} __packed;
+
+#define	VRING_PACKED_EVENT_F_ENABLE	0
+#define	VRING_PACKED_EVENT_F_DISABLE	1
+#define	VRING_PACKED_EVENT_F_DESC	2
+#define	VRING_PACKED_EVENT_WRAP		(1 << 15)
+
+struct vring_packed_event {
+	uint16_t vpe_off_wrap; /* ring slot, wrap counter in bit 15 */
+	uint16_t vpe_flags; /* VRING_PACKED_EVENT_F_* */
+} __packed;
+
 #pragma clang diagnostic pop
 
 /*
@@ -248,6 +297,7 @@ struct vring_used {
 #define	VTCFG_STATUS_ACK	0x01	/* guest OS has acknowledged dev */
 #define	VTCFG_STATUS_DRIVER	0x02	/* guest OS driver is loaded */
 #define	VTCFG_STATUS_DRIVER_OK	0x04	/* guest OS driver ready */
+#define	VTCFG_STATUS_FEATURES_OK 0x08	/* features final (modern only) */
 #define	VTCFG_STATUS_FAILED	0x80	/* guest has given up on this dev */
 
 /*
@@ -260,6 +310,77 @@ struct vring_used {
 
 #define VIRTIO_MSI_NO_VECTOR	0xFFFF
 
+/*
+ * The modern (virtio 1.0) PCI transport.  Vendor specific capabilities
+ * in PCI config space locate each group of registers within a memory
+ * BAR: the common configuration, which takes the place of the legacy
+ * registers above with 64 bits of features and a set of ring addresses
+ * per queue, the ISR byte, the device configuration, and the notify
+ * area, where the guest kicks queue <n> by writing to offset
+ * <n> * VTMOD_NOTIFY_MULT.  Devices offer it next to the legacy I/O
+ * BAR, and the guest driver picks one.
+ */
+#define	VIRTIO_PCI_CAP_COMMON_CFG	1
+#define	VIRTIO_PCI_CAP_NOTIFY_CFG	2
+#define	VIRTIO_PCI_CAP_ISR_CFG		3
+#define	VIRTIO_PCI_CAP_DEVICE_CFG	4
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpacked"
+
+struct virtio_pci_cap {
+	uint8_t cap_vndr; /* PCIY_VENDOR */
+	uint8_t cap_next;
+	uint8_t cap_len;
+	uint8_t cfg_type; /* VIRTIO_PCI_CAP_* */
+	uint8_t bar;
+	uint8_t padding[3];
+	uint32_t offset; /* within the BAR */
+	uint32_t length;
+} __packed;
+
+struct virtio_pci_notify_cap {
+	struct virtio_pci_cap cap;
+	uint32_t notify_off_multiplier;
+} __packed;
+
+#pragma clang diagnostic pop
+
+/*
+ * Common configuration registers, offsets from VTMOD_COMMON.
+ * The queue registers refer to the queue selected by QSEL.
+ */
+#define	VTMOD_R_DFSELECT	0	/* device feature word select */
+#define	VTMOD_R_DF		4	/* device features, 32 at a time */
+#define	VTMOD_R_GFSELECT	8	/* guest feature word select */
+#define	VTMOD_R_GF		12	/* guest features, 32 at a time */
+#define	VTMOD_R_CFGVEC		16
+#define	VTMOD_R_NUMQ		18
+#define	VTMOD_R_STATUS		20
+#define	VTMOD_R_CFGGEN		21
+#define	VTMOD_R_QSEL		22
+#define	VTMOD_R_QSIZE		24
+#define	VTMOD_R_QVEC		26
+#define	VTMOD_R_QENABLE		28
+#define	VTMOD_R_QNOFF		30	/* notify offset, / MULT */
+#define	VTMOD_R_QDESC_LO	32
+#define	VTMOD_R_QDESC_HI	36
+#define	VTMOD_R_QAVAIL_LO	40
+#define	VTMOD_R_QAVAIL_HI	44
+#define	VTMOD_R_QUSED_LO	48
+#define	VTMOD_R_QUSED_HI	52
+#define	VTMOD_COMMON_SIZE	56
+
+/*
+ * Layout of the modern BAR, one page per group of registers.
+ */
+#define	VTMOD_COMMON		0x0000
+#define	VTMOD_ISR		0x1000
+#define	VTMOD_DEVICE		0x2000
+#define	VTMOD_NOTIFY		0x3000
+#define	VTMOD_BAR_SIZE		0x4000
+#define	VTMOD_NOTIFY_MULT	4
+
 /*
  * Feature flags.
  * Note: bits 0 through 23 are reserved to each device type.
@@ -267,6 +388,13 @@ struct vring_used {
 #define	VIRTIO_F_NOTIFY_ON_EMPTY	(1 << 24)
 #define	VIRTIO_RING_F_INDIRECT_DESC	(1 << 28)
 #define	VIRTIO_RING_F_EVENT_IDX		(1 << 29)
+#define	VIRTIO_F_VERSION_1		(1ULL << 32)
+#define	VIRTIO_F_RING_PACKED		(1ULL << 34)
+
+/*
+ * Features implemented by the virtio core for every device.
+ */
+#define	VIRTIO_CORE_CAPS	VIRTIO_F_RING_PACKED
 
 /* From section 2.3, "Virtqueue Configuration", of the virtio specification */
 static inline size_t
@@ -287,6 +415,7 @@ vring_size(u_int qsz)
 
 struct pci_devinst;
 struct vqueue_info;
+struct vi_intr_mod;
 
 /*
  * A virtual device, with some number (possibly 0) of virtual
@@ -320,6 +449,7 @@ struct vqueue_info;
  */
 #define	VIRTIO_USE_MSIX		0x01
 #define	VIRTIO_EVENT_IDX	0x02	/* use the event-index values */
+#define	VIRTIO_MODERN		0x04	/* has the modern transport */
 #define	VIRTIO_BROKED		0x08	/* ??? */
 
 #pragma clang diagnostic push
@@ -330,12 +460,16 @@ struct virtio_softc {
 	int vs_flags; /* VIRTIO_* flags from above */
 	pthread_mutex_t *vs_mtx; /* POSIX mutex, if any */
 	struct pci_devinst *vs_pi; /* PCI device instance */
-	uint32_t vs_negotiated_caps; /* negotiated capabilities */
+	uint64_t vs_negotiated_caps; /* negotiated capabilities */
 	struct vqueue_info *vs_queues; /* one per vc_nvq */
 	int vs_curq; /* current queue */
 	uint8_t vs_status; /* value from last status write */
 	uint8_t vs_isr; /* ISR flags, if not MSI-X */
 	uint16_t vs_msix_cfg_idx; /* MSI-X vector for config event */
+	int vs_modern_bar; /* BAR of the modern transport */
+	uint32_t vs_dfselect; /* modern feature word selects */
+	uint32_t vs_gfselect;
+	struct vi_intr_mod *vs_mod; /* see vi_set_intr_mod() */
 };
 
 #define	VS_LOCK(vs) \
@@ -390,8 +524,9 @@ struct virtio_consts {
  */
 #define	VQ_ALLOC	0x01	/* set once we have a pfn */
 #define	VQ_BROKED	0x02	/* ??? */
+#define	VQ_PACKED	0x04	/* packed ring, see vi_vq_init_rings */
 struct vqueue_info {
-	/* size of this queue (a power of 2) */
+	/* size of this queue, a power of 2 unless the ring is packed */
 	uint16_t vq_qsize;
 	/* called instead of vc_notify, if not NULL */
 	void (*vq_notify)(void *, struct vqueue_info *);
@@ -405,6 +540,8 @@ struct vqueue_info {
 	uint16_t vq_last_avail;
 	/* saved vq_used->vu_idx; see vq_endchains */
 	uint16_t vq_save_used;
+	/* next used ring slot to fill; see vq_relchain_prepare */
+	uint16_t vq_next_used;
 	/* MSI-X index, or VIRTIO_MSI_NO_VECTOR */
 	uint16_t vq_msix_idx;
 	/* PFN of virt queue (not shifted!) */
@@ -415,6 +552,46 @@ struct vqueue_info {
 	volatile struct vring_avail *vq_avail;
 	/* the "used" ring */
 	volatile struct vring_used *vq_used;
+	/*
+	 * Packed rings use the descriptor ring and event structures
+	 * below instead.  vq_last_avail and vq_next_used are then slots
+	 * in the ring with their own wrap counters, and each used entry
+	 * steps over as many slots as its chain was made available in.
+	 */
+	volatile struct virtio_packed_desc *vq_pdesc;
+	/* event suppression: written by the driver, by us */
+	volatile struct vring_packed_event *vq_drv_event;
+	volatile struct vring_packed_event *vq_dev_event;
+	/* wrap counters of vq_last_avail, vq_next_used and vq_save_used */
+	uint8_t vq_avail_wrap;
+	uint8_t vq_used_wrap;
+	uint8_t vq_save_wrap;
+	/* ring slots taken by the chain last returned by vq_getchain */
+	uint16_t vq_last_chain;
+	/*
+	 * used entries prepared but not yet published, for packed
+	 * rings the first one's flags are held back
+	 */
+	uint16_t vq_npend;
+	uint16_t vq_pend_used;
+	uint16_t vq_pend_flags;
+	/* ring slots taken by the chain of each buffer id */
+	uint16_t *vq_chainlen;
+	/* largest vq_qsize, modern drivers may ask for less */
+	uint16_t vq_maxsize;
+	/* ring addresses from a modern driver, see VTMOD_R_QENABLE */
+	uint64_t vq_desc_addr;
+	uint64_t vq_avail_addr;
+	uint64_t vq_used_addr;
+	/*
+	 * Interrupt moderation, see vi_set_intr_mod().  An interrupt
+	 * vq_endchains decided on is held back until vq_mod_frames used
+	 * entries were added since the last one, or vq_mod_usecs passed.
+	 */
+	uint16_t vq_mod_frames;
+	uint32_t vq_mod_usecs;
+	uint32_t vq_mod_cnt; /* used entries since the last interrupt */
+	uint64_t vq_mod_deadline; /* 0 if no interrupt is held back */
 };
 
 #pragma clang diagnostic pop
@@ -441,8 +618,44 @@ vq_ring_ready(struct vqueue_info *vq)
 static inline int
 vq_has_descs(struct vqueue_info *vq)
 {
-	return (vq_ring_ready(vq) && vq->vq_last_avail !=
-	    vq->vq_avail->va_idx);
+	uint16_t flags;
+
+	if (!vq_ring_ready(vq))
+		return (0);
+	if (vq->vq_flags & VQ_PACKED) {
+		flags = vq->vq_pdesc[vq->vq_last_avail].vpd_flags;
+		return (((flags & VRING_PACKED_DESC_F_AVAIL) != 0) ==
+		    vq->vq_avail_wrap &&
+		    ((flags & VRING_PACKED_DESC_F_USED) != 0) !=
+		    vq->vq_avail_wrap);
+	}
+	return (vq->vq_last_avail != vq->vq_avail->va_idx);
+}
+
+/*
+ * Ask the guest for, or to stop sending, notifications of new
+ * available descriptors.  Only a hint, the guest may notify anyway.
+ */
+static inline void
+vq_kick_enable(struct vqueue_info *vq)
+{
+	if (!vq_ring_ready(vq))
+		return;
+	if (vq->vq_flags & VQ_PACKED)
+		vq->vq_dev_event->vpe_flags = VRING_PACKED_EVENT_F_ENABLE;
+	else
+		vq->vq_used->vu_flags &= ~VRING_USED_F_NO_NOTIFY;
+}
+
+static inline void
+vq_kick_disable(struct vqueue_info *vq)
+{
+	if (!vq_ring_ready(vq))
+		return;
+	if (vq->vq_flags & VQ_PACKED)
+		vq->vq_dev_event->vpe_flags = VRING_PACKED_EVENT_F_DISABLE;
+	else
+		vq->vq_used->vu_flags |= VRING_USED_F_NO_NOTIFY;
 }
 
 /*
@@ -469,10 +682,18 @@ void vi_softc_linkup(struct virtio_softc *vs, struct virtio_consts *vc,
 int vi_intr_init(struct virtio_softc *vs, int barnum, int use_msix);
 void vi_reset_dev(struct virtio_softc *);
 void vi_set_io_bar(struct virtio_softc *, int);
+void vi_set_modern_bar(struct virtio_softc *, int);
+int vi_parse_intr_mod(const char *opt, int *frames, int *usecs);
+void vi_set_intr_mod(struct virtio_softc *vs, int qnum, int frames, int usecs);
+void vi_vq_init_rings(struct virtio_softc *vs, uint64_t desc, uint64_t avail,
+	uint64_t used);
 int vq_getchain(struct vqueue_info *vq, uint16_t *pidx, struct iovec *iov,
 	int n_iov, uint16_t *flags);
+struct iovec *vq_iov_skip(struct iovec *iov, int *niov, size_t len);
 void vq_retchain(struct vqueue_info *vq);
 void vq_relchain(struct vqueue_info *vq, uint16_t idx, uint32_t iolen);
+void vq_relchain_prepare(struct vqueue_info *vq, uint16_t idx, uint32_t iolen);
+void vq_relchain_publish(struct vqueue_info *vq);
 void vq_endchains(struct vqueue_info *vq, int used_all_avail);
 uint64_t vi_pci_read(int vcpu, struct pci_devinst *pi, int baridx,
 	uint64_t offset, int size);
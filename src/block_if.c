@@ -32,10 +32,13 @@
 #include <sys/errno.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#ifdef __APPLE__
 #include <sys/disk.h>
+#endif
 
 #include <assert.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,6 +50,8 @@
 #include <xhyve/xhyve.h>
 #include <xhyve/mevent.h>
 #include <xhyve/block_if.h>
+#include <xhyve/block_if_be.h>
+#include <xhyve/block_if_trace.h>
 
 #define BLOCKIF_SIG 0xb109b109
 /* xhyve: FIXME
@@ -60,6 +65,17 @@
 
 #define BLOCKIF_MAXREQ (64 + BLOCKIF_NUMTHR)
 
+#ifndef OFF_MAX
+#define OFF_MAX ((off_t) (~0ULL >> 1))
+#endif
+
+#ifndef MAXPHYS
+#define MAXPHYS (128 * 1024)
+#endif
+
+/* Segments per preadv/pwritev call the host will accept */
+#define BLOCKIF_HOST_IOV_MAX IOV_MAX
+
 enum blockop {
 	BOP_READ,
 	BOP_WRITE,
@@ -84,15 +100,30 @@ struct blockif_elem {
 	enum blockstat be_status;
 	pthread_t be_tid;
 	off_t be_block;
+	/* for the trace */
+	uint64_t be_start;
+	size_t be_len;
+	int be_qd;
 };
 
 struct blockif_ctxt {
 	int bc_magic;
 	int bc_fd;
 	int bc_ischr;
-	int bc_isgeom;
+	int bc_direct;
 	int bc_candelete;
 	int bc_rdonly;
+	int bc_cache;		/* BLOCKIF_CACHE_* */
+	int bc_wce;		/* volatile write cache currently enabled */
+	const struct blockif_backend *bc_be; /* NULL for plain files */
+	void *bc_bearg;
+	struct blockif_export *bc_export; /* NULL unless export= was given */
+	struct blockif_dirty *bc_dirty; /* NULL unless dirty was given */
+	struct blockif_prefetch *bc_prefetch; /* NULL unless prefetch= */
+	struct blockif_prealloc *bc_prealloc; /* NULL unless prealloc */
+	struct blockif_trace *bc_trace; /* NULL unless trace= */
+	/* requests queued or in progress, not yet called back */
+	volatile u_int bc_inflight;
 	off_t bc_size;
 	int bc_sectsz;
 	int bc_psectsz;
@@ -110,6 +141,11 @@ struct blockif_ctxt {
 
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
 
+static pthread_once_t blockif_atexit_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t blockif_atexit_mtx = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, blockif_atexit) blockif_atexit_list =
+    LIST_HEAD_INITIALIZER(blockif_atexit_list);
+
 struct blockif_sig_elem {
 	pthread_mutex_t bse_mtx;
 	pthread_cond_t bse_cond;
@@ -121,6 +157,14 @@ static struct blockif_sig_elem *blockif_bse_head;
 
 #pragma clang diagnostic pop
 
+static const int blockif_trace_ops[] = {
+	[BOP_READ] = BLOCKIF_TRACE_READ,
+	[BOP_WRITE] = BLOCKIF_TRACE_WRITE,
+	[BOP_FLUSH] = BLOCKIF_TRACE_FLUSH,
+	[BOP_DELETE] = BLOCKIF_TRACE_DELETE,
+};
+
+#ifdef __APPLE__
 static ssize_t
 preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
 {
@@ -141,6 +185,24 @@ pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
 	return writev(fd, iov, iovcnt);
 }
 
+/* Present in libc but not declared by the OS X headers */
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wredundant-decls"
+extern int fdatasync(int fd);
+#pragma clang diagnostic pop
+#endif
+
+int
+blockif_fdatasync(int fd)
+{
+#ifdef F_FULLFSYNC
+	/* Not every file system supports it, those get fdatasync */
+	if (fcntl(fd, F_FULLFSYNC) == 0)
+		return (0);
+#endif
+	return (fdatasync(fd));
+}
+
 static int
 blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
@@ -155,6 +217,10 @@ blockif_enqueue(struct blockif_ctxt *bc, struct blockif_req *breq,
 	TAILQ_REMOVE(&bc->bc_freeq, be, be_link);
 	be->be_req = breq;
 	be->be_op = op;
+	be->be_len = (op == BOP_FLUSH) ? 0 : (size_t) breq->br_resid;
+	be->be_qd = (int) atomic_fetchadd_int(&bc->bc_inflight, 1) + 1;
+	if (bc->bc_trace != NULL)
+		be->be_start = blockif_trace_clock();
 	switch (op) {
 	case BOP_READ:
 	case BOP_WRITE:
@@ -218,12 +284,130 @@ blockif_complete(struct blockif_ctxt *bc, struct blockif_elem *be)
 		if (tbe->be_req->br_offset == be->be_block)
 			tbe->be_status = BST_PEND;
 	}
+	/* Those done were counted out before the callback */
+	if (be->be_status != BST_DONE)
+		atomic_subtract_int(&bc->bc_inflight, 1);
 	be->be_tid = 0;
 	be->be_status = BST_FREE;
 	be->be_req = NULL;
 	TAILQ_INSERT_TAIL(&bc->bc_freeq, be, be_link);
 }
 
+/*
+ * With nocache the host may require sector aligned buffers, in which
+ * case misaligned requests have to go through a bounce buffer.
+ */
+static int
+blockif_aligned(struct blockif_ctxt *bc, struct blockif_req *br)
+{
+	int i;
+
+	if (br->br_offset % bc->bc_sectsz)
+		return (0);
+	for (i = 0; i < br->br_iovcnt; i++) {
+		if (((uintptr_t) br->br_iov[i].iov_base) % ((uintptr_t) bc->bc_sectsz) ||
+		    br->br_iov[i].iov_len % ((size_t) bc->bc_sectsz))
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * Transfer directly between the backing file and the guest iovecs.
+ * The request is only split when it has more segments than the host
+ * takes in one call; short transfers are resumed where they stopped.
+ */
+static int
+blockif_rdwr_vec(struct blockif_ctxt *bc, struct blockif_req *br, int write)
+{
+	struct iovec iov[BLOCKIF_IOV_MAX], *v;
+	ssize_t len;
+	off_t off;
+	int cnt;
+
+	memcpy(iov, br->br_iov, sizeof(struct iovec) * ((size_t) br->br_iovcnt));
+	v = iov;
+	cnt = br->br_iovcnt;
+	off = br->br_offset;
+	while (cnt > 0 && br->br_resid > 0) {
+		if (bc->bc_be != NULL && write)
+			len = bc->bc_be->bb_pwritev(bc->bc_bearg, v, cnt, off);
+		else if (bc->bc_be != NULL)
+			len = bc->bc_be->bb_preadv(bc->bc_bearg, v, cnt, off);
+		else if (write)
+			len = pwritev(bc->bc_fd, v, MIN(cnt, BLOCKIF_HOST_IOV_MAX),
+				off);
+		else
+			len = preadv(bc->bc_fd, v, MIN(cnt, BLOCKIF_HOST_IOV_MAX),
+				off);
+		if (len < 0)
+			return (errno);
+		if (len == 0)
+			break;
+		br->br_resid -= len;
+		off += len;
+		while (cnt > 0 && len >= ((ssize_t) v->iov_len)) {
+			len -= v->iov_len;
+			v++;
+			cnt--;
+		}
+		if (len > 0) {
+			v->iov_base = ((uint8_t *) v->iov_base) + len;
+			v->iov_len -= ((size_t) len);
+		}
+	}
+	return (0);
+}
+
+/*
+ * Make completed writes stable
+ */
+static int
+blockif_sync(struct blockif_ctxt *bc)
+{
+	if (bc->bc_be != NULL)
+		return (bc->bc_be->bb_flush != NULL ?
+		    bc->bc_be->bb_flush(bc->bc_bearg) : 0);
+#ifdef DKIOCSYNCHRONIZECACHE
+	if (bc->bc_ischr)
+		return (ioctl(bc->bc_fd, DKIOCSYNCHRONIZECACHE) ? errno : 0);
+#endif
+	return (blockif_fdatasync(bc->bc_fd) ? errno : 0);
+}
+
+/*
+ * Read the disk on behalf of an export or the prefetcher.  Runs in
+ * their threads, concurrently with the block i/o thread; backends
+ * serialize callers.
+ */
+static int
+blockif_read_at(void *arg, void *buf, size_t len, off_t off)
+{
+	struct blockif_ctxt *bc;
+	struct iovec iov;
+	ssize_t n;
+
+	bc = arg;
+	while (len > 0) {
+		if (bc->bc_be != NULL) {
+			iov.iov_base = buf;
+			iov.iov_len = len;
+			n = bc->bc_be->bb_preadv(bc->bc_bearg, &iov, 1, off);
+		} else
+			n = pread(bc->bc_fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (errno);
+		if (n == 0)
+			return (EIO);
+		buf = ((uint8_t *) buf) + n;
+		off += n;
+		len -= (size_t) n;
+	}
+	return (0);
+}
+
 static void
 blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 {
@@ -233,17 +417,16 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 	int i, err;
 
 	br = be->be_req;
-	if (br->br_iovcnt <= 1)
+	if (buf != NULL && blockif_aligned(bc, br))
 		buf = NULL;
 	err = 0;
 	switch (be->be_op) {
 	case BOP_READ:
+		if (bc->bc_prefetch != NULL)
+			blockif_prefetch_record(bc->bc_prefetch, br->br_offset,
+			    br->br_resid);
 		if (buf == NULL) {
-			if ((len = preadv(bc->bc_fd, br->br_iov, br->br_iovcnt,
-				   br->br_offset)) < 0)
-				err = errno;
-			else
-				br->br_resid -= len;
+			err = blockif_rdwr_vec(bc, br, 0);
 			break;
 		}
 		i = 0;
@@ -278,12 +461,17 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 			err = EROFS;
 			break;
 		}
+		if (bc->bc_export != NULL)
+			blockif_export_cbw(bc->bc_export, br->br_offset,
+			    br->br_resid);
+		if (bc->bc_dirty != NULL)
+			blockif_dirty_mark(bc->bc_dirty, br->br_offset,
+			    br->br_resid);
+		if (bc->bc_prealloc != NULL)
+			blockif_prealloc_write(bc->bc_prealloc, br->br_offset,
+			    br->br_resid);
 		if (buf == NULL) {
-			if ((len = pwritev(bc->bc_fd, br->br_iov, br->br_iovcnt,
-				    br->br_offset)) < 0)
-				err = errno;
-			else
-				br->br_resid -= len;
+			err = blockif_rdwr_vec(bc, br, 1);
 			break;
 		}
 		i = 0;
@@ -315,11 +503,8 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 		}
 		break;
 	case BOP_FLUSH:
-		if (bc->bc_ischr) {
-			if (ioctl(bc->bc_fd, DKIOCSYNCHRONIZECACHE))
-				err = errno;
-		} else if (fsync(bc->bc_fd))
-			err = errno;
+		if (bc->bc_cache != BLOCKIF_CACHE_UNSAFE)
+			err = blockif_sync(bc);
 		break;
 	case BOP_DELETE:
 		if (!bc->bc_candelete) {
@@ -334,14 +519,39 @@ blockif_proc(struct blockif_ctxt *bc, struct blockif_elem *be, uint8_t *buf)
 		// 	} else {
 		// 		br->br_resid = 0;
 		// 	}
+		} else if (bc->bc_be != NULL) {
+			if (bc->bc_export != NULL)
+				blockif_export_cbw(bc->bc_export, br->br_offset,
+				    br->br_resid);
+			if (bc->bc_dirty != NULL)
+				blockif_dirty_mark(bc->bc_dirty, br->br_offset,
+				    br->br_resid);
+			err = bc->bc_be->bb_delete(bc->bc_bearg, br->br_offset,
+			    br->br_resid);
+			if (err == 0)
+				br->br_resid = 0;
 		} else {
 			err = EOPNOTSUPP;
 		}
 		break;
 	}
 
+	/*
+	 * Without a write cache the data has to be stable before the
+	 * request completes.
+	 */
+	if (be->be_op == BOP_WRITE && err == 0 && !bc->bc_wce &&
+	    bc->bc_cache != BLOCKIF_CACHE_UNSAFE)
+		err = blockif_sync(bc);
+
 	be->be_status = BST_DONE;
 
+	if (bc->bc_trace != NULL)
+		blockif_trace_record(bc->bc_trace, blockif_trace_ops[be->be_op],
+		    br->br_offset, be->be_len, be->be_start, be->be_qd, err);
+
+	/* The callback may submit the next request in its place */
+	atomic_subtract_int(&bc->bc_inflight, 1);
 	(*br->br_callback)(br, err);
 }
 
@@ -351,12 +561,12 @@ blockif_thr(void *arg)
 	struct blockif_ctxt *bc;
 	struct blockif_elem *be;
 	pthread_t t;
-	uint8_t *buf;
+	void *buf;
 
 	bc = arg;
-	if (bc->bc_isgeom)
-		buf = malloc(MAXPHYS);
-	else
+	/* Bounce buffer for misaligned requests with nocache only */
+	buf = NULL;
+	if (bc->bc_direct && posix_memalign(&buf, XHYVE_PAGE_SIZE, MAXPHYS))
 		buf = NULL;
 	t = pthread_self();
 
@@ -407,6 +617,42 @@ blockif_sigcont_handler(UNUSED int signal, UNUSED enum ev_type type,
 	}
 }
 
+static void
+blockif_atexit_run(void)
+{
+	struct blockif_atexit *ae;
+
+	pthread_mutex_lock(&blockif_atexit_mtx);
+	LIST_FOREACH(ae, &blockif_atexit_list, ae_link)
+		ae->ae_fn(ae->ae_arg);
+	pthread_mutex_unlock(&blockif_atexit_mtx);
+}
+
+static void
+blockif_atexit_init(void)
+{
+	atexit(blockif_atexit_run);
+}
+
+void
+blockif_atexit_add(struct blockif_atexit *ae, void (*fn)(void *), void *arg)
+{
+	pthread_once(&blockif_atexit_once, blockif_atexit_init);
+	ae->ae_fn = fn;
+	ae->ae_arg = arg;
+	pthread_mutex_lock(&blockif_atexit_mtx);
+	LIST_INSERT_HEAD(&blockif_atexit_list, ae, ae_link);
+	pthread_mutex_unlock(&blockif_atexit_mtx);
+}
+
+void
+blockif_atexit_remove(struct blockif_atexit *ae)
+{
+	pthread_mutex_lock(&blockif_atexit_mtx);
+	LIST_REMOVE(ae, ae_link);
+	pthread_mutex_unlock(&blockif_atexit_mtx);
+}
+
 static void
 blockif_init(void)
 {
@@ -414,25 +660,137 @@ blockif_init(void)
 	(void) signal(SIGCONT, SIG_IGN);
 }
 
+/*
+ * Split the options of a disk emulation into its own, which match()
+ * takes, and those for blockif_open(), path first, which are returned.
+ * match() returns 1 if it took the option, 0 to leave it to blockif
+ * and -1 if it is invalid.  The caller frees the result.
+ */
+char *
+blockif_split_opts(const char *opts, int (*match)(const char *, void *),
+	void *arg)
+{
+	char *bopts, *nopt, *xopts, *cp;
+	int r;
+
+	bopts = calloc(1, strlen(opts) + 1);
+	nopt = xopts = strdup(opts);
+	if (bopts == NULL || nopt == NULL)
+		goto err;
+
+	while (xopts != NULL) {
+		cp = strsep(&xopts, ",");
+		if (cp != nopt) {
+			r = match(cp, arg);
+			if (r < 0) {
+				fprintf(stderr, "Invalid device option \"%s\"\n",
+				    cp);
+				goto err;
+			}
+			if (r > 0)
+				continue;
+			strcat(bopts, ",");
+		}
+		strcat(bopts, cp);
+	}
+	free(nopt);
+	return (bopts);
+err:
+	free(nopt);
+	free(bopts);
+	return (NULL);
+}
+
+/*
+ * For match() functions: parse opt if it is "<name>=<n>", n >= 0.
+ * Returns 1 if it was, -1 if its value is invalid and 0 if opt is
+ * another option.
+ */
+int
+blockif_opt_int(const char *opt, const char *name, int *val)
+{
+	size_t len;
+	char *end;
+	long v;
+
+	len = strlen(name);
+	if (strncmp(opt, name, len) != 0 || opt[len] != '=')
+		return (0);
+	errno = 0;
+	v = strtol(opt + len + 1, &end, 10);
+	if (end == opt + len + 1 || *end != '\0' || errno != 0 || v < 0 ||
+	    v > INT_MAX)
+		return (-1);
+	*val = (int) v;
+	return (1);
+}
+
+static const char *blockif_fmt_names[] = {
+	[BLOCKIF_FMT_RAW] = "raw",
+	[BLOCKIF_FMT_CZ] = "cz",
+	[BLOCKIF_FMT_OV] = "ov",
+	[BLOCKIF_FMT_DD] = "dedup",
+};
+
+/*
+ * BLOCKIF_FMT_* named by the format= option, or -1.
+ */
+int
+blockif_fmt_parse(const char *name)
+{
+	int i;
+
+	for (i = 0; i < (int) nitems(blockif_fmt_names); i++)
+		if (strcmp(name, blockif_fmt_names[i]) == 0)
+			return (i);
+	return (-1);
+}
+
+const char *
+blockif_fmt_name(int fmt)
+{
+	return (blockif_fmt_names[fmt]);
+}
+
 struct blockif_ctxt *
 blockif_open(const char *optstr, UNUSED const char *ident)
 {
 	// char name[MAXPATHLEN];
-	char *nopt, *xopts, *cp;
+	char *nopt, *xopts, *cp, *path, *export, *dirtygran, *ssdcache;
+	char *prefetch, *ephspec, *paspec, *trace, *store;
+	char *stripe[BLOCKIF_STRIPE_MAX];
 	struct blockif_ctxt *bc;
+	const struct blockif_backend *be;
+	void *bearg, *layer;
 	struct stat sbuf;
 	// struct diocgattr_arg arg;
 	off_t size, psectsz, psectoff;
 	int extra, fd, i, sectsz;
-	int nocache, sync, ro, candelete, geom, ssopt, pssopt;
+	int nocache, cache, ro, candelete, ssopt, pssopt;
+	int nstripe, stnocache, dirty, eph, ephro, prealloc, fmt;
 
 	pthread_once(&blockif_once, blockif_init);
 
+	bc = NULL;
 	fd = -1;
+	be = NULL;
+	bearg = NULL;
 	ssopt = 0;
 	nocache = 0;
-	sync = 0;
+	cache = BLOCKIF_CACHE_WRITEBACK;
 	ro = 0;
+	nstripe = stnocache = 0;
+	export = NULL;
+	dirty = 0;
+	dirtygran = NULL;
+	ssdcache = NULL;
+	prefetch = NULL;
+	eph = prealloc = 0;
+	ephspec = paspec = NULL;
+	trace = NULL;
+	store = NULL;
+	ephro = 0;
+	fmt = BLOCKIF_FMT_RAW;
 
 	pssopt = 0;
 	/*
@@ -447,43 +805,145 @@ blockif_open(const char *optstr, UNUSED const char *ident)
 		else if (!strcmp(cp, "nocache"))
 			nocache = 1;
 		else if (!strcmp(cp, "sync") || !strcmp(cp, "direct"))
-			sync = 1;
+			cache = BLOCKIF_CACHE_WRITETHROUGH;
+		else if (!strcmp(cp, "cache=writeback"))
+			cache = BLOCKIF_CACHE_WRITEBACK;
+		else if (!strcmp(cp, "cache=writethrough"))
+			cache = BLOCKIF_CACHE_WRITETHROUGH;
+		else if (!strcmp(cp, "cache=unsafe"))
+			cache = BLOCKIF_CACHE_UNSAFE;
 		else if (!strcmp(cp, "ro"))
 			ro = 1;
+		else if (!strncmp(cp, "format=", 7)) {
+			fmt = blockif_fmt_parse(cp + 7);
+			if (fmt < 0) {
+				fprintf(stderr, "Unknown image format \"%s\"\n",
+				    cp + 7);
+				goto err;
+			}
+		}
+		else if (!strncmp(cp, "store=", 6) && cp[6] != '\0')
+			store = cp + 6;
+		else if (!strncmp(cp, "export=", 7) && cp[7] != '\0')
+			export = cp + 7;
+		else if (!strcmp(cp, "dirty"))
+			dirty = 1;
+		else if (!strncmp(cp, "dirty=", 6)) {
+			dirty = 1;
+			dirtygran = cp + 6;
+		}
+		else if (!strncmp(cp, "ssdcache=", 9) && cp[9] != '\0')
+			ssdcache = cp + 9;
+		else if (!strncmp(cp, "prefetch=", 9) && cp[9] != '\0')
+			prefetch = cp + 9;
+		else if (!strcmp(cp, "ephemeral"))
+			eph = 1;
+		else if (!strncmp(cp, "ephemeral=", 10) && cp[10] != '\0') {
+			eph = 1;
+			ephspec = cp + 10;
+		}
+		else if (!strcmp(cp, "prealloc"))
+			prealloc = 1;
+		else if (!strncmp(cp, "prealloc=", 9) && cp[9] != '\0') {
+			prealloc = 1;
+			paspec = cp + 9;
+		}
+		else if (!strncmp(cp, "trace=", 6) && cp[6] != '\0')
+			trace = cp + 6;
 		else if (sscanf(cp, "sectorsize=%d/%d", &ssopt, &pssopt) == 2)
 			;
 		else if (sscanf(cp, "sectorsize=%d", &ssopt) == 1)
 			pssopt = ssopt;
+		else if (blockif_stripe_probe(nopt) &&
+		    nstripe < BLOCKIF_STRIPE_MAX)
+			stripe[nstripe++] = cp;
 		else {
 			fprintf(stderr, "Invalid device option \"%s\"\n", cp);
 			goto err;
 		}
 	}
+	path = nopt;
 
-	extra = 0;
-	if (nocache) {
-		perror("xhyve: nocache support unimplemented");
-		goto err;
-		// extra |= O_DIRECT;
+	/* The overlay takes the writes, the disk below is only read */
+	if (eph) {
+		ephro = ro;
+		ro = 1;
+		nocache = 0;
 	}
-	if (sync)
-		extra |= O_SYNC;
 
-	fd = open(nopt, (ro ? O_RDONLY : O_RDWR) | extra);
-	if (fd < 0 && !ro) {
-		/* Attempt a r/w fail with a r/o open */
-		fd = open(nopt, O_RDONLY | extra);
+	if (fmt == BLOCKIF_FMT_CZ) {
+		/* Decompressed data is cached by the backend itself */
+		be = &blockif_cz_backend;
+		nocache = 0;
 		ro = 1;
+	} else if (fmt == BLOCKIF_FMT_OV) {
+		/* Layers are opened by the backend without O_DIRECT */
+		be = &blockif_ov_backend;
+		nocache = 0;
+	} else if (blockif_stripe_probe(nopt)) {
+		/* Members are opened by the backend, probe the first one */
+		if (nstripe == 0) {
+			fprintf(stderr, "No files in \"%s\"\n", nopt);
+			goto err;
+		}
+		be = &blockif_stripe_backend;
+		path = stripe[0];
+		stnocache = nocache;
+		nocache = 0;
+	} else if (blockif_nbd_probe(nopt)) {
+		/* Nothing local to open */
+		be = &blockif_nbd_backend;
+		path = NULL;
+		nocache = 0;
+	} else if (fmt == BLOCKIF_FMT_DD) {
+		/* The header of the manifest is not trusted with a path */
+		if (store == NULL) {
+			fprintf(stderr, "format=dedup needs store=<dir>\n");
+			goto err;
+		}
+		/* Chunks are read by the backend without O_DIRECT */
+		be = &blockif_dd_backend;
+		nocache = 0;
 	}
 
-	if (fd < 0) {
-		perror("Could not open backing file");
-		goto err;
-	}
+	/* The cache reads and writes the disk from its own buffers */
+	if (ssdcache != NULL)
+		nocache = 0;
 
-	if (fstat(fd, &sbuf) < 0) {
-		perror("Could not stat backing file");
-		goto err;
+	extra = 0;
+#ifdef O_DIRECT
+	if (nocache)
+		extra |= O_DIRECT;
+#endif
+
+	if (path != NULL) {
+		fd = open(path, (ro ? O_RDONLY : O_RDWR) | extra);
+		if (fd < 0 && !ro) {
+			/* Attempt a r/w fail with a r/o open */
+			fd = open(path, O_RDONLY | extra);
+			ro = 1;
+		}
+
+		if (fd < 0) {
+			perror("Could not open backing file");
+			goto err;
+		}
+
+#ifdef F_NOCACHE
+		if (nocache && fcntl(fd, F_NOCACHE, 1) < 0) {
+			perror("Could not disable caching on backing file");
+			goto err;
+		}
+#endif
+
+		if (fstat(fd, &sbuf) < 0) {
+			perror("Could not stat backing file");
+			goto err;
+		}
+	} else {
+		memset(&sbuf, 0, sizeof(sbuf));
+		sbuf.st_mode = S_IFREG;
+		sbuf.st_blksize = 4096;
 	}
 
     /*
@@ -492,7 +952,7 @@ blockif_open(const char *optstr, UNUSED const char *ident)
 	size = sbuf.st_size;
 	sectsz = DEV_BSIZE;
 	psectsz = psectoff = 0;
-	candelete = geom = 0;
+	candelete = 0;
 	if (S_ISCHR(sbuf.st_mode)) {
 		perror("xhyve: raw device support unimplemented");
 		goto err;		
@@ -544,6 +1004,52 @@ blockif_open(const char *optstr, UNUSED const char *ident)
 		psectoff = 0;
 	}
 
+	if (be == &blockif_cz_backend) {
+		bearg = blockif_cz_open(nopt, &size);
+		if (bearg == NULL)
+			goto err;
+	} else if (be == &blockif_ov_backend) {
+		bearg = blockif_ov_open(nopt, ro, &size);
+		if (bearg == NULL)
+			goto err;
+	} else if (be == &blockif_stripe_backend) {
+		bearg = blockif_stripe_open(nopt, stripe, nstripe, ro, stnocache,
+		    &size);
+		if (bearg == NULL)
+			goto err;
+	} else if (be == &blockif_nbd_backend) {
+		bearg = blockif_nbd_open(nopt, &ro, &size);
+		if (bearg == NULL)
+			goto err;
+	} else if (be == &blockif_dd_backend) {
+		bearg = blockif_dd_open(nopt, store, ro, &size);
+		if (bearg == NULL)
+			goto err;
+	}
+
+	if (ssdcache != NULL) {
+		layer = blockif_ssd_open(ssdcache, nopt, be, bearg, fd, size,
+		    !ro);
+		if (layer == NULL)
+			goto err;
+		be = &blockif_ssd_backend;
+		bearg = layer;
+	}
+
+	if (eph) {
+		layer = blockif_eph_open(ephspec, be, bearg, fd, size);
+		if (layer == NULL)
+			goto err;
+		be = &blockif_eph_backend;
+		bearg = layer;
+		ro = ephro;
+	}
+
+	/* A zero length delete tells whether the backend has them */
+	if (be != NULL && be->bb_delete != NULL && !ro &&
+	    be->bb_delete(bearg, 0, 0) == 0)
+		candelete = 1;
+
 	bc = calloc(1, sizeof(struct blockif_ctxt));
 	if (bc == NULL) {
 		perror("calloc");
@@ -553,9 +1059,13 @@ blockif_open(const char *optstr, UNUSED const char *ident)
 	bc->bc_magic = (int) BLOCKIF_SIG;
 	bc->bc_fd = fd;
 	bc->bc_ischr = S_ISCHR(sbuf.st_mode);
-	bc->bc_isgeom = geom;
+	bc->bc_direct = nocache;
 	bc->bc_candelete = candelete;
 	bc->bc_rdonly = ro;
+	bc->bc_cache = cache;
+	bc->bc_wce = (cache == BLOCKIF_CACHE_WRITEBACK);
+	bc->bc_be = be;
+	bc->bc_bearg = bearg;
 	bc->bc_size = size;
 	bc->bc_sectsz = sectsz;
 	bc->bc_psectsz = (int) psectsz;
@@ -570,14 +1080,73 @@ blockif_open(const char *optstr, UNUSED const char *ident)
 		TAILQ_INSERT_HEAD(&bc->bc_freeq, &bc->bc_reqs[i], be_link);
 	}
 
+	if (dirty) {
+		if (path == NULL) {
+			fprintf(stderr, "dirty needs a local image\n");
+			goto err;
+		}
+		bc->bc_dirty = blockif_dirty_open(path, size, dirtygran);
+		if (bc->bc_dirty == NULL)
+			goto err;
+	}
+
+	if (export != NULL) {
+		bc->bc_export = blockif_export_open(export, size,
+		    blockif_read_at, bc);
+		if (bc->bc_export == NULL)
+			goto err;
+	}
+
+	if (prefetch != NULL) {
+		/* Without a host cache there is nothing to read ahead into */
+		bc->bc_prefetch = blockif_prefetch_open(prefetch, size,
+		    (nocache || stnocache) ? NULL : blockif_read_at, bc);
+		if (bc->bc_prefetch == NULL)
+			goto err;
+	}
+
+	if (prealloc) {
+		/* Only the holes of a plain file can be allocated */
+		if (be != NULL || bc->bc_ischr) {
+			fprintf(stderr, "prealloc needs a plain image file\n");
+			goto err;
+		}
+		bc->bc_prealloc = blockif_prealloc_open(paspec, fd, size);
+		if (bc->bc_prealloc == NULL)
+			goto err;
+	}
+
+	if (trace != NULL) {
+		bc->bc_trace = blockif_trace_open(trace, size, sectsz);
+		if (bc->bc_trace == NULL)
+			goto err;
+	}
+
 	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
 		pthread_create(&bc->bc_btid[i], NULL, blockif_thr, bc);
 	}
 
 	return (bc);
 err:
+	/* Undo the above in reverse, the layers of bc first */
+	if (bc != NULL) {
+		if (bc->bc_prealloc != NULL)
+			blockif_prealloc_close(bc->bc_prealloc);
+		if (bc->bc_prefetch != NULL)
+			blockif_prefetch_close(bc->bc_prefetch);
+		if (bc->bc_export != NULL)
+			blockif_export_close(bc->bc_export);
+		if (bc->bc_dirty != NULL)
+			blockif_dirty_close(bc->bc_dirty);
+		pthread_cond_destroy(&bc->bc_cond);
+		pthread_mutex_destroy(&bc->bc_mtx);
+		free(bc);
+	}
+	if (bearg != NULL)
+		be->bb_close(bearg);
 	if (fd >= 0)
 		close(fd);
+	free(nopt);
 	return (NULL);
 }
 
@@ -741,6 +1310,18 @@ blockif_close(struct blockif_ctxt *bc)
 	 * Release resources
 	 */
 	bc->bc_magic = 0;
+	if (bc->bc_trace != NULL)
+		blockif_trace_close(bc->bc_trace);
+	if (bc->bc_prealloc != NULL)
+		blockif_prealloc_close(bc->bc_prealloc);
+	if (bc->bc_prefetch != NULL)
+		blockif_prefetch_close(bc->bc_prefetch);
+	if (bc->bc_export != NULL)
+		blockif_export_close(bc->bc_export);
+	if (bc->bc_dirty != NULL)
+		blockif_dirty_close(bc->bc_dirty);
+	if (bc->bc_be != NULL)
+		bc->bc_be->bb_close(bc->bc_bearg);
 	close(bc->bc_fd);
 	free(bc);
 
@@ -841,3 +1422,31 @@ blockif_candelete(struct blockif_ctxt *bc)
 	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
 	return (bc->bc_candelete);
 }
+
+int
+blockif_cache_mode(struct blockif_ctxt *bc)
+{
+	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
+	return (bc->bc_cache);
+}
+
+int
+blockif_get_wce(struct blockif_ctxt *bc)
+{
+	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
+	return (bc->bc_wce);
+}
+
+/*
+ * The guest may turn the write cache off, but it can only turn it back
+ * on when the disk was configured as writeback.  Unsafe disks claim to
+ * have no volatile cache at all, so it always reads as off.
+ */
+void
+blockif_set_wce(struct blockif_ctxt *bc, int wce)
+{
+	assert(bc->bc_magic == ((int) BLOCKIF_SIG));
+	pthread_mutex_lock(&bc->bc_mtx);
+	bc->bc_wce = wce && bc->bc_cache == BLOCKIF_CACHE_WRITEBACK;
+	pthread_mutex_unlock(&bc->bc_mtx);
+}
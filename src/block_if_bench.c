@@ -0,0 +1,431 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Load generator for the block i/o layer.  Drives blockif_read(),
+ * blockif_write() and blockif_flush() directly, without a guest, and
+ * prints IOPS, bandwidth and latency percentiles as JSON.
+ *
+ * With -V every byte written is a function of its offset and reads are
+ * checked against it, so an image first filled that way (a sequential
+ * pass with -r 0) holds a known pattern that any later run keeps.
+ *
+ *  make blockif-bench
+ *  build/blockif-bench -b 4096 -q 32 -r 70 -R -t 10 disk.img[,opts]
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/mevent.h>
+#include <xhyve/block_if.h>
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct bench_slot {
+	struct blockif_req bs_req;
+	uint8_t *bs_buf;
+	off_t bs_off;
+	uint64_t bs_start;
+	int bs_op;
+	int bs_busy;
+};
+#pragma clang diagnostic pop
+
+enum {
+	BENCH_READ,
+	BENCH_WRITE,
+	BENCH_FLUSH
+};
+
+static pthread_mutex_t bench_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bench_cond = PTHREAD_COND_INITIALIZER;
+
+static uint64_t *bench_lat;	/* completion latencies, nsecs */
+static size_t bench_nlat;
+static size_t bench_maxlat;
+static uint64_t bench_ops[3];
+static uint64_t bench_bytes;
+static uint64_t bench_errors;
+static uint64_t bench_mismatches;
+static int bench_inflight;
+static int bench_verify;
+static size_t bench_bslen;
+
+/*
+ * blockif registers a SIGCONT handler for blockif_cancel(); there is
+ * no event loop here and nothing is ever cancelled.
+ */
+struct mevent *
+mevent_add(UNUSED int fd, UNUSED enum ev_type type,
+	UNUSED void (*func)(int, enum ev_type, void *), UNUSED void *param)
+{
+	return (NULL);
+}
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t) ts.tv_sec) * 1000000000ull + ((uint64_t) ts.tv_nsec));
+}
+
+/*
+ * The -V pattern: every 8 bytes hold their offset, scrambled.
+ */
+static uint64_t
+bench_word(off_t off)
+{
+	return (((uint64_t) off) * 0x9e3779b97f4a7c15ull);
+}
+
+static void
+bench_fill(uint8_t *buf, size_t len, off_t off)
+{
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i < len; i += sizeof(w)) {
+		w = bench_word(off + (off_t) i);
+		memcpy(buf + i, &w, sizeof(w));
+	}
+}
+
+static int
+bench_check(const uint8_t *buf, size_t len, off_t off)
+{
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i < len; i += sizeof(w)) {
+		memcpy(&w, buf + i, sizeof(w));
+		if (w != bench_word(off + (off_t) i))
+			return (-1);
+	}
+	return (0);
+}
+
+static void
+bench_done(struct blockif_req *br, int err)
+{
+	struct bench_slot *bs = br->br_param;
+	uint64_t lat;
+	int bad;
+
+	lat = bench_now() - bs->bs_start;
+	bad = (bench_verify && !err && bs->bs_op == BENCH_READ &&
+	    bench_check(bs->bs_buf, bench_bslen, bs->bs_off) < 0);
+
+	pthread_mutex_lock(&bench_mtx);
+	if (err)
+		bench_errors++;
+	if (bad)
+		bench_mismatches++;
+	bench_ops[bs->bs_op]++;
+	if (bs->bs_op != BENCH_FLUSH)
+		bench_bytes += (uint64_t) (bs->bs_req.br_iov[0].iov_len *
+		    ((size_t) bs->bs_req.br_iovcnt));
+	if (bench_nlat == bench_maxlat) {
+		bench_maxlat = bench_maxlat ? bench_maxlat * 2 : 65536;
+		bench_lat = realloc(bench_lat, bench_maxlat * sizeof(uint64_t));
+		assert(bench_lat != NULL);
+	}
+	bench_lat[bench_nlat++] = lat;
+	bs->bs_busy = 0;
+	bench_inflight--;
+	pthread_cond_signal(&bench_cond);
+	pthread_mutex_unlock(&bench_mtx);
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return ((x > y) - (x < y));
+}
+
+static double
+bench_pct(double p)
+{
+	size_t i;
+
+	if (bench_nlat == 0)
+		return (0.0);
+	i = (size_t) (p / 100.0 * ((double) (bench_nlat - 1)) + 0.5);
+	return (((double) bench_lat[i]) / 1000.0);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	    "Usage: %s [-RV] [-b bs] [-g segs] [-q depth] [-r read%%] "
+	    "[-F flush%%]\n"
+	    "       %*s [-n ops] [-t secs] [-s seed] path[,blockif-opts]\n"
+	    "\t-R: random offsets (default sequential)\n"
+	    "\t-V: write a pattern derived from the offset, check reads "
+	    "against it\n"
+	    "\t-b: block size in bytes (default 4096)\n"
+	    "\t-g: iovec segments per request (default 1)\n"
+	    "\t-q: queue depth (default 1)\n"
+	    "\t-r: percentage of reads in the mix (default 100)\n"
+	    "\t-F: percentage of writes followed by a flush (default 0)\n"
+	    "\t-n: stop after this many requests\n"
+	    "\t-t: stop after this many seconds, 0 for no limit (default 10)\n",
+	    prog, (int) strlen(prog), "");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct blockif_ctxt *bc;
+	struct bench_slot *slots, *bs;
+	uint64_t start, elapsed, deadline, nops, submitted, num;
+	off_t size, nblocks, seq, blk;
+	size_t bs_len, seg_len;
+	double secs;
+	int c, i, err, depth, rnd, rpct, fpct, segs, secs_limit, op;
+	unsigned seed;
+
+	bs_len = 4096;
+	depth = 1;
+	rnd = 0;
+	rpct = 100;
+	fpct = 0;
+	segs = 1;
+	nops = 0;
+	secs_limit = 10;
+	seed = 1;
+
+	while ((c = getopt(argc, argv, "RVb:g:q:r:F:n:t:s:")) != -1) {
+		switch (c) {
+		case 'R':
+			rnd = 1;
+			break;
+		case 'V':
+			bench_verify = 1;
+			break;
+		case 'b':
+			if (expand_number(optarg, &num) != 0)
+				usage(argv[0]);
+			bs_len = (size_t) num;
+			break;
+		case 'g':
+			segs = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'r':
+			rpct = atoi(optarg);
+			break;
+		case 'F':
+			fpct = atoi(optarg);
+			break;
+		case 'n':
+			nops = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			secs_limit = atoi(optarg);
+			break;
+		case 's':
+			seed = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || bs_len == 0 || depth < 1 || segs < 1 ||
+	    segs > BLOCKIF_IOV_MAX || (bs_len % ((size_t) segs)) != 0 ||
+	    (bench_verify && (bs_len % sizeof(uint64_t)) != 0) ||
+	    rpct < 0 || rpct > 100 || fpct < 0 || fpct > 100 ||
+	    (nops == 0 && secs_limit == 0))
+		usage(argv[0]);
+
+	bc = blockif_open(argv[optind], "bench");
+	if (bc == NULL)
+		exit(1);
+	if (rpct < 100 && blockif_is_ro(bc)) {
+		fprintf(stderr, "%s: backing file is read-only\n", argv[0]);
+		exit(1);
+	}
+	if (depth > blockif_queuesz(bc))
+		depth = blockif_queuesz(bc);
+
+	size = blockif_size(bc);
+	nblocks = size / ((off_t) bs_len);
+	if (nblocks == 0) {
+		fprintf(stderr, "%s: backing file smaller than block size\n",
+		    argv[0]);
+		exit(1);
+	}
+
+	bench_bslen = bs_len;
+	seg_len = bs_len / ((size_t) segs);
+	slots = calloc((size_t) depth, sizeof(struct bench_slot));
+	assert(slots != NULL);
+	for (i = 0; i < depth; i++) {
+		bs = &slots[i];
+		if (posix_memalign((void **) &bs->bs_buf, 4096, bs_len))
+			abort();
+		memset(bs->bs_buf, 0xa5, bs_len);
+		bs->bs_req.br_callback = bench_done;
+		bs->bs_req.br_param = bs;
+	}
+
+	srandom(seed);
+	seq = 0;
+	submitted = 0;
+	start = bench_now();
+	deadline = start + ((uint64_t) secs_limit) * 1000000000ull;
+
+	pthread_mutex_lock(&bench_mtx);
+	for (;;) {
+		if ((nops && submitted >= nops) ||
+		    (secs_limit && bench_now() >= deadline))
+			break;
+
+		for (i = 0; i < depth && slots[i].bs_busy; i++)
+			;
+		if (i == depth) {
+			pthread_cond_wait(&bench_cond, &bench_mtx);
+			continue;
+		}
+		bs = &slots[i];
+
+		/*
+		 * A flush is issued in place of the next request after a
+		 * write, with the requested probability.
+		 */
+		if (fpct && bs->bs_op == BENCH_WRITE &&
+		    (random() % 100) < fpct)
+			op = BENCH_FLUSH;
+		else
+			op = ((random() % 100) < rpct) ? BENCH_READ : BENCH_WRITE;
+
+		if (rnd)
+			blk = (off_t) (((uint64_t) random() << 31 |
+			    (uint64_t) random()) % ((uint64_t) nblocks));
+		else {
+			blk = seq++;
+			if (seq == nblocks)
+				seq = 0;
+		}
+
+		bs->bs_op = op;
+		bs->bs_req.br_iovcnt = segs;
+		for (c = 0; c < segs; c++) {
+			bs->bs_req.br_iov[c].iov_base = bs->bs_buf +
+			    ((size_t) c) * seg_len;
+			bs->bs_req.br_iov[c].iov_len = seg_len;
+		}
+		bs->bs_off = blk * ((off_t) bs_len);
+		if (bench_verify && op == BENCH_WRITE)
+			bench_fill(bs->bs_buf, bs_len, bs->bs_off);
+		bs->bs_req.br_offset = bs->bs_off;
+		bs->bs_req.br_resid = (ssize_t) bs_len;
+		bs->bs_busy = 1;
+		bench_inflight++;
+		submitted++;
+		pthread_mutex_unlock(&bench_mtx);
+
+		bs->bs_start = bench_now();
+		switch (op) {
+		case BENCH_READ:
+			err = blockif_read(bc, &bs->bs_req);
+			break;
+		case BENCH_WRITE:
+			err = blockif_write(bc, &bs->bs_req);
+			break;
+		default:
+			err = blockif_flush(bc, &bs->bs_req);
+			break;
+		}
+
+		pthread_mutex_lock(&bench_mtx);
+		if (err) {
+			fprintf(stderr, "%s: request failed: %s\n", argv[0],
+			    strerror(err));
+			exit(1);
+		}
+	}
+	while (bench_inflight > 0)
+		pthread_cond_wait(&bench_cond, &bench_mtx);
+	pthread_mutex_unlock(&bench_mtx);
+
+	elapsed = bench_now() - start;
+	blockif_close(bc);
+
+	secs = ((double) elapsed) / 1e9;
+	qsort(bench_lat, bench_nlat, sizeof(uint64_t), bench_cmp);
+
+	printf("{\n");
+	printf("  \"path\": \"%s\",\n", argv[optind]);
+	printf("  \"pattern\": \"%s\",\n", rnd ? "random" : "sequential");
+	printf("  \"block_size\": %zu,\n", bs_len);
+	printf("  \"segments\": %d,\n", segs);
+	printf("  \"queue_depth\": %d,\n", depth);
+	printf("  \"read_pct\": %d,\n", rpct);
+	printf("  \"flush_pct\": %d,\n", fpct);
+	printf("  \"seconds\": %.3f,\n", secs);
+	printf("  \"reads\": %llu,\n", (unsigned long long) bench_ops[BENCH_READ]);
+	printf("  \"writes\": %llu,\n",
+	    (unsigned long long) bench_ops[BENCH_WRITE]);
+	printf("  \"flushes\": %llu,\n",
+	    (unsigned long long) bench_ops[BENCH_FLUSH]);
+	printf("  \"errors\": %llu,\n", (unsigned long long) bench_errors);
+	printf("  \"mismatches\": %llu,\n",
+	    (unsigned long long) bench_mismatches);
+	printf("  \"iops\": %.1f,\n", ((double) bench_nlat) / secs);
+	printf("  \"bandwidth_mib_s\": %.2f,\n",
+	    ((double) bench_bytes) / secs / (1024.0 * 1024.0));
+	printf("  \"latency_us\": {\n");
+	printf("    \"min\": %.1f,\n", bench_pct(0.0));
+	printf("    \"p50\": %.1f,\n", bench_pct(50.0));
+	printf("    \"p90\": %.1f,\n", bench_pct(90.0));
+	printf("    \"p99\": %.1f,\n", bench_pct(99.0));
+	printf("    \"p99.9\": %.1f,\n", bench_pct(99.9));
+	printf("    \"max\": %.1f\n", bench_pct(100.0));
+	printf("  }\n");
+	printf("}\n");
+
+	return (bench_errors || bench_mismatches ? 1 : 0);
+}
@@ -0,0 +1,487 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Seekable compressed read-only images.
+ *
+ * The image is cut into fixed size chunks that are compressed on their
+ * own, so any sector can be reached by decompressing a single chunk.
+ * Layout (host byte order, i.e. little endian):
+ *
+ *   struct cz_header		padded to CZ_HDR_SIZE
+ *   chunk data			zlib streams, back to back
+ *   uint64_t index[n + 1]	file offset of every chunk, plus the end
+ *
+ * Chunk i occupies [index[i], index[i + 1]). A chunk whose stored length
+ * equals its uncompressed length did not compress and is kept as is.
+ * Recently used chunks are kept decompressed in a small direct mapped
+ * cache, which absorbs the sub-chunk reads CD-ROM and boot loaders issue.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if_be.h>
+
+#define CZ_MAGIC "XHYVECZ1"
+#define CZ_VERSION 1
+#define CZ_HDR_SIZE 512
+
+#define CZ_SHIFT_DEF 16 /* 64KB chunks */
+#define CZ_SHIFT_MIN 12
+#define CZ_SHIFT_MAX 24
+
+#define CZ_CACHE_SLOTS 32
+#define CZ_NOCHUNK UINT64_MAX
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct cz_header {
+	char ch_magic[8];
+	uint32_t ch_version;
+	uint32_t ch_chunk_shift;
+	uint64_t ch_size; /* uncompressed image size */
+	uint64_t ch_nchunks;
+	uint64_t ch_index; /* file offset of the chunk index */
+};
+
+struct cz_slot {
+	uint64_t cs_chunk;
+	uint8_t *cs_data;
+};
+
+struct blockif_cz {
+	int cz_fd;
+	uint32_t cz_shift;
+	size_t cz_chunksz;
+	uint64_t cz_size;
+	uint64_t cz_nchunks;
+	uint64_t *cz_index;
+	uint8_t *cz_cbuf; /* compressed chunk staging */
+	pthread_mutex_t cz_mtx;
+	struct cz_slot cz_cache[CZ_CACHE_SLOTS];
+};
+#pragma clang diagnostic pop
+
+static int
+cz_pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (-1);
+		if (n == 0) {
+			errno = EIO;
+			return (-1);
+		}
+		buf = ((uint8_t *) buf) + n;
+		len -= (size_t) n;
+		off += n;
+	}
+	return (0);
+}
+
+static int
+cz_write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (-1);
+		buf = ((const uint8_t *) buf) + n;
+		len -= (size_t) n;
+	}
+	return (0);
+}
+
+static int
+cz_read_header(int fd, struct cz_header *ch)
+{
+	if (cz_pread_full(fd, ch, sizeof(*ch), 0) < 0)
+		return (-1);
+	if (memcmp(ch->ch_magic, CZ_MAGIC, sizeof(ch->ch_magic)) != 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
+
+static size_t
+cz_chunk_len(struct blockif_cz *cz, uint64_t n)
+{
+	uint64_t start;
+
+	start = n << cz->cz_shift;
+	return ((size_t) MIN(cz->cz_chunksz, cz->cz_size - start));
+}
+
+/*
+ * Return chunk n decompressed, reading it in if it is not cached.
+ * Called with cz_mtx held; the data stays valid until the lock is dropped.
+ */
+static uint8_t *
+cz_chunk(struct blockif_cz *cz, uint64_t n)
+{
+	struct cz_slot *slot;
+	uLongf dlen;
+	size_t clen, ulen;
+
+	slot = &cz->cz_cache[n % CZ_CACHE_SLOTS];
+	if (slot->cs_chunk == n)
+		return (slot->cs_data);
+
+	if (slot->cs_data == NULL) {
+		slot->cs_data = malloc(cz->cz_chunksz);
+		if (slot->cs_data == NULL)
+			return (NULL);
+	}
+	slot->cs_chunk = CZ_NOCHUNK;
+
+	ulen = cz_chunk_len(cz, n);
+	clen = (size_t) (cz->cz_index[n + 1] - cz->cz_index[n]);
+	if (clen == ulen) {
+		if (cz_pread_full(cz->cz_fd, slot->cs_data, ulen,
+		    (off_t) cz->cz_index[n]) < 0)
+			return (NULL);
+	} else {
+		if (cz_pread_full(cz->cz_fd, cz->cz_cbuf, clen,
+		    (off_t) cz->cz_index[n]) < 0)
+			return (NULL);
+		dlen = (uLongf) ulen;
+		if (uncompress(slot->cs_data, &dlen, cz->cz_cbuf, (uLong) clen) !=
+		    Z_OK || dlen != ulen) {
+			errno = EIO;
+			return (NULL);
+		}
+	}
+	slot->cs_chunk = n;
+	return (slot->cs_data);
+}
+
+static ssize_t
+cz_preadv(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct blockif_cz *cz;
+	uint8_t *data, *p;
+	uint64_t off, n;
+	size_t resid, coff, len;
+	ssize_t done;
+	int i;
+
+	cz = arg;
+	done = 0;
+	pthread_mutex_lock(&cz->cz_mtx);
+	for (i = 0; i < iovcnt; i++) {
+		p = iov[i].iov_base;
+		resid = iov[i].iov_len;
+		while (resid > 0) {
+			off = (uint64_t) offset + (uint64_t) done;
+			if (off >= cz->cz_size)
+				goto out;
+			n = off >> cz->cz_shift;
+			coff = (size_t) (off & (cz->cz_chunksz - 1));
+			data = cz_chunk(cz, n);
+			if (data == NULL) {
+				done = -1;
+				goto out;
+			}
+			len = MIN(resid, cz_chunk_len(cz, n) - coff);
+			memcpy(p, data + coff, len);
+			p += len;
+			resid -= len;
+			done += (ssize_t) len;
+		}
+	}
+out:
+	pthread_mutex_unlock(&cz->cz_mtx);
+	return (done);
+}
+
+static void
+cz_close(void *arg)
+{
+	struct blockif_cz *cz;
+	int i;
+
+	cz = arg;
+	for (i = 0; i < CZ_CACHE_SLOTS; i++)
+		free(cz->cz_cache[i].cs_data);
+	free(cz->cz_cbuf);
+	free(cz->cz_index);
+	pthread_mutex_destroy(&cz->cz_mtx);
+	close(cz->cz_fd);
+	free(cz);
+}
+
+const struct blockif_backend blockif_cz_backend = {
+	.bb_name = "cz",
+	.bb_preadv = cz_preadv,
+	.bb_pwritev = NULL,
+	.bb_flush = NULL,
+	.bb_close = cz_close,
+};
+
+/*
+ * Open the compressed image at path read-only and return the handle of
+ * its backend with the size of the uncompressed disk in *size, or NULL
+ * if it cannot be opened or is not a compressed image.
+ */
+void *
+blockif_cz_open(const char *path, off_t *size)
+{
+	struct blockif_cz *cz;
+	struct cz_header ch;
+	struct stat sbuf;
+	uint64_t i;
+	int fd;
+
+	cz = NULL;
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || cz_read_header(fd, &ch) < 0 || fstat(fd, &sbuf) < 0) {
+		perror("Could not open compressed image");
+		goto err;
+	}
+	if (ch.ch_version != CZ_VERSION || ch.ch_chunk_shift < CZ_SHIFT_MIN ||
+	    ch.ch_chunk_shift > CZ_SHIFT_MAX ||
+	    ch.ch_nchunks != (ch.ch_size + (1ULL << ch.ch_chunk_shift) - 1) >>
+	    ch.ch_chunk_shift ||
+	    ch.ch_index + (ch.ch_nchunks + 1) * sizeof(uint64_t) >
+	    (uint64_t) sbuf.st_size) {
+		fprintf(stderr, "Unsupported or corrupt compressed image %s\n",
+		    path);
+		goto err;
+	}
+
+	cz = calloc(1, sizeof(struct blockif_cz));
+	if (cz == NULL)
+		goto err;
+	cz->cz_fd = fd;
+	cz->cz_shift = ch.ch_chunk_shift;
+	cz->cz_chunksz = ((size_t) 1) << ch.ch_chunk_shift;
+	cz->cz_size = ch.ch_size;
+	cz->cz_nchunks = ch.ch_nchunks;
+	cz->cz_index = malloc((size_t) (ch.ch_nchunks + 1) * sizeof(uint64_t));
+	cz->cz_cbuf = malloc(cz->cz_chunksz);
+	if (cz->cz_index == NULL || cz->cz_cbuf == NULL) {
+		perror("malloc");
+		goto err;
+	}
+	if (cz_pread_full(fd, cz->cz_index,
+	    (size_t) (ch.ch_nchunks + 1) * sizeof(uint64_t),
+	    (off_t) ch.ch_index) < 0) {
+		perror("Could not read compressed image index");
+		goto err;
+	}
+
+	/* Validate once so lookups can trust the index */
+	for (i = 0; i < ch.ch_nchunks; i++) {
+		if (cz->cz_index[i] < CZ_HDR_SIZE ||
+		    cz->cz_index[i + 1] < cz->cz_index[i] ||
+		    cz->cz_index[i + 1] - cz->cz_index[i] > cz_chunk_len(cz, i) ||
+		    cz->cz_index[i + 1] > ch.ch_index) {
+			fprintf(stderr, "Corrupt index in compressed image %s\n",
+			    path);
+			goto err;
+		}
+	}
+
+	for (i = 0; i < CZ_CACHE_SLOTS; i++)
+		cz->cz_cache[i].cs_chunk = CZ_NOCHUNK;
+	pthread_mutex_init(&cz->cz_mtx, NULL);
+
+	*size = (off_t) cz->cz_size;
+	return (cz);
+err:
+	if (cz != NULL) {
+		free(cz->cz_cbuf);
+		free(cz->cz_index);
+		free(cz);
+	}
+	if (fd >= 0)
+		close(fd);
+	return (NULL);
+}
+
+/*
+ * Compress the raw image src into dst. chunk_shift selects the chunk
+ * size, 0 picks the default. Chunks are compressed at the highest level
+ * since that costs nothing at decompression time.
+ */
+int
+blockif_cz_create(const char *src, const char *dst, int chunk_shift)
+{
+	struct cz_header ch;
+	struct stat sbuf;
+	uint64_t *index, pos, i, data;
+	uint8_t *buf, *cbuf, *zbuf;
+	uLongf clen, zlen;
+	size_t chunksz, ulen;
+	off_t d;
+	int sfd, dfd, ret;
+
+	if (chunk_shift == 0)
+		chunk_shift = CZ_SHIFT_DEF;
+	if (chunk_shift < CZ_SHIFT_MIN || chunk_shift > CZ_SHIFT_MAX) {
+		fprintf(stderr, "Invalid chunk size\n");
+		return (-1);
+	}
+
+	ret = -1;
+	index = NULL;
+	buf = cbuf = zbuf = NULL;
+	zlen = 0;
+	dfd = -1;
+	sfd = open(src, O_RDONLY);
+	if (sfd < 0 || fstat(sfd, &sbuf) < 0) {
+		perror(src);
+		goto out;
+	}
+	dfd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (dfd < 0) {
+		perror(dst);
+		goto out;
+	}
+
+	memset(&ch, 0, sizeof(ch));
+	memcpy(ch.ch_magic, CZ_MAGIC, sizeof(ch.ch_magic));
+	ch.ch_version = CZ_VERSION;
+	ch.ch_chunk_shift = (uint32_t) chunk_shift;
+	ch.ch_size = (uint64_t) sbuf.st_size;
+	chunksz = ((size_t) 1) << chunk_shift;
+	ch.ch_nchunks = (ch.ch_size + chunksz - 1) >> chunk_shift;
+
+	index = malloc((size_t) (ch.ch_nchunks + 1) * sizeof(uint64_t));
+	buf = malloc(chunksz);
+	cbuf = malloc(compressBound((uLong) chunksz));
+	if (index == NULL || buf == NULL || cbuf == NULL) {
+		perror("malloc");
+		goto out;
+	}
+
+	pos = CZ_HDR_SIZE;
+	if (lseek(dfd, (off_t) pos, SEEK_SET) < 0) {
+		perror(dst);
+		goto out;
+	}
+	data = 0;
+	for (i = 0; i < ch.ch_nchunks; i++) {
+		ulen = (size_t) MIN(chunksz, ch.ch_size - (i << chunk_shift));
+		index[i] = pos;
+#ifdef SEEK_DATA
+		/* Chunks in holes of the source all compress the same */
+		if (data <= (i << chunk_shift)) {
+			d = lseek(sfd, (off_t) (i << chunk_shift), SEEK_DATA);
+			data = (d < 0) ? ((errno == ENXIO) ? ch.ch_size :
+			    (i << chunk_shift)) : (uint64_t) d;
+		}
+		if (data >= (i << chunk_shift) + ulen && ulen == chunksz) {
+			if (zbuf == NULL) {
+				zlen = compressBound((uLong) chunksz);
+				zbuf = malloc(zlen);
+				memset(buf, 0, chunksz);
+				if (zbuf == NULL || compress2(zbuf, &zlen, buf,
+				    (uLong) chunksz, Z_BEST_COMPRESSION) != Z_OK) {
+					perror("compress");
+					goto out;
+				}
+			}
+			if (cz_write_full(dfd, zbuf, (size_t) zlen) < 0) {
+				perror(dst);
+				goto out;
+			}
+			pos += zlen;
+			continue;
+		}
+#else
+		(void) d;
+		(void) data;
+#endif
+		if (cz_pread_full(sfd, buf, ulen, (off_t) (i << chunk_shift)) < 0) {
+			perror(src);
+			goto out;
+		}
+		clen = compressBound((uLong) chunksz);
+		if (compress2(cbuf, &clen, buf, (uLong) ulen, Z_BEST_COMPRESSION) ==
+		    Z_OK && clen < ulen) {
+			if (cz_write_full(dfd, cbuf, (size_t) clen) < 0) {
+				perror(dst);
+				goto out;
+			}
+			pos += clen;
+		} else {
+			if (cz_write_full(dfd, buf, ulen) < 0) {
+				perror(dst);
+				goto out;
+			}
+			pos += ulen;
+		}
+	}
+	index[i] = pos;
+	ch.ch_index = pos;
+
+	if (cz_write_full(dfd, index,
+	    (size_t) (ch.ch_nchunks + 1) * sizeof(uint64_t)) < 0 ||
+	    pwrite(dfd, &ch, sizeof(ch), 0) != (ssize_t) sizeof(ch) ||
+	    fsync(dfd) < 0) {
+		perror(dst);
+		goto out;
+	}
+	ret = 0;
+out:
+	free(zbuf);
+	free(cbuf);
+	free(buf);
+	free(index);
+	if (dfd >= 0) {
+		close(dfd);
+		if (ret != 0)
+			unlink(dst);
+	}
+	if (sfd >= 0)
+		close(sfd);
+	return (ret);
+}
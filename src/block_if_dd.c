@@ -0,0 +1,1248 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Deduplicated images: a manifest of chunk hashes, with the chunks
+ * themselves in a store shared by all the images made with it.
+ *
+ * The manifest holds
+ *
+ *   struct dd_header	padded to DD_HDR_SIZE
+ *   table		the SHA-256 of each chunk of the disk, 64KB by
+ *			default, all zeroes for a chunk of zeroes
+ *
+ * and the store directory
+ *
+ *   <hh>/<62 hex>	a chunk, named by its hash, hh its first byte
+ *   images		the manifests using the store, one per line
+ *   lock		held shared while chunks are referenced, and
+ *			exclusively by the garbage collector
+ *
+ * Chunks are immutable.  A write copies the chunk into one of
+ * DD_DIRTY_MAX buffers, and the buffered chunks are committed on
+ * flush, when the buffers run out, on close and at exit: each is
+ * hashed, written to the store unless a chunk of that hash is already
+ * there, and only then is the manifest updated.  Zero chunks are never
+ * stored.  The chunks of a store are therefore shared by every image,
+ * and by every copy of the same data within an image.
+ *
+ * References are not counted as they are made; blockif_dd_gc() counts
+ * them over all the registered manifests and deletes the chunks no
+ * longer referenced, so copying or reverting an image needs no
+ * bookkeeping.  Images are registered by absolute path when created
+ * and every time they are opened, and stay registered until
+ * blockif_dd_unregister(): the collector deletes nothing while a
+ * registered manifest is gone or cannot be read, as the chunks it
+ * references would be lost for good if it was only moved.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/support/sha256.h>
+#include <xhyve/block_if_be.h>
+
+#define DD_MAGIC "XHYVEDD1"
+#define DD_VERSION 1
+#define DD_HDR_SIZE 4096
+#define DD_PAGE 4096 /* table write granularity */
+#define DD_SHIFT 16
+#define DD_MIN_SHIFT 12
+#define DD_MAX_SHIFT 24
+#define DD_HASH SHA256_DIGEST_LENGTH
+#define DD_DIRTY_MAX 128 /* chunks buffered between commits */
+#define DD_FDS 64 /* open chunk files */
+#define DD_PATH_MAX 1024
+#define DD_NAME_MAX (DD_PATH_MAX + 128) /* a path in the store */
+#define DD_GC_READ (1024 * 1024)
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct dd_header {
+	char dh_magic[8];
+	uint32_t dh_version;
+	uint32_t dh_shift; /* log2 of the chunk size */
+	uint64_t dh_size; /* virtual disk size */
+	char dh_store[DD_PATH_MAX]; /* absolute path of the store */
+};
+
+struct dd_dirty {
+	uint64_t dc_chunk;
+	uint8_t *dc_buf;
+};
+
+struct dd_fd {
+	uint8_t df_hash[DD_HASH];
+	int df_fd; /* -1 if unused */
+};
+
+struct blockif_dd {
+	struct blockif_atexit dd_atexit;
+	char *dd_path;
+	int dd_fd;
+	int dd_lockfd;
+	int dd_ro;
+	size_t dd_csize;
+	uint64_t dd_size;
+	uint64_t dd_nchunks;
+	char dd_store[DD_PATH_MAX];
+	uint8_t *dd_table; /* DD_HASH bytes per chunk */
+	uint8_t *dd_tdirty; /* table pages to write */
+	uint64_t dd_ntdirty;
+	struct dd_dirty dd_dirty[DD_DIRTY_MAX];
+	int dd_ndirty;
+	struct dd_fd dd_fds[DD_FDS];
+	uint8_t dd_sync[256 / 8]; /* chunk directories to sync */
+	int dd_syncstore; /* a chunk directory was created */
+	pthread_mutex_t dd_mtx;
+};
+
+struct dd_gc_chunk {
+	uint64_t gc_key; /* first bytes of the hash */
+	uint32_t gc_refs;
+};
+#pragma clang diagnostic pop
+
+static const uint8_t dd_zero_hash[DD_HASH];
+
+
+static int
+dd_iszero(const uint8_t *buf, size_t len)
+{
+	const uint64_t *p;
+	size_t i;
+
+	p = (const uint64_t *) ((const void *) buf);
+	for (i = 0; i < len / sizeof(uint64_t); i++)
+		if (p[i] != 0)
+			return (0);
+	for (i = i * sizeof(uint64_t); i < len; i++)
+		if (buf[i] != 0)
+			return (0);
+	return (1);
+}
+
+static int
+dd_pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (-1);
+		if (n == 0) {
+			memset(buf, 0, len);
+			break;
+		}
+		buf = ((uint8_t *) buf) + n;
+		len -= (size_t) n;
+		off += n;
+	}
+	return (0);
+}
+
+static int
+dd_pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (-1);
+		buf = ((const uint8_t *) buf) + n;
+		len -= (size_t) n;
+		off += n;
+	}
+	return (0);
+}
+
+static int
+dd_read_header(int fd, struct dd_header *dh)
+{
+	if (dd_pread_full(fd, dh, sizeof(*dh), 0) < 0)
+		return (-1);
+	if (memcmp(dh->dh_magic, DD_MAGIC, sizeof(dh->dh_magic)) != 0 ||
+	    dh->dh_version != DD_VERSION || dh->dh_shift < DD_MIN_SHIFT ||
+	    dh->dh_shift > DD_MAX_SHIFT || dh->dh_store[0] != '/') {
+		errno = EINVAL;
+		return (-1);
+	}
+	dh->dh_store[DD_PATH_MAX - 1] = '\0';
+	return (0);
+}
+
+/*
+ * Name of the chunk file of hash, or of its directory.
+ */
+static void
+dd_chunk_path(const char *store, const uint8_t *hash, char *buf, size_t len,
+	int dir)
+{
+	char hex[DD_HASH * 2 + 1];
+	int i;
+
+	for (i = 0; i < DD_HASH; i++)
+		snprintf(hex + 2 * i, 3, "%02x", hash[i]);
+	if (dir)
+		snprintf(buf, len, "%s/%.2s", store, hex);
+	else
+		snprintf(buf, len, "%s/%.2s/%s", store, hex, hex + 2);
+}
+
+static uint64_t
+dd_key(const uint8_t *hash)
+{
+	uint64_t key;
+	int i;
+
+	for (key = 0, i = 0; i < 8; i++)
+		key = (key << 8) | hash[i];
+	return (key);
+}
+
+static size_t
+dd_chunk_len(struct blockif_dd *dd, uint64_t c)
+{
+	return ((size_t) MIN((uint64_t) dd->dd_csize,
+	    dd->dd_size - c * dd->dd_csize));
+}
+
+static uint8_t *
+dd_entry(struct blockif_dd *dd, uint64_t c)
+{
+	return (dd->dd_table + c * DD_HASH);
+}
+
+static void
+dd_set_entry(struct blockif_dd *dd, uint64_t c, const uint8_t *hash)
+{
+	uint64_t p;
+
+	if (memcmp(dd_entry(dd, c), hash, DD_HASH) == 0)
+		return;
+	memcpy(dd_entry(dd, c), hash, DD_HASH);
+	p = (c * DD_HASH) / DD_PAGE;
+	if (!dd->dd_tdirty[p]) {
+		dd->dd_tdirty[p] = 1;
+		dd->dd_ntdirty++;
+	}
+}
+
+static int
+dd_find_dirty(struct blockif_dd *dd, uint64_t c)
+{
+	int i;
+
+	for (i = 0; i < dd->dd_ndirty; i++)
+		if (dd->dd_dirty[i].dc_chunk == c)
+			return (i);
+	return (-1);
+}
+
+/*
+ * An open descriptor of the chunk file of hash, from a small cache.
+ */
+static int
+dd_chunk_fd(struct blockif_dd *dd, const uint8_t *hash)
+{
+	char path[DD_NAME_MAX];
+	struct dd_fd *df;
+
+	df = &dd->dd_fds[hash[DD_HASH - 1] % DD_FDS];
+	if (df->df_fd >= 0 && memcmp(df->df_hash, hash, DD_HASH) == 0)
+		return (df->df_fd);
+	if (df->df_fd >= 0)
+		close(df->df_fd);
+	dd_chunk_path(dd->dd_store, hash, path, sizeof(path), 0);
+	df->df_fd = open(path, O_RDONLY);
+	if (df->df_fd < 0) {
+		if (errno == ENOENT)
+			fprintf(stderr, "%s: chunk %s missing\n", dd->dd_path,
+			    path);
+		return (-1);
+	}
+	memcpy(df->df_hash, hash, DD_HASH);
+	return (df->df_fd);
+}
+
+/*
+ * Read n bytes at coff of chunk c to skip in iov.  Returns 0 or an
+ * errno.
+ */
+static int
+dd_read_chunk(struct blockif_dd *dd, uint64_t c, const struct iovec *iov,
+	int iovcnt, size_t skip, size_t coff, size_t n)
+{
+	struct iovec v[BLOCKIF_IOV_SLICE];
+	const uint8_t *hash;
+	ssize_t r;
+	int i, fd, cnt;
+
+	i = dd_find_dirty(dd, c);
+	if (i >= 0) {
+		blockif_iov_copy(iov, iovcnt, skip,
+		    dd->dd_dirty[i].dc_buf + coff, n, 1);
+		return (0);
+	}
+	hash = dd_entry(dd, c);
+	if (memcmp(hash, dd_zero_hash, DD_HASH) == 0) {
+		blockif_iov_copy(iov, iovcnt, skip, NULL, n, 1);
+		return (0);
+	}
+	fd = dd_chunk_fd(dd, hash);
+	if (fd < 0)
+		return (errno == ENOENT ? EIO : errno);
+	while (n > 0) {
+		cnt = blockif_iov_slice(iov, iovcnt, skip, n, v);
+		r = preadv(fd, v, cnt, (off_t) coff);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return (errno);
+		if (r == 0)
+			return (EIO);
+		skip += (size_t) r;
+		coff += (size_t) r;
+		n -= (size_t) r;
+	}
+	return (0);
+}
+
+/*
+ * Put a chunk into the store, if there is none of its hash yet.  The
+ * directory entry is made stable by dd_sync_dirs().
+ */
+static int
+dd_chunk_store(struct blockif_dd *dd, const uint8_t *hash, const uint8_t *buf,
+	size_t len)
+{
+	char path[DD_NAME_MAX], tmp[DD_NAME_MAX];
+	int fd, err;
+
+	dd->dd_sync[hash[0] / 8] |= (uint8_t) (1 << (hash[0] % 8));
+	dd_chunk_path(dd->dd_store, hash, path, sizeof(path), 0);
+	if (access(path, F_OK) == 0)
+		return (0);
+
+	dd_chunk_path(dd->dd_store, hash, tmp, sizeof(tmp), 1);
+	if (mkdir(tmp, 0755) == 0)
+		dd->dd_syncstore = 1;
+	else if (errno != EEXIST)
+		return (errno);
+	snprintf(tmp + strlen(tmp), sizeof(tmp) - strlen(tmp), "/.tmpXXXXXX");
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return (errno);
+	err = 0;
+	if (fchmod(fd, 0644) < 0 || dd_pwrite_full(fd, buf, len, 0) < 0 ||
+	    blockif_fdatasync(fd) < 0)
+		err = errno;
+	close(fd);
+	if (err == 0 && rename(tmp, path) < 0)
+		err = errno;
+	if (err != 0)
+		unlink(tmp);
+	return (err);
+}
+
+static int
+dd_fsync_path(const char *path)
+{
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (errno);
+	err = (fsync(fd) < 0) ? errno : 0;
+	close(fd);
+	return (err);
+}
+
+/*
+ * Make the chunks referenced since the last time stable, whether put
+ * into the store by this image or by another one still syncing them.
+ */
+static int
+dd_sync_dirs(struct blockif_dd *dd)
+{
+	char path[DD_NAME_MAX];
+	uint8_t hash[DD_HASH];
+	int i, err;
+
+	memset(hash, 0, sizeof(hash));
+	for (i = 0; i < 256; i++) {
+		if (!(dd->dd_sync[i / 8] & (1 << (i % 8))))
+			continue;
+		hash[0] = (uint8_t) i;
+		dd_chunk_path(dd->dd_store, hash, path, sizeof(path), 1);
+		if ((err = dd_fsync_path(path)) != 0)
+			return (err);
+		dd->dd_sync[i / 8] &= (uint8_t) ~(1 << (i % 8));
+	}
+	if (dd->dd_syncstore) {
+		if ((err = dd_fsync_path(dd->dd_store)) != 0)
+			return (err);
+		dd->dd_syncstore = 0;
+	}
+	return (0);
+}
+
+static int
+dd_table_sync(struct blockif_dd *dd)
+{
+	uint64_t p, tlen;
+	size_t len;
+
+	if (dd->dd_ntdirty == 0)
+		return (0);
+	tlen = dd->dd_nchunks * DD_HASH;
+	for (p = 0; dd->dd_ntdirty > 0 && p * DD_PAGE < tlen; p++) {
+		if (!dd->dd_tdirty[p])
+			continue;
+		len = (size_t) MIN((uint64_t) DD_PAGE, tlen - p * DD_PAGE);
+		if (dd_pwrite_full(dd->dd_fd, dd->dd_table + p * DD_PAGE, len,
+		    (off_t) (DD_HDR_SIZE + p * DD_PAGE)) < 0)
+			return (errno);
+		dd->dd_tdirty[p] = 0;
+		dd->dd_ntdirty--;
+	}
+	return (blockif_fdatasync(dd->dd_fd) ? errno : 0);
+}
+
+/*
+ * Store the buffered chunks and point the manifest at them.  Called
+ * with dd_mtx held.
+ */
+static int
+dd_commit(struct blockif_dd *dd)
+{
+	struct dd_dirty *dc;
+	SHA256_CTX ctx;
+	uint8_t hash[DD_HASH];
+	size_t len;
+	int i, err;
+
+	if (dd->dd_ndirty == 0 && dd->dd_ntdirty == 0)
+		return (0);
+
+	/* The collector must not delete a chunk before it is referenced */
+	if (flock(dd->dd_lockfd, LOCK_SH) < 0)
+		return (errno);
+	err = 0;
+	for (i = 0; err == 0 && i < dd->dd_ndirty; i++) {
+		dc = &dd->dd_dirty[i];
+		len = dd_chunk_len(dd, dc->dc_chunk);
+		if (dd_iszero(dc->dc_buf, len)) {
+			dd_set_entry(dd, dc->dc_chunk, dd_zero_hash);
+			continue;
+		}
+		SHA256_Init(&ctx);
+		SHA256_Update(&ctx, dc->dc_buf, len);
+		SHA256_Final(hash, &ctx);
+		err = dd_chunk_store(dd, hash, dc->dc_buf, len);
+		if (err == 0)
+			dd_set_entry(dd, dc->dc_chunk, hash);
+	}
+	if (err == 0)
+		err = dd_sync_dirs(dd);
+	if (err == 0)
+		err = dd_table_sync(dd);
+	flock(dd->dd_lockfd, LOCK_UN);
+
+	if (err == 0)
+		dd->dd_ndirty = 0;
+	return (err);
+}
+
+/*
+ * Write n bytes at coff of chunk c from skip in iov, or zeroes if iov
+ * is NULL.  Returns 0 or an errno.
+ */
+static int
+dd_write_chunk(struct blockif_dd *dd, uint64_t c, const struct iovec *iov,
+	int iovcnt, size_t skip, size_t coff, size_t n)
+{
+	struct dd_dirty *dc;
+	struct iovec v;
+	size_t len;
+	int i, err;
+
+	i = dd_find_dirty(dd, c);
+	if (i < 0) {
+		if (dd->dd_ndirty == DD_DIRTY_MAX &&
+		    (err = dd_commit(dd)) != 0)
+			return (err);
+		dc = &dd->dd_dirty[dd->dd_ndirty];
+		if (dc->dc_buf == NULL &&
+		    (dc->dc_buf = malloc(dd->dd_csize)) == NULL)
+			return (ENOMEM);
+		/* A whole chunk need not be read first */
+		len = dd_chunk_len(dd, c);
+		if (n < len) {
+			v.iov_base = dc->dc_buf;
+			v.iov_len = len;
+			if ((err = dd_read_chunk(dd, c, &v, 1, 0, 0, len)) != 0)
+				return (err);
+		}
+		dc->dc_chunk = c;
+		i = dd->dd_ndirty++;
+	}
+	if (iov == NULL)
+		memset(dd->dd_dirty[i].dc_buf + coff, 0, n);
+	else
+		blockif_iov_copy(iov, iovcnt, skip,
+		    dd->dd_dirty[i].dc_buf + coff, n, 0);
+	return (0);
+}
+
+static ssize_t
+dd_rw(struct blockif_dd *dd, const struct iovec *iov, int iovcnt, off_t off,
+	int write)
+{
+	uint64_t c;
+	size_t total, done, n, coff;
+	int i, err;
+
+	if (write && dd->dd_ro) {
+		errno = EROFS;
+		return (-1);
+	}
+	for (total = 0, i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (off >= (off_t) dd->dd_size)
+		return (0);
+	total = (size_t) MIN((uint64_t) total, dd->dd_size - (uint64_t) off);
+
+	err = 0;
+	pthread_mutex_lock(&dd->dd_mtx);
+	for (done = 0; err == 0 && done < total; done += n) {
+		c = (uint64_t) (off + (off_t) done) / dd->dd_csize;
+		coff = (size_t) ((uint64_t) (off + (off_t) done) % dd->dd_csize);
+		n = MIN(total - done, dd->dd_csize - coff);
+		if (write)
+			err = dd_write_chunk(dd, c, iov, iovcnt, done, coff, n);
+		else
+			err = dd_read_chunk(dd, c, iov, iovcnt, done, coff, n);
+	}
+	pthread_mutex_unlock(&dd->dd_mtx);
+
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+	return ((ssize_t) total);
+}
+
+static ssize_t
+dd_preadv(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return (dd_rw(arg, iov, iovcnt, offset, 0));
+}
+
+static ssize_t
+dd_pwritev(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return (dd_rw(arg, iov, iovcnt, offset, 1));
+}
+
+static int
+dd_flush(void *arg)
+{
+	struct blockif_dd *dd;
+	int err;
+
+	dd = arg;
+	if (dd->dd_ro)
+		return (0);
+	pthread_mutex_lock(&dd->dd_mtx);
+	err = dd_commit(dd);
+	pthread_mutex_unlock(&dd->dd_mtx);
+	return (err);
+}
+
+/*
+ * Whole chunks become zero chunks, parts of chunks are zeroed.
+ */
+static int
+dd_delete(void *arg, off_t offset, off_t len)
+{
+	struct blockif_dd *dd;
+	struct dd_dirty tmp;
+	uint64_t c;
+	size_t n, coff;
+	off_t pos;
+	int i, err;
+
+	dd = arg;
+	if (dd->dd_ro)
+		return (EROFS);
+	if (offset < 0 || (uint64_t) (offset + len) > dd->dd_size)
+		return (EINVAL);
+
+	err = 0;
+	pthread_mutex_lock(&dd->dd_mtx);
+	for (pos = offset; err == 0 && pos < offset + len; pos += (off_t) n) {
+		c = (uint64_t) pos / dd->dd_csize;
+		coff = (size_t) ((uint64_t) pos % dd->dd_csize);
+		n = (size_t) MIN((uint64_t) (offset + len - pos),
+		    dd->dd_csize - coff);
+		if (n < dd_chunk_len(dd, c)) {
+			err = dd_write_chunk(dd, c, NULL, 0, 0, coff, n);
+			continue;
+		}
+		if ((i = dd_find_dirty(dd, c)) >= 0) {
+			/* Keep the buffer for reuse */
+			tmp = dd->dd_dirty[i];
+			dd->dd_dirty[i] = dd->dd_dirty[--dd->dd_ndirty];
+			dd->dd_dirty[dd->dd_ndirty] = tmp;
+		}
+		dd_set_entry(dd, c, dd_zero_hash);
+	}
+	pthread_mutex_unlock(&dd->dd_mtx);
+	return (err);
+}
+
+static void
+dd_exit(void *arg)
+{
+	struct blockif_dd *dd;
+	int err;
+
+	dd = arg;
+	pthread_mutex_lock(&dd->dd_mtx);
+	if ((err = dd_commit(dd)) != 0)
+		fprintf(stderr, "%s: %s\n", dd->dd_path, strerror(err));
+	pthread_mutex_unlock(&dd->dd_mtx);
+}
+
+static void
+dd_free(struct blockif_dd *dd)
+{
+	int i;
+
+	for (i = 0; i < DD_FDS; i++)
+		if (dd->dd_fds[i].df_fd >= 0)
+			close(dd->dd_fds[i].df_fd);
+	for (i = 0; i < DD_DIRTY_MAX; i++)
+		free(dd->dd_dirty[i].dc_buf);
+	if (dd->dd_lockfd >= 0)
+		close(dd->dd_lockfd);
+	if (dd->dd_fd >= 0)
+		close(dd->dd_fd);
+	free(dd->dd_path);
+	free(dd->dd_table);
+	free(dd->dd_tdirty);
+	free(dd);
+}
+
+static void
+dd_close(void *arg)
+{
+	struct blockif_dd *dd;
+	int err;
+
+	dd = arg;
+	blockif_atexit_remove(&dd->dd_atexit);
+
+	if (!dd->dd_ro && (err = dd_commit(dd)) != 0)
+		fprintf(stderr, "%s: %s\n", dd->dd_path, strerror(err));
+	pthread_mutex_destroy(&dd->dd_mtx);
+	dd_free(dd);
+}
+
+const struct blockif_backend blockif_dd_backend = {
+	.bb_name = "dedup",
+	.bb_preadv = dd_preadv,
+	.bb_pwritev = dd_pwritev,
+	.bb_flush = dd_flush,
+	.bb_delete = dd_delete,
+	.bb_close = dd_close,
+};
+
+static int
+dd_lock_store(const char *store, int op)
+{
+	char path[DD_NAME_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/lock", store);
+	fd = open(path, O_RDONLY | O_CREAT, 0644);
+	if (fd < 0)
+		return (-1);
+	if (op != 0 && flock(fd, op) < 0) {
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * Contents of the registry of store, NUL terminated, or NULL with
+ * errno set.
+ */
+static char *
+dd_read_images(const char *store)
+{
+	char path[DD_NAME_MAX];
+	struct stat sbuf;
+	char *buf;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/images", store);
+	fd = open(path, O_RDONLY);
+	if (fd < 0 && errno == ENOENT)
+		return (strdup(""));
+	if (fd < 0 || fstat(fd, &sbuf) < 0 ||
+	    (buf = malloc((size_t) sbuf.st_size + 1)) == NULL) {
+		if (fd >= 0)
+			close(fd);
+		return (NULL);
+	}
+	if (dd_pread_full(fd, buf, (size_t) sbuf.st_size, 0) < 0) {
+		free(buf);
+		buf = NULL;
+	} else
+		buf[sbuf.st_size] = '\0';
+	close(fd);
+	return (buf);
+}
+
+/*
+ * Add the manifest at path to the registry of its store.
+ */
+int
+blockif_dd_register(const char *path)
+{
+	char abs[PATH_MAX], file[DD_NAME_MAX], *images, *line, *next;
+	struct dd_header dh;
+	int fd, lockfd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || dd_read_header(fd, &dh) < 0 ||
+	    realpath(path, abs) == NULL) {
+		if (fd >= 0)
+			close(fd);
+		perror(path);
+		return (-1);
+	}
+	close(fd);
+
+	lockfd = dd_lock_store(dh.dh_store, LOCK_EX);
+	if (lockfd < 0) {
+		perror(dh.dh_store);
+		return (-1);
+	}
+	ret = -1;
+	images = dd_read_images(dh.dh_store);
+	if (images == NULL)
+		goto out;
+	for (line = images; line != NULL && *line != '\0'; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+		if (strcmp(line, abs) == 0) {
+			ret = 0;
+			goto out;
+		}
+	}
+	snprintf(file, sizeof(file), "%s/images", dh.dh_store);
+	fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd >= 0 && dprintf(fd, "%s\n", abs) > 0 && fsync(fd) == 0)
+		ret = 0;
+	if (fd >= 0)
+		close(fd);
+out:
+	if (ret < 0)
+		perror(dh.dh_store);
+	free(images);
+	close(lockfd);
+	return (ret);
+}
+
+/*
+ * Drop path from the registry of store, e.g. once the image has been
+ * deleted.  Its chunks are collected by the next blockif_dd_gc().
+ */
+int
+blockif_dd_unregister(const char *store, const char *path)
+{
+	char real[PATH_MAX], dir[DD_PATH_MAX], abs[PATH_MAX];
+	char file[DD_NAME_MAX], tmp[DD_NAME_MAX], *images, *line, *next;
+	int lockfd, found, ret;
+	FILE *fp;
+
+	if (realpath(store, real) == NULL) {
+		perror(store);
+		return (-1);
+	}
+	if (strlen(real) >= sizeof(dir)) {
+		fprintf(stderr, "%s: path too long\n", real);
+		return (-1);
+	}
+	snprintf(dir, sizeof(dir), "%s", real);
+	/* The image itself may be gone */
+	if (realpath(path, abs) == NULL)
+		snprintf(abs, sizeof(abs), "%s", path);
+	lockfd = dd_lock_store(dir, LOCK_EX);
+	if (lockfd < 0) {
+		perror(dir);
+		return (-1);
+	}
+	ret = -1;
+	fp = NULL;
+	snprintf(file, sizeof(file), "%s/images", dir);
+	snprintf(tmp, sizeof(tmp), "%s/images.tmp", dir);
+	images = dd_read_images(dir);
+	if (images == NULL || (fp = fopen(tmp, "w")) == NULL) {
+		perror(dir);
+		goto out;
+	}
+	found = 0;
+	for (line = images; *line != '\0'; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+		else
+			next = line + strlen(line);
+		if (strcmp(line, abs) == 0)
+			found = 1;
+		else if (*line != '\0')
+			fprintf(fp, "%s\n", line);
+	}
+	if (!found) {
+		fprintf(stderr, "%s: not an image of %s\n", abs, dir);
+		goto out;
+	}
+	if (fflush(fp) != 0 || fsync(fileno(fp)) < 0 || rename(tmp, file) < 0) {
+		perror(file);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (fp != NULL) {
+		fclose(fp);
+		unlink(tmp);
+	}
+	free(images);
+	close(lockfd);
+	return (ret);
+}
+
+/*
+ * Open the manifest at path.  Unless store is NULL, its chunks must be
+ * in store: the header is only trusted to name the store the image was
+ * made with.
+ */
+void *
+blockif_dd_open(const char *path, const char *store, int ro, off_t *size)
+{
+	char real[PATH_MAX];
+	struct blockif_dd *dd;
+	struct dd_header dh;
+	uint64_t tlen;
+	int i;
+
+	dd = calloc(1, sizeof(struct blockif_dd));
+	if (dd == NULL)
+		return (NULL);
+	dd->dd_lockfd = -1;
+	for (i = 0; i < DD_FDS; i++)
+		dd->dd_fds[i].df_fd = -1;
+	dd->dd_ro = ro;
+	dd->dd_path = strdup(path);
+	dd->dd_fd = open(path, ro ? O_RDONLY : O_RDWR);
+	if (dd->dd_path == NULL || dd->dd_fd < 0 ||
+	    dd_read_header(dd->dd_fd, &dh) < 0) {
+		perror(path);
+		goto err;
+	}
+	/* One writer, or any number of readers */
+	if (flock(dd->dd_fd, (ro ? LOCK_SH : LOCK_EX) | LOCK_NB) < 0) {
+		fprintf(stderr, "%s: in use\n", path);
+		goto err;
+	}
+	if (store != NULL && (realpath(store, real) == NULL ||
+	    strcmp(real, dh.dh_store) != 0)) {
+		fprintf(stderr, "%s: chunks are in %s, not %s\n", path,
+		    dh.dh_store, store);
+		goto err;
+	}
+	snprintf(dd->dd_store, sizeof(dd->dd_store), "%s", dh.dh_store);
+	dd->dd_lockfd = dd_lock_store(dd->dd_store, 0);
+	if (dd->dd_lockfd < 0) {
+		perror(dd->dd_store);
+		goto err;
+	}
+
+	dd->dd_csize = (size_t) 1 << dh.dh_shift;
+	dd->dd_size = dh.dh_size;
+	dd->dd_nchunks = howmany(dd->dd_size, dd->dd_csize);
+	tlen = dd->dd_nchunks * DD_HASH;
+	dd->dd_table = malloc((size_t) MAX(tlen, 1));
+	dd->dd_tdirty = calloc((size_t) MAX(howmany(tlen, DD_PAGE), 1), 1);
+	if (dd->dd_table == NULL || dd->dd_tdirty == NULL ||
+	    dd_pread_full(dd->dd_fd, dd->dd_table, (size_t) tlen,
+	    DD_HDR_SIZE) < 0) {
+		perror(path);
+		goto err;
+	}
+	/* Wherever the image has been moved or copied to */
+	if (blockif_dd_register(path) < 0)
+		goto err;
+
+	pthread_mutex_init(&dd->dd_mtx, NULL);
+	blockif_atexit_add(&dd->dd_atexit, dd_exit, dd);
+
+	*size = (off_t) dd->dd_size;
+	return (dd);
+err:
+	dd_free(dd);
+	return (NULL);
+}
+
+/*
+ * Create an empty manifest of size bytes at path, its chunks to be
+ * kept in store.
+ */
+int
+blockif_dd_create(const char *path, const char *store, off_t size)
+{
+	char abs[PATH_MAX];
+	struct dd_header dh;
+	uint64_t nchunks;
+	int fd;
+
+	if (mkdir(store, 0755) < 0 && errno != EEXIST) {
+		perror(store);
+		return (-1);
+	}
+	memset(&dh, 0, sizeof(dh));
+	if (realpath(store, abs) == NULL ||
+	    strlen(abs) >= sizeof(dh.dh_store)) {
+		perror(store);
+		return (-1);
+	}
+	memcpy(dh.dh_magic, DD_MAGIC, sizeof(dh.dh_magic));
+	dh.dh_version = DD_VERSION;
+	dh.dh_shift = DD_SHIFT;
+	dh.dh_size = (uint64_t) size;
+	snprintf(dh.dh_store, sizeof(dh.dh_store), "%s", abs);
+	nchunks = howmany((uint64_t) size, (uint64_t) 1 << DD_SHIFT);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || dd_pwrite_full(fd, &dh, sizeof(dh), 0) < 0 ||
+	    ftruncate(fd, (off_t) (DD_HDR_SIZE + nchunks * DD_HASH)) < 0 ||
+	    fsync(fd) < 0) {
+		perror(path);
+		if (fd >= 0) {
+			close(fd);
+			unlink(path);
+		}
+		return (-1);
+	}
+	close(fd);
+	return (blockif_dd_register(path));
+}
+
+static int
+dd_gc_cmp(const void *a, const void *b)
+{
+	uint64_t ka, kb;
+
+	ka = ((const struct dd_gc_chunk *) a)->gc_key;
+	kb = ((const struct dd_gc_chunk *) b)->gc_key;
+	return ((ka > kb) - (ka < kb));
+}
+
+static int
+dd_hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a' + 10);
+	return (-1);
+}
+
+static int
+dd_unhex(const char *s, uint8_t *out, int n)
+{
+	int i, hi, lo;
+
+	for (i = 0; i < n; i++) {
+		hi = dd_hexval(s[2 * i]);
+		lo = dd_hexval(s[2 * i + 1]);
+		if (hi < 0 || lo < 0)
+			return (-1);
+		out[i] = (uint8_t) ((hi << 4) | lo);
+	}
+	return (0);
+}
+
+/*
+ * Walk the chunk files of store: collect them, or with sweep set
+ * delete those unreferenced.  Leftovers of interrupted commits are
+ * deleted either way, no commit being under way.
+ */
+static int
+dd_gc_walk(const char *store, struct dd_gc_chunk **gcp, size_t *np,
+	int sweep, uint64_t *freed, uint64_t *bytes)
+{
+	char dir[DD_NAME_MAX], path[PATH_MAX];
+	struct dd_gc_chunk key, *gc, *next, *hit;
+	uint8_t hash[DD_HASH];
+	struct dirent *de;
+	struct stat sbuf;
+	size_t n, max;
+	DIR *d;
+	int i;
+
+	gc = *gcp;
+	n = *np;
+	max = n;
+	for (i = 0; i < 256; i++) {
+		snprintf(dir, sizeof(dir), "%s/%02x", store, i);
+		d = opendir(dir);
+		if (d == NULL && errno == ENOENT)
+			continue;
+		if (d == NULL)
+			return (-1);
+		while ((de = readdir(d)) != NULL) {
+			snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+			if (strncmp(de->d_name, ".tmp", 4) == 0) {
+				unlink(path);
+				continue;
+			}
+			hash[0] = (uint8_t) i;
+			if (strlen(de->d_name) != (DD_HASH - 1) * 2 ||
+			    dd_unhex(de->d_name, hash + 1, 7) < 0)
+				continue;
+			key.gc_key = dd_key(hash);
+			if (sweep) {
+				hit = bsearch(&key, gc, n, sizeof(*gc),
+				    dd_gc_cmp);
+				if (hit == NULL || hit->gc_refs > 0 ||
+				    stat(path, &sbuf) < 0 || unlink(path) < 0)
+					continue;
+				(*freed)++;
+				*bytes += (uint64_t) sbuf.st_size;
+				continue;
+			}
+			if (n == max) {
+				max = MAX(max * 2, 1024);
+				next = realloc(gc, max * sizeof(*gc));
+				if (next == NULL) {
+					closedir(d);
+					*gcp = gc;
+					return (-1);
+				}
+				gc = next;
+			}
+			gc[n].gc_key = key.gc_key;
+			gc[n].gc_refs = 0;
+			n++;
+		}
+		closedir(d);
+		if (sweep)
+			dd_fsync_path(dir);
+	}
+	*gcp = gc;
+	*np = n;
+	return (0);
+}
+
+/*
+ * Count the references of one manifest.  Returns -1 if it is gone,
+ * unreadable or not an image of store.
+ */
+static int
+dd_gc_count(const char *store, const char *path, struct dd_gc_chunk *gc,
+	size_t n, uint64_t *refs, uint64_t *missing)
+{
+	struct dd_gc_chunk key, *hit;
+	struct dd_header dh;
+	uint8_t *buf;
+	uint64_t tlen, off;
+	size_t len, i;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || dd_read_header(fd, &dh) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return (-1);
+	}
+	if (strcmp(dh.dh_store, store) != 0) {
+		fprintf(stderr, "%s: an image of %s now\n", path, dh.dh_store);
+		close(fd);
+		return (-1);
+	}
+	/* What a running VM has committed is about to be relied upon */
+	buf = malloc(DD_GC_READ);
+	if (buf == NULL || fsync(fd) < 0) {
+		perror(path);
+		free(buf);
+		close(fd);
+		return (-1);
+	}
+	ret = 0;
+	tlen = howmany(dh.dh_size, (uint64_t) 1 << dh.dh_shift) * DD_HASH;
+	for (off = 0; ret == 0 && off < tlen; off += len) {
+		len = (size_t) MIN((uint64_t) DD_GC_READ, tlen - off);
+		if (dd_pread_full(fd, buf, len, (off_t) (DD_HDR_SIZE + off)) < 0) {
+			perror(path);
+			ret = -1;
+			break;
+		}
+		for (i = 0; i < len; i += DD_HASH) {
+			if (memcmp(buf + i, dd_zero_hash, DD_HASH) == 0)
+				continue;
+			key.gc_key = dd_key(buf + i);
+			hit = bsearch(&key, gc, n, sizeof(*gc), dd_gc_cmp);
+			if (hit == NULL)
+				(*missing)++;
+			else {
+				hit->gc_refs++;
+				(*refs)++;
+			}
+		}
+	}
+	free(buf);
+	close(fd);
+	return (ret);
+}
+
+/*
+ * Delete the chunks of store that no registered image references.
+ */
+int
+blockif_dd_gc(const char *store)
+{
+	char real[PATH_MAX], abs[DD_PATH_MAX], *images, *line, *next;
+	struct dd_gc_chunk *gc;
+	uint64_t refs, missing, shared, freed, bytes;
+	size_t n, i, j;
+	int lockfd, nimages, bad, ret;
+
+	if (realpath(store, real) == NULL) {
+		perror(store);
+		return (-1);
+	}
+	if (strlen(real) >= sizeof(abs)) {
+		fprintf(stderr, "%s: path too long\n", real);
+		return (-1);
+	}
+	snprintf(abs, sizeof(abs), "%s", real);
+	/* Waits for commits under way, and holds off new ones */
+	lockfd = dd_lock_store(abs, LOCK_EX);
+	if (lockfd < 0) {
+		perror(abs);
+		return (-1);
+	}
+	ret = -1;
+	gc = NULL;
+	n = 0;
+	images = dd_read_images(abs);
+	if (images == NULL || dd_gc_walk(abs, &gc, &n, 0, NULL, NULL) < 0) {
+		perror(abs);
+		goto out;
+	}
+	/* Chunks sharing a key are kept or deleted together */
+	qsort(gc, n, sizeof(*gc), dd_gc_cmp);
+	for (i = j = 0; i < n; i++)
+		if (j == 0 || gc[i].gc_key != gc[j - 1].gc_key)
+			gc[j++] = gc[i];
+	n = j;
+
+	refs = missing = 0;
+	nimages = bad = 0;
+	for (line = images; *line != '\0'; line = next) {
+		next = strchr(line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+		else
+			next = line + strlen(line);
+		if (*line == '\0')
+			continue;
+		if (dd_gc_count(abs, line, gc, n, &refs, &missing) < 0)
+			bad++;
+		else
+			nimages++;
+	}
+	if (bad > 0) {
+		/* Moved or damaged images would lose their chunks */
+		fprintf(stderr, "%s: %d registered images unusable, nothing "
+		    "deleted; unregister those deleted for good\n", abs, bad);
+		goto out;
+	}
+	if (missing > 0) {
+		/* Deleting anything now could only make matters worse */
+		fprintf(stderr, "%s: %llu chunk references missing from the "
+		    "store, nothing deleted\n", abs, (unsigned long long) missing);
+		goto out;
+	}
+
+	freed = bytes = 0;
+	if (dd_gc_walk(abs, &gc, &n, 1, &freed, &bytes) < 0) {
+		perror(abs);
+		goto out;
+	}
+	for (shared = 0, i = 0; i < n; i++)
+		if (gc[i].gc_refs > 1)
+			shared++;
+	fprintf(stdout, "%s: %d images, %llu references to %llu chunks "
+	    "(%llu shared), %llu chunks freed (%llu MB)\n", abs, nimages,
+	    (unsigned long long) refs, (unsigned long long) (n - freed),
+	    (unsigned long long) shared, (unsigned long long) freed,
+	    (unsigned long long) (bytes >> 20));
+	ret = 0;
+out:
+	free(images);
+	free(gc);
+	close(lockfd);
+	return (ret);
+}
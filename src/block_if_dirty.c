@@ -0,0 +1,389 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Persistent bitmaps of the blocks written since the last backup.
+ *
+ * The bitmap of <image> lives in <image>.dirty:
+ *
+ *   struct dirty_header	padded to DIRTY_HDR_SIZE
+ *   bitmap			one bit per granule of the disk
+ *
+ * A running VM keeps the bitmap in memory and holds an flock(2) on the
+ * file. The header is marked in use before the guest can write and
+ * marked clean only after the bitmap has been written back, from
+ * blockif_close() or at exit; a bitmap found in use by the next open
+ * therefore belongs to a VM that crashed and is not trusted. The mtime
+ * of the image is recorded as well, so writes made without tracking,
+ * e.g. by a VM started without the dirty option, invalidate it too.
+ *
+ * A bitmap that is not valid only means the next backup has to copy
+ * the whole disk; tracking always restarts from there.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if_be.h>
+
+#define DIRTY_MAGIC "XHYVEDB1"
+#define DIRTY_VERSION 1
+#define DIRTY_HDR_SIZE 4096
+#define DIRTY_SHIFT_DEF 16
+#define DIRTY_SHIFT_MIN 12
+#define DIRTY_SHIFT_MAX 30
+
+#define DIRTY_CLEAN 0
+#define DIRTY_INUSE 1
+
+#ifdef __APPLE__
+/* declared in unistd.h only with _POSIX_C_SOURCE */
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wredundant-decls"
+int fdatasync(int fd);
+#pragma clang diagnostic pop
+#endif
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct dirty_header {
+	char dh_magic[8];
+	uint32_t dh_version;
+	uint32_t dh_shift; /* log2 of the granularity */
+	uint64_t dh_size; /* disk size */
+	uint32_t dh_state; /* DIRTY_CLEAN or DIRTY_INUSE */
+	uint32_t dh_valid; /* bits cover every write since the checkpoint */
+	int64_t dh_mtime; /* image mtime when last saved, ns */
+	uint64_t dh_checkpoints;
+};
+
+struct blockif_dirty {
+	struct blockif_atexit dt_atexit;
+	char *dt_image;
+	int dt_fd;
+	int dt_inuse; /* header on disk says DIRTY_INUSE */
+	struct dirty_header dt_hdr;
+	uint64_t dt_nbits;
+	uint8_t *dt_bits;
+	pthread_mutex_t dt_mtx;
+};
+#pragma clang diagnostic pop
+
+static int64_t
+dirty_mtime(const char *image)
+{
+	struct stat sbuf;
+
+	if (stat(image, &sbuf) < 0)
+		return (-1);
+#ifdef __APPLE__
+	return (((int64_t) sbuf.st_mtimespec.tv_sec) * 1000000000 +
+	    sbuf.st_mtimespec.tv_nsec);
+#else
+	return (((int64_t) sbuf.st_mtim.tv_sec) * 1000000000 +
+	    sbuf.st_mtim.tv_nsec);
+#endif
+}
+
+static size_t
+dirty_mapsize(struct blockif_dirty *dt)
+{
+	return ((size_t) ((dt->dt_nbits + 7) / 8));
+}
+
+static int
+dirty_write_header(struct blockif_dirty *dt)
+{
+	if (pwrite(dt->dt_fd, &dt->dt_hdr, sizeof(dt->dt_hdr), 0) !=
+	    (ssize_t) sizeof(dt->dt_hdr) || fdatasync(dt->dt_fd) < 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Write the bitmap back and mark the file clean.
+ */
+static int
+dirty_save(struct blockif_dirty *dt)
+{
+	if (pwrite(dt->dt_fd, dt->dt_bits, dirty_mapsize(dt), DIRTY_HDR_SIZE) !=
+	    (ssize_t) dirty_mapsize(dt) || fdatasync(dt->dt_fd) < 0)
+		return (-1);
+	dt->dt_hdr.dh_state = DIRTY_CLEAN;
+	dt->dt_hdr.dh_mtime = dirty_mtime(dt->dt_image);
+	if (dirty_write_header(dt) < 0)
+		return (-1);
+	dt->dt_inuse = 0;
+	return (0);
+}
+
+static void
+dirty_exit(void *arg)
+{
+	struct blockif_dirty *dt;
+
+	dt = arg;
+	pthread_mutex_lock(&dt->dt_mtx);
+	if (dirty_save(dt) < 0)
+		perror(dt->dt_image);
+	pthread_mutex_unlock(&dt->dt_mtx);
+}
+
+/*
+ * gran is NULL or "<bytes>[k|m|g]".
+ */
+static int
+dirty_parse_shift(const char *gran, uint32_t *shift)
+{
+	uint64_t size;
+
+	*shift = DIRTY_SHIFT_DEF;
+	if (gran == NULL)
+		return (0);
+	if (expand_number(gran, &size) != 0 || size == 0 || !powerof2(size))
+		return (-1);
+	for (*shift = 0; (1ULL << *shift) < size; (*shift)++)
+		;
+	if (*shift < DIRTY_SHIFT_MIN || *shift > DIRTY_SHIFT_MAX)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Lock and read the bitmap of image, creating it if there is none. A
+ * bitmap that cannot be trusted, or has another granularity than
+ * shift (0 for whatever it has), comes back cleared and not valid.
+ */
+static struct blockif_dirty *
+dirty_load(const char *image, off_t size, uint32_t shift)
+{
+	struct blockif_dirty *dt;
+	struct dirty_header *dh;
+	char *path;
+	ssize_t n;
+
+	if (asprintf(&path, "%s.dirty", image) < 0)
+		return (NULL);
+	dt = calloc(1, sizeof(struct blockif_dirty));
+	if (dt == NULL) {
+		perror("calloc");
+		free(path);
+		return (NULL);
+	}
+	dt->dt_fd = -1;
+	dt->dt_image = strdup(image);
+	if (dt->dt_image == NULL) {
+		perror("strdup");
+		goto fail;
+	}
+	dt->dt_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (dt->dt_fd < 0) {
+		perror(path);
+		goto fail;
+	}
+	if (flock(dt->dt_fd, LOCK_EX | LOCK_NB) < 0) {
+		fprintf(stderr, "%s: in use by a running VM\n", path);
+		goto fail;
+	}
+
+	dh = &dt->dt_hdr;
+	n = pread(dt->dt_fd, dh, sizeof(*dh), 0);
+	if (n != (ssize_t) sizeof(*dh) ||
+	    memcmp(dh->dh_magic, DIRTY_MAGIC, sizeof(dh->dh_magic)) != 0 ||
+	    dh->dh_version != DIRTY_VERSION || dh->dh_shift < DIRTY_SHIFT_MIN ||
+	    dh->dh_shift > DIRTY_SHIFT_MAX) {
+		memset(dh, 0, sizeof(*dh));
+		memcpy(dh->dh_magic, DIRTY_MAGIC, sizeof(dh->dh_magic));
+		dh->dh_version = DIRTY_VERSION;
+		dh->dh_shift = shift ? shift : DIRTY_SHIFT_DEF;
+	}
+	if (dh->dh_state != DIRTY_CLEAN)
+		fprintf(stderr, "%s: not closed cleanly, the next backup will "
+		    "be a full one\n", path);
+	if (dh->dh_state != DIRTY_CLEAN || dh->dh_size != (uint64_t) size ||
+	    dh->dh_mtime != dirty_mtime(image) ||
+	    (shift != 0 && dh->dh_shift != shift)) {
+		dh->dh_valid = 0;
+		dh->dh_state = DIRTY_CLEAN;
+	}
+	if (shift != 0)
+		dh->dh_shift = shift;
+	dh->dh_size = (uint64_t) size;
+
+	dt->dt_nbits = ((uint64_t) size + (1ULL << dh->dh_shift) - 1) >>
+	    dh->dh_shift;
+	dt->dt_bits = calloc(1, MAX(dirty_mapsize(dt), 1));
+	if (dt->dt_bits == NULL) {
+		perror("calloc");
+		goto fail;
+	}
+	if (dh->dh_valid && pread(dt->dt_fd, dt->dt_bits, dirty_mapsize(dt),
+	    DIRTY_HDR_SIZE) != (ssize_t) dirty_mapsize(dt)) {
+		memset(dt->dt_bits, 0, dirty_mapsize(dt));
+		dh->dh_valid = 0;
+	}
+	pthread_mutex_init(&dt->dt_mtx, NULL);
+	free(path);
+	return (dt);
+
+fail:
+	if (dt->dt_fd >= 0)
+		close(dt->dt_fd);
+	free(dt->dt_image);
+	free(dt);
+	free(path);
+	return (NULL);
+}
+
+struct blockif_dirty *
+blockif_dirty_open(const char *image, off_t size, const char *gran)
+{
+	struct blockif_dirty *dt;
+	uint32_t shift;
+
+	if (dirty_parse_shift(gran, &shift) < 0) {
+		fprintf(stderr, "Invalid dirty block granularity \"%s\"\n", gran);
+		return (NULL);
+	}
+	dt = dirty_load(image, size, shift);
+	if (dt == NULL)
+		return (NULL);
+
+	/* Anything written from now on must invalidate a crashed bitmap */
+	dt->dt_hdr.dh_state = DIRTY_INUSE;
+	if (dirty_write_header(dt) < 0) {
+		perror(image);
+		blockif_dirty_unload(dt);
+		return (NULL);
+	}
+	dt->dt_inuse = 1;
+
+	blockif_atexit_add(&dt->dt_atexit, dirty_exit, dt);
+	return (dt);
+}
+
+void
+blockif_dirty_mark(struct blockif_dirty *dt, off_t off, off_t len)
+{
+	uint64_t bit, end;
+
+	if (len <= 0)
+		return;
+	bit = ((uint64_t) off) >> dt->dt_hdr.dh_shift;
+	end = MIN(((uint64_t) (off + len - 1)) >> dt->dt_hdr.dh_shift,
+	    dt->dt_nbits - 1);
+
+	pthread_mutex_lock(&dt->dt_mtx);
+	/* Written back already, e.g. by exit racing a last request */
+	if (!dt->dt_inuse) {
+		dt->dt_hdr.dh_state = DIRTY_INUSE;
+		(void) dirty_write_header(dt);
+		dt->dt_inuse = 1;
+	}
+	for (; bit <= end; bit++)
+		dt->dt_bits[bit >> 3] |= (uint8_t) (1 << (bit & 7));
+	pthread_mutex_unlock(&dt->dt_mtx);
+}
+
+void
+blockif_dirty_close(struct blockif_dirty *dt)
+{
+	blockif_atexit_remove(&dt->dt_atexit);
+
+	if (dirty_save(dt) < 0)
+		perror(dt->dt_image);
+	blockif_dirty_unload(dt);
+}
+
+struct blockif_dirty *
+blockif_dirty_load(const char *image, off_t size, int *valid)
+{
+	struct blockif_dirty *dt;
+
+	dt = dirty_load(image, size, 0);
+	if (dt != NULL)
+		*valid = dt->dt_hdr.dh_valid != 0;
+	return (dt);
+}
+
+off_t
+blockif_dirty_next(struct blockif_dirty *dt, off_t off, off_t *len)
+{
+	uint64_t bit, end;
+	uint32_t shift;
+
+	shift = dt->dt_hdr.dh_shift;
+	for (bit = ((uint64_t) off) >> shift; bit < dt->dt_nbits; bit++) {
+		if ((bit & 7) == 0 && dt->dt_bits[bit >> 3] == 0) {
+			bit += 7;
+			continue;
+		}
+		if (dt->dt_bits[bit >> 3] & (1 << (bit & 7)))
+			break;
+	}
+	if (bit >= dt->dt_nbits)
+		return (-1);
+	for (end = bit + 1; end < dt->dt_nbits; end++)
+		if (!(dt->dt_bits[end >> 3] & (1 << (end & 7))))
+			break;
+	*len = (off_t) MIN(end << shift, dt->dt_hdr.dh_size) -
+	    (off_t) (bit << shift);
+	return ((off_t) (bit << shift));
+}
+
+int
+blockif_dirty_checkpoint(struct blockif_dirty *dt)
+{
+	memset(dt->dt_bits, 0, dirty_mapsize(dt));
+	dt->dt_hdr.dh_valid = 1;
+	dt->dt_hdr.dh_checkpoints++;
+	if (dirty_save(dt) < 0) {
+		perror(dt->dt_image);
+		return (-1);
+	}
+	return (0);
+}
+
+void
+blockif_dirty_unload(struct blockif_dirty *dt)
+{
+	pthread_mutex_destroy(&dt->dt_mtx);
+	close(dt->dt_fd);
+	free(dt->dt_bits);
+	free(dt->dt_image);
+	free(dt);
+}
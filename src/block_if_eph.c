@@ -0,0 +1,443 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Throwaway write overlay in memory.
+ *
+ *   ephemeral[=<bytes>[k|m|g][:<dir>]]
+ *
+ * The disk below is opened read-only and every guest write goes to a
+ * 64KB cluster of the overlay instead, the first write to a cluster
+ * copying in the rest of it from below.  The first <bytes> (default
+ * EPH_MEM_DEF) of clusters are kept in memory, further ones in an
+ * unlinked file in <dir>, or $TMPDIR, best on a tmpfs.  Deleted
+ * clusters read as zeroes without an overlay cluster.
+ *
+ * Nothing is ever made stable, so flushes return at once, and all of
+ * the overlay is gone when the VM exits, however it exits.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if_be.h>
+
+#define EPH_SHIFT 16
+#define EPH_CLUSTER (1 << EPH_SHIFT)
+#define EPH_MEM_DEF (1ULL << 30)
+
+/* ep_map entries, otherwise the overlay slot + 1 */
+#define EPH_BELOW 0
+#define EPH_ZERO UINT32_MAX
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct blockif_eph {
+	const struct blockif_backend *ep_be; /* NULL for a plain file */
+	void *ep_bearg;
+	int ep_fd;
+	off_t ep_size;
+	uint32_t *ep_map; /* per cluster */
+	uint64_t ep_ncl;
+	/* slots below ep_maxmem are in memory, the rest in the spill file */
+	uint8_t **ep_mem;
+	uint32_t ep_maxmem;
+	uint32_t ep_nslots;
+	uint32_t *ep_free;
+	uint32_t ep_nfree;
+	uint32_t ep_maxfree;
+	char *ep_dir;
+	int ep_sfd;
+	uint8_t *ep_buf;
+	pthread_mutex_t ep_mtx;
+};
+#pragma clang diagnostic pop
+
+static int
+eph_below(struct blockif_eph *ep, const struct iovec *iov, int iovcnt,
+	size_t skip, size_t len, off_t off)
+{
+	return (blockif_iov_xfer(ep->ep_fd, ep->ep_be, ep->ep_bearg, iov,
+	    iovcnt, skip, len, off, 0));
+}
+
+static size_t
+eph_cl_len(struct blockif_eph *ep, uint64_t cl)
+{
+	return ((size_t) MIN((off_t) EPH_CLUSTER,
+	    ep->ep_size - (off_t) (cl << EPH_SHIFT)));
+}
+
+/*
+ * Move len bytes between skip in iov and slot s at loff.
+ */
+static int
+eph_slot_io(struct blockif_eph *ep, uint32_t s, const struct iovec *iov,
+	int iovcnt, size_t skip, size_t len, size_t loff, int write)
+{
+	if (s < ep->ep_maxmem) {
+		blockif_iov_copy(iov, iovcnt, skip, ep->ep_mem[s] + loff, len,
+		    !write);
+		return (0);
+	}
+	return (blockif_iov_xfer(ep->ep_sfd, NULL, NULL, iov, iovcnt, skip, len,
+	    (off_t) (((uint64_t) (s - ep->ep_maxmem) << EPH_SHIFT) + loff),
+	    write));
+}
+
+static int
+eph_spill_open(struct blockif_eph *ep)
+{
+	const char *dir;
+	char tmpl[MAXPATHLEN];
+
+	dir = ep->ep_dir;
+	if (dir == NULL)
+		dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == '\0')
+		dir = "/tmp";
+	snprintf(tmpl, sizeof(tmpl), "%s/xhyve-ephemeral.XXXXXX", dir);
+	ep->ep_sfd = mkstemp(tmpl);
+	if (ep->ep_sfd < 0) {
+		perror(tmpl);
+		return (errno);
+	}
+	unlink(tmpl);
+	return (0);
+}
+
+static int
+eph_alloc(struct blockif_eph *ep, uint32_t *slot)
+{
+	uint32_t s;
+	int err;
+
+	if (ep->ep_nfree > 0)
+		s = ep->ep_free[--ep->ep_nfree];
+	else if (ep->ep_nslots < EPH_ZERO - 1)
+		s = ep->ep_nslots;
+	else
+		return (ENOSPC);
+	if (s < ep->ep_maxmem && ep->ep_mem[s] == NULL) {
+		ep->ep_mem[s] = malloc(EPH_CLUSTER);
+		if (ep->ep_mem[s] == NULL)
+			return (ENOMEM);
+	}
+	if (s >= ep->ep_maxmem && ep->ep_sfd < 0 &&
+	    (err = eph_spill_open(ep)) != 0)
+		return (err);
+	if (s == ep->ep_nslots)
+		ep->ep_nslots++;
+	*slot = s;
+	return (0);
+}
+
+static void
+eph_release(struct blockif_eph *ep, uint64_t cl)
+{
+	uint32_t s;
+	uint32_t *f;
+
+	if (ep->ep_map[cl] == EPH_BELOW || ep->ep_map[cl] == EPH_ZERO)
+		return;
+	s = ep->ep_map[cl] - 1;
+	if (s < ep->ep_maxmem) {
+		free(ep->ep_mem[s]);
+		ep->ep_mem[s] = NULL;
+	}
+	if (ep->ep_nfree == ep->ep_maxfree) {
+		f = realloc(ep->ep_free, (ep->ep_maxfree + 1024) *
+		    sizeof(uint32_t));
+		if (f == NULL)
+			return; /* the slot is lost until exit */
+		ep->ep_free = f;
+		ep->ep_maxfree += 1024;
+	}
+	ep->ep_free[ep->ep_nfree++] = s;
+}
+
+/*
+ * Give cluster cl an overlay slot, holding what the guest sees now if
+ * fill is set.
+ */
+static int
+eph_map(struct blockif_eph *ep, uint64_t cl, int fill, uint32_t *slot)
+{
+	struct iovec iov;
+	size_t len;
+	uint32_t m, s;
+	int err;
+
+	m = ep->ep_map[cl];
+	if (m != EPH_BELOW && m != EPH_ZERO) {
+		*slot = m - 1;
+		return (0);
+	}
+	err = eph_alloc(ep, &s);
+	if (err != 0)
+		return (err);
+	ep->ep_map[cl] = s + 1;
+	if (fill) {
+		len = eph_cl_len(ep, cl);
+		iov.iov_base = s < ep->ep_maxmem ? ep->ep_mem[s] : ep->ep_buf;
+		iov.iov_len = len;
+		if (m == EPH_ZERO)
+			memset(iov.iov_base, 0, len);
+		else
+			err = eph_below(ep, &iov, 1, 0, len,
+			    (off_t) (cl << EPH_SHIFT));
+		if (err == 0 && s >= ep->ep_maxmem)
+			err = eph_slot_io(ep, s, &iov, 1, 0, len, 0, 1);
+	}
+	if (err != 0) {
+		eph_release(ep, cl);
+		ep->ep_map[cl] = m;
+		return (err);
+	}
+	*slot = s;
+	return (0);
+}
+
+static ssize_t
+eph_rw(struct blockif_eph *ep, const struct iovec *iov, int iovcnt,
+	off_t off, int write)
+{
+	uint64_t cl;
+	uint32_t m, s;
+	size_t total, done, n, loff, rstart, rlen;
+	int i, err;
+
+	for (total = 0, i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (off >= ep->ep_size)
+		return (0);
+	total = (size_t) MIN((off_t) total, ep->ep_size - off);
+
+	err = 0;
+	rstart = rlen = 0;
+	pthread_mutex_lock(&ep->ep_mtx);
+	for (done = 0; err == 0 && done < total; done += n) {
+		cl = (uint64_t) (off + (off_t) done) >> EPH_SHIFT;
+		loff = (size_t) (off + (off_t) done) & (EPH_CLUSTER - 1);
+		n = MIN(total - done, EPH_CLUSTER - loff);
+		m = ep->ep_map[cl];
+		if (write) {
+			/* A whole cluster need not be copied in first */
+			err = eph_map(ep, cl, n < eph_cl_len(ep, cl), &s);
+			if (err == 0)
+				err = eph_slot_io(ep, s, iov, iovcnt, done, n,
+				    loff, 1);
+			continue;
+		}
+		/* Reads of the disk below are done in runs */
+		if (m == EPH_BELOW) {
+			if (rlen == 0)
+				rstart = done;
+			rlen += n;
+			continue;
+		}
+		if (rlen > 0)
+			err = eph_below(ep, iov, iovcnt, rstart, rlen,
+			    off + (off_t) rstart);
+		rlen = 0;
+		if (err != 0)
+			break;
+		if (m == EPH_ZERO)
+			blockif_iov_copy(iov, iovcnt, done, NULL, n, 1);
+		else
+			err = eph_slot_io(ep, m - 1, iov, iovcnt, done, n, loff,
+			    0);
+	}
+	if (err == 0 && rlen > 0)
+		err = eph_below(ep, iov, iovcnt, rstart, rlen,
+		    off + (off_t) rstart);
+	pthread_mutex_unlock(&ep->ep_mtx);
+
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+	return ((ssize_t) total);
+}
+
+static ssize_t
+eph_preadv(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return (eph_rw(arg, iov, iovcnt, offset, 0));
+}
+
+static ssize_t
+eph_pwritev(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return (eph_rw(arg, iov, iovcnt, offset, 1));
+}
+
+static int
+eph_flush(void *arg)
+{
+	(void) arg;
+	return (0);
+}
+
+static int
+eph_delete(void *arg, off_t offset, off_t len)
+{
+	struct blockif_eph *ep;
+	struct iovec iov;
+	uint64_t cl;
+	uint32_t s;
+	size_t n, loff;
+	off_t pos;
+	int err;
+
+	ep = arg;
+	if (offset < 0 || offset + len > ep->ep_size)
+		return (EINVAL);
+
+	err = 0;
+	pthread_mutex_lock(&ep->ep_mtx);
+	memset(ep->ep_buf, 0, EPH_CLUSTER);
+	iov.iov_base = ep->ep_buf;
+	iov.iov_len = EPH_CLUSTER;
+	for (pos = offset; err == 0 && pos < offset + len; pos += (off_t) n) {
+		cl = (uint64_t) pos >> EPH_SHIFT;
+		loff = (size_t) pos & (EPH_CLUSTER - 1);
+		n = (size_t) MIN(offset + len - pos, (off_t) (EPH_CLUSTER - loff));
+		if (n == eph_cl_len(ep, cl)) {
+			eph_release(ep, cl);
+			ep->ep_map[cl] = EPH_ZERO;
+		} else if (ep->ep_map[cl] != EPH_ZERO) {
+			err = eph_map(ep, cl, 1, &s);
+			if (err == 0) {
+				memset(ep->ep_buf, 0, n);
+				err = eph_slot_io(ep, s, &iov, 1, 0, n, loff, 1);
+			}
+		}
+	}
+	pthread_mutex_unlock(&ep->ep_mtx);
+	return (err);
+}
+
+static void
+eph_free(struct blockif_eph *ep)
+{
+	uint32_t s;
+
+	if (ep->ep_mem != NULL)
+		for (s = 0; s < ep->ep_maxmem; s++)
+			free(ep->ep_mem[s]);
+	if (ep->ep_sfd >= 0)
+		close(ep->ep_sfd);
+	free(ep->ep_mem);
+	free(ep->ep_map);
+	free(ep->ep_free);
+	free(ep->ep_dir);
+	free(ep->ep_buf);
+	free(ep);
+}
+
+static void
+eph_close(void *arg)
+{
+	struct blockif_eph *ep;
+
+	ep = arg;
+	pthread_mutex_destroy(&ep->ep_mtx);
+	if (ep->ep_be != NULL)
+		ep->ep_be->bb_close(ep->ep_bearg);
+	eph_free(ep);
+}
+
+const struct blockif_backend blockif_eph_backend = {
+	.bb_name = "ephemeral",
+	.bb_preadv = eph_preadv,
+	.bb_pwritev = eph_pwritev,
+	.bb_flush = eph_flush,
+	.bb_delete = eph_delete,
+	.bb_close = eph_close,
+};
+
+/*
+ * spec is NULL for the defaults, or "<bytes>[k|m|g][:<dir>]".
+ */
+void *
+blockif_eph_open(const char *spec, const struct blockif_backend *be,
+	void *bearg, int fd, off_t size)
+{
+	struct blockif_eph *ep;
+	uint64_t mem;
+	char *num, *dir;
+
+	ep = calloc(1, sizeof(struct blockif_eph));
+	if (ep == NULL) {
+		perror("calloc");
+		return (NULL);
+	}
+	ep->ep_sfd = -1;
+
+	mem = EPH_MEM_DEF;
+	if (spec != NULL) {
+		dir = num = strdup(spec);
+		strsep(&dir, ":");
+		if (num == NULL || expand_number(num, &mem) != 0 ||
+		    (dir != NULL && *dir == '\0')) {
+			fprintf(stderr, "Invalid ephemeral overlay \"%s\"\n", spec);
+			free(num);
+			eph_free(ep);
+			return (NULL);
+		}
+		if (dir != NULL)
+			ep->ep_dir = strdup(dir);
+		free(num);
+	}
+
+	ep->ep_be = be;
+	ep->ep_bearg = bearg;
+	ep->ep_fd = fd;
+	ep->ep_size = size;
+	ep->ep_ncl = ((uint64_t) size + EPH_CLUSTER - 1) >> EPH_SHIFT;
+	ep->ep_maxmem = (uint32_t) MIN(mem >> EPH_SHIFT, ep->ep_ncl);
+	ep->ep_map = calloc(ep->ep_ncl, sizeof(uint32_t));
+	ep->ep_mem = calloc(MAX(ep->ep_maxmem, 1), sizeof(uint8_t *));
+	ep->ep_buf = malloc(EPH_CLUSTER);
+	if (ep->ep_map == NULL || ep->ep_mem == NULL || ep->ep_buf == NULL ||
+	    ep->ep_ncl >= EPH_ZERO) {
+		perror("calloc");
+		eph_free(ep);
+		return (NULL);
+	}
+	pthread_mutex_init(&ep->ep_mtx, NULL);
+	return (ep);
+}
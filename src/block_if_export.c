@@ -0,0 +1,719 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Read-only NBD export of a running disk for live backups.
+ *
+ *   -s 4,virtio-blk,disk.img,export=/tmp/vm-disk.sock
+ *
+ * The point in time is taken when the first client connects and held
+ * until the last one disconnects.  While it is held, the first guest
+ * write or delete touching a cluster copies the old contents of that
+ * cluster to an unlinked side file (copy-before-write); export reads of
+ * preserved clusters come from the side file and everything else is
+ * read from the live disk.  Only clusters the guest overwrites during
+ * the backup are ever copied, and nothing at all is done while no
+ * client is attached.
+ *
+ * The side file is identity mapped and sparse, so it takes host space
+ * only for the clusters preserved.  If copying fails the guest write
+ * still goes ahead and the export fails every later read with EIO, so
+ * a backup never silently mixes two points in time.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if_be.h>
+#include <xhyve/nbd.h>
+
+#define EX_SHIFT 16 /* copy-before-write granularity */
+#define EX_MAXREQ (32 * 1024 * 1024) /* largest NBD read served */
+#define EX_MAXOPT (NBD_MAX_STRING + 64) /* largest option payload */
+#define EX_FLAGS (NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY | \
+	NBD_FLAG_SEND_FLUSH | NBD_FLAG_CAN_MULTI_CONN)
+
+#ifdef MSG_NOSIGNAL
+#define EX_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define EX_SEND_FLAGS 0
+#endif
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct ex_conn {
+	LIST_ENTRY(ex_conn) ec_link;
+	struct blockif_export *ec_ex;
+	int ec_fd;
+	int ec_nozero; /* client asked for NBD_FLAG_C_NO_ZEROES */
+	uint8_t *ec_buf;
+	size_t ec_buflen;
+};
+
+struct blockif_export {
+	char ex_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+	blockif_read_t *ex_read;
+	void *ex_arg;
+	off_t ex_size;
+	size_t ex_clsz;
+	uint64_t ex_ncl;
+	int ex_lfd; /* listening socket */
+	int ex_pipe[2]; /* wakes the listener on close */
+	pthread_t ex_tid;
+	pthread_mutex_t ex_mtx; /* everything below */
+	pthread_cond_t ex_cond;
+	LIST_HEAD(, ex_conn) ex_conns;
+	int ex_nconns; /* the point in time is held while > 0 */
+	int ex_error; /* copy-before-write failed, view is lost */
+	int ex_sfd; /* side file of preserved clusters */
+	uint8_t *ex_map; /* one bit per preserved cluster */
+	uint8_t *ex_cbuf; /* copy-before-write bounce buffer */
+	uint64_t ex_copied;
+};
+#pragma clang diagnostic pop
+
+static int
+ex_send(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, EX_SEND_FLAGS);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (-1);
+		buf = ((const uint8_t *) buf) + n;
+		len -= (size_t) n;
+	}
+	return (0);
+}
+
+static int
+ex_recv(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(fd, buf, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (-1);
+		buf = ((uint8_t *) buf) + n;
+		len -= (size_t) n;
+	}
+	return (0);
+}
+
+static int
+ex_discard(int fd, size_t len)
+{
+	uint8_t buf[512];
+	size_t n;
+
+	while (len > 0) {
+		n = MIN(len, sizeof(buf));
+		if (ex_recv(fd, buf, n) < 0)
+			return (-1);
+		len -= n;
+	}
+	return (0);
+}
+
+static int
+ex_errno(int err)
+{
+	switch (err) {
+	case EPERM:
+	case EROFS:
+		return (NBD_EPERM);
+	case ENOMEM:
+		return (NBD_ENOMEM);
+	case EINVAL:
+		return (NBD_EINVAL);
+	case ENOSPC:
+		return (NBD_ENOSPC);
+	case EOVERFLOW:
+		return (NBD_EOVERFLOW);
+	case ESHUTDOWN:
+		return (NBD_ESHUTDOWN);
+	default:
+		return (NBD_EIO);
+	}
+}
+
+static int
+ex_preserved(struct blockif_export *ex, uint64_t cl)
+{
+	return ((ex->ex_map[cl >> 3] >> (cl & 7)) & 1);
+}
+
+/*
+ * Read len bytes of the disk at off, which must be cluster aligned,
+ * either from the live disk or from the side file.  Called with ex_mtx
+ * held so that no cluster in the range gets preserved meanwhile.
+ */
+static int
+ex_read_run(struct blockif_export *ex, uint8_t *buf, size_t len, off_t off,
+	int preserved)
+{
+	ssize_t n;
+
+	if (!preserved)
+		return ((*ex->ex_read)(ex->ex_arg, buf, len, off));
+	while (len > 0) {
+		n = pread(ex->ex_sfd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (errno);
+		if (n == 0)
+			return (EIO);
+		buf += n;
+		off += n;
+		len -= (size_t) n;
+	}
+	return (0);
+}
+
+/*
+ * Fill buf with the point in time view of [off, off + len), both cluster
+ * aligned or ending at the disk size.  Runs of clusters in the same
+ * place are read with one call, one run at a time under ex_mtx.
+ */
+static int
+ex_read(struct blockif_export *ex, uint8_t *buf, off_t off, size_t len)
+{
+	uint64_t cl, end, run;
+	size_t n;
+	int err, preserved;
+
+	cl = ((uint64_t) off) >> EX_SHIFT;
+	end = cl + ((len + ex->ex_clsz - 1) >> EX_SHIFT);
+	err = 0;
+	while (err == 0 && cl < end) {
+		pthread_mutex_lock(&ex->ex_mtx);
+		if (ex->ex_error != 0) {
+			pthread_mutex_unlock(&ex->ex_mtx);
+			return (EIO);
+		}
+		preserved = ex_preserved(ex, cl);
+		for (run = cl + 1; run < end; run++)
+			if (ex_preserved(ex, run) != preserved)
+				break;
+		n = MIN(len, (size_t) (run - cl) << EX_SHIFT);
+		err = ex_read_run(ex, buf, n, (off_t) (cl << EX_SHIFT), preserved);
+		pthread_mutex_unlock(&ex->ex_mtx);
+		buf += n;
+		len -= n;
+		cl = run;
+	}
+	return (err);
+}
+
+void
+blockif_export_cbw(struct blockif_export *ex, off_t off, off_t len)
+{
+	uint64_t cl, end;
+	ssize_t n;
+	size_t clen;
+	off_t coff;
+	int err;
+
+	if (len <= 0 || off >= ex->ex_size)
+		return;
+	len = MIN(len, ex->ex_size - off);
+
+	pthread_mutex_lock(&ex->ex_mtx);
+	if (ex->ex_nconns == 0 || ex->ex_error != 0) {
+		pthread_mutex_unlock(&ex->ex_mtx);
+		return;
+	}
+	cl = ((uint64_t) off) >> EX_SHIFT;
+	end = ((uint64_t) (off + len - 1)) >> EX_SHIFT;
+	for (err = 0; err == 0 && cl <= end; cl++) {
+		if (ex_preserved(ex, cl))
+			continue;
+		coff = (off_t) (cl << EX_SHIFT);
+		clen = (size_t) MIN((off_t) ex->ex_clsz, ex->ex_size - coff);
+		err = (*ex->ex_read)(ex->ex_arg, ex->ex_cbuf, clen, coff);
+		if (err == 0) {
+			n = pwrite(ex->ex_sfd, ex->ex_cbuf, clen, coff);
+			if (n < 0)
+				err = errno;
+			else if ((size_t) n != clen)
+				err = ENOSPC;
+		}
+		if (err == 0) {
+			ex->ex_map[cl >> 3] |= (uint8_t) (1 << (cl & 7));
+			ex->ex_copied++;
+		}
+	}
+	if (err != 0) {
+		fprintf(stderr, "export %s: copy-before-write failed: %s, "
+			"point in time lost\n", ex->ex_path, strerror(err));
+		ex->ex_error = err;
+	}
+	pthread_mutex_unlock(&ex->ex_mtx);
+}
+
+/*
+ * Drop the point in time once the last client is gone.  Called with
+ * ex_mtx held.
+ */
+static void
+ex_release(struct blockif_export *ex)
+{
+	memset(ex->ex_map, 0, (size_t) ((ex->ex_ncl + 7) / 8));
+	if (ftruncate(ex->ex_sfd, 0) != 0)
+		perror("export ftruncate");
+	ex->ex_error = 0;
+	ex->ex_copied = 0;
+}
+
+static int
+ex_opt_reply(struct ex_conn *ec, uint32_t opt, uint32_t type,
+	const void *data, uint32_t len)
+{
+	uint8_t hdr[20];
+
+	nbd_enc64(hdr, NBD_REP_MAGIC);
+	nbd_enc32(hdr + 8, opt);
+	nbd_enc32(hdr + 12, type);
+	nbd_enc32(hdr + 16, len);
+	if (ex_send(ec->ec_fd, hdr, sizeof(hdr)) < 0)
+		return (-1);
+	if (len > 0 && ex_send(ec->ec_fd, data, len) < 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Fixed newstyle negotiation.  There is a single export and any name
+ * selects it.  Structured replies are declined, reads are answered
+ * with simple replies.  Returns 0 to enter transmission, -1 to drop
+ * the client.
+ */
+static int
+ex_handshake(struct ex_conn *ec)
+{
+	struct blockif_export *ex;
+	uint8_t buf[EX_MAXOPT], zero[124];
+	uint32_t opt, len, nlen;
+	int fd;
+
+	ex = ec->ec_ex;
+	fd = ec->ec_fd;
+
+	nbd_enc64(buf, NBD_MAGIC);
+	nbd_enc64(buf + 8, NBD_OPTS_MAGIC);
+	nbd_enc16(buf + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	if (ex_send(fd, buf, 18) < 0 || ex_recv(fd, buf, 4) < 0)
+		return (-1);
+	if (!(nbd_dec32(buf) & NBD_FLAG_C_FIXED_NEWSTYLE))
+		return (-1);
+	ec->ec_nozero = (nbd_dec32(buf) & NBD_FLAG_C_NO_ZEROES) != 0;
+
+	for (;;) {
+		if (ex_recv(fd, buf, 16) < 0 ||
+		    nbd_dec64(buf) != NBD_OPTS_MAGIC)
+			return (-1);
+		opt = nbd_dec32(buf + 8);
+		len = nbd_dec32(buf + 12);
+		if (len > sizeof(buf) || ex_recv(fd, buf, len) < 0)
+			return (-1);
+
+		switch (opt) {
+		case NBD_OPT_EXPORT_NAME:
+			nbd_enc64(buf, (uint64_t) ex->ex_size);
+			nbd_enc16(buf + 8, EX_FLAGS);
+			memset(zero, 0, sizeof(zero));
+			if (ex_send(fd, buf, 10) < 0 || (!ec->ec_nozero &&
+			    ex_send(fd, zero, sizeof(zero)) < 0))
+				return (-1);
+			return (0);
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO:
+			/* name length, name, count of info requests, requests */
+			if (len < 6 || (nlen = nbd_dec32(buf)) > len - 6 ||
+			    len != 6 + nlen + 2 * nbd_dec16(buf + 4 + nlen)) {
+				if (ex_opt_reply(ec, opt, NBD_REP_ERR_INVALID,
+				    NULL, 0) < 0)
+					return (-1);
+				break;
+			}
+			nbd_enc16(buf, NBD_INFO_EXPORT);
+			nbd_enc64(buf + 2, (uint64_t) ex->ex_size);
+			nbd_enc16(buf + 10, EX_FLAGS);
+			if (ex_opt_reply(ec, opt, NBD_REP_INFO, buf, 12) < 0 ||
+			    ex_opt_reply(ec, opt, NBD_REP_ACK, NULL, 0) < 0)
+				return (-1);
+			if (opt == NBD_OPT_GO)
+				return (0);
+			break;
+		case NBD_OPT_LIST:
+			nbd_enc32(buf, 0);
+			if (ex_opt_reply(ec, opt, NBD_REP_SERVER, buf, 4) < 0 ||
+			    ex_opt_reply(ec, opt, NBD_REP_ACK, NULL, 0) < 0)
+				return (-1);
+			break;
+		case NBD_OPT_ABORT:
+			(void) ex_opt_reply(ec, opt, NBD_REP_ACK, NULL, 0);
+			return (-1);
+		default:
+			if (ex_opt_reply(ec, opt, NBD_REP_ERR_UNSUP, NULL, 0) < 0)
+				return (-1);
+			break;
+		}
+	}
+}
+
+static int
+ex_reply(struct ex_conn *ec, const uint8_t *handle, int err,
+	const void *data, size_t len)
+{
+	uint8_t hdr[NBD_SIMPLE_REPLY_SIZE];
+
+	nbd_enc32(hdr, NBD_SIMPLE_REPLY_MAGIC);
+	nbd_enc32(hdr + 4, err ? (uint32_t) ex_errno(err) : 0);
+	memcpy(hdr + 8, handle, 8);
+	if (ex_send(ec->ec_fd, hdr, sizeof(hdr)) < 0)
+		return (-1);
+	if (len > 0 && ex_send(ec->ec_fd, data, len) < 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Serve one read.  The range is widened to whole clusters so that the
+ * live disk is only ever read aligned, as O_DIRECT requires.
+ */
+static int
+ex_serve_read(struct ex_conn *ec, const uint8_t *handle, uint64_t off,
+	uint32_t len)
+{
+	struct blockif_export *ex;
+	uint64_t start, end;
+	size_t need;
+	void *p;
+	int err;
+
+	ex = ec->ec_ex;
+	if (len == 0 || len > EX_MAXREQ || off >= (uint64_t) ex->ex_size ||
+	    len > (uint64_t) ex->ex_size - off)
+		return (ex_reply(ec, handle, EINVAL, NULL, 0));
+
+	start = off & ~((uint64_t) ex->ex_clsz - 1);
+	end = MIN((off + len + ex->ex_clsz - 1) & ~((uint64_t) ex->ex_clsz - 1),
+		(uint64_t) ex->ex_size);
+	need = (size_t) (end - start);
+	if (need > ec->ec_buflen) {
+		if (posix_memalign(&p, 4096, need) != 0)
+			return (ex_reply(ec, handle, ENOMEM, NULL, 0));
+		free(ec->ec_buf);
+		ec->ec_buf = p;
+		ec->ec_buflen = need;
+	}
+	err = ex_read(ex, ec->ec_buf, (off_t) start, need);
+	if (err != 0)
+		return (ex_reply(ec, handle, err, NULL, 0));
+	return (ex_reply(ec, handle, 0, ec->ec_buf + (off - start), len));
+}
+
+static void
+ex_serve(struct ex_conn *ec)
+{
+	uint8_t req[NBD_REQUEST_SIZE];
+	uint32_t len;
+	uint16_t type;
+	int fd;
+
+	fd = ec->ec_fd;
+	for (;;) {
+		if (ex_recv(fd, req, sizeof(req)) < 0 ||
+		    nbd_dec32(req) != NBD_REQUEST_MAGIC)
+			return;
+		type = nbd_dec16(req + 6);
+		len = nbd_dec32(req + 24);
+
+		switch (type) {
+		case NBD_CMD_READ:
+			if (ex_serve_read(ec, req + 8, nbd_dec64(req + 16), len) < 0)
+				return;
+			break;
+		case NBD_CMD_WRITE:
+			if (ex_discard(fd, len) < 0 ||
+			    ex_reply(ec, req + 8, EPERM, NULL, 0) < 0)
+				return;
+			break;
+		case NBD_CMD_TRIM:
+		case NBD_CMD_WRITE_ZEROES:
+			if (ex_reply(ec, req + 8, EPERM, NULL, 0) < 0)
+				return;
+			break;
+		case NBD_CMD_FLUSH:
+			if (ex_reply(ec, req + 8, 0, NULL, 0) < 0)
+				return;
+			break;
+		case NBD_CMD_DISC:
+			return;
+		default:
+			if (ex_reply(ec, req + 8, EINVAL, NULL, 0) < 0)
+				return;
+			break;
+		}
+	}
+}
+
+static void *
+ex_conn_thread(void *arg)
+{
+	struct blockif_export *ex;
+	struct ex_conn *ec;
+
+	ec = arg;
+	ex = ec->ec_ex;
+	if (ex_handshake(ec) == 0)
+		ex_serve(ec);
+
+	pthread_mutex_lock(&ex->ex_mtx);
+	LIST_REMOVE(ec, ec_link);
+	if (--ex->ex_nconns == 0) {
+		if (ex->ex_copied > 0)
+			fprintf(stderr, "export %s: released, %llu clusters "
+				"preserved\n", ex->ex_path,
+				(unsigned long long) ex->ex_copied);
+		ex_release(ex);
+	}
+	pthread_cond_broadcast(&ex->ex_cond);
+	pthread_mutex_unlock(&ex->ex_mtx);
+
+	close(ec->ec_fd);
+	free(ec->ec_buf);
+	free(ec);
+	return (NULL);
+}
+
+static void *
+ex_listen_thread(void *arg)
+{
+	struct blockif_export *ex;
+	struct ex_conn *ec;
+	struct pollfd pfd[2];
+	pthread_t tid;
+	int fd;
+#ifdef SO_NOSIGPIPE
+	int one;
+#endif
+
+	ex = arg;
+	pfd[0].fd = ex->ex_lfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ex->ex_pipe[0];
+	pfd[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("export poll");
+			break;
+		}
+		if (pfd[1].revents != 0)
+			break;
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+		fd = accept(ex->ex_lfd, NULL, NULL);
+		if (fd < 0)
+			continue;
+#ifdef SO_NOSIGPIPE
+		one = 1;
+		(void) setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+		ec = calloc(1, sizeof(struct ex_conn));
+		if (ec == NULL) {
+			close(fd);
+			continue;
+		}
+		ec->ec_ex = ex;
+		ec->ec_fd = fd;
+
+		/* The point in time is taken here, on the first client */
+		pthread_mutex_lock(&ex->ex_mtx);
+		LIST_INSERT_HEAD(&ex->ex_conns, ec, ec_link);
+		ex->ex_nconns++;
+		if (pthread_create(&tid, NULL, ex_conn_thread, ec) != 0) {
+			LIST_REMOVE(ec, ec_link);
+			if (--ex->ex_nconns == 0)
+				ex_release(ex);
+			pthread_mutex_unlock(&ex->ex_mtx);
+			close(fd);
+			free(ec);
+			continue;
+		}
+		pthread_detach(tid);
+		pthread_mutex_unlock(&ex->ex_mtx);
+	}
+	return (NULL);
+}
+
+struct blockif_export *
+blockif_export_open(const char *path, off_t size, blockif_read_t *rd,
+	void *arg)
+{
+	struct blockif_export *ex;
+	struct sockaddr_un sun;
+	struct stat sbuf;
+	char tmpl[MAXPATHLEN];
+	const char *tmpdir;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "export socket path too long \"%s\"\n", path);
+		return (NULL);
+	}
+
+	ex = calloc(1, sizeof(struct blockif_export));
+	if (ex == NULL) {
+		perror("calloc");
+		return (NULL);
+	}
+	strcpy(ex->ex_path, path);
+	ex->ex_read = rd;
+	ex->ex_arg = arg;
+	ex->ex_size = size;
+	ex->ex_clsz = ((size_t) 1) << EX_SHIFT;
+	ex->ex_ncl = (((uint64_t) size) + ex->ex_clsz - 1) >> EX_SHIFT;
+	ex->ex_lfd = ex->ex_sfd = -1;
+	ex->ex_pipe[0] = ex->ex_pipe[1] = -1;
+	LIST_INIT(&ex->ex_conns);
+
+	ex->ex_map = calloc(1, (size_t) ((ex->ex_ncl + 7) / 8));
+	if (ex->ex_map == NULL ||
+	    posix_memalign((void **) &ex->ex_cbuf, 4096, ex->ex_clsz) != 0) {
+		perror("export alloc");
+		goto fail;
+	}
+
+	tmpdir = getenv("TMPDIR");
+	if (tmpdir == NULL || *tmpdir == '\0')
+		tmpdir = "/tmp";
+	snprintf(tmpl, sizeof(tmpl), "%s/xhyve-export.XXXXXX", tmpdir);
+	ex->ex_sfd = mkstemp(tmpl);
+	if (ex->ex_sfd < 0) {
+		perror(tmpl);
+		goto fail;
+	}
+	unlink(tmpl);
+
+	/* Only replace a stale socket, never some other file */
+	if (lstat(path, &sbuf) == 0 && S_ISSOCK(sbuf.st_mode))
+		unlink(path);
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	ex->ex_lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (ex->ex_lfd < 0 ||
+	    bind(ex->ex_lfd, (struct sockaddr *) &sun, sizeof(sun)) < 0 ||
+	    listen(ex->ex_lfd, 8) < 0) {
+		perror(path);
+		goto fail;
+	}
+
+	if (pipe(ex->ex_pipe) < 0) {
+		perror("pipe");
+		goto fail;
+	}
+	pthread_mutex_init(&ex->ex_mtx, NULL);
+	pthread_cond_init(&ex->ex_cond, NULL);
+	if (pthread_create(&ex->ex_tid, NULL, ex_listen_thread, ex) != 0) {
+		perror("pthread_create");
+		pthread_cond_destroy(&ex->ex_cond);
+		pthread_mutex_destroy(&ex->ex_mtx);
+		goto fail;
+	}
+	return (ex);
+
+fail:
+	if (ex->ex_lfd >= 0) {
+		close(ex->ex_lfd);
+		unlink(path);
+	}
+	if (ex->ex_pipe[0] >= 0) {
+		close(ex->ex_pipe[0]);
+		close(ex->ex_pipe[1]);
+	}
+	if (ex->ex_sfd >= 0)
+		close(ex->ex_sfd);
+	free(ex->ex_cbuf);
+	free(ex->ex_map);
+	free(ex);
+	return (NULL);
+}
+
+/*
+ * Stop listening and drop all clients.  The disk must still be
+ * readable until this returns.
+ */
+void
+blockif_export_close(struct blockif_export *ex)
+{
+	struct ex_conn *ec;
+	void *jval;
+
+	(void) write(ex->ex_pipe[1], "", 1);
+	pthread_join(ex->ex_tid, &jval);
+	close(ex->ex_lfd);
+	unlink(ex->ex_path);
+
+	pthread_mutex_lock(&ex->ex_mtx);
+	LIST_FOREACH(ec, &ex->ex_conns, ec_link)
+		shutdown(ec->ec_fd, SHUT_RDWR);
+	while (ex->ex_nconns > 0)
+		pthread_cond_wait(&ex->ex_cond, &ex->ex_mtx);
+	pthread_mutex_unlock(&ex->ex_mtx);
+
+	close(ex->ex_pipe[0]);
+	close(ex->ex_pipe[1]);
+	close(ex->ex_sfd);
+	pthread_cond_destroy(&ex->ex_cond);
+	pthread_mutex_destroy(&ex->ex_mtx);
+	free(ex->ex_cbuf);
+	free(ex->ex_map);
+	free(ex);
+}
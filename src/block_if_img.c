@@ -0,0 +1,765 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Offline image maintenance: sparse copies, format conversion,
+ * compaction, incremental backups and import into a dedup store.
+ *
+ * All of them walk the data extents of the source, found with
+ * SEEK_DATA/SEEK_HOLE so that holes are never read, and hand out
+ * IMG_CHUNK sized pieces of them to a pool of threads. A piece that
+ * turns out to be all zeroes is not written (copy, convert) or has its
+ * blocks deallocated (compact), so the result is as sparse as possible.
+ * Incremental backups walk the blocks of the dirty bitmap instead.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if_be.h>
+
+#define IMG_CHUNK (1024 * 1024)
+#define IMG_BLOCK (64 * 1024) /* granularity of hole punching */
+#define IMG_MAXTHREADS 8
+
+enum img_op {
+	IMG_COPY,
+	IMG_COMPACT,
+	IMG_UPDATE, /* copy over existing data */
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct img_extent {
+	off_t ie_off;
+	off_t ie_len;
+};
+
+struct img_job {
+	enum img_op ij_op;
+	const char *ij_name;
+	/* source: a plain file, or an image read through its backend */
+	int ij_sfd;
+	const struct blockif_backend *ij_be;
+	void *ij_bearg;
+	int ij_dfd;
+	/* or a destination written through its backend */
+	const struct blockif_backend *ij_dbe;
+	void *ij_dbearg;
+	off_t ij_size;
+	struct img_extent *ij_ext;
+	int ij_next;
+	int ij_next_ext;
+	off_t ij_next_off;
+	off_t ij_total;
+	off_t ij_done;
+	off_t ij_zero;
+	int ij_pct;
+	int ij_error;
+	pthread_mutex_t ij_mtx;
+};
+#pragma clang diagnostic pop
+
+static int
+img_pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (-1);
+		if (n == 0) {
+			memset(buf, 0, len);
+			break;
+		}
+		buf = ((uint8_t *) buf) + n;
+		len -= (size_t) n;
+		off += n;
+	}
+	return (0);
+}
+
+static int
+img_pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (-1);
+		buf = ((const uint8_t *) buf) + n;
+		len -= (size_t) n;
+		off += n;
+	}
+	return (0);
+}
+
+static int
+img_iszero(const uint8_t *buf, size_t len)
+{
+	const uint64_t *p;
+	size_t i;
+
+	p = (const uint64_t *) ((const void *) buf);
+	for (i = 0; i < len / sizeof(uint64_t); i++)
+		if (p[i] != 0)
+			return (0);
+	for (i = i * sizeof(uint64_t); i < len; i++)
+		if (buf[i] != 0)
+			return (0);
+	return (1);
+}
+
+/*
+ * Deallocate [off, off + len) without changing the file size.
+ */
+static int
+img_punch(int fd, off_t off, off_t len)
+{
+#if defined(FALLOC_FL_PUNCH_HOLE)
+	return (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off,
+	    len));
+#elif defined(F_PUNCHHOLE)
+	struct fpunchhole fp;
+
+	memset(&fp, 0, sizeof(fp));
+	fp.fp_offset = off;
+	fp.fp_length = len;
+	return (fcntl(fd, F_PUNCHHOLE, &fp));
+#else
+	(void) fd;
+	(void) off;
+	(void) len;
+	errno = EOPNOTSUPP;
+	return (-1);
+#endif
+}
+
+typedef off_t img_seek_t(void *arg, off_t offset, int whence);
+
+#ifdef SEEK_DATA
+static off_t
+img_lseek(void *arg, off_t offset, int whence)
+{
+	return (lseek(*((int *) arg), offset, whence));
+}
+
+static struct img_extent *
+img_seek_extents(img_seek_t *seek, void *arg, off_t size, off_t *total)
+{
+	struct img_extent *ext, *next;
+	off_t data, hole;
+	int n, max;
+
+	max = 64;
+	ext = malloc((size_t) (max + 1) * sizeof(struct img_extent));
+	if (ext == NULL)
+		return (NULL);
+	n = 0;
+	*total = 0;
+	for (data = 0; data < size; data = hole) {
+		data = seek(arg, data, SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			break;
+		hole = (data < 0) ? -1 : seek(arg, data, SEEK_HOLE);
+		if (hole < 0) {
+			free(ext);
+			return (NULL);
+		}
+		hole = MIN(hole, size);
+		if (n == max) {
+			max *= 2;
+			next = realloc(ext, (size_t) (max + 1) *
+			    sizeof(struct img_extent));
+			if (next == NULL) {
+				free(ext);
+				return (NULL);
+			}
+			ext = next;
+		}
+		ext[n].ie_off = data;
+		ext[n].ie_len = hole - data;
+		*total += hole - data;
+		n++;
+	}
+	ext[n].ie_len = 0;
+	return (ext);
+}
+#endif
+
+/*
+ * The runs of blocks set in a dirty bitmap, terminated by an empty one.
+ */
+static struct img_extent *
+img_dirty_extents(struct blockif_dirty *dt, off_t *total)
+{
+	struct img_extent *ext, *next;
+	off_t off, len;
+	int n, max;
+
+	max = 64;
+	ext = malloc((size_t) (max + 1) * sizeof(struct img_extent));
+	if (ext == NULL)
+		return (NULL);
+	n = 0;
+	*total = 0;
+	for (off = 0; (off = blockif_dirty_next(dt, off, &len)) >= 0;
+	    off += len) {
+		if (n == max) {
+			max *= 2;
+			next = realloc(ext, (size_t) (max + 1) *
+			    sizeof(struct img_extent));
+			if (next == NULL) {
+				free(ext);
+				return (NULL);
+			}
+			ext = next;
+		}
+		ext[n].ie_off = off;
+		ext[n].ie_len = len;
+		*total += len;
+		n++;
+	}
+	ext[n].ie_len = 0;
+	return (ext);
+}
+
+/*
+ * Data extents found with seek, terminated by an empty one. Without
+ * seek, or if the file system cannot tell, a single extent covers
+ * everything.
+ */
+static struct img_extent *
+img_extents(img_seek_t *seek, void *arg, off_t size, off_t *total)
+{
+	struct img_extent *ext;
+
+#ifdef SEEK_DATA
+	if (seek != NULL &&
+	    (ext = img_seek_extents(seek, arg, size, total)) != NULL)
+		return (ext);
+#else
+	(void) seek;
+	(void) arg;
+#endif
+	ext = calloc(2, sizeof(struct img_extent));
+	if (ext == NULL)
+		return (NULL);
+	if (size > 0) {
+		ext[0].ie_off = 0;
+		ext[0].ie_len = size;
+	}
+	*total = size;
+	return (ext);
+}
+
+/*
+ * Hand out the next piece of work, and account for the previous one.
+ */
+static int
+img_next(struct img_job *ij, off_t donelen, off_t *off, size_t *len)
+{
+	struct img_extent *ie;
+	int pct, ret;
+
+	pthread_mutex_lock(&ij->ij_mtx);
+	ij->ij_done += donelen;
+	pct = ij->ij_total ? (int) ((ij->ij_done * 100) / ij->ij_total) : 100;
+	if (pct != ij->ij_pct) {
+		ij->ij_pct = pct;
+		fprintf(stderr, "\r%s: %3d%% (%lld/%lld MB)", ij->ij_name, pct,
+		    (long long) (ij->ij_done >> 20),
+		    (long long) (ij->ij_total >> 20));
+	}
+
+	ret = 0;
+	ie = &ij->ij_ext[ij->ij_next_ext];
+	if (ij->ij_error == 0 && ie->ie_len != 0) {
+		*off = ie->ie_off + ij->ij_next_off;
+		*len = (size_t) MIN(IMG_CHUNK, ie->ie_len - ij->ij_next_off);
+		ij->ij_next_off += (off_t) *len;
+		if (ij->ij_next_off == ie->ie_len) {
+			ij->ij_next_ext++;
+			ij->ij_next_off = 0;
+		}
+		ret = 1;
+	}
+	pthread_mutex_unlock(&ij->ij_mtx);
+	return (ret);
+}
+
+static int
+img_read(struct img_job *ij, uint8_t *buf, size_t len, off_t off)
+{
+	struct iovec iov;
+	ssize_t n;
+
+	if (ij->ij_be == NULL)
+		return (img_pread_full(ij->ij_sfd, buf, len, off));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	n = ij->ij_be->bb_preadv(ij->ij_bearg, &iov, 1, off);
+	if (n < 0)
+		return (-1);
+	if ((size_t) n < len)
+		memset(buf + n, 0, len - (size_t) n);
+	return (0);
+}
+
+static int
+img_write(struct img_job *ij, const uint8_t *buf, size_t len, off_t off)
+{
+	struct iovec iov;
+	ssize_t n;
+
+	if (ij->ij_dbe == NULL)
+		return (img_pwrite_full(ij->ij_dfd, buf, len, off));
+	iov.iov_base = (void *) (uintptr_t) buf;
+	iov.iov_len = len;
+	n = ij->ij_dbe->bb_pwritev(ij->ij_dbearg, &iov, 1, off);
+	if (n >= 0 && (size_t) n < len) {
+		errno = EIO;
+		return (-1);
+	}
+	return (n < 0 ? -1 : 0);
+}
+
+/*
+ * Punch out the zero blocks of a piece, merging adjacent ones.
+ */
+static int
+img_compact(struct img_job *ij, uint8_t *buf, size_t len, off_t off)
+{
+	size_t i, blen, start;
+	off_t zero;
+	int run;
+
+	zero = 0;
+	run = 0;
+	start = 0;
+	for (i = 0; i <= len; i += IMG_BLOCK) {
+		blen = MIN(IMG_BLOCK, len - MIN(i, len));
+		/* only whole blocks, the tail of the file is left alone */
+		if (i < len && blen == IMG_BLOCK && img_iszero(buf + i, blen)) {
+			if (!run)
+				start = i;
+			run = 1;
+			continue;
+		}
+		if (run) {
+			if (img_punch(ij->ij_dfd, off + (off_t) start,
+			    (off_t) (i - start)) < 0)
+				return (-1);
+			zero += (off_t) (i - start);
+			run = 0;
+		}
+	}
+
+	pthread_mutex_lock(&ij->ij_mtx);
+	ij->ij_zero += zero;
+	pthread_mutex_unlock(&ij->ij_mtx);
+	return (0);
+}
+
+static void *
+img_thread(void *arg)
+{
+	struct img_job *ij;
+	uint8_t *buf;
+	size_t len;
+	off_t off, donelen;
+	int err;
+
+	ij = arg;
+	buf = malloc(IMG_CHUNK);
+	if (buf == NULL) {
+		pthread_mutex_lock(&ij->ij_mtx);
+		ij->ij_error = ENOMEM;
+		pthread_mutex_unlock(&ij->ij_mtx);
+		return (NULL);
+	}
+
+	donelen = 0;
+	while (img_next(ij, donelen, &off, &len)) {
+		err = img_read(ij, buf, len, off);
+		if (err == 0 && ij->ij_op == IMG_COMPACT)
+			err = img_compact(ij, buf, len, off);
+		else if (err == 0 && !img_iszero(buf, len))
+			err = img_write(ij, buf, len, off);
+		else if (err == 0 && ij->ij_op == IMG_UPDATE &&
+		    img_punch(ij->ij_dfd, off, (off_t) len) < 0)
+			/* zeroes replacing old data have to be written */
+			err = img_pwrite_full(ij->ij_dfd, buf, len, off);
+		if (err < 0) {
+			pthread_mutex_lock(&ij->ij_mtx);
+			ij->ij_error = errno;
+			pthread_mutex_unlock(&ij->ij_mtx);
+			break;
+		}
+		donelen = (off_t) len;
+	}
+	free(buf);
+	return (NULL);
+}
+
+static int
+img_run(struct img_job *ij)
+{
+	pthread_t tid[IMG_MAXTHREADS];
+	long ncpu;
+	int i, n;
+
+	ij->ij_pct = -1;
+	pthread_mutex_init(&ij->ij_mtx, NULL);
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	n = (int) MAX(1, MIN(ncpu, IMG_MAXTHREADS));
+	for (i = 0; i < n; i++)
+		if (pthread_create(&tid[i], NULL, img_thread, ij) != 0)
+			break;
+	if (i == 0)
+		img_thread(ij);
+	while (i-- > 0)
+		pthread_join(tid[i], NULL);
+	fprintf(stderr, "\n");
+
+	pthread_mutex_destroy(&ij->ij_mtx);
+	if (ij->ij_error) {
+		fprintf(stderr, "%s: %s\n", ij->ij_name, strerror(ij->ij_error));
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Open src, an image in format fmt, for reading its guest-visible
+ * contents. Plain files are read directly, keeping their holes visible.
+ */
+static int
+img_open_src(struct img_job *ij, const char *src, int fmt)
+{
+	struct stat sbuf;
+	int ro;
+
+	ij->ij_sfd = -1;
+	ij->ij_be = NULL;
+	if (blockif_nbd_probe(src)) {
+		ij->ij_be = &blockif_nbd_backend;
+		ij->ij_bearg = blockif_nbd_open(src, &ro, &ij->ij_size);
+	} else if (fmt == BLOCKIF_FMT_OV) {
+		ij->ij_be = &blockif_ov_backend;
+		ij->ij_bearg = blockif_ov_open(src, 1, &ij->ij_size);
+	} else if (fmt == BLOCKIF_FMT_CZ) {
+		ij->ij_be = &blockif_cz_backend;
+		ij->ij_bearg = blockif_cz_open(src, &ij->ij_size);
+	} else if (fmt == BLOCKIF_FMT_DD) {
+		ij->ij_be = &blockif_dd_backend;
+		ij->ij_bearg = blockif_dd_open(src, NULL, 1, &ij->ij_size);
+	} else {
+		ij->ij_sfd = open(src, O_RDONLY);
+		if (ij->ij_sfd < 0 || fstat(ij->ij_sfd, &sbuf) < 0) {
+			perror(src);
+			return (-1);
+		}
+		ij->ij_size = sbuf.st_size;
+		ij->ij_ext = img_extents(img_lseek, &ij->ij_sfd, ij->ij_size,
+		    &ij->ij_total);
+		return (ij->ij_ext == NULL ? -1 : 0);
+	}
+	if (ij->ij_bearg == NULL)
+		return (-1);
+	ij->ij_ext = img_extents((ij->ij_be == &blockif_ov_backend) ?
+	    blockif_ov_seek : NULL, ij->ij_bearg, ij->ij_size, &ij->ij_total);
+	return (ij->ij_ext == NULL ? -1 : 0);
+}
+
+static void
+img_close_src(struct img_job *ij)
+{
+	if (ij->ij_be != NULL && ij->ij_bearg != NULL)
+		ij->ij_be->bb_close(ij->ij_bearg);
+	if (ij->ij_sfd >= 0)
+		close(ij->ij_sfd);
+	free(ij->ij_ext);
+}
+
+/*
+ * Write the contents of the image src, in format srcfmt, to a new
+ * sparse raw image dst. With raw set the file itself is copied instead,
+ * so an overlay or a compressed image stays one.
+ */
+static int
+img_copy(const char *src, int srcfmt, const char *dst, int raw)
+{
+	struct img_job ij;
+	struct stat sbuf;
+	int ret;
+
+	memset(&ij, 0, sizeof(ij));
+	ij.ij_op = IMG_COPY;
+	ij.ij_name = dst;
+	ij.ij_dfd = -1;
+	ret = -1;
+	if (raw) {
+		ij.ij_sfd = open(src, O_RDONLY);
+		if (ij.ij_sfd < 0 || fstat(ij.ij_sfd, &sbuf) < 0) {
+			perror(src);
+			goto out;
+		}
+		ij.ij_size = sbuf.st_size;
+		ij.ij_ext = img_extents(img_lseek, &ij.ij_sfd, ij.ij_size,
+		    &ij.ij_total);
+		if (ij.ij_ext == NULL)
+			goto out;
+	} else if (img_open_src(&ij, src, srcfmt) < 0)
+		goto out;
+
+	ij.ij_dfd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (ij.ij_dfd < 0 || ftruncate(ij.ij_dfd, ij.ij_size) < 0) {
+		perror(dst);
+		goto out;
+	}
+	if (img_run(&ij) < 0)
+		goto out;
+	if (fsync(ij.ij_dfd) < 0) {
+		perror(dst);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (ij.ij_dfd >= 0)
+		close(ij.ij_dfd);
+	if (ret < 0 && ij.ij_dfd >= 0)
+		unlink(dst);
+	img_close_src(&ij);
+	return (ret);
+}
+
+int
+blockif_img_copy(const char *src, int srcfmt, const char *dst)
+{
+	if (img_copy(src, srcfmt, dst, 1) < 0)
+		return (-1);
+	/* The chunks of the copy must survive the original */
+	if (srcfmt == BLOCKIF_FMT_DD && blockif_dd_register(dst) < 0)
+		return (-1);
+	return (0);
+}
+
+/*
+ * Write the contents of the image src into a new deduplicated image
+ * dst with its chunks in store.
+ */
+static int
+img_dedup(const char *src, int srcfmt, const char *dst, const char *store)
+{
+	struct img_job ij;
+	off_t size;
+	int err, ret;
+
+	memset(&ij, 0, sizeof(ij));
+	ij.ij_op = IMG_COPY;
+	ij.ij_name = dst;
+	ij.ij_dfd = -1;
+	ret = -1;
+	if (img_open_src(&ij, src, srcfmt) < 0)
+		goto out;
+	if (blockif_dd_create(dst, store, ij.ij_size) < 0)
+		goto out;
+	ij.ij_dbe = &blockif_dd_backend;
+	ij.ij_dbearg = blockif_dd_open(dst, store, 0, &size);
+	if (ij.ij_dbearg == NULL || img_run(&ij) < 0)
+		goto out;
+	if ((err = ij.ij_dbe->bb_flush(ij.ij_dbearg)) != 0) {
+		fprintf(stderr, "%s: %s\n", dst, strerror(err));
+		goto out;
+	}
+	ret = 0;
+out:
+	if (ij.ij_dbearg != NULL)
+		ij.ij_dbe->bb_close(ij.ij_dbearg);
+	if (ret < 0 && ij.ij_dbe != NULL) {
+		(void) blockif_dd_unregister(store, dst);
+		unlink(dst);
+	}
+	img_close_src(&ij);
+	return (ret);
+}
+
+int
+blockif_img_convert(const char *src, int srcfmt, const char *dst,
+	const char *fmt)
+{
+	char *tmp;
+	int ret;
+
+	if (strcmp(fmt, "raw") == 0)
+		return (img_copy(src, srcfmt, dst, 0));
+	if (strncmp(fmt, "dedup:", 6) == 0 && fmt[6] != '\0')
+		return (img_dedup(src, srcfmt, dst, fmt + 6));
+	if (strcmp(fmt, "cz") != 0) {
+		fprintf(stderr, "Unknown image format %s\n", fmt);
+		return (-1);
+	}
+	if (srcfmt == BLOCKIF_FMT_RAW && !blockif_nbd_probe(src))
+		return (blockif_cz_create(src, dst, 0));
+
+	/* Flatten through a sparse raw image first */
+	if (asprintf(&tmp, "%s.raw", dst) < 0)
+		return (-1);
+	ret = img_copy(src, srcfmt, tmp, 0);
+	if (ret == 0)
+		ret = blockif_cz_create(tmp, dst, 0);
+	unlink(tmp);
+	free(tmp);
+	return (ret);
+}
+
+int
+blockif_img_compact(const char *path, int fmt)
+{
+	struct img_job ij;
+	struct stat sbuf;
+	int ret;
+
+	if (fmt == BLOCKIF_FMT_CZ) {
+		fprintf(stderr, "%s: compressed images cannot be compacted\n",
+		    path);
+		return (-1);
+	}
+	if (fmt == BLOCKIF_FMT_DD) {
+		fprintf(stderr, "%s: deduplicated images cannot be compacted, "
+		    "collect the garbage of their store instead\n", path);
+		return (-1);
+	}
+
+	memset(&ij, 0, sizeof(ij));
+	ij.ij_op = IMG_COMPACT;
+	ij.ij_name = path;
+	ret = -1;
+	ij.ij_dfd = open(path, O_RDWR);
+	if (ij.ij_dfd < 0 || fstat(ij.ij_dfd, &sbuf) < 0) {
+		perror(path);
+		goto out;
+	}
+	/* Overlays are compacted as files, their holes read as zeroes */
+	ij.ij_sfd = ij.ij_dfd;
+	ij.ij_size = sbuf.st_size;
+	ij.ij_ext = img_extents(img_lseek, &ij.ij_dfd, ij.ij_size,
+	    &ij.ij_total);
+	if (ij.ij_ext == NULL || img_run(&ij) < 0)
+		goto out;
+	if (fsync(ij.ij_dfd) < 0) {
+		perror(path);
+		goto out;
+	}
+	fprintf(stderr, "%s: released %lld MB\n", path,
+	    (long long) (ij.ij_zero >> 20));
+	ret = 0;
+out:
+	if (ij.ij_dfd >= 0)
+		close(ij.ij_dfd);
+	free(ij.ij_ext);
+	return (ret);
+}
+
+/*
+ * Bring target, a copy of image as of the previous backup, up to date
+ * by copying only the blocks written since then. Without a valid
+ * dirty bitmap, or a target of the right size, all of image is copied.
+ * Either way the bitmap is cleared once the target is stable.
+ */
+int
+blockif_img_backup(const char *image, int fmt, const char *target)
+{
+	struct blockif_dirty *dt;
+	struct img_job ij;
+	struct stat sbuf;
+	int ret, valid;
+
+	memset(&ij, 0, sizeof(ij));
+	ij.ij_op = IMG_UPDATE;
+	ij.ij_name = target;
+	ij.ij_dfd = -1;
+	ret = -1;
+	dt = NULL;
+	if (img_open_src(&ij, image, fmt) < 0)
+		goto out;
+	/* Held until done, so no VM can start writing to image meanwhile */
+	dt = blockif_dirty_load(image, ij.ij_size, &valid);
+	if (dt == NULL)
+		goto out;
+
+	if (!valid || stat(target, &sbuf) < 0 || sbuf.st_size != ij.ij_size) {
+		fprintf(stderr, "%s: full backup\n", target);
+		if (img_copy(image, fmt, target, 0) < 0)
+			goto out;
+	} else {
+		free(ij.ij_ext);
+		ij.ij_ext = img_dirty_extents(dt, &ij.ij_total);
+		if (ij.ij_ext == NULL)
+			goto out;
+		ij.ij_dfd = open(target, O_WRONLY);
+		if (ij.ij_dfd < 0) {
+			perror(target);
+			goto out;
+		}
+		if (img_run(&ij) < 0)
+			goto out;
+		if (fsync(ij.ij_dfd) < 0) {
+			perror(target);
+			goto out;
+		}
+		fprintf(stderr, "%s: %lld of %lld MB changed\n", target,
+		    (long long) (ij.ij_total >> 20),
+		    (long long) (ij.ij_size >> 20));
+	}
+	ret = blockif_dirty_checkpoint(dt);
+out:
+	if (dt != NULL)
+		blockif_dirty_unload(dt);
+	if (ij.ij_dfd >= 0)
+		close(ij.ij_dfd);
+	img_close_src(&ij);
+	return (ret);
+}
@@ -0,0 +1,117 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Scatter/gather helpers for the layers that split a request at their
+ * own line or cluster boundaries.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if_be.h>
+
+int
+blockif_iov_slice(const struct iovec *iov, int iovcnt, size_t skip,
+	size_t len, struct iovec *out)
+{
+	size_t n;
+	int i, cnt;
+
+	for (i = 0; i < iovcnt && skip >= iov[i].iov_len; i++)
+		skip -= iov[i].iov_len;
+	for (cnt = 0; i < iovcnt && len > 0 && cnt < BLOCKIF_IOV_SLICE; i++) {
+		n = MIN(len, iov[i].iov_len - skip);
+		out[cnt].iov_base = ((uint8_t *) iov[i].iov_base) + skip;
+		out[cnt].iov_len = n;
+		cnt++;
+		len -= n;
+		skip = 0;
+	}
+	return (cnt);
+}
+
+void
+blockif_iov_copy(const struct iovec *iov, int iovcnt, size_t skip,
+	uint8_t *buf, size_t len, int toiov)
+{
+	struct iovec v[BLOCKIF_IOV_SLICE];
+	int i, cnt;
+
+	while (len > 0) {
+		cnt = blockif_iov_slice(iov, iovcnt, skip, len, v);
+		for (i = 0; i < cnt; i++) {
+			if (buf == NULL)
+				memset(v[i].iov_base, 0, v[i].iov_len);
+			else if (toiov)
+				memcpy(v[i].iov_base, buf, v[i].iov_len);
+			else
+				memcpy(buf, v[i].iov_base, v[i].iov_len);
+			if (buf != NULL)
+				buf += v[i].iov_len;
+			skip += v[i].iov_len;
+			len -= v[i].iov_len;
+		}
+	}
+}
+
+int
+blockif_iov_xfer(int fd, const struct blockif_backend *be, void *bearg,
+	const struct iovec *iov, int iovcnt, size_t skip, size_t len, off_t off,
+	int write)
+{
+	struct iovec v[BLOCKIF_IOV_SLICE];
+	ssize_t n;
+	int cnt;
+
+	while (len > 0) {
+		cnt = blockif_iov_slice(iov, iovcnt, skip, len, v);
+		if (be != NULL && write)
+			n = be->bb_pwritev(bearg, v, cnt, off);
+		else if (be != NULL)
+			n = be->bb_preadv(bearg, v, cnt, off);
+		else if (write)
+			n = pwritev(fd, v, cnt, off);
+		else
+			n = preadv(fd, v, cnt, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (errno);
+		if (n == 0)
+			return (EIO);
+		skip += (size_t) n;
+		len -= (size_t) n;
+		off += n;
+	}
+	return (0);
+}
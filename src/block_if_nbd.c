@@ -0,0 +1,885 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Disks served by an NBD server.
+ *
+ *   nbd:unix:<socket>[:exportname=<name>][:conns=<n>]
+ *   nbd:<host>:<port>[:exportname=<name>][:conns=<n>]
+ *
+ * Requests are cut into NBD_PIECE sized commands which are all sent
+ * before any reply is awaited, spread round robin over several
+ * connections when the server allows it (NBD_FLAG_CAN_MULTI_CONN).
+ * Every connection has a thread that receives the replies, simple or
+ * structured, straight into the guest buffers.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if_be.h>
+#include <xhyve/nbd.h>
+
+#define NBD_CONNS_DEF 4
+#define NBD_CONNS_MAX 16
+#define NBD_SLOTS 64 /* commands in flight */
+#define NBD_PIECE (256 * 1024)
+
+#ifdef MSG_NOSIGNAL
+#define NBD_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define NBD_SEND_FLAGS 0
+#endif
+
+enum nbd_io {
+	NBD_IO_SEND,
+	NBD_IO_RECV,
+	NBD_IO_ZERO
+};
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct nbd_slot {
+	int ns_busy;
+	int ns_conn;
+	uint16_t ns_cmd;
+	int ns_error; /* errno value */
+	/* part of the caller's buffers the command transfers */
+	const struct iovec *ns_iov;
+	int ns_iovcnt;
+	size_t ns_skip;
+	uint64_t ns_off;
+	uint32_t ns_len;
+};
+
+struct nbd_conn {
+	struct blockif_nbd *nc_nb;
+	int nc_fd;
+	pthread_t nc_tid;
+	int nc_dead;
+};
+
+struct blockif_nbd {
+	uint16_t nb_flags; /* transmission flags */
+	uint64_t nb_size;
+	int nb_nconns;
+	int nb_nthreads;
+	struct nbd_conn nb_conn[NBD_CONNS_MAX];
+	pthread_mutex_t nb_mtx; /* one caller at a time */
+	pthread_mutex_t nb_smtx; /* slots */
+	pthread_cond_t nb_cond;
+	int nb_pending;
+	struct nbd_slot nb_slot[NBD_SLOTS];
+};
+
+struct nbd_spec {
+	char *unix_path;
+	char *host;
+	char *port;
+	const char *export;
+	int conns;
+};
+#pragma clang diagnostic pop
+
+static int
+nbd_errno(uint32_t err)
+{
+	switch (err) {
+	case 0:
+		return (0);
+	case NBD_EPERM:
+		return (EPERM);
+	case NBD_ENOMEM:
+		return (ENOMEM);
+	case NBD_EINVAL:
+		return (EINVAL);
+	case NBD_ENOSPC:
+		return (ENOSPC);
+	case NBD_EOVERFLOW:
+		return (EOVERFLOW);
+	case NBD_ENOTSUP:
+		return (EOPNOTSUPP);
+	default:
+		return (EIO);
+	}
+}
+
+static int
+nbd_send(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, NBD_SEND_FLAGS);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (-1);
+		buf = ((const uint8_t *) buf) + n;
+		len -= (size_t) n;
+	}
+	return (0);
+}
+
+static int
+nbd_recv(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(fd, buf, len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = ECONNRESET;
+			return (-1);
+		}
+		buf = ((uint8_t *) buf) + n;
+		len -= (size_t) n;
+	}
+	return (0);
+}
+
+static int
+nbd_discard(int fd, size_t len)
+{
+	uint8_t buf[512];
+	size_t n;
+
+	while (len > 0) {
+		n = MIN(len, sizeof(buf));
+		if (nbd_recv(fd, buf, n) < 0)
+			return (-1);
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * Send, receive or clear len bytes at skip in an iovec array.
+ */
+static int
+nbd_iov_io(int fd, const struct iovec *iov, int iovcnt, size_t skip,
+	size_t len, enum nbd_io io)
+{
+	size_t n;
+	uint8_t *p;
+	int i;
+
+	for (i = 0; i < iovcnt && skip >= iov[i].iov_len; i++)
+		skip -= iov[i].iov_len;
+	for (; i < iovcnt && len > 0; i++) {
+		p = ((uint8_t *) iov[i].iov_base) + skip;
+		n = MIN(len, iov[i].iov_len - skip);
+		if (io == NBD_IO_SEND && nbd_send(fd, p, n) < 0)
+			return (-1);
+		if (io == NBD_IO_RECV && nbd_recv(fd, p, n) < 0)
+			return (-1);
+		if (io == NBD_IO_ZERO)
+			memset(p, 0, n);
+		len -= n;
+		skip = 0;
+	}
+	if (len > 0) {
+		errno = EINVAL;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Slots are shared with the caller waiting in nbd_wait(), so their
+ * state only changes under nb_smtx. The first error sticks.
+ */
+static void
+nbd_slot_error(struct blockif_nbd *nb, struct nbd_slot *ns, int error)
+{
+	pthread_mutex_lock(&nb->nb_smtx);
+	if (ns->ns_error == 0)
+		ns->ns_error = error;
+	pthread_mutex_unlock(&nb->nb_smtx);
+}
+
+static void
+nbd_slot_done(struct blockif_nbd *nb, struct nbd_slot *ns, int error)
+{
+	pthread_mutex_lock(&nb->nb_smtx);
+	if (ns->ns_error == 0)
+		ns->ns_error = error;
+	ns->ns_busy = 0;
+	if (--nb->nb_pending == 0)
+		pthread_cond_signal(&nb->nb_cond);
+	pthread_mutex_unlock(&nb->nb_smtx);
+}
+
+static struct nbd_slot *
+nbd_slot_lookup(struct blockif_nbd *nb, struct nbd_conn *nc, uint64_t handle)
+{
+	struct nbd_slot *ns;
+
+	if (handle >= NBD_SLOTS)
+		return (NULL);
+	ns = &nb->nb_slot[handle];
+	pthread_mutex_lock(&nb->nb_smtx);
+	if (!ns->ns_busy || ns->ns_conn != (nc - nb->nb_conn))
+		ns = NULL;
+	pthread_mutex_unlock(&nb->nb_smtx);
+	return (ns);
+}
+
+/*
+ * Receive one structured reply chunk. Returns 1 when it was the last
+ * one for its command.
+ */
+static int
+nbd_recv_chunk(struct blockif_nbd *nb, struct nbd_conn *nc, uint8_t *hdr)
+{
+	struct nbd_slot *ns;
+	uint8_t buf[12];
+	uint64_t off;
+	uint32_t len, hlen;
+	uint16_t flags, type;
+
+	flags = nbd_dec16(hdr + 4);
+	type = nbd_dec16(hdr + 6);
+	len = nbd_dec32(hdr + 16);
+	ns = nbd_slot_lookup(nb, nc, nbd_dec64(hdr + 8));
+	if (ns == NULL) {
+		errno = EPROTO;
+		return (-1);
+	}
+
+	switch (type) {
+	case NBD_REPLY_TYPE_OFFSET_DATA:
+	case NBD_REPLY_TYPE_OFFSET_HOLE:
+		hlen = (type == NBD_REPLY_TYPE_OFFSET_DATA) ? 8 : 12;
+		if (len < hlen || nbd_recv(nc->nc_fd, buf, hlen) < 0)
+			goto proto;
+		off = nbd_dec64(buf);
+		if (type == NBD_REPLY_TYPE_OFFSET_DATA)
+			len -= 8;
+		else
+			len = nbd_dec32(buf + 8);
+		if (ns->ns_cmd != NBD_CMD_READ || off < ns->ns_off ||
+		    off + len > ns->ns_off + ns->ns_len)
+			goto proto;
+		if (nbd_iov_io(nc->nc_fd, ns->ns_iov, ns->ns_iovcnt,
+		    ns->ns_skip + (off - ns->ns_off), len,
+		    (type == NBD_REPLY_TYPE_OFFSET_DATA) ? NBD_IO_RECV :
+		    NBD_IO_ZERO) < 0)
+			return (-1);
+		break;
+	default:
+		if (NBD_REPLY_TYPE_IS_ERR(type)) {
+			if (len < 4 || nbd_recv(nc->nc_fd, buf, 4) < 0)
+				goto proto;
+			nbd_slot_error(nb, ns, nbd_errno(nbd_dec32(buf)));
+			len -= 4;
+		}
+		/* Error messages and unknown chunks are skipped */
+		if (nbd_discard(nc->nc_fd, len) < 0)
+			return (-1);
+		break;
+	}
+
+	if ((flags & NBD_REPLY_FLAG_DONE) == 0)
+		return (0);
+	nbd_slot_done(nb, ns, 0);
+	return (1);
+proto:
+	errno = EPROTO;
+	return (-1);
+}
+
+static void *
+nbd_thread(void *arg)
+{
+	struct nbd_conn *nc;
+	struct blockif_nbd *nb;
+	struct nbd_slot *ns;
+	uint8_t hdr[NBD_STRUCTURED_REPLY_SIZE];
+	uint32_t magic, err;
+	int i;
+
+	nc = arg;
+	nb = nc->nc_nb;
+	for (;;) {
+		if (nbd_recv(nc->nc_fd, hdr, 4) < 0)
+			break;
+		magic = nbd_dec32(hdr);
+		if (magic == NBD_STRUCTURED_REPLY_MAGIC) {
+			if (nbd_recv(nc->nc_fd, hdr + 4,
+			    NBD_STRUCTURED_REPLY_SIZE - 4) < 0 ||
+			    nbd_recv_chunk(nb, nc, hdr) < 0)
+				break;
+			continue;
+		}
+		if (magic != NBD_SIMPLE_REPLY_MAGIC ||
+		    nbd_recv(nc->nc_fd, hdr + 4, NBD_SIMPLE_REPLY_SIZE - 4) < 0)
+			break;
+		ns = nbd_slot_lookup(nb, nc, nbd_dec64(hdr + 8));
+		if (ns == NULL)
+			break;
+		err = nbd_dec32(hdr + 4);
+		if (err == 0 && ns->ns_cmd == NBD_CMD_READ &&
+		    nbd_iov_io(nc->nc_fd, ns->ns_iov, ns->ns_iovcnt, ns->ns_skip,
+		    ns->ns_len, NBD_IO_RECV) < 0)
+			break;
+		nbd_slot_done(nb, ns, nbd_errno(err));
+	}
+
+	/* Fail whatever is still waiting for this connection */
+	pthread_mutex_lock(&nb->nb_smtx);
+	if (!nc->nc_dead)
+		fprintf(stderr, "nbd: connection lost\n");
+	nc->nc_dead = 1;
+	for (i = 0; i < NBD_SLOTS; i++) {
+		ns = &nb->nb_slot[i];
+		if (ns->ns_busy && ns->ns_conn == (nc - nb->nb_conn)) {
+			ns->ns_error = EIO;
+			ns->ns_busy = 0;
+			nb->nb_pending--;
+		}
+	}
+	pthread_cond_signal(&nb->nb_cond);
+	pthread_mutex_unlock(&nb->nb_smtx);
+	return (NULL);
+}
+
+/*
+ * Send a command; the slot must be set up and accounted as pending.
+ */
+static int
+nbd_send_cmd(struct blockif_nbd *nb, struct nbd_slot *ns)
+{
+	struct nbd_conn *nc;
+	uint8_t req[NBD_REQUEST_SIZE];
+
+	nc = &nb->nb_conn[ns->ns_conn];
+	nbd_enc32(req, NBD_REQUEST_MAGIC);
+	nbd_enc16(req + 4, 0);
+	nbd_enc16(req + 6, ns->ns_cmd);
+	nbd_enc64(req + 8, (uint64_t) (ns - nb->nb_slot));
+	nbd_enc64(req + 16, ns->ns_off);
+	nbd_enc32(req + 24, ns->ns_len);
+	if (nbd_send(nc->nc_fd, req, sizeof(req)) < 0)
+		return (-1);
+	if (ns->ns_cmd == NBD_CMD_WRITE &&
+	    nbd_iov_io(nc->nc_fd, ns->ns_iov, ns->ns_iovcnt, ns->ns_skip,
+	    ns->ns_len, NBD_IO_SEND) < 0)
+		return (-1);
+	return (0);
+}
+
+static int
+nbd_wait(struct blockif_nbd *nb, int nslots)
+{
+	int i, err;
+
+	pthread_mutex_lock(&nb->nb_smtx);
+	while (nb->nb_pending > 0)
+		pthread_cond_wait(&nb->nb_cond, &nb->nb_smtx);
+	err = 0;
+	for (i = 0; i < nslots && err == 0; i++)
+		err = nb->nb_slot[i].ns_error;
+	pthread_mutex_unlock(&nb->nb_smtx);
+	return (err);
+}
+
+/*
+ * Run cmd over [off, off + len), in pieces spread over the connections.
+ */
+static int
+nbd_cmd(struct blockif_nbd *nb, uint16_t cmd, const struct iovec *iov,
+	int iovcnt, uint64_t off, uint64_t len)
+{
+	struct nbd_slot *ns;
+	size_t skip;
+	int n, err, conn;
+
+	skip = 0;
+	err = 0;
+	conn = 0;
+	do {
+		/* Fill the slots, then wait for all of them */
+		for (n = 0; n < NBD_SLOTS && (len > 0 || n == 0); n++) {
+			ns = &nb->nb_slot[n];
+			ns->ns_cmd = cmd;
+			ns->ns_iov = iov;
+			ns->ns_iovcnt = iovcnt;
+			ns->ns_skip = skip;
+			ns->ns_off = off;
+			ns->ns_len = (uint32_t) MIN(len,
+			    (cmd == NBD_CMD_READ || cmd == NBD_CMD_WRITE) ?
+			    NBD_PIECE : (1U << 30));
+
+			pthread_mutex_lock(&nb->nb_smtx);
+			ns->ns_error = 0;
+			/* Skip connections that were lost */
+			for (; nb->nb_conn[conn].nc_dead && conn < nb->nb_nconns - 1;
+			    conn++)
+				;
+			ns->ns_conn = conn;
+			conn = (conn + 1) % nb->nb_nconns;
+			if (nb->nb_conn[ns->ns_conn].nc_dead) {
+				ns->ns_error = EIO;
+				pthread_mutex_unlock(&nb->nb_smtx);
+				n++;
+				break;
+			}
+			ns->ns_busy = 1;
+			nb->nb_pending++;
+			pthread_mutex_unlock(&nb->nb_smtx);
+			if (nbd_send_cmd(nb, ns) < 0) {
+				/* The receive thread notices and fails it */
+				shutdown(nb->nb_conn[ns->ns_conn].nc_fd, SHUT_RDWR);
+				n++;
+				break;
+			}
+			skip += ns->ns_len;
+			off += ns->ns_len;
+			len -= ns->ns_len;
+		}
+		err = nbd_wait(nb, n);
+	} while (err == 0 && len > 0);
+	return (err);
+}
+
+static ssize_t
+nbd_rw(void *arg, const struct iovec *iov, int iovcnt, off_t offset,
+	uint16_t cmd)
+{
+	struct blockif_nbd *nb;
+	uint64_t len;
+	int i, err;
+
+	nb = arg;
+	len = 0;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if ((uint64_t) offset >= nb->nb_size)
+		return (0);
+	len = MIN(len, nb->nb_size - (uint64_t) offset);
+	if (cmd == NBD_CMD_WRITE && (nb->nb_flags & NBD_FLAG_READ_ONLY)) {
+		errno = EROFS;
+		return (-1);
+	}
+
+	pthread_mutex_lock(&nb->nb_mtx);
+	err = nbd_cmd(nb, cmd, iov, iovcnt, (uint64_t) offset, len);
+	pthread_mutex_unlock(&nb->nb_mtx);
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	return ((ssize_t) len);
+}
+
+static ssize_t
+nbd_preadv(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return (nbd_rw(arg, iov, iovcnt, offset, NBD_CMD_READ));
+}
+
+static ssize_t
+nbd_pwritev(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return (nbd_rw(arg, iov, iovcnt, offset, NBD_CMD_WRITE));
+}
+
+static int
+nbd_flush(void *arg)
+{
+	struct blockif_nbd *nb;
+	int err;
+
+	nb = arg;
+	if ((nb->nb_flags & NBD_FLAG_SEND_FLUSH) == 0)
+		return (0);
+	/*
+	 * Writes have completed on all connections, which a flush on one
+	 * of them covers with NBD_FLAG_CAN_MULTI_CONN.
+	 */
+	pthread_mutex_lock(&nb->nb_mtx);
+	err = nbd_cmd(nb, NBD_CMD_FLUSH, NULL, 0, 0, 0);
+	pthread_mutex_unlock(&nb->nb_mtx);
+	return (err);
+}
+
+/*
+ * Zeroes the range with NBD_CMD_WRITE_ZEROES, which leaves the server
+ * free to deallocate it. A plain NBD_CMD_TRIM would not guarantee that
+ * the range reads back as zeroes.
+ */
+static int
+nbd_delete(void *arg, off_t offset, off_t len)
+{
+	struct blockif_nbd *nb;
+	int err;
+
+	nb = arg;
+	if ((nb->nb_flags & NBD_FLAG_SEND_WRITE_ZEROES) == 0 ||
+	    (nb->nb_flags & NBD_FLAG_READ_ONLY))
+		return (EOPNOTSUPP);
+	if (len == 0)
+		return (0);
+	pthread_mutex_lock(&nb->nb_mtx);
+	err = nbd_cmd(nb, NBD_CMD_WRITE_ZEROES, NULL, 0, (uint64_t) offset,
+	    (uint64_t) len);
+	pthread_mutex_unlock(&nb->nb_mtx);
+	return (err);
+}
+
+static void
+nbd_close(void *arg)
+{
+	struct blockif_nbd *nb;
+	struct nbd_conn *nc;
+	uint8_t req[NBD_REQUEST_SIZE];
+	int i;
+
+	nb = arg;
+	memset(req, 0, sizeof(req));
+	nbd_enc32(req, NBD_REQUEST_MAGIC);
+	nbd_enc16(req + 6, NBD_CMD_DISC);
+	for (i = 0; i < nb->nb_nconns; i++) {
+		nc = &nb->nb_conn[i];
+		pthread_mutex_lock(&nb->nb_smtx);
+		nc->nc_dead = 1;
+		pthread_mutex_unlock(&nb->nb_smtx);
+		if (nc->nc_fd < 0)
+			continue;
+		(void) nbd_send(nc->nc_fd, req, sizeof(req));
+		shutdown(nc->nc_fd, SHUT_RDWR);
+	}
+	for (i = 0; i < nb->nb_nconns; i++) {
+		nc = &nb->nb_conn[i];
+		if (i < nb->nb_nthreads)
+			pthread_join(nc->nc_tid, NULL);
+		if (nc->nc_fd >= 0)
+			close(nc->nc_fd);
+	}
+	pthread_mutex_destroy(&nb->nb_mtx);
+	pthread_mutex_destroy(&nb->nb_smtx);
+	pthread_cond_destroy(&nb->nb_cond);
+	free(nb);
+}
+
+const struct blockif_backend blockif_nbd_backend = {
+	.bb_name = "nbd",
+	.bb_preadv = nbd_preadv,
+	.bb_pwritev = nbd_pwritev,
+	.bb_flush = nbd_flush,
+	.bb_delete = nbd_delete,
+	.bb_close = nbd_close,
+};
+
+static int
+nbd_parse(char *str, struct nbd_spec *sp)
+{
+	char *tok, *addr[2];
+	int n;
+
+	memset(sp, 0, sizeof(*sp));
+	sp->export = "";
+	n = 0;
+	str += 4; /* "nbd:" */
+	while ((tok = strsep(&str, ":")) != NULL) {
+		if (strncmp(tok, "exportname=", 11) == 0) {
+			sp->export = tok + 11;
+			if (strlen(sp->export) > NBD_MAX_STRING)
+				return (-1);
+		} else if (strncmp(tok, "conns=", 6) == 0) {
+			sp->conns = atoi(tok + 6);
+			if (sp->conns < 1 || sp->conns > NBD_CONNS_MAX)
+				return (-1);
+		} else if (n < 2)
+			addr[n++] = tok;
+		else
+			return (-1);
+	}
+	if (n != 2 || addr[1][0] == '\0')
+		return (-1);
+	if (strcmp(addr[0], "unix") == 0)
+		sp->unix_path = addr[1];
+	else {
+		sp->host = addr[0];
+		sp->port = addr[1];
+	}
+	return (0);
+}
+
+static int
+nbd_dial(struct nbd_spec *sp)
+{
+	struct sockaddr_un sun;
+	struct addrinfo hints, *res, *ai;
+	int fd, on, err;
+
+	if (sp->unix_path != NULL) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(sp->unix_path) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return (-1);
+		}
+		strcpy(sun.sun_path, sp->unix_path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 &&
+		    connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	} else {
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		err = getaddrinfo(sp->host, sp->port, &hints, &res);
+		if (err != 0) {
+			fprintf(stderr, "nbd: %s: %s\n", sp->host, gai_strerror(err));
+			errno = EHOSTUNREACH;
+			return (-1);
+		}
+		fd = -1;
+		for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+			fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		freeaddrinfo(res);
+		on = 1;
+		if (fd >= 0)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+#ifdef SO_NOSIGPIPE
+	on = 1;
+	if (fd >= 0)
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+	return (fd);
+}
+
+static int
+nbd_send_opt(int fd, uint32_t opt, const void *data, uint32_t len)
+{
+	uint8_t hdr[16];
+
+	nbd_enc64(hdr, NBD_OPTS_MAGIC);
+	nbd_enc32(hdr + 8, opt);
+	nbd_enc32(hdr + 12, len);
+	if (nbd_send(fd, hdr, sizeof(hdr)) < 0 ||
+	    (len > 0 && nbd_send(fd, data, len) < 0))
+		return (-1);
+	return (0);
+}
+
+/*
+ * Receive an option reply, its data truncated to NBD_MAX_STRING.
+ */
+static int
+nbd_recv_opt(int fd, uint32_t opt, uint32_t *type, uint8_t *data,
+	uint32_t *len)
+{
+	uint8_t hdr[20];
+	uint32_t n;
+
+	if (nbd_recv(fd, hdr, sizeof(hdr)) < 0)
+		return (-1);
+	if (nbd_dec64(hdr) != NBD_REP_MAGIC || nbd_dec32(hdr + 8) != opt) {
+		errno = EPROTO;
+		return (-1);
+	}
+	*type = nbd_dec32(hdr + 12);
+	*len = nbd_dec32(hdr + 16);
+	n = MIN(*len, NBD_MAX_STRING);
+	if (nbd_recv(fd, data, n) < 0 || nbd_discard(fd, *len - n) < 0)
+		return (-1);
+	*len = n;
+	return (0);
+}
+
+/*
+ * Fixed newstyle negotiation, preferring structured replies and
+ * NBD_OPT_GO but falling back to what older servers speak.
+ */
+static int
+nbd_handshake(int fd, struct nbd_spec *sp, uint64_t *size, uint16_t *flags)
+{
+	uint8_t buf[NBD_MAX_STRING + 8];
+	uint32_t type, len, nlen;
+	uint16_t hflags;
+	int noz, go;
+
+	if (nbd_recv(fd, buf, 18) < 0)
+		return (-1);
+	if (nbd_dec64(buf) != NBD_MAGIC || nbd_dec64(buf + 8) != NBD_OPTS_MAGIC ||
+	    ((hflags = nbd_dec16(buf + 16)) & NBD_FLAG_FIXED_NEWSTYLE) == 0) {
+		fprintf(stderr, "nbd: server does not speak fixed newstyle\n");
+		errno = EPROTO;
+		return (-1);
+	}
+	noz = (hflags & NBD_FLAG_NO_ZEROES) != 0;
+	nbd_enc32(buf, NBD_FLAG_C_FIXED_NEWSTYLE |
+	    (noz ? NBD_FLAG_C_NO_ZEROES : 0));
+	if (nbd_send(fd, buf, 4) < 0)
+		return (-1);
+
+	/* Without structured replies every reply is a simple one */
+	if (nbd_send_opt(fd, NBD_OPT_STRUCTURED_REPLY, NULL, 0) < 0 ||
+	    nbd_recv_opt(fd, NBD_OPT_STRUCTURED_REPLY, &type, buf, &len) < 0)
+		return (-1);
+
+	nlen = (uint32_t) strlen(sp->export);
+	nbd_enc32(buf, nlen);
+	memcpy(buf + 4, sp->export, nlen);
+	nbd_enc16(buf + 4 + nlen, 0); /* no information requests */
+	if (nbd_send_opt(fd, NBD_OPT_GO, buf, nlen + 6) < 0)
+		return (-1);
+	go = 1;
+	*size = 0;
+	*flags = 0;
+	for (;;) {
+		if (nbd_recv_opt(fd, NBD_OPT_GO, &type, buf, &len) < 0)
+			return (-1);
+		if (type == NBD_REP_ACK)
+			break;
+		if (type == NBD_REP_INFO && len >= 12 &&
+		    nbd_dec16(buf) == NBD_INFO_EXPORT) {
+			*size = nbd_dec64(buf + 2);
+			*flags = nbd_dec16(buf + 10);
+		} else if (type == NBD_REP_ERR_UNSUP) {
+			go = 0;
+			break;
+		} else if (type & NBD_REP_FLAG_ERROR) {
+			fprintf(stderr, "nbd: export \"%s\": %.*s\n", sp->export,
+			    (int) len, buf);
+			errno = ENOENT;
+			return (-1);
+		}
+	}
+	if (go)
+		return (0);
+
+	if (nbd_send_opt(fd, NBD_OPT_EXPORT_NAME, sp->export, nlen) < 0 ||
+	    nbd_recv(fd, buf, 10) < 0 || (!noz && nbd_discard(fd, 124) < 0))
+		return (-1);
+	*size = nbd_dec64(buf);
+	*flags = nbd_dec16(buf + 8);
+	return (0);
+}
+
+int
+blockif_nbd_probe(const char *path)
+{
+	return (strncmp(path, "nbd:", 4) == 0);
+}
+
+void *
+blockif_nbd_open(const char *path, int *ro, off_t *size)
+{
+	struct blockif_nbd *nb;
+	struct nbd_conn *nc;
+	struct nbd_spec sp;
+	uint64_t csize;
+	uint16_t cflags;
+	char *str;
+	int i;
+
+	str = strdup(path);
+	nb = calloc(1, sizeof(struct blockif_nbd));
+	if (str == NULL || nb == NULL) {
+		free(str);
+		free(nb);
+		return (NULL);
+	}
+	pthread_mutex_init(&nb->nb_mtx, NULL);
+	pthread_mutex_init(&nb->nb_smtx, NULL);
+	pthread_cond_init(&nb->nb_cond, NULL);
+	for (i = 0; i < NBD_CONNS_MAX; i++) {
+		nb->nb_conn[i].nc_nb = nb;
+		nb->nb_conn[i].nc_fd = -1;
+	}
+	if (nbd_parse(str, &sp) < 0) {
+		fprintf(stderr, "Invalid NBD disk \"%s\"\n", path);
+		goto err;
+	}
+
+	/*
+	 * The first connection decides how many more the server
+	 * allows; all of them have to agree on the export.
+	 */
+	nb->nb_nconns = 1;
+	for (i = 0; i < nb->nb_nconns; i++) {
+		nc = &nb->nb_conn[i];
+		nc->nc_fd = nbd_dial(&sp);
+		if (nc->nc_fd < 0 ||
+		    nbd_handshake(nc->nc_fd, &sp, &csize, &cflags) < 0) {
+			perror(path);
+			goto err;
+		}
+		if (i == 0) {
+			nb->nb_size = csize;
+			nb->nb_flags = cflags;
+			if (cflags & NBD_FLAG_CAN_MULTI_CONN)
+				nb->nb_nconns = sp.conns ? sp.conns : NBD_CONNS_DEF;
+		} else if (csize != nb->nb_size || cflags != nb->nb_flags) {
+			fprintf(stderr, "nbd: %s changed while connecting\n", path);
+			goto err;
+		}
+		if (pthread_create(&nc->nc_tid, NULL, nbd_thread, nc) != 0) {
+			perror("pthread_create");
+			goto err;
+		}
+		nb->nb_nthreads++;
+	}
+
+	if (nb->nb_flags & NBD_FLAG_READ_ONLY)
+		*ro = 1;
+	*size = (off_t) nb->nb_size;
+	free(str);
+	return (nb);
+err:
+	free(str);
+	nbd_close(nb);
+	return (NULL);
+}
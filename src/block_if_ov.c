@@ -0,0 +1,762 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Overlay images for external snapshot chains.
+ *
+ * An overlay records the clusters written since it was created on top
+ * of a backing image, which is a raw, compressed or deduplicated base
+ * image or another overlay, whose format is recorded when the overlay
+ * is created. Layout (host byte order):
+ *
+ *   struct ov_header		padded to OV_HDR_SIZE
+ *   bitmap			one bit per cluster, set if the cluster is
+ *				stored in this overlay
+ *   data			cluster i at oh_data + i * cluster size;
+ *				unallocated clusters are holes
+ *
+ * Since clusters have fixed locations, creating an overlay only writes
+ * a header. When a chain is opened, the bitmaps are folded into a table
+ * holding the layer that owns every cluster, so a read costs one lookup
+ * no matter how deep the chain is. Only the top overlay is written to;
+ * partially written clusters are first copied up from their owner.
+ *
+ * The bitmap of the top overlay is only written at a flush, after the
+ * data it covers is synced, so a crash never leaves a bit set for a
+ * cluster whose data did not reach the disk. Copy-ups since the last
+ * flush are lost on a crash, like any unflushed write.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if_be.h>
+
+#define OV_MAGIC "XHYVEOV1"
+#define OV_VERSION 2
+#define OV_HDR_SIZE 4096
+#define OV_SHIFT 16 /* 64KB clusters */
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct ov_header {
+	char oh_magic[8];
+	uint32_t oh_version;
+	uint32_t oh_cluster_shift;
+	uint64_t oh_size; /* virtual disk size */
+	uint64_t oh_bitmap; /* file offset of the allocation bitmap */
+	uint64_t oh_data; /* file offset of cluster 0 */
+	char oh_backing[BLOCKIF_OV_PATH_MAX];
+	char oh_name[BLOCKIF_OV_NAME_MAX]; /* snapshot name of the backing */
+	uint32_t oh_backing_fmt; /* BLOCKIF_FMT_* */
+};
+
+struct ov_layer {
+	int ol_fd;
+	off_t ol_data; /* cluster 0, or 0 for a raw base */
+	const struct blockif_backend *ol_be; /* compressed or dedup base */
+	void *ol_bearg;
+};
+
+struct blockif_ov {
+	uint32_t ov_shift;
+	size_t ov_clsz;
+	uint64_t ov_size;
+	uint64_t ov_nclusters;
+	int ov_nlayers; /* layer 0 is the top, the last one the base */
+	struct ov_layer *ov_layers;
+	uint16_t *ov_owner; /* layer holding each cluster */
+	uint8_t *ov_bitmap; /* bitmap of the top overlay */
+	off_t ov_bitmap_off;
+	size_t ov_bmlo, ov_bmhi; /* bitmap bytes not yet written */
+	uint8_t *ov_cbuf; /* copy-up staging */
+	int ov_ro;
+	/* owner table, bitmap and copy-ups; data moves without it */
+	pthread_mutex_t ov_mtx;
+	pthread_mutex_t ov_syncmtx; /* one ov_sync at a time */
+	struct blockif_atexit ov_atexit;
+};
+#pragma clang diagnostic pop
+
+static int
+ov_pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pread(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (-1);
+		if (n == 0) {
+			/* short raw base or a hole at the end of an overlay */
+			memset(buf, 0, len);
+			break;
+		}
+		buf = ((uint8_t *) buf) + n;
+		len -= (size_t) n;
+		off += n;
+	}
+	return (0);
+}
+
+static int
+ov_pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = pwrite(fd, buf, len, off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (-1);
+		buf = ((const uint8_t *) buf) + n;
+		len -= (size_t) n;
+		off += n;
+	}
+	return (0);
+}
+
+static int
+ov_read_header(int fd, struct ov_header *oh)
+{
+	if (ov_pread_full(fd, oh, sizeof(*oh), 0) < 0)
+		return (-1);
+	if (memcmp(oh->oh_magic, OV_MAGIC, sizeof(oh->oh_magic)) != 0 ||
+	    oh->oh_version != OV_VERSION || oh->oh_backing_fmt > BLOCKIF_FMT_DD) {
+		errno = EINVAL;
+		return (-1);
+	}
+	oh->oh_backing[BLOCKIF_OV_PATH_MAX - 1] = '\0';
+	oh->oh_name[BLOCKIF_OV_NAME_MAX - 1] = '\0';
+	return (0);
+}
+
+/*
+ * Backing paths are stored relative to the directory of the overlay
+ * unless they are absolute.
+ */
+static void
+ov_backing_path(const char *path, const char *backing, char *buf, size_t len)
+{
+	char *dir, *tmp;
+
+	if (backing[0] == '/') {
+		snprintf(buf, len, "%s", backing);
+		return;
+	}
+	tmp = strdup(path);
+	dir = dirname(tmp);
+	snprintf(buf, len, "%s/%s", dir, backing);
+	free(tmp);
+}
+
+/*
+ * Describe the image at path, known to be in format fmt, as a layer of
+ * a snapshot chain.
+ */
+int
+blockif_ov_info(const char *path, int fmt, struct blockif_ov_info *info)
+{
+	struct ov_header oh;
+	struct stat sbuf;
+	int fd, ret;
+
+	memset(info, 0, sizeof(*info));
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return (-1);
+	ret = -1;
+	if (fstat(fd, &sbuf) < 0)
+		goto out;
+	info->oi_used = (off_t) sbuf.st_blocks * 512;
+	if (fmt != BLOCKIF_FMT_OV) {
+		/* the base of a chain */
+		info->oi_size = sbuf.st_size;
+		if (fmt == BLOCKIF_FMT_CZ) {
+			void *cz = blockif_cz_open(path, &info->oi_size);
+
+			if (cz == NULL)
+				goto out;
+			blockif_cz_backend.bb_close(cz);
+		} else if (fmt == BLOCKIF_FMT_DD) {
+			void *dd = blockif_dd_open(path, NULL, 1,
+			    &info->oi_size);
+
+			if (dd == NULL)
+				goto out;
+			blockif_dd_backend.bb_close(dd);
+		}
+		ret = 0;
+		goto out;
+	}
+	if (ov_read_header(fd, &oh) < 0)
+		goto out;
+	info->oi_overlay = 1;
+	info->oi_backing_fmt = (int) oh.oh_backing_fmt;
+	info->oi_size = (off_t) oh.oh_size;
+	ov_backing_path(path, oh.oh_backing, info->oi_backing,
+	    sizeof(info->oi_backing));
+	snprintf(info->oi_name, sizeof(info->oi_name), "%s", oh.oh_name);
+	ret = 0;
+out:
+	close(fd);
+	return (ret);
+}
+
+/*
+ * Create an empty overlay at path on top of backing, an image in format
+ * backing_fmt; name labels the state of backing at this point. Only the
+ * header is written.
+ */
+int
+blockif_ov_create(const char *path, const char *backing, int backing_fmt,
+	const char *name)
+{
+	struct blockif_ov_info info;
+	struct ov_header oh;
+	uint64_t nclusters, clsz;
+	char bpath[BLOCKIF_OV_PATH_MAX];
+	int fd;
+
+	if (strlen(backing) >= BLOCKIF_OV_PATH_MAX ||
+	    strlen(name) >= BLOCKIF_OV_NAME_MAX) {
+		fprintf(stderr, "Backing path or snapshot name too long\n");
+		return (-1);
+	}
+	ov_backing_path(path, backing, bpath, sizeof(bpath));
+	if (blockif_ov_info(bpath, backing_fmt, &info) < 0) {
+		perror(bpath);
+		return (-1);
+	}
+
+	memset(&oh, 0, sizeof(oh));
+	memcpy(oh.oh_magic, OV_MAGIC, sizeof(oh.oh_magic));
+	oh.oh_version = OV_VERSION;
+	oh.oh_cluster_shift = OV_SHIFT;
+	oh.oh_size = (uint64_t) info.oi_size;
+	clsz = 1ULL << OV_SHIFT;
+	nclusters = (oh.oh_size + clsz - 1) >> OV_SHIFT;
+	oh.oh_bitmap = OV_HDR_SIZE;
+	oh.oh_data = roundup(OV_HDR_SIZE + roundup(nclusters, 8) / 8, clsz);
+	strcpy(oh.oh_backing, backing);
+	strcpy(oh.oh_name, name);
+	oh.oh_backing_fmt = (uint32_t) backing_fmt;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		perror(path);
+		return (-1);
+	}
+	if (ov_pwrite_full(fd, &oh, sizeof(oh), 0) < 0 ||
+	    ftruncate(fd, (off_t) oh.oh_data) < 0 || fsync(fd) < 0) {
+		perror(path);
+		close(fd);
+		unlink(path);
+		return (-1);
+	}
+	close(fd);
+	return (0);
+}
+
+static int
+ov_layer_read(struct blockif_ov *ov, int layer, void *buf, size_t len,
+	uint64_t off)
+{
+	struct ov_layer *ol;
+	struct iovec iov;
+	ssize_t n;
+
+	ol = &ov->ov_layers[layer];
+	if (ol->ol_be != NULL) {
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		n = ol->ol_be->bb_preadv(ol->ol_bearg, &iov, 1, (off_t) off);
+		if (n < 0)
+			return (-1);
+		if ((size_t) n < len)
+			memset(((uint8_t *) buf) + n, 0, len - (size_t) n);
+		return (0);
+	}
+	return (ov_pread_full(ol->ol_fd, buf, len, ol->ol_data + (off_t) off));
+}
+
+static ssize_t
+ov_preadv(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct blockif_ov *ov;
+	uint64_t off, cl;
+	size_t resid, len;
+	uint8_t *p;
+	ssize_t done;
+	int i, layer;
+
+	ov = arg;
+	done = 0;
+	for (i = 0; i < iovcnt; i++) {
+		p = iov[i].iov_base;
+		resid = iov[i].iov_len;
+		while (resid > 0) {
+			off = (uint64_t) offset + (uint64_t) done;
+			if (off >= ov->ov_size)
+				return (done);
+			cl = off >> ov->ov_shift;
+			len = MIN(resid, ov->ov_clsz - (off & (ov->ov_clsz - 1)));
+			len = (size_t) MIN(len, ov->ov_size - off);
+			/*
+			 * A cluster only ever moves up to the top, after its
+			 * data is there, so the owner read is good for the
+			 * whole transfer.
+			 */
+			pthread_mutex_lock(&ov->ov_mtx);
+			layer = ov->ov_owner[cl];
+			pthread_mutex_unlock(&ov->ov_mtx);
+			if (ov_layer_read(ov, layer, p, len, off) < 0)
+				return (-1);
+			p += len;
+			resid -= len;
+			done += (ssize_t) len;
+		}
+	}
+	return (done);
+}
+
+/*
+ * Make cluster cl part of the top overlay, merging len bytes at off
+ * from buf into the data it had in the layer that owned it.  Called
+ * with ov_mtx held.
+ */
+static int
+ov_copy_up(struct blockif_ov *ov, uint64_t cl, const uint8_t *buf,
+	size_t len, uint64_t off)
+{
+	struct ov_layer *top;
+	uint64_t start;
+	size_t cllen, b;
+
+	top = &ov->ov_layers[0];
+	start = cl << ov->ov_shift;
+	cllen = (size_t) MIN(ov->ov_clsz, ov->ov_size - start);
+	if (len == cllen) {
+		if (ov_pwrite_full(top->ol_fd, buf, len, top->ol_data +
+		    (off_t) start) < 0)
+			return (-1);
+	} else {
+		if (ov_layer_read(ov, ov->ov_owner[cl], ov->ov_cbuf, cllen,
+		    start) < 0)
+			return (-1);
+		memcpy(ov->ov_cbuf + (off - start), buf, len);
+		if (ov_pwrite_full(top->ol_fd, ov->ov_cbuf, cllen, top->ol_data +
+		    (off_t) start) < 0)
+			return (-1);
+	}
+
+	/* The bit reaches the file at the next ov_sync, after the data */
+	b = (size_t) (cl / 8);
+	ov->ov_bitmap[b] |= (uint8_t) (1 << (cl % 8));
+	if (ov->ov_bmlo == ov->ov_bmhi) {
+		ov->ov_bmlo = b;
+		ov->ov_bmhi = b + 1;
+	} else {
+		ov->ov_bmlo = MIN(ov->ov_bmlo, b);
+		ov->ov_bmhi = MAX(ov->ov_bmhi, b + 1);
+	}
+	ov->ov_owner[cl] = 0;
+	return (0);
+}
+
+static ssize_t
+ov_pwritev(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	struct blockif_ov *ov;
+	struct ov_layer *top;
+	uint64_t off, cl;
+	size_t resid, len;
+	uint8_t *p;
+	ssize_t done;
+	int i, err;
+
+	ov = arg;
+	top = &ov->ov_layers[0];
+	done = 0;
+	for (i = 0; i < iovcnt; i++) {
+		p = iov[i].iov_base;
+		resid = iov[i].iov_len;
+		while (resid > 0) {
+			off = (uint64_t) offset + (uint64_t) done;
+			if (off >= ov->ov_size)
+				return (done);
+			cl = off >> ov->ov_shift;
+			len = MIN(resid, ov->ov_clsz - (off & (ov->ov_clsz - 1)));
+			len = (size_t) MIN(len, ov->ov_size - off);
+			pthread_mutex_lock(&ov->ov_mtx);
+			if (ov->ov_owner[cl] == 0) {
+				pthread_mutex_unlock(&ov->ov_mtx);
+				err = ov_pwrite_full(top->ol_fd, p, len,
+				    top->ol_data + (off_t) off);
+			} else {
+				err = ov_copy_up(ov, cl, p, len, off);
+				pthread_mutex_unlock(&ov->ov_mtx);
+			}
+			if (err < 0)
+				return (-1);
+			p += len;
+			resid -= len;
+			done += (ssize_t) len;
+		}
+	}
+	return (done);
+}
+
+/*
+ * Sync the data of the top overlay, then write and sync the bitmap
+ * bytes changed by the copy-ups before it.  0 or an errno value.
+ */
+static int
+ov_sync(struct blockif_ov *ov)
+{
+	struct ov_layer *top;
+	size_t lo, hi;
+	uint8_t *bm;
+	int err;
+
+	top = &ov->ov_layers[0];
+	bm = NULL;
+	pthread_mutex_lock(&ov->ov_syncmtx);
+	pthread_mutex_lock(&ov->ov_mtx);
+	lo = ov->ov_bmlo;
+	hi = ov->ov_bmhi;
+	if (lo < hi && (bm = malloc(hi - lo)) != NULL) {
+		memcpy(bm, ov->ov_bitmap + lo, hi - lo);
+		ov->ov_bmlo = ov->ov_bmhi = 0;
+	}
+	pthread_mutex_unlock(&ov->ov_mtx);
+
+	err = 0;
+	if (lo < hi && bm == NULL)
+		err = ENOMEM;
+	else if (blockif_fdatasync(top->ol_fd) < 0)
+		err = errno;
+	else if (bm != NULL && (ov_pwrite_full(top->ol_fd, bm, hi - lo,
+	    ov->ov_bitmap_off + (off_t) lo) < 0 ||
+	    blockif_fdatasync(top->ol_fd) < 0))
+		err = errno;
+	if (err != 0 && bm != NULL) {
+		/* Try again at the next flush */
+		pthread_mutex_lock(&ov->ov_mtx);
+		if (ov->ov_bmlo == ov->ov_bmhi) {
+			ov->ov_bmlo = lo;
+			ov->ov_bmhi = hi;
+		} else {
+			ov->ov_bmlo = MIN(ov->ov_bmlo, lo);
+			ov->ov_bmhi = MAX(ov->ov_bmhi, hi);
+		}
+		pthread_mutex_unlock(&ov->ov_mtx);
+	}
+	pthread_mutex_unlock(&ov->ov_syncmtx);
+	free(bm);
+	return (err);
+}
+
+static int
+ov_flush(void *arg)
+{
+
+	return (ov_sync(arg));
+}
+
+/*
+ * VMs exit without closing their disks, nor flushing them with
+ * cache=unsafe.
+ */
+static void
+ov_exit(void *arg)
+{
+
+	(void) ov_sync(arg);
+}
+
+static void
+ov_free(struct blockif_ov *ov)
+{
+	struct ov_layer *ol;
+	int i;
+
+	for (i = 0; i < ov->ov_nlayers; i++) {
+		ol = &ov->ov_layers[i];
+		if (ol->ol_be != NULL)
+			ol->ol_be->bb_close(ol->ol_bearg);
+		else if (ol->ol_fd >= 0)
+			close(ol->ol_fd);
+	}
+	free(ov->ov_layers);
+	free(ov->ov_owner);
+	free(ov->ov_bitmap);
+	free(ov->ov_cbuf);
+	free(ov);
+}
+
+static void
+ov_close(void *arg)
+{
+	struct blockif_ov *ov;
+
+	ov = arg;
+	if (!ov->ov_ro) {
+		blockif_atexit_remove(&ov->ov_atexit);
+		(void) ov_sync(ov);
+	}
+	pthread_mutex_destroy(&ov->ov_syncmtx);
+	pthread_mutex_destroy(&ov->ov_mtx);
+	ov_free(ov);
+}
+
+/*
+ * Offset of the first data in the base image at or after cluster cl, or
+ * the start of cl if the base cannot tell.
+ */
+static uint64_t
+ov_base_data(struct blockif_ov *ov, uint64_t cl)
+{
+	struct ov_layer *base;
+	off_t d;
+
+	base = &ov->ov_layers[ov->ov_nlayers - 1];
+	d = -1;
+#ifdef SEEK_DATA
+	if (base->ol_be == NULL) {
+		d = lseek(base->ol_fd, (off_t) (cl << ov->ov_shift), SEEK_DATA);
+		if (d < 0 && errno == ENXIO)
+			d = (off_t) ov->ov_size;
+	}
+#endif
+	return (d < 0 ? cl << ov->ov_shift : (uint64_t) d);
+}
+
+/*
+ * lseek(2) SEEK_DATA/SEEK_HOLE on the guest view of the chain, at
+ * cluster granularity, so images can be copied without reading holes.
+ */
+off_t
+blockif_ov_seek(void *arg, off_t offset, int whence)
+{
+	struct blockif_ov *ov;
+	uint64_t cl, end, d;
+	uint16_t bl;
+
+	ov = arg;
+	bl = (uint16_t) (ov->ov_nlayers - 1);
+	cl = (uint64_t) offset >> ov->ov_shift;
+	while (cl < ov->ov_nclusters) {
+		end = MIN((cl + 1) << ov->ov_shift, ov->ov_size);
+		d = (ov->ov_owner[cl] == bl) ? ov_base_data(ov, cl) : 0;
+		if ((whence == SEEK_HOLE) == (ov->ov_owner[cl] == bl && d >= end))
+			return (MAX(offset, (off_t) (cl << ov->ov_shift)));
+		cl++;
+		if (whence == SEEK_HOLE || ov->ov_owner[cl - 1] != bl)
+			continue;
+		/* Skip the hole in the base unless an overlay covers part */
+		while (cl < (d >> ov->ov_shift) && ov->ov_owner[cl] == bl)
+			cl++;
+	}
+	if (whence == SEEK_HOLE)
+		return ((off_t) ov->ov_size);
+	errno = ENXIO;
+	return (-1);
+}
+
+const struct blockif_backend blockif_ov_backend = {
+	.bb_name = "overlay",
+	.bb_preadv = ov_preadv,
+	.bb_pwritev = ov_pwritev,
+	.bb_flush = ov_flush,
+	.bb_close = ov_close,
+};
+
+/*
+ * Add the layer at path, in format fmt, below the ones opened so far.
+ * Returns 1 if it is an overlay with a backing image of its own, 0 for
+ * the base.
+ */
+static int
+ov_open_layer(struct blockif_ov *ov, const char *path, int fmt, int ro,
+	struct ov_header *oh)
+{
+	struct ov_layer *ol;
+	off_t size;
+	int fd;
+
+	if (ov->ov_nlayers == BLOCKIF_OV_MAXLAYERS) {
+		fprintf(stderr, "Snapshot chain deeper than %d\n", BLOCKIF_OV_MAXLAYERS);
+		return (-1);
+	}
+	ol = &ov->ov_layers[ov->ov_nlayers];
+	ol->ol_fd = -1;
+	ol->ol_be = NULL;
+	ol->ol_data = 0;
+
+	fd = open(path, (ro ? O_RDONLY : O_RDWR));
+	if (fd < 0) {
+		perror(path);
+		return (-1);
+	}
+	ov->ov_nlayers++;
+	ol->ol_fd = fd;
+	if (fmt == BLOCKIF_FMT_OV) {
+		if (ov_read_header(fd, oh) < 0) {
+			fprintf(stderr, "%s is not an overlay\n", path);
+			return (-1);
+		}
+		ol->ol_data = (off_t) oh->oh_data;
+		return (1);
+	}
+	if (fmt == BLOCKIF_FMT_CZ) {
+		close(fd);
+		ol->ol_fd = -1;
+		ol->ol_be = &blockif_cz_backend;
+		ol->ol_bearg = blockif_cz_open(path, &size);
+	} else if (fmt == BLOCKIF_FMT_DD) {
+		close(fd);
+		ol->ol_fd = -1;
+		ol->ol_be = &blockif_dd_backend;
+		ol->ol_bearg = blockif_dd_open(path, NULL, 1, &size);
+	}
+	if (ol->ol_be != NULL && ol->ol_bearg == NULL) {
+		ol->ol_be = NULL;
+		return (-1);
+	}
+	return (0);
+}
+
+void *
+blockif_ov_open(const char *path, int ro, off_t *size)
+{
+	char lpath[BLOCKIF_OV_PATH_MAX], bpath[BLOCKIF_OV_PATH_MAX];
+	struct blockif_ov *ov;
+	struct ov_header oh, top;
+	uint64_t cl, bmlen;
+	uint8_t *bm;
+	int i, layer, more;
+
+	ov = calloc(1, sizeof(struct blockif_ov));
+	if (ov == NULL)
+		return (NULL);
+	ov->ov_layers = calloc(BLOCKIF_OV_MAXLAYERS, sizeof(struct ov_layer));
+	if (ov->ov_layers == NULL) {
+		free(ov);
+		return (NULL);
+	}
+
+	/* Only the top of the chain is written to */
+	snprintf(lpath, sizeof(lpath), "%s", path);
+	more = ov_open_layer(ov, lpath, BLOCKIF_FMT_OV, ro, &top);
+	if (more != 1)
+		goto err;
+	oh = top;
+	while (more == 1) {
+		if (oh.oh_size != top.oh_size ||
+		    oh.oh_cluster_shift != top.oh_cluster_shift) {
+			fprintf(stderr, "Overlay %s does not match the top of "
+			    "its chain\n", lpath);
+			goto err;
+		}
+		ov_backing_path(lpath, oh.oh_backing, bpath, sizeof(bpath));
+		snprintf(lpath, sizeof(lpath), "%s", bpath);
+		more = ov_open_layer(ov, lpath, (int) oh.oh_backing_fmt, 1, &oh);
+		if (more < 0)
+			goto err;
+	}
+
+	ov->ov_shift = top.oh_cluster_shift;
+	ov->ov_clsz = ((size_t) 1) << ov->ov_shift;
+	ov->ov_size = top.oh_size;
+	ov->ov_nclusters = (ov->ov_size + ov->ov_clsz - 1) >> ov->ov_shift;
+	ov->ov_bitmap_off = (off_t) top.oh_bitmap;
+	bmlen = roundup(ov->ov_nclusters, 8) / 8;
+	ov->ov_owner = malloc((size_t) ov->ov_nclusters * sizeof(uint16_t));
+	ov->ov_bitmap = malloc((size_t) bmlen);
+	bm = malloc((size_t) bmlen);
+	ov->ov_cbuf = malloc(ov->ov_clsz);
+	if (ov->ov_owner == NULL || ov->ov_bitmap == NULL || bm == NULL ||
+	    ov->ov_cbuf == NULL) {
+		free(bm);
+		goto err;
+	}
+
+	/*
+	 * Fold the bitmaps into the owner table, from the base up so
+	 * upper layers win.
+	 */
+	for (cl = 0; cl < ov->ov_nclusters; cl++)
+		ov->ov_owner[cl] = (uint16_t) (ov->ov_nlayers - 1);
+	for (layer = ov->ov_nlayers - 2; layer >= 0; layer--) {
+		if (ov_read_header(ov->ov_layers[layer].ol_fd, &oh) < 0 ||
+		    ov_pread_full(ov->ov_layers[layer].ol_fd, bm, (size_t) bmlen,
+		    (off_t) oh.oh_bitmap) < 0) {
+			perror("Could not read overlay bitmap");
+			free(bm);
+			goto err;
+		}
+		for (i = 0; ((uint64_t) i) < bmlen; i++) {
+			if (bm[i] == 0)
+				continue;
+			for (cl = ((uint64_t) i) * 8;
+			    cl < MIN(((uint64_t) i) * 8 + 8, ov->ov_nclusters);
+			    cl++) {
+				if (bm[i] & (1 << (cl % 8)))
+					ov->ov_owner[cl] = (uint16_t) layer;
+			}
+		}
+		if (layer == 0)
+			memcpy(ov->ov_bitmap, bm, (size_t) bmlen);
+	}
+	free(bm);
+
+	pthread_mutex_init(&ov->ov_mtx, NULL);
+	pthread_mutex_init(&ov->ov_syncmtx, NULL);
+	ov->ov_ro = ro;
+	if (!ro)
+		blockif_atexit_add(&ov->ov_atexit, ov_exit, ov);
+	*size = (off_t) ov->ov_size;
+	return (ov);
+err:
+	ov_free(ov);
+	return (NULL);
+}
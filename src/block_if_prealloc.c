@@ -0,0 +1,259 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Allocation ahead of sequential writers into sparse images.
+ *
+ *   prealloc[=<window>[k|m|g]]
+ *
+ * Writes are matched against the last PA_STREAMS write streams, give
+ * or take PA_SLACK for requests completed out of order by the block
+ * i/o threads.  Once a stream has written PA_SEQ bytes in a row, the
+ * host blocks of the next <window> bytes (default PA_WINDOW) past its
+ * head are allocated ahead of the writer, again whenever it gets half
+ * way through the last window.  The file system then hands out a few
+ * large extents instead of one per guest write, so what the guest
+ * writes sequentially reads back sequentially.  Random writes never
+ * make a stream and stay as sparse as without the option, and ranges
+ * already allocated are left alone.
+ *
+ * The blocks allocated read as zeroes and the file size is unchanged.
+ * That takes fallocate(2) with FALLOC_FL_KEEP_SIZE.  F_PREALLOCATE on
+ * macOS only allocates past the end of a file, not its holes, so there
+ * the holes of the window, found with SEEK_HOLE, are written with
+ * zeroes instead.  That writes what the guest streams twice; it is
+ * done by the block i/o thread ahead of the write that triggered it,
+ * so it never overtakes a guest write into the window.  A file system
+ * without fallocate(2) turns the option off at the first attempt.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if_be.h>
+
+#define PA_WINDOW (16LL * 1024 * 1024)
+#define PA_MIN_WINDOW (1024 * 1024)
+#define PA_SEQ (1024 * 1024) /* written in a row before allocating */
+#define PA_SLACK (1024 * 1024)
+#define PA_STREAMS 4
+
+#define PA_ZERO (64 * 1024) /* zeroes written at a time */
+
+#if defined(FALLOC_FL_KEEP_SIZE) || defined(SEEK_HOLE)
+#define PA_HOLES 1
+#else
+#define PA_HOLES 0
+#endif
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct pa_stream {
+	off_t ps_next; /* end of the writes so far */
+	off_t ps_run; /* bytes written in a row, 0 if unused */
+	off_t ps_end; /* allocated up to here */
+	uint64_t ps_used;
+};
+
+struct blockif_prealloc {
+	int pa_fd;
+	off_t pa_size;
+	off_t pa_window;
+	int pa_off; /* the host cannot allocate */
+	uint64_t pa_tick;
+	struct pa_stream pa_streams[PA_STREAMS];
+	pthread_mutex_t pa_mtx;
+};
+#pragma clang diagnostic pop
+
+#if !defined(FALLOC_FL_KEEP_SIZE) && defined(SEEK_HOLE)
+/*
+ * Fill the holes in [start, end) with zeroes.
+ */
+static int
+pa_zero(int fd, off_t start, off_t end)
+{
+	static const uint8_t zero[PA_ZERO];
+	off_t data;
+	ssize_t len;
+
+	while (start < end) {
+		start = lseek(fd, start, SEEK_HOLE);
+		if (start < 0)
+			return (errno);
+		if (start >= end)
+			break;
+		data = lseek(fd, start, SEEK_DATA);
+		if (data < 0 && errno != ENXIO)
+			return (errno);
+		if (data < 0 || data > end)
+			data = end;
+		while (start < data) {
+			len = pwrite(fd, zero, (size_t) MIN(data - start,
+			    PA_ZERO), start);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0)
+				return (errno);
+			start += len;
+		}
+	}
+	return (0);
+}
+#endif
+
+/*
+ * Allocate the holes in [start, end).  Returns 0 or an errno.
+ */
+static int
+pa_allocate(struct blockif_prealloc *pa, off_t start, off_t end)
+{
+#ifdef SEEK_HOLE
+	off_t hole;
+
+	hole = lseek(pa->pa_fd, start, SEEK_HOLE);
+	if (hole >= end)
+		return (0);
+	if (hole > start)
+		start = hole;
+#endif
+#if defined(FALLOC_FL_KEEP_SIZE)
+	return (fallocate(pa->pa_fd, FALLOC_FL_KEEP_SIZE, start, end - start) ?
+	    errno : 0);
+#elif defined(SEEK_HOLE)
+	return (pa_zero(pa->pa_fd, start, end));
+#else
+	(void) end;
+	return (EOPNOTSUPP);
+#endif
+}
+
+/*
+ * Called before a write of [off, off + len) to the image.
+ */
+void
+blockif_prealloc_write(struct blockif_prealloc *pa, off_t off, off_t len)
+{
+	struct pa_stream *ps, *lru;
+	off_t start, end;
+	int i, err;
+
+	pthread_mutex_lock(&pa->pa_mtx);
+	if (pa->pa_off) {
+		pthread_mutex_unlock(&pa->pa_mtx);
+		return;
+	}
+	ps = NULL;
+	lru = &pa->pa_streams[0];
+	for (i = 0; i < PA_STREAMS; i++) {
+		if (pa->pa_streams[i].ps_run > 0 &&
+		    off >= pa->pa_streams[i].ps_next - PA_SLACK &&
+		    off <= pa->pa_streams[i].ps_next + PA_SLACK) {
+			ps = &pa->pa_streams[i];
+			break;
+		}
+		if (pa->pa_streams[i].ps_used < lru->ps_used)
+			lru = &pa->pa_streams[i];
+	}
+	if (ps == NULL) {
+		ps = lru;
+		ps->ps_next = off;
+		ps->ps_run = 0;
+		ps->ps_end = 0;
+	}
+	ps->ps_used = ++pa->pa_tick;
+	ps->ps_run += len;
+	ps->ps_next = MAX(ps->ps_next, off + len);
+
+	start = end = 0;
+	if (ps->ps_run >= PA_SEQ &&
+	    ps->ps_next + pa->pa_window / 2 > ps->ps_end) {
+		start = MAX(ps->ps_end, ps->ps_next);
+		end = MIN(ps->ps_next + pa->pa_window, pa->pa_size);
+		ps->ps_end = MAX(ps->ps_end, end);
+	}
+	pthread_mutex_unlock(&pa->pa_mtx);
+
+	/* Out of space or not, the write itself will tell */
+	if (start < end && (err = pa_allocate(pa, start, end)) != 0 &&
+	    (err == EOPNOTSUPP || err == ENOSYS)) {
+		pthread_mutex_lock(&pa->pa_mtx);
+		pa->pa_off = 1;
+		pthread_mutex_unlock(&pa->pa_mtx);
+	}
+}
+
+/*
+ * spec is NULL for the default window or "<window>[k|m|g]".
+ */
+struct blockif_prealloc *
+blockif_prealloc_open(const char *spec, int fd, off_t size)
+{
+	struct blockif_prealloc *pa;
+	uint64_t window;
+
+	if (!PA_HOLES) {
+		fprintf(stderr, "prealloc: the host cannot allocate the holes "
+		    "of a file\n");
+		return (NULL);
+	}
+	window = PA_WINDOW;
+	if (spec != NULL) {
+		if (expand_number(spec, &window) != 0 ||
+		    window < PA_MIN_WINDOW) {
+			fprintf(stderr, "Invalid preallocation window \"%s\", "
+			    "at least %dk\n", spec, PA_MIN_WINDOW >> 10);
+			return (NULL);
+		}
+	}
+
+	pa = calloc(1, sizeof(struct blockif_prealloc));
+	if (pa == NULL) {
+		perror("calloc");
+		return (NULL);
+	}
+	pa->pa_fd = fd;
+	pa->pa_size = size;
+	pa->pa_window = (off_t) window;
+	pthread_mutex_init(&pa->pa_mtx, NULL);
+	return (pa);
+}
+
+void
+blockif_prealloc_close(struct blockif_prealloc *pa)
+{
+	pthread_mutex_destroy(&pa->pa_mtx);
+	free(pa);
+}
@@ -0,0 +1,416 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Boot prefetch profiles.
+ *
+ *   prefetch=<file>[:<seconds>]
+ *
+ * For the first <seconds> (default PF_SECS) after the disk is opened,
+ * the ranges the guest reads are recorded, rounded out to PF_SHIFT.
+ * Then, or when the disk is closed earlier, they are sorted, merged
+ * across gaps of less than PF_GAP and written to <file>:
+ *
+ *   struct pf_header
+ *   struct pf_extent	one per merged range, by offset
+ *
+ * When the disk is opened and <file> is a profile of a disk of the
+ * same size, PF_THREADS threads read its ranges in disk order right
+ * away, so the blocks are in the host cache, or whatever caches the
+ * backend has, by the time the guest asks for them. The read data is
+ * thrown away. Every boot records a new profile, so it follows changes
+ * to the guest.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if_be.h>
+
+#define PF_MAGIC "XHYVEPF1"
+#define PF_VERSION 1
+#define PF_SECS 60
+#define PF_SHIFT 16
+#define PF_GAP (256 * 1024) /* cheaper to read through than to seek */
+#define PF_MAXEXT (1 << 20) /* ranges recorded */
+#define PF_THREADS 4
+#define PF_IOSIZE (1024 * 1024)
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct pf_header {
+	char ph_magic[8];
+	uint32_t ph_version;
+	uint32_t ph_secs; /* recording time */
+	uint64_t ph_size; /* disk size */
+	uint64_t ph_count; /* extents following */
+};
+
+struct pf_extent {
+	uint64_t pe_off;
+	uint64_t pe_len;
+};
+
+struct blockif_prefetch {
+	char *pf_path;
+	off_t pf_size;
+	blockif_read_t *pf_read;
+	void *pf_arg;
+	int pf_closing;
+	pthread_mutex_t pf_mtx;
+	pthread_cond_t pf_cond;
+	/* replay of the last profile */
+	struct pf_extent *pf_ext;
+	uint64_t pf_next;
+	uint64_t pf_count;
+	int pf_nthreads;
+	pthread_t pf_tid[PF_THREADS];
+	/* recording of the next one */
+	struct pf_extent *pf_rec;
+	uint64_t pf_nrec;
+	uint64_t pf_maxrec;
+	int pf_recording;
+	unsigned pf_secs;
+	struct timespec pf_deadline;
+	int pf_timed; /* pf_timer running */
+	pthread_t pf_timer;
+};
+#pragma clang diagnostic pop
+
+static int
+pf_cmp_extent(const void *a, const void *b)
+{
+	const struct pf_extent *x, *y;
+
+	x = a;
+	y = b;
+	return ((x->pe_off > y->pe_off) - (x->pe_off < y->pe_off));
+}
+
+/*
+ * Sort the extents and merge those that overlap or are close.
+ */
+static uint64_t
+pf_merge(struct pf_extent *ext, uint64_t n)
+{
+	uint64_t i, m;
+
+	if (n == 0)
+		return (0);
+	qsort(ext, n, sizeof(*ext), pf_cmp_extent);
+	for (m = 0, i = 1; i < n; i++) {
+		if (ext[i].pe_off <= ext[m].pe_off + ext[m].pe_len + PF_GAP) {
+			ext[m].pe_len = MAX(ext[m].pe_len,
+			    ext[i].pe_off + ext[i].pe_len - ext[m].pe_off);
+			continue;
+		}
+		ext[++m] = ext[i];
+	}
+	return (m + 1);
+}
+
+static void
+pf_load(struct blockif_prefetch *pf)
+{
+	struct pf_header ph;
+	uint64_t i;
+	size_t len;
+	int fd;
+
+	fd = open(pf->pf_path, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (read(fd, &ph, sizeof(ph)) != (ssize_t) sizeof(ph) ||
+	    memcmp(ph.ph_magic, PF_MAGIC, sizeof(ph.ph_magic)) != 0 ||
+	    ph.ph_version != PF_VERSION ||
+	    ph.ph_size != (uint64_t) pf->pf_size ||
+	    ph.ph_count == 0 || ph.ph_count > PF_MAXEXT) {
+		close(fd);
+		return;
+	}
+	len = ph.ph_count * sizeof(struct pf_extent);
+	pf->pf_ext = malloc(len);
+	if (pf->pf_ext == NULL ||
+	    read(fd, pf->pf_ext, len) != (ssize_t) len) {
+		free(pf->pf_ext);
+		pf->pf_ext = NULL;
+		close(fd);
+		return;
+	}
+	close(fd);
+
+	/* Never beyond the end of the disk */
+	for (i = 0; i < ph.ph_count; i++) {
+		if (pf->pf_ext[i].pe_off >= ph.ph_size)
+			break;
+		pf->pf_ext[i].pe_len = MIN(pf->pf_ext[i].pe_len,
+		    ph.ph_size - pf->pf_ext[i].pe_off);
+	}
+	pf->pf_count = i;
+}
+
+/*
+ * Write the recorded profile next to the old one and move it in place,
+ * so a crash leaves one or the other.
+ */
+static void
+pf_save(struct blockif_prefetch *pf)
+{
+	struct pf_header ph;
+	char *tmp;
+	size_t len;
+	int fd;
+
+	pf->pf_nrec = pf_merge(pf->pf_rec, pf->pf_nrec);
+	/* A VM stopped right away should not lose the profile */
+	if (pf->pf_nrec == 0)
+		return;
+
+	memset(&ph, 0, sizeof(ph));
+	memcpy(ph.ph_magic, PF_MAGIC, sizeof(ph.ph_magic));
+	ph.ph_version = PF_VERSION;
+	ph.ph_secs = pf->pf_secs;
+	ph.ph_size = (uint64_t) pf->pf_size;
+	ph.ph_count = pf->pf_nrec;
+	len = pf->pf_nrec * sizeof(struct pf_extent);
+
+	if (asprintf(&tmp, "%s.tmp", pf->pf_path) < 0)
+		return;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 ||
+	    write(fd, &ph, sizeof(ph)) != (ssize_t) sizeof(ph) ||
+	    write(fd, pf->pf_rec, len) != (ssize_t) len ||
+	    close(fd) < 0 || rename(tmp, pf->pf_path) < 0) {
+		perror(pf->pf_path);
+		if (fd >= 0)
+			unlink(tmp);
+	}
+	free(tmp);
+}
+
+/*
+ * Read the extents of the profile, handed out in disk order.
+ */
+static void *
+pf_reader(void *arg)
+{
+	struct blockif_prefetch *pf;
+	struct pf_extent pe;
+	uint8_t *buf;
+	size_t n;
+
+	pf = arg;
+	buf = malloc(PF_IOSIZE);
+	if (buf == NULL)
+		return (NULL);
+	for (;;) {
+		pthread_mutex_lock(&pf->pf_mtx);
+		if (pf->pf_closing || pf->pf_next == pf->pf_count) {
+			pthread_mutex_unlock(&pf->pf_mtx);
+			break;
+		}
+		pe = pf->pf_ext[pf->pf_next++];
+		pthread_mutex_unlock(&pf->pf_mtx);
+
+		while (pe.pe_len > 0 && !pf->pf_closing) {
+			n = (size_t) MIN(pe.pe_len, PF_IOSIZE);
+			if (pf->pf_read(pf->pf_arg, buf, n,
+			    (off_t) pe.pe_off) != 0)
+				break;
+			pe.pe_off += n;
+			pe.pe_len -= n;
+		}
+	}
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * Ends the recording at the deadline, or when the disk is closed.
+ */
+static void *
+pf_timer(void *arg)
+{
+	struct blockif_prefetch *pf;
+
+	pf = arg;
+	pthread_mutex_lock(&pf->pf_mtx);
+	while (!pf->pf_closing &&
+	    pthread_cond_timedwait(&pf->pf_cond, &pf->pf_mtx,
+	    &pf->pf_deadline) != ETIMEDOUT)
+		;
+	pf->pf_recording = 0;
+	pthread_mutex_unlock(&pf->pf_mtx);
+
+	pf_save(pf);
+	free(pf->pf_rec);
+	pf->pf_rec = NULL;
+	return (NULL);
+}
+
+void
+blockif_prefetch_record(struct blockif_prefetch *pf, off_t off, off_t len)
+{
+	struct pf_extent *pe;
+	uint64_t start, end;
+	void *rec;
+
+	start = ((uint64_t) off) & ~((1ULL << PF_SHIFT) - 1);
+	end = roundup2((uint64_t) (off + len), 1ULL << PF_SHIFT);
+
+	pthread_mutex_lock(&pf->pf_mtx);
+	if (!pf->pf_recording) {
+		pthread_mutex_unlock(&pf->pf_mtx);
+		return;
+	}
+	/* Sequential reads extend the last range */
+	pe = pf->pf_nrec > 0 ? &pf->pf_rec[pf->pf_nrec - 1] : NULL;
+	if (pe != NULL && start >= pe->pe_off &&
+	    start <= pe->pe_off + pe->pe_len) {
+		pe->pe_len = MAX(pe->pe_len, end - pe->pe_off);
+		pthread_mutex_unlock(&pf->pf_mtx);
+		return;
+	}
+	if (pf->pf_nrec == pf->pf_maxrec) {
+		rec = NULL;
+		if (pf->pf_maxrec < PF_MAXEXT)
+			rec = realloc(pf->pf_rec, 2 * pf->pf_maxrec *
+			    sizeof(struct pf_extent));
+		if (rec == NULL) {
+			/* Keep what fits */
+			pf->pf_recording = 0;
+			pthread_mutex_unlock(&pf->pf_mtx);
+			return;
+		}
+		pf->pf_rec = rec;
+		pf->pf_maxrec *= 2;
+	}
+	pf->pf_rec[pf->pf_nrec].pe_off = start;
+	pf->pf_rec[pf->pf_nrec].pe_len = end - start;
+	pf->pf_nrec++;
+	pthread_mutex_unlock(&pf->pf_mtx);
+}
+
+/*
+ * rd is NULL if reading ahead is of no use, e.g. without a host cache;
+ * the profile is still recorded.
+ */
+struct blockif_prefetch *
+blockif_prefetch_open(const char *spec, off_t size, blockif_read_t *rd,
+	void *arg)
+{
+	struct blockif_prefetch *pf;
+	char *secs, *end;
+	unsigned long n;
+
+	pf = calloc(1, sizeof(struct blockif_prefetch));
+	if (pf == NULL) {
+		perror("calloc");
+		return (NULL);
+	}
+	pf->pf_path = strdup(spec);
+	pf->pf_maxrec = 1024;
+	pf->pf_rec = malloc(pf->pf_maxrec * sizeof(struct pf_extent));
+	if (pf->pf_path == NULL || pf->pf_rec == NULL) {
+		perror("malloc");
+		goto fail;
+	}
+	pf->pf_secs = PF_SECS;
+	secs = strrchr(pf->pf_path, ':');
+	if (secs != NULL) {
+		n = strtoul(secs + 1, &end, 10);
+		if (secs[1] == '\0' || *end != '\0' || n == 0 || n > 3600) {
+			fprintf(stderr, "Invalid prefetch profile \"%s\"\n", spec);
+			goto fail;
+		}
+		pf->pf_secs = (unsigned) n;
+		*secs = '\0';
+	}
+	pf->pf_size = size;
+	pf->pf_read = rd;
+	pf->pf_arg = arg;
+	pthread_mutex_init(&pf->pf_mtx, NULL);
+	pthread_cond_init(&pf->pf_cond, NULL);
+
+	if (rd != NULL)
+		pf_load(pf);
+	for (; pf->pf_nthreads < PF_THREADS &&
+	    (uint64_t) pf->pf_nthreads < pf->pf_count; pf->pf_nthreads++)
+		if (pthread_create(&pf->pf_tid[pf->pf_nthreads], NULL,
+		    pf_reader, pf) != 0)
+			break;
+
+	clock_gettime(CLOCK_REALTIME, &pf->pf_deadline);
+	pf->pf_deadline.tv_sec += (time_t) pf->pf_secs;
+	pf->pf_recording = 1;
+	if (pthread_create(&pf->pf_timer, NULL, pf_timer, pf) != 0) {
+		perror("pthread_create");
+		blockif_prefetch_close(pf);
+		return (NULL);
+	}
+	pf->pf_timed = 1;
+	return (pf);
+
+fail:
+	free(pf->pf_rec);
+	free(pf->pf_path);
+	free(pf);
+	return (NULL);
+}
+
+void
+blockif_prefetch_close(struct blockif_prefetch *pf)
+{
+	void *jval;
+	int i;
+
+	pthread_mutex_lock(&pf->pf_mtx);
+	pf->pf_closing = 1;
+	pthread_cond_broadcast(&pf->pf_cond);
+	pthread_mutex_unlock(&pf->pf_mtx);
+
+	for (i = 0; i < pf->pf_nthreads; i++)
+		pthread_join(pf->pf_tid[i], &jval);
+	if (pf->pf_timed)
+		pthread_join(pf->pf_timer, &jval);
+
+	pthread_cond_destroy(&pf->pf_cond);
+	pthread_mutex_destroy(&pf->pf_mtx);
+	free(pf->pf_rec);
+	free(pf->pf_ext);
+	free(pf->pf_path);
+	free(pf);
+}
@@ -0,0 +1,416 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Replays a trace taken with the trace= disk option against any disk,
+ * through the block i/o layer and without a guest, and prints the
+ * latencies next to the recorded ones as JSON.
+ *
+ *  make blockif-replay
+ *  build/blockif-replay [-f] [-q depth] [-r] vm.trace disk.img[,opts]
+ *
+ * Requests are issued at the times they were originally submitted, or
+ * with -f as fast as possible while keeping as many in flight as when
+ * each was recorded.  Writes write a fixed pattern, so replay against
+ * a copy of the disk, or with -r, which skips writes and deletes.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/mevent.h>
+#include <xhyve/block_if.h>
+#include <xhyve/block_if_trace.h>
+
+#define REPLAY_LATE_NS 1000000 /* issued later than recorded */
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct replay_slot {
+	struct blockif_req rs_req;
+	uint8_t *rs_buf;
+	uint64_t rs_start;
+	int rs_op;
+	int rs_busy;
+};
+
+struct replay_lat {
+	uint64_t *rl_ns;
+	size_t rl_n;
+};
+#pragma clang diagnostic pop
+
+static pthread_mutex_t replay_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replay_cond = PTHREAD_COND_INITIALIZER;
+
+static struct replay_lat replay_lat; /* of the replay */
+static struct replay_lat replay_rec; /* as recorded */
+static uint64_t replay_ops[4];
+static uint64_t replay_bytes;
+static uint64_t replay_errors;
+static int replay_inflight;
+
+/*
+ * blockif registers a SIGCONT handler for blockif_cancel(); there is
+ * no event loop here and nothing is ever cancelled.
+ */
+struct mevent *
+mevent_add(UNUSED int fd, UNUSED enum ev_type type,
+	UNUSED void (*func)(int, enum ev_type, void *), UNUSED void *param)
+{
+	return (NULL);
+}
+
+static uint64_t
+replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t) ts.tv_sec) * 1000000000ull + ((uint64_t) ts.tv_nsec));
+}
+
+static void
+replay_sleep(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t) (ns / 1000000000ull);
+	ts.tv_nsec = (long) (ns % 1000000000ull);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static void
+replay_done(struct blockif_req *br, int err)
+{
+	struct replay_slot *rs = br->br_param;
+	uint64_t lat;
+
+	lat = replay_now() - rs->rs_start;
+
+	pthread_mutex_lock(&replay_mtx);
+	if (err)
+		replay_errors++;
+	replay_ops[rs->rs_op]++;
+	if (rs->rs_op == BLOCKIF_TRACE_READ || rs->rs_op == BLOCKIF_TRACE_WRITE)
+		replay_bytes += rs->rs_req.br_iov[0].iov_len;
+	replay_lat.rl_ns[replay_lat.rl_n++] = lat;
+	rs->rs_busy = 0;
+	replay_inflight--;
+	pthread_cond_broadcast(&replay_cond);
+	pthread_mutex_unlock(&replay_mtx);
+}
+
+static int
+replay_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return ((x > y) - (x < y));
+}
+
+/* Records by submission time, they are written in completion order */
+static int
+replay_cmp_rec(const void *a, const void *b)
+{
+	const struct blockif_trace_rec *x = a, *y = b;
+
+	return ((x->tr_time > y->tr_time) - (x->tr_time < y->tr_time));
+}
+
+static double
+replay_pct(struct replay_lat *rl, double p)
+{
+	size_t i;
+
+	if (rl->rl_n == 0)
+		return (0.0);
+	i = (size_t) (p / 100.0 * ((double) (rl->rl_n - 1)) + 0.5);
+	return (((double) rl->rl_ns[i]) / 1000.0);
+}
+
+static void
+replay_print_lat(const char *name, struct replay_lat *rl, int last)
+{
+	qsort(rl->rl_ns, rl->rl_n, sizeof(uint64_t), replay_cmp);
+	printf("  \"%s\": {\n", name);
+	printf("    \"min\": %.1f,\n", replay_pct(rl, 0.0));
+	printf("    \"p50\": %.1f,\n", replay_pct(rl, 50.0));
+	printf("    \"p90\": %.1f,\n", replay_pct(rl, 90.0));
+	printf("    \"p99\": %.1f,\n", replay_pct(rl, 99.0));
+	printf("    \"p99.9\": %.1f,\n", replay_pct(rl, 99.9));
+	printf("    \"max\": %.1f\n", replay_pct(rl, 100.0));
+	printf("  }%s\n", last ? "" : ",");
+}
+
+static struct blockif_trace_rec *
+replay_load(const char *path, size_t *nrecs)
+{
+	struct blockif_trace_header th;
+	struct blockif_trace_rec *recs;
+	long len;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		return (NULL);
+	}
+	recs = NULL;
+	if (fread(&th, sizeof(th), 1, fp) != 1 ||
+	    memcmp(th.th_magic, BLOCKIF_TRACE_MAGIC, sizeof(th.th_magic)) ||
+	    th.th_version != BLOCKIF_TRACE_VERSION) {
+		fprintf(stderr, "%s: not a block i/o trace\n", path);
+		goto out;
+	}
+	if (fseek(fp, 0, SEEK_END) < 0 || (len = ftell(fp)) < 0 ||
+	    fseek(fp, (long) sizeof(th), SEEK_SET) < 0) {
+		perror(path);
+		goto out;
+	}
+	*nrecs = ((size_t) len - sizeof(th)) / sizeof(struct blockif_trace_rec);
+	recs = calloc(MAX(*nrecs, 1), sizeof(struct blockif_trace_rec));
+	if (recs == NULL ||
+	    fread(recs, sizeof(struct blockif_trace_rec), *nrecs, fp) != *nrecs) {
+		perror(path);
+		free(recs);
+		recs = NULL;
+		goto out;
+	}
+	qsort(recs, *nrecs, sizeof(struct blockif_trace_rec), replay_cmp_rec);
+out:
+	fclose(fp);
+	return (recs);
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+	    "Usage: %s [-f] [-q depth] [-r] trace path[,blockif-opts]\n"
+	    "\t-f: as fast as possible (default at the recorded times)\n"
+	    "\t-q: with -f, keep this many requests in flight instead of\n"
+	    "\t    as many as recorded\n"
+	    "\t-r: skip writes and deletes, leaving the disk unchanged\n",
+	    prog);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct blockif_trace_rec *recs, *rec;
+	struct replay_slot *slots, *rs;
+	struct blockif_ctxt *bc;
+	uint64_t start, now, elapsed, skipped, late;
+	size_t nrecs, maxlen, i;
+	off_t size;
+	int c, j, err, fast, fixed, depth, rdonly, limit, maxqd;
+
+	fast = 0;
+	fixed = 0;
+	depth = 0;
+	rdonly = 0;
+	while ((c = getopt(argc, argv, "fq:r")) != -1) {
+		switch (c) {
+		case 'f':
+			fast = 1;
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			if (depth < 1)
+				usage(argv[0]);
+			fixed = 1;
+			break;
+		case 'r':
+			rdonly = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 2)
+		usage(argv[0]);
+
+	recs = replay_load(argv[optind], &nrecs);
+	if (recs == NULL)
+		exit(1);
+	bc = blockif_open(argv[optind + 1], "replay");
+	if (bc == NULL)
+		exit(1);
+	if (!rdonly && blockif_is_ro(bc)) {
+		fprintf(stderr, "%s: backing file is read-only, use -r\n",
+		    argv[0]);
+		exit(1);
+	}
+	size = blockif_size(bc);
+
+	maxlen = 4096;
+	maxqd = 1;
+	for (i = 0; i < nrecs; i++) {
+		maxlen = MAX(maxlen, recs[i].tr_len);
+		maxqd = MAX(maxqd, recs[i].tr_qd);
+	}
+	if (!fixed || !fast)
+		depth = maxqd;
+	if (depth > blockif_queuesz(bc))
+		depth = blockif_queuesz(bc);
+
+	slots = calloc((size_t) depth, sizeof(struct replay_slot));
+	replay_lat.rl_ns = calloc(MAX(nrecs, 1), sizeof(uint64_t));
+	replay_rec.rl_ns = calloc(MAX(nrecs, 1), sizeof(uint64_t));
+	assert(slots != NULL && replay_lat.rl_ns != NULL &&
+	    replay_rec.rl_ns != NULL);
+	for (j = 0; j < depth; j++) {
+		rs = &slots[j];
+		if (posix_memalign((void **) &rs->rs_buf, 4096, maxlen))
+			abort();
+		memset(rs->rs_buf, 0xa5, maxlen);
+		rs->rs_req.br_callback = replay_done;
+		rs->rs_req.br_param = rs;
+	}
+
+	skipped = late = 0;
+	start = replay_now();
+	pthread_mutex_lock(&replay_mtx);
+	for (i = 0; i < nrecs; i++) {
+		rec = &recs[i];
+		if (rec->tr_op > BLOCKIF_TRACE_DELETE ||
+		    (rec->tr_op != BLOCKIF_TRACE_FLUSH &&
+		    (off_t) (rec->tr_off + rec->tr_len) > size) ||
+		    (rdonly && (rec->tr_op == BLOCKIF_TRACE_WRITE ||
+		    rec->tr_op == BLOCKIF_TRACE_DELETE))) {
+			skipped++;
+			continue;
+		}
+
+		if (!fast) {
+			now = replay_now() - start;
+			if (rec->tr_time > now) {
+				pthread_mutex_unlock(&replay_mtx);
+				replay_sleep(rec->tr_time - now);
+				pthread_mutex_lock(&replay_mtx);
+			}
+		}
+		limit = depth;
+		if (fast && !fixed)
+			limit = MIN(depth, MAX(rec->tr_qd, 1));
+		for (;;) {
+			for (j = 0; j < depth && slots[j].rs_busy; j++)
+				;
+			if (j < depth && replay_inflight < limit)
+				break;
+			pthread_cond_wait(&replay_cond, &replay_mtx);
+		}
+		rs = &slots[j];
+		if (!fast && replay_now() - start > rec->tr_time + REPLAY_LATE_NS)
+			late++;
+
+		rs->rs_op = rec->tr_op;
+		rs->rs_req.br_iovcnt = 1;
+		rs->rs_req.br_iov[0].iov_base = rs->rs_buf;
+		rs->rs_req.br_iov[0].iov_len = rec->tr_len;
+		rs->rs_req.br_offset = (off_t) rec->tr_off;
+		rs->rs_req.br_resid = (ssize_t) rec->tr_len;
+		rs->rs_busy = 1;
+		replay_rec.rl_ns[replay_rec.rl_n++] = (uint64_t) rec->tr_lat * 1000;
+		replay_inflight++;
+		pthread_mutex_unlock(&replay_mtx);
+
+		rs->rs_start = replay_now();
+		switch (rs->rs_op) {
+		case BLOCKIF_TRACE_READ:
+			err = blockif_read(bc, &rs->rs_req);
+			break;
+		case BLOCKIF_TRACE_WRITE:
+			err = blockif_write(bc, &rs->rs_req);
+			break;
+		case BLOCKIF_TRACE_FLUSH:
+			err = blockif_flush(bc, &rs->rs_req);
+			break;
+		default:
+			err = blockif_delete(bc, &rs->rs_req);
+			break;
+		}
+
+		pthread_mutex_lock(&replay_mtx);
+		if (err) {
+			fprintf(stderr, "%s: request failed: %s\n", argv[0],
+			    strerror(err));
+			exit(1);
+		}
+	}
+	while (replay_inflight > 0)
+		pthread_cond_wait(&replay_cond, &replay_mtx);
+	pthread_mutex_unlock(&replay_mtx);
+
+	elapsed = replay_now() - start;
+	blockif_close(bc);
+
+	printf("{\n");
+	printf("  \"trace\": \"%s\",\n", argv[optind]);
+	printf("  \"path\": \"%s\",\n", argv[optind + 1]);
+	printf("  \"mode\": \"%s\",\n", fast ? "fast" : "timed");
+	printf("  \"queue_depth\": %d,\n", depth);
+	printf("  \"requests\": %zu,\n", replay_lat.rl_n);
+	printf("  \"skipped\": %llu,\n", (unsigned long long) skipped);
+	if (!fast)
+		printf("  \"late\": %llu,\n", (unsigned long long) late);
+	printf("  \"recorded_seconds\": %.3f,\n", nrecs ?
+	    ((double) recs[nrecs - 1].tr_time) / 1e9 : 0.0);
+	printf("  \"seconds\": %.3f,\n", ((double) elapsed) / 1e9);
+	printf("  \"reads\": %llu,\n",
+	    (unsigned long long) replay_ops[BLOCKIF_TRACE_READ]);
+	printf("  \"writes\": %llu,\n",
+	    (unsigned long long) replay_ops[BLOCKIF_TRACE_WRITE]);
+	printf("  \"flushes\": %llu,\n",
+	    (unsigned long long) replay_ops[BLOCKIF_TRACE_FLUSH]);
+	printf("  \"deletes\": %llu,\n",
+	    (unsigned long long) replay_ops[BLOCKIF_TRACE_DELETE]);
+	printf("  \"errors\": %llu,\n", (unsigned long long) replay_errors);
+	printf("  \"iops\": %.1f,\n", ((double) replay_lat.rl_n) /
+	    (((double) elapsed) / 1e9));
+	printf("  \"bandwidth_mib_s\": %.2f,\n", ((double) replay_bytes) /
+	    (((double) elapsed) / 1e9) / (1024.0 * 1024.0));
+	replay_print_lat("recorded_latency_us", &replay_rec, 0);
+	replay_print_lat("latency_us", &replay_lat, 1);
+	printf("}\n");
+
+	return (replay_errors ? 1 : 0);
+}
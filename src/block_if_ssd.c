@@ -0,0 +1,1115 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Persistent cache of a slow disk in a file on fast local storage.
+ *
+ *   ssdcache=<file>[:size=<bytes>[k|m|g]][:writeback]
+ *
+ * The cache file holds
+ *
+ *   struct ssd_header	padded to SSD_HDR_SIZE
+ *   slot table		one struct ssd_meta per slot, the tag of the
+ *			disk line it caches and its state
+ *   data		one SSD_LINE sized line per slot
+ *
+ * The slot table is a persistent hash: it is loaded into an in-memory
+ * hash table on open and written back a page at a time when it changes.
+ * Misses are read from the disk and counted; a line missed SSD_ADMIT
+ * times is queued, and a background thread reads the queued lines in
+ * disk order and copies them into the cache, so the cache warms up with
+ * what is used repeatedly and a one-off scan does not flush it.  When
+ * full, clean lines are evicted by a clock over their hit counts.
+ *
+ * In write-through mode every write goes to the disk, and cached
+ * lines are updated along.  In write-back mode writes to cached lines
+ * only go to the cache file; the thread writes dirty lines back when
+ * the disk has been idle for SSD_IDLE_MS or half the cache is dirty.
+ * Dirty lines survive restarts, so a disk must not be used without its
+ * cache until a write-through run has drained it.
+ *
+ * Crash consistency: the data of a line is on stable storage before a
+ * slot table page marking it valid is written, and an evicted slot is
+ * only reused once its invalidation is stable.  Dirty lines take all
+ * writes to them in either mode.  Of a cache not closed cleanly, the
+ * clean lines of a write-through run are dropped, as they may be older
+ * than the disk; after a write-back run all lines count as dirty.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if_be.h>
+
+#define SSD_MAGIC "XHYVESC1"
+#define SSD_VERSION 1
+#define SSD_HDR_SIZE 4096
+#define SSD_PAGE 4096 /* slot table write granularity */
+#define SSD_SHIFT 16
+#define SSD_LINE (1 << SSD_SHIFT)
+#define SSD_SIZE_DEF (4ULL << 30)
+#define SSD_ADMIT 2 /* misses before a line is cached */
+#define SSD_HEAT 65536 /* lines whose misses are counted */
+#define SSD_WARM_MAX 1024 /* lines queued for warming */
+#define SSD_EVICT 64 /* slots reclaimed at a time */
+#define SSD_DESTAGE 16 /* dirty lines written back at a time */
+#define SSD_IDLE_MS 1000
+#define SSD_NIL UINT32_MAX
+
+#define SSD_CLEAN 0
+#define SSD_INUSE 1
+
+/* ssd_meta flags, all but the first two only meaningful in memory */
+#define SSD_VALID 0x1
+#define SSD_DIRTY 0x2
+#define SSD_FILLING 0x4
+#define SSD_STALE 0x8 /* written while filling, discard the fill */
+#define SSD_WASDIRTY 0x10 /* written back, still dirty in the file */
+
+#define SSD_NAME_MAX 1024
+
+/* the source of partial line deletes, never written */
+static uint8_t ssd_zero[SSD_LINE];
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct ssd_header {
+	char sh_magic[8];
+	uint32_t sh_version;
+	uint32_t sh_state; /* SSD_CLEAN or SSD_INUSE */
+	uint64_t sh_nslots;
+	uint64_t sh_meta; /* offset of the slot table */
+	uint64_t sh_data; /* offset of the first line */
+	uint64_t sh_disk_size;
+	uint32_t sh_writeback; /* mode of the last run */
+	char sh_disk[SSD_NAME_MAX]; /* the disk cached */
+};
+
+struct ssd_meta {
+	uint64_t sm_tag; /* line number + 1, 0 if free */
+	uint32_t sm_flags;
+	uint32_t sm_freq; /* hits, halved by the clock */
+};
+
+struct ssd_heat {
+	uint64_t sh_line;
+	uint32_t sh_count;
+};
+
+struct blockif_ssd {
+	struct blockif_atexit sd_atexit;
+	/* the disk being cached */
+	const struct blockif_backend *sd_be; /* NULL for a plain file */
+	void *sd_bearg;
+	int sd_fd;
+	off_t sd_size;
+	int sd_writeback;
+	/* the cache */
+	char *sd_path;
+	int sd_cfd;
+	struct ssd_header sd_hdr;
+	uint32_t sd_nslots;
+	struct ssd_meta *sd_meta;
+	uint8_t *sd_mdirty; /* slot table pages to write, 2 if written */
+	uint32_t *sd_gen; /* bumped by every write to a line */
+	uint32_t *sd_hash;
+	uint32_t *sd_next;
+	uint32_t sd_hmask;
+	uint32_t *sd_free; /* free slots, invalidation stable */
+	uint32_t sd_nfree;
+	uint32_t *sd_pend; /* evicted slots, invalidation not yet stable */
+	uint32_t sd_npend;
+	uint32_t sd_ndirty;
+	uint32_t sd_hand;
+	uint32_t sd_dhand;
+	struct ssd_heat *sd_heat;
+	uint64_t sd_warm[SSD_WARM_MAX];
+	uint32_t sd_nwarm;
+	uint64_t sd_lastio; /* ms */
+	/* background thread */
+	uint64_t sd_wlist[SSD_WARM_MAX];
+	uint8_t *sd_buf;
+	int sd_closing;
+	pthread_t sd_tid;
+	pthread_mutex_t sd_mtx; /* everything above */
+	pthread_mutex_t sd_syncmtx; /* orders fills and slot table writes */
+	pthread_cond_t sd_cond;
+};
+#pragma clang diagnostic pop
+
+
+static uint64_t
+ssd_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (((uint64_t) ts.tv_sec) * 1000 + ((uint64_t) ts.tv_nsec) / 1000000);
+}
+
+static int
+ssd_disk_io(struct blockif_ssd *sd, const struct iovec *iov, int iovcnt,
+	size_t skip, size_t len, off_t off, int write)
+{
+	return (blockif_iov_xfer(sd->sd_fd, sd->sd_be, sd->sd_bearg, iov,
+	    iovcnt, skip, len, off, write));
+}
+
+static int
+ssd_disk_flush(struct blockif_ssd *sd)
+{
+	if (sd->sd_be != NULL)
+		return (sd->sd_be->bb_flush != NULL ?
+		    sd->sd_be->bb_flush(sd->sd_bearg) : 0);
+	return (blockif_fdatasync(sd->sd_fd) ? errno : 0);
+}
+
+static int
+ssd_write_header(struct blockif_ssd *sd, uint32_t state)
+{
+	sd->sd_hdr.sh_state = state;
+	if (pwrite(sd->sd_cfd, &sd->sd_hdr, sizeof(sd->sd_hdr), 0) !=
+	    (ssize_t) sizeof(sd->sd_hdr) || blockif_fdatasync(sd->sd_cfd) < 0)
+		return (errno ? errno : EIO);
+	return (0);
+}
+
+/*
+ * Called with sd_mtx held before the cache file changes.
+ */
+static void
+ssd_inuse(struct blockif_ssd *sd)
+{
+	/* Marked clean already, e.g. by exit racing a last request */
+	if (sd->sd_hdr.sh_state != SSD_INUSE)
+		(void) ssd_write_header(sd, SSD_INUSE);
+}
+
+/*
+ * Move len bytes between skip in iov and the line in slot s, starting
+ * at loff within the line.  Called with sd_mtx held.
+ */
+static int
+ssd_cache_io(struct blockif_ssd *sd, uint32_t s, const struct iovec *iov,
+	int iovcnt, size_t skip, size_t len, size_t loff, int write)
+{
+	off_t off;
+
+	if (write)
+		ssd_inuse(sd);
+	off = (off_t) (sd->sd_hdr.sh_data + ((uint64_t) s << SSD_SHIFT) + loff);
+	return (blockif_iov_xfer(sd->sd_cfd, NULL, NULL, iov, iovcnt, skip,
+	    len, off, write));
+}
+
+static size_t
+ssd_line_len(struct blockif_ssd *sd, uint64_t line)
+{
+	return ((size_t) MIN((off_t) SSD_LINE,
+	    sd->sd_size - (off_t) (line << SSD_SHIFT)));
+}
+
+static uint32_t
+ssd_bucket(struct blockif_ssd *sd, uint64_t line)
+{
+	return ((uint32_t) ((line * 0x9e3779b97f4a7c15ULL) >> 32) & sd->sd_hmask);
+}
+
+static uint32_t
+ssd_lookup(struct blockif_ssd *sd, uint64_t line)
+{
+	uint32_t s;
+
+	for (s = sd->sd_hash[ssd_bucket(sd, line)]; s != SSD_NIL;
+	    s = sd->sd_next[s])
+		if (sd->sd_meta[s].sm_tag == line + 1)
+			return (s);
+	return (SSD_NIL);
+}
+
+static void
+ssd_hash_insert(struct blockif_ssd *sd, uint32_t s)
+{
+	uint32_t b;
+
+	b = ssd_bucket(sd, sd->sd_meta[s].sm_tag - 1);
+	sd->sd_next[s] = sd->sd_hash[b];
+	sd->sd_hash[b] = s;
+}
+
+static void
+ssd_hash_remove(struct blockif_ssd *sd, uint32_t s)
+{
+	uint32_t *p;
+
+	p = &sd->sd_hash[ssd_bucket(sd, sd->sd_meta[s].sm_tag - 1)];
+	while (*p != s)
+		p = &sd->sd_next[*p];
+	*p = sd->sd_next[s];
+}
+
+static void
+ssd_touch(struct blockif_ssd *sd, uint32_t s)
+{
+	ssd_inuse(sd);
+	sd->sd_mdirty[(s * sizeof(struct ssd_meta)) / SSD_PAGE] = 1;
+}
+
+/*
+ * Count a miss, and queue the line for warming once it is hot.
+ */
+static void
+ssd_heat(struct blockif_ssd *sd, uint64_t line)
+{
+	struct ssd_heat *h;
+
+	h = &sd->sd_heat[ssd_bucket(sd, line) & (SSD_HEAT - 1)];
+	if (h->sh_line != line) {
+		/* an older line loses its count first */
+		if (h->sh_count > 0) {
+			h->sh_count--;
+			return;
+		}
+		h->sh_line = line;
+	}
+	if (++h->sh_count < SSD_ADMIT)
+		return;
+	h->sh_count = 0;
+	if (sd->sd_nwarm < SSD_WARM_MAX)
+		sd->sd_warm[sd->sd_nwarm++] = line;
+	if (sd->sd_nwarm >= SSD_WARM_MAX / 16)
+		pthread_cond_signal(&sd->sd_cond);
+}
+
+/*
+ * Read or write a run of lines through the disk.  After a write, lines
+ * that are cached, or being filled, must not keep the old data.
+ */
+static int
+ssd_run(struct blockif_ssd *sd, const struct iovec *iov, int iovcnt,
+	size_t skip, size_t len, off_t off, int write)
+{
+	uint64_t line;
+	uint32_t s;
+	size_t n, loff;
+	off_t pos;
+	int err;
+
+	err = ssd_disk_io(sd, iov, iovcnt, skip, len, off + (off_t) skip, write);
+	if (err != 0 || !write)
+		return (err);
+
+	pthread_mutex_lock(&sd->sd_mtx);
+	for (pos = off + (off_t) skip; err == 0 && len > 0; pos += (off_t) n) {
+		line = (uint64_t) pos >> SSD_SHIFT;
+		loff = (size_t) pos & (SSD_LINE - 1);
+		n = MIN(len, SSD_LINE - loff);
+		s = ssd_lookup(sd, line);
+		if (s != SSD_NIL && (sd->sd_meta[s].sm_flags & SSD_VALID)) {
+			err = ssd_cache_io(sd, s, iov, iovcnt, skip, n, loff, 1);
+			sd->sd_gen[s]++;
+		} else if (s != SSD_NIL)
+			sd->sd_meta[s].sm_flags |= SSD_STALE;
+		skip += n;
+		len -= n;
+	}
+	pthread_mutex_unlock(&sd->sd_mtx);
+	return (err);
+}
+
+static ssize_t
+ssd_rw(struct blockif_ssd *sd, const struct iovec *iov, int iovcnt,
+	off_t off, int write)
+{
+	struct ssd_meta *sm;
+	uint64_t line;
+	size_t total, done, n, rstart, rlen, loff;
+	uint32_t s;
+	int i, err;
+
+	for (total = 0, i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (off >= sd->sd_size)
+		return (0);
+	total = (size_t) MIN((off_t) total, sd->sd_size - off);
+
+	err = 0;
+	rstart = rlen = 0;
+	for (done = 0; err == 0 && done < total; done += n) {
+		line = (uint64_t) (off + (off_t) done) >> SSD_SHIFT;
+		loff = (size_t) (off + (off_t) done) & (SSD_LINE - 1);
+		n = MIN(total - done, SSD_LINE - loff);
+
+		pthread_mutex_lock(&sd->sd_mtx);
+		sd->sd_lastio = ssd_now();
+		s = ssd_lookup(sd, line);
+		sm = (s != SSD_NIL) ? &sd->sd_meta[s] : NULL;
+		/*
+		 * Lines dirty in the file take writes in either mode, so
+		 * a dirty line found after a crash is never older than
+		 * the disk.
+		 */
+		if (sm != NULL && (sm->sm_flags & SSD_VALID) && (!write ||
+		    sd->sd_writeback ||
+		    (sm->sm_flags & (SSD_DIRTY | SSD_WASDIRTY)))) {
+			err = ssd_cache_io(sd, s, iov, iovcnt, done, n, loff,
+			    write);
+			if (err == 0 && write) {
+				if (!(sm->sm_flags & SSD_DIRTY)) {
+					sm->sm_flags |= SSD_DIRTY;
+					sm->sm_flags &= ~((uint32_t) SSD_WASDIRTY);
+					sd->sd_ndirty++;
+					ssd_touch(sd, s);
+				}
+				sd->sd_gen[s]++;
+			}
+			if (sm->sm_freq < 255)
+				sm->sm_freq++;
+			pthread_mutex_unlock(&sd->sd_mtx);
+			if (err == 0 && rlen > 0)
+				err = ssd_run(sd, iov, iovcnt, rstart, rlen, off,
+				    write);
+			rlen = 0;
+			continue;
+		}
+		if (sm == NULL)
+			ssd_heat(sd, line);
+		pthread_mutex_unlock(&sd->sd_mtx);
+		if (rlen == 0)
+			rstart = done;
+		rlen += n;
+	}
+	if (err == 0 && rlen > 0)
+		err = ssd_run(sd, iov, iovcnt, rstart, rlen, off, write);
+	if (err != 0) {
+		errno = err;
+		return (-1);
+	}
+	return ((ssize_t) total);
+}
+
+static ssize_t
+ssd_preadv(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return (ssd_rw(arg, iov, iovcnt, offset, 0));
+}
+
+static ssize_t
+ssd_pwritev(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return (ssd_rw(arg, iov, iovcnt, offset, 1));
+}
+
+/*
+ * Make the slot table on disk match memory: line data first, then the
+ * changed pages.  Evicted slots become reusable once this is done.
+ */
+static int
+ssd_meta_sync(struct blockif_ssd *sd)
+{
+	size_t npages, p, len, tsize;
+	uint32_t k, s, end;
+	int err;
+
+	pthread_mutex_lock(&sd->sd_syncmtx);
+	err = blockif_fdatasync(sd->sd_cfd) ? errno : 0;
+
+	pthread_mutex_lock(&sd->sd_mtx);
+	tsize = sd->sd_nslots * sizeof(struct ssd_meta);
+	npages = (tsize + SSD_PAGE - 1) / SSD_PAGE;
+	for (p = 0; err == 0 && p < npages; p++) {
+		if (!sd->sd_mdirty[p])
+			continue;
+		len = MIN(SSD_PAGE, tsize - p * SSD_PAGE);
+		if (pwrite(sd->sd_cfd, ((uint8_t *) sd->sd_meta) + p * SSD_PAGE,
+		    len, (off_t) (sd->sd_hdr.sh_meta + p * SSD_PAGE)) !=
+		    (ssize_t) len)
+			err = errno ? errno : EIO;
+		else
+			sd->sd_mdirty[p] = 2;
+	}
+	k = sd->sd_npend;
+	pthread_mutex_unlock(&sd->sd_mtx);
+
+	if (err == 0 && blockif_fdatasync(sd->sd_cfd) < 0)
+		err = errno;
+	if (err == 0) {
+		pthread_mutex_lock(&sd->sd_mtx);
+		memcpy(&sd->sd_free[sd->sd_nfree], sd->sd_pend,
+		    k * sizeof(uint32_t));
+		sd->sd_nfree += k;
+		sd->sd_npend -= k;
+		memmove(sd->sd_pend, &sd->sd_pend[k],
+		    sd->sd_npend * sizeof(uint32_t));
+		/* Lines written back are now clean in the file, too */
+		for (p = 0; p < npages; p++) {
+			if (sd->sd_mdirty[p] != 2)
+				continue;
+			sd->sd_mdirty[p] = 0;
+			s = (uint32_t) (p * SSD_PAGE / sizeof(struct ssd_meta));
+			end = MIN(sd->sd_nslots, s + SSD_PAGE /
+			    sizeof(struct ssd_meta));
+			for (; s < end; s++)
+				sd->sd_meta[s].sm_flags &=
+				    ~((uint32_t) SSD_WASDIRTY);
+		}
+		pthread_mutex_unlock(&sd->sd_mtx);
+	}
+	pthread_mutex_unlock(&sd->sd_syncmtx);
+	return (err);
+}
+
+/*
+ * Evict up to SSD_EVICT clean lines, least used first.
+ */
+static uint32_t
+ssd_reclaim(struct blockif_ssd *sd)
+{
+	struct ssd_meta *sm;
+	uint32_t i, s, found;
+
+	found = 0;
+	pthread_mutex_lock(&sd->sd_mtx);
+	for (i = 0; i < 2 * sd->sd_nslots && found < SSD_EVICT; i++) {
+		s = sd->sd_hand;
+		sd->sd_hand = (s + 1) % sd->sd_nslots;
+		sm = &sd->sd_meta[s];
+		if ((sm->sm_flags & (SSD_VALID | SSD_DIRTY)) != SSD_VALID)
+			continue;
+		if (sm->sm_freq > 0) {
+			sm->sm_freq >>= 1;
+			continue;
+		}
+		ssd_hash_remove(sd, s);
+		memset(sm, 0, sizeof(*sm));
+		ssd_touch(sd, s);
+		sd->sd_pend[sd->sd_npend++] = s;
+		found++;
+	}
+	pthread_mutex_unlock(&sd->sd_mtx);
+	if (found > 0 && ssd_meta_sync(sd) != 0)
+		return (0);
+	return (found);
+}
+
+/*
+ * Copy a line of the disk into the cache.  Returns ENOSPC if there is
+ * no free slot.
+ */
+static int
+ssd_fill(struct blockif_ssd *sd, uint64_t line)
+{
+	struct ssd_meta *sm;
+	struct iovec iov;
+	uint32_t s;
+	size_t len;
+	int err;
+
+	pthread_mutex_lock(&sd->sd_mtx);
+	if (ssd_lookup(sd, line) != SSD_NIL) {
+		pthread_mutex_unlock(&sd->sd_mtx);
+		return (0);
+	}
+	if (sd->sd_nfree == 0) {
+		pthread_mutex_unlock(&sd->sd_mtx);
+		return (ENOSPC);
+	}
+	s = sd->sd_free[--sd->sd_nfree];
+	sm = &sd->sd_meta[s];
+	sm->sm_tag = line + 1;
+	sm->sm_flags = SSD_FILLING;
+	sm->sm_freq = 1;
+	ssd_hash_insert(sd, s);
+	pthread_mutex_unlock(&sd->sd_mtx);
+
+	len = ssd_line_len(sd, line);
+	iov.iov_base = sd->sd_buf;
+	iov.iov_len = len;
+	err = ssd_disk_io(sd, &iov, 1, 0, len, (off_t) (line << SSD_SHIFT), 0);
+
+	pthread_mutex_lock(&sd->sd_syncmtx);
+	pthread_mutex_lock(&sd->sd_mtx);
+	if (err == 0 && !(sm->sm_flags & SSD_STALE))
+		err = ssd_cache_io(sd, s, &iov, 1, 0, len, 0, 1);
+	if (err != 0 || (sm->sm_flags & SSD_STALE)) {
+		/* never marked valid on disk, free right away */
+		ssd_hash_remove(sd, s);
+		memset(sm, 0, sizeof(*sm));
+		sd->sd_free[sd->sd_nfree++] = s;
+	} else {
+		sm->sm_flags = SSD_VALID;
+		ssd_touch(sd, s);
+	}
+	pthread_mutex_unlock(&sd->sd_mtx);
+	pthread_mutex_unlock(&sd->sd_syncmtx);
+	return (err);
+}
+
+/*
+ * Write a batch of dirty lines back to the disk.
+ */
+static int
+ssd_destage(struct blockif_ssd *sd)
+{
+	uint32_t slot[SSD_DESTAGE], gen[SSD_DESTAGE], i, n, s, scanned;
+	uint64_t tag[SSD_DESTAGE];
+	struct iovec iov;
+	size_t len;
+	int err;
+
+	err = 0;
+	n = 0;
+	pthread_mutex_lock(&sd->sd_mtx);
+	for (scanned = 0; scanned < sd->sd_nslots && n < SSD_DESTAGE &&
+	    err == 0; scanned++) {
+		s = sd->sd_dhand;
+		sd->sd_dhand = (s + 1) % sd->sd_nslots;
+		if (!(sd->sd_meta[s].sm_flags & SSD_DIRTY))
+			continue;
+		iov.iov_base = sd->sd_buf + ((size_t) n << SSD_SHIFT);
+		iov.iov_len = ssd_line_len(sd, sd->sd_meta[s].sm_tag - 1);
+		err = ssd_cache_io(sd, s, &iov, 1, 0, iov.iov_len, 0, 0);
+		slot[n] = s;
+		gen[n] = sd->sd_gen[s];
+		tag[n] = sd->sd_meta[s].sm_tag;
+		n++;
+	}
+	pthread_mutex_unlock(&sd->sd_mtx);
+
+	/* Delete may free the slots meanwhile, go by the tags taken */
+	for (i = 0; err == 0 && i < n; i++) {
+		len = ssd_line_len(sd, tag[i] - 1);
+		iov.iov_base = sd->sd_buf + ((size_t) i << SSD_SHIFT);
+		iov.iov_len = len;
+		err = ssd_disk_io(sd, &iov, 1, 0, len,
+		    (off_t) ((tag[i] - 1) << SSD_SHIFT), 1);
+	}
+	if (err == 0 && n > 0)
+		err = ssd_disk_flush(sd);
+	if (err != 0)
+		return (err);
+
+	pthread_mutex_lock(&sd->sd_mtx);
+	for (i = 0; i < n; i++) {
+		/* rewritten meanwhile, stays dirty */
+		if (sd->sd_gen[slot[i]] != gen[i])
+			continue;
+		sd->sd_meta[slot[i]].sm_flags &= ~((uint32_t) SSD_DIRTY);
+		sd->sd_meta[slot[i]].sm_flags |= SSD_WASDIRTY;
+		sd->sd_ndirty--;
+		ssd_touch(sd, slot[i]);
+	}
+	pthread_mutex_unlock(&sd->sd_mtx);
+	return (0);
+}
+
+/*
+ * Called with sd_mtx held.
+ */
+static int
+ssd_want_destage(struct blockif_ssd *sd)
+{
+	if (sd->sd_ndirty == 0)
+		return (0);
+	return (!sd->sd_writeback || sd->sd_ndirty > sd->sd_nslots / 2 ||
+	    ssd_now() - sd->sd_lastio >= SSD_IDLE_MS);
+}
+
+static int
+ssd_cmp_line(const void *a, const void *b)
+{
+	uint64_t x, y;
+
+	x = *((const uint64_t *) a);
+	y = *((const uint64_t *) b);
+	return ((x > y) - (x < y));
+}
+
+static void *
+ssd_thread(void *arg)
+{
+	struct blockif_ssd *sd;
+	struct timespec ts;
+	uint32_t i, n;
+	int destage, err;
+
+	sd = arg;
+	for (;;) {
+		pthread_mutex_lock(&sd->sd_mtx);
+		if (!sd->sd_closing && sd->sd_nwarm == 0 &&
+		    !ssd_want_destage(sd)) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 100 * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&sd->sd_cond, &sd->sd_mtx, &ts);
+		}
+		if (sd->sd_closing) {
+			pthread_mutex_unlock(&sd->sd_mtx);
+			break;
+		}
+		n = sd->sd_nwarm;
+		memcpy(sd->sd_wlist, sd->sd_warm, n * sizeof(uint64_t));
+		sd->sd_nwarm = 0;
+		destage = ssd_want_destage(sd);
+		pthread_mutex_unlock(&sd->sd_mtx);
+
+		if (destage && (err = ssd_destage(sd)) != 0) {
+			fprintf(stderr, "%s: write back failed: %s\n",
+			    sd->sd_path, strerror(err));
+			sleep(1);
+		}
+
+		/* Warm in disk order, slow disks like that best */
+		qsort(sd->sd_wlist, n, sizeof(uint64_t), ssd_cmp_line);
+		for (i = 0; i < n; i++) {
+			if (i > 0 && sd->sd_wlist[i] == sd->sd_wlist[i - 1])
+				continue;
+			err = ssd_fill(sd, sd->sd_wlist[i]);
+			if (err == ENOSPC && ssd_reclaim(sd) > 0)
+				err = ssd_fill(sd, sd->sd_wlist[i]);
+			if (err != 0)
+				break;
+		}
+	}
+	return (NULL);
+}
+
+static int
+ssd_flush(void *arg)
+{
+	struct blockif_ssd *sd;
+	int err, sync;
+
+	sd = arg;
+	err = ssd_disk_flush(sd);
+	pthread_mutex_lock(&sd->sd_mtx);
+	sync = sd->sd_writeback || sd->sd_ndirty > 0;
+	pthread_mutex_unlock(&sd->sd_mtx);
+	if (err == 0 && sync)
+		err = ssd_meta_sync(sd);
+	return (err);
+}
+
+/*
+ * Lines wholly inside the range are dropped, partial ones zeroed.
+ */
+static int
+ssd_delete(void *arg, off_t offset, off_t len)
+{
+	struct blockif_ssd *sd;
+	struct ssd_meta *sm;
+	struct iovec iov;
+	uint64_t line;
+	uint32_t s;
+	size_t n, loff;
+	off_t pos;
+	int err;
+
+	sd = arg;
+	if (sd->sd_be == NULL || sd->sd_be->bb_delete == NULL)
+		return (EOPNOTSUPP);
+	if (len == 0)
+		return (sd->sd_be->bb_delete(sd->sd_bearg, 0, 0));
+
+	err = 0;
+	/* sd_buf belongs to the thread, which uses it unlocked */
+	iov.iov_base = ssd_zero;
+	iov.iov_len = SSD_LINE;
+	pthread_mutex_lock(&sd->sd_mtx);
+	for (pos = offset; err == 0 && pos < offset + len; pos += (off_t) n) {
+		line = (uint64_t) pos >> SSD_SHIFT;
+		loff = (size_t) pos & (SSD_LINE - 1);
+		n = (size_t) MIN(offset + len - pos, (off_t) (SSD_LINE - loff));
+		s = ssd_lookup(sd, line);
+		if (s == SSD_NIL)
+			continue;
+		sm = &sd->sd_meta[s];
+		sd->sd_gen[s]++;
+		if (!(sm->sm_flags & SSD_VALID)) {
+			sm->sm_flags |= SSD_STALE;
+		} else if (loff == 0 && n == ssd_line_len(sd, line)) {
+			if (sm->sm_flags & SSD_DIRTY)
+				sd->sd_ndirty--;
+			ssd_hash_remove(sd, s);
+			memset(sm, 0, sizeof(*sm));
+			ssd_touch(sd, s);
+			sd->sd_pend[sd->sd_npend++] = s;
+		} else
+			err = ssd_cache_io(sd, s, &iov, 1, 0, n, loff, 1);
+	}
+	pthread_mutex_unlock(&sd->sd_mtx);
+	if (err == 0)
+		err = sd->sd_be->bb_delete(sd->sd_bearg, offset, len);
+	return (err);
+}
+
+/*
+ * Stop the thread and leave the cache file clean.  Requests may still
+ * be running at exit; any that changes the file afterwards marks it in
+ * use again.
+ */
+static void
+ssd_shutdown(struct blockif_ssd *sd)
+{
+	size_t npages, p;
+	void *jval;
+	int err;
+
+	pthread_mutex_lock(&sd->sd_mtx);
+	if (sd->sd_closing) {
+		pthread_mutex_unlock(&sd->sd_mtx);
+		return;
+	}
+	sd->sd_closing = 1;
+	pthread_cond_signal(&sd->sd_cond);
+	pthread_mutex_unlock(&sd->sd_mtx);
+	pthread_join(sd->sd_tid, &jval);
+
+	err = ssd_meta_sync(sd);
+	pthread_mutex_lock(&sd->sd_mtx);
+	npages = (sd->sd_nslots * sizeof(struct ssd_meta) + SSD_PAGE - 1) /
+	    SSD_PAGE;
+	for (p = 0; p < npages && sd->sd_mdirty[p] != 1; p++)
+		;
+	/* Lines written since the sync are on disk before the header */
+	if (err == 0 && p == npages) {
+		if (blockif_fdatasync(sd->sd_cfd) < 0)
+			err = errno;
+		else
+			err = ssd_write_header(sd, SSD_CLEAN);
+	}
+	pthread_mutex_unlock(&sd->sd_mtx);
+	if (err != 0) {
+		errno = err;
+		perror(sd->sd_path);
+	}
+}
+
+static void
+ssd_exit(void *arg)
+{
+	ssd_shutdown(arg);
+}
+
+static void
+ssd_free(struct blockif_ssd *sd)
+{
+	if (sd->sd_cfd >= 0)
+		close(sd->sd_cfd);
+	free(sd->sd_path);
+	free(sd->sd_meta);
+	free(sd->sd_mdirty);
+	free(sd->sd_gen);
+	free(sd->sd_hash);
+	free(sd->sd_next);
+	free(sd->sd_free);
+	free(sd->sd_pend);
+	free(sd->sd_heat);
+	free(sd->sd_buf);
+	pthread_cond_destroy(&sd->sd_cond);
+	pthread_mutex_destroy(&sd->sd_syncmtx);
+	pthread_mutex_destroy(&sd->sd_mtx);
+	free(sd);
+}
+
+static void
+ssd_close(void *arg)
+{
+	struct blockif_ssd *sd;
+
+	sd = arg;
+	blockif_atexit_remove(&sd->sd_atexit);
+
+	ssd_shutdown(sd);
+	if (sd->sd_be != NULL)
+		sd->sd_be->bb_close(sd->sd_bearg);
+	ssd_free(sd);
+}
+
+const struct blockif_backend blockif_ssd_backend = {
+	.bb_name = "ssdcache",
+	.bb_preadv = ssd_preadv,
+	.bb_pwritev = ssd_pwritev,
+	.bb_flush = ssd_flush,
+	.bb_delete = ssd_delete,
+	.bb_close = ssd_close,
+};
+
+/*
+ * spec is "<file>[:size=<bytes>[k|m|g]][:writeback|:writethrough]";
+ * the file name is cut off at the first colon.
+ */
+static int
+ssd_parse(char *spec, uint64_t *size, int *writeback)
+{
+	char *opt;
+
+	*size = SSD_SIZE_DEF;
+	*writeback = 0;
+	strsep(&spec, ":");
+	while ((opt = strsep(&spec, ":")) != NULL) {
+		if (strcmp(opt, "writeback") == 0) {
+			*writeback = 1;
+			continue;
+		}
+		if (strcmp(opt, "writethrough") == 0) {
+			*writeback = 0;
+			continue;
+		}
+		if (strncmp(opt, "size=", 5) != 0)
+			return (-1);
+		if (expand_number(opt + 5, size) != 0 ||
+		    *size < 16 * SSD_LINE)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Whether the slot table in the file has lines not yet written back.
+ */
+static int
+ssd_pending(struct blockif_ssd *sd)
+{
+	struct ssd_meta page[SSD_PAGE / sizeof(struct ssd_meta)];
+	struct ssd_header *sh;
+	uint64_t i, n, j;
+	ssize_t len;
+
+	sh = &sd->sd_hdr;
+	for (i = 0; i < sh->sh_nslots; i += n) {
+		n = MIN(sh->sh_nslots - i, nitems(page));
+		len = pread(sd->sd_cfd, page, n * sizeof(struct ssd_meta),
+		    (off_t) (sh->sh_meta + i * sizeof(struct ssd_meta)));
+		if (len != (ssize_t) (n * sizeof(struct ssd_meta)))
+			return (0);
+		for (j = 0; j < n; j++)
+			if ((page[j].sm_flags & SSD_VALID) &&
+			    ((page[j].sm_flags & SSD_DIRTY) ||
+			    (sh->sh_state != SSD_CLEAN && sh->sh_writeback)))
+				return (1);
+	}
+	return (0);
+}
+
+/*
+ * Use the slot table in the file if it belongs to this disk, start over
+ * otherwise.
+ */
+static int
+ssd_load(struct blockif_ssd *sd, const char *disk, uint64_t size)
+{
+	struct ssd_header *sh;
+	struct ssd_meta *sm;
+	uint64_t nslots;
+	size_t tsize;
+	uint32_t s;
+	int fresh, unclean;
+
+	sh = &sd->sd_hdr;
+	fresh = pread(sd->sd_cfd, sh, sizeof(*sh), 0) != (ssize_t) sizeof(*sh) ||
+	    memcmp(sh->sh_magic, SSD_MAGIC, sizeof(sh->sh_magic)) != 0 ||
+	    sh->sh_version != SSD_VERSION || sh->sh_nslots == 0 ||
+	    sh->sh_nslots > UINT32_MAX - 1;
+	if (!fresh && (sh->sh_disk_size != (uint64_t) sd->sd_size ||
+	    strncmp(sh->sh_disk, disk, sizeof(sh->sh_disk)) != 0)) {
+		sh->sh_disk[sizeof(sh->sh_disk) - 1] = '\0';
+		if (ssd_pending(sd)) {
+			fprintf(stderr, "%s: holds data not yet written back to "
+			    "%s\n", sd->sd_path, sh->sh_disk);
+			return (-1);
+		}
+		fresh = 1;
+	}
+	unclean = !fresh && sh->sh_state != SSD_CLEAN;
+	if (unclean && !sh->sh_writeback)
+		fprintf(stderr, "%s: not closed cleanly, dropping clean lines\n",
+		    sd->sd_path);
+
+	if (fresh) {
+		nslots = size / (SSD_LINE + sizeof(struct ssd_meta));
+		memset(sh, 0, sizeof(*sh));
+		memcpy(sh->sh_magic, SSD_MAGIC, sizeof(sh->sh_magic));
+		sh->sh_version = SSD_VERSION;
+		sh->sh_state = SSD_CLEAN;
+		sh->sh_nslots = MIN(nslots, UINT32_MAX - 1);
+		sh->sh_meta = SSD_HDR_SIZE;
+		sh->sh_data = roundup2(SSD_HDR_SIZE + sh->sh_nslots *
+		    sizeof(struct ssd_meta), 1024 * 1024);
+		sh->sh_disk_size = (uint64_t) sd->sd_size;
+		strncpy(sh->sh_disk, disk, sizeof(sh->sh_disk) - 1);
+	}
+	sd->sd_nslots = (uint32_t) sh->sh_nslots;
+	tsize = sd->sd_nslots * sizeof(struct ssd_meta);
+
+	sd->sd_meta = calloc(1, tsize);
+	sd->sd_mdirty = calloc(1, (tsize + SSD_PAGE - 1) / SSD_PAGE);
+	sd->sd_gen = calloc(sd->sd_nslots, sizeof(uint32_t));
+	for (sd->sd_hmask = 1; sd->sd_hmask < sd->sd_nslots; sd->sd_hmask <<= 1)
+		;
+	sd->sd_hash = malloc(sd->sd_hmask * sizeof(uint32_t));
+	sd->sd_hmask--;
+	sd->sd_next = calloc(sd->sd_nslots, sizeof(uint32_t));
+	sd->sd_free = calloc(sd->sd_nslots, sizeof(uint32_t));
+	sd->sd_pend = calloc(sd->sd_nslots, sizeof(uint32_t));
+	if (sd->sd_meta == NULL || sd->sd_mdirty == NULL ||
+	    sd->sd_gen == NULL || sd->sd_hash == NULL || sd->sd_next == NULL ||
+	    sd->sd_free == NULL || sd->sd_pend == NULL) {
+		perror("calloc");
+		return (-1);
+	}
+	memset(sd->sd_hash, 0xff, (sd->sd_hmask + 1) * sizeof(uint32_t));
+
+	if (fresh) {
+		if (ftruncate(sd->sd_cfd, 0) < 0 ||
+		    ftruncate(sd->sd_cfd, (off_t) (sh->sh_data +
+		    ((uint64_t) sd->sd_nslots << SSD_SHIFT))) < 0 ||
+		    pwrite(sd->sd_cfd, sd->sd_meta, tsize,
+		    (off_t) sh->sh_meta) != (ssize_t) tsize) {
+			perror(sd->sd_path);
+			return (-1);
+		}
+	} else if (pread(sd->sd_cfd, sd->sd_meta, tsize, (off_t) sh->sh_meta) !=
+	    (ssize_t) tsize) {
+		perror(sd->sd_path);
+		return (-1);
+	}
+
+	for (s = sd->sd_nslots; s-- > 0;) {
+		sm = &sd->sd_meta[s];
+		sm->sm_flags &= SSD_VALID | SSD_DIRTY;
+		/*
+		 * After a crash, the lines of a write-back cache may be
+		 * newer than the disk, the clean ones of a write-through
+		 * cache older.
+		 */
+		if (unclean && sh->sh_writeback)
+			sm->sm_flags |= SSD_DIRTY;
+		if (!(sm->sm_flags & SSD_VALID) || sm->sm_tag == 0 ||
+		    sm->sm_tag - 1 >= (sh->sh_disk_size + SSD_LINE - 1) >>
+		    SSD_SHIFT || ssd_lookup(sd, sm->sm_tag - 1) != SSD_NIL ||
+		    (unclean && !(sm->sm_flags & SSD_DIRTY))) {
+			memset(sm, 0, sizeof(*sm));
+			sd->sd_free[sd->sd_nfree++] = s;
+			continue;
+		}
+		if (sm->sm_flags & SSD_DIRTY)
+			sd->sd_ndirty++;
+		ssd_hash_insert(sd, s);
+	}
+	if (unclean)
+		memset(sd->sd_mdirty, 1, (tsize + SSD_PAGE - 1) / SSD_PAGE);
+	sh->sh_writeback = (uint32_t) sd->sd_writeback;
+	return (0);
+}
+
+void *
+blockif_ssd_open(const char *spec, const char *disk,
+	const struct blockif_backend *be, void *bearg, int fd, off_t size,
+	int writeable)
+{
+	struct blockif_ssd *sd;
+	uint64_t csize;
+	char *copy;
+
+	copy = strdup(spec);
+	if (copy == NULL)
+		return (NULL);
+	sd = calloc(1, sizeof(struct blockif_ssd));
+	if (sd == NULL) {
+		free(copy);
+		return (NULL);
+	}
+	sd->sd_cfd = -1;
+	sd->sd_path = copy;
+	pthread_mutex_init(&sd->sd_mtx, NULL);
+	pthread_mutex_init(&sd->sd_syncmtx, NULL);
+	pthread_cond_init(&sd->sd_cond, NULL);
+	if (ssd_parse(copy, &csize, &sd->sd_writeback) < 0) {
+		fprintf(stderr, "Invalid SSD cache \"%s\"\n", spec);
+		goto fail;
+	}
+	/* Nothing to write back on a read-only disk */
+	sd->sd_writeback &= writeable;
+	sd->sd_be = be;
+	sd->sd_bearg = bearg;
+	sd->sd_fd = fd;
+	sd->sd_size = size;
+
+	sd->sd_cfd = open(sd->sd_path, O_RDWR | O_CREAT, 0644);
+	if (sd->sd_cfd < 0) {
+		perror(sd->sd_path);
+		goto fail;
+	}
+	if (flock(sd->sd_cfd, LOCK_EX | LOCK_NB) < 0) {
+		fprintf(stderr, "%s: in use by a running VM\n", sd->sd_path);
+		goto fail;
+	}
+	if (ssd_load(sd, disk, csize) < 0)
+		goto fail;
+	if (!writeable && sd->sd_ndirty > 0) {
+		fprintf(stderr, "%s: holds data not yet written back, the disk "
+		    "must be writeable\n", sd->sd_path);
+		goto fail;
+	}
+	sd->sd_heat = calloc(SSD_HEAT, sizeof(struct ssd_heat));
+	sd->sd_buf = malloc(SSD_DESTAGE * SSD_LINE);
+	if (sd->sd_heat == NULL || sd->sd_buf == NULL) {
+		perror("malloc");
+		goto fail;
+	}
+	if (ssd_meta_sync(sd) != 0 || ssd_write_header(sd, SSD_INUSE) != 0) {
+		perror(sd->sd_path);
+		goto fail;
+	}
+	if (pthread_create(&sd->sd_tid, NULL, ssd_thread, sd) != 0) {
+		perror("pthread_create");
+		goto fail;
+	}
+	blockif_atexit_add(&sd->sd_atexit, ssd_exit, sd);
+	return (sd);
+
+fail:
+	ssd_free(sd);
+	return (NULL);
+}
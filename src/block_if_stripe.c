@@ -0,0 +1,495 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Disks striped across several backing files, RAID-0 style.
+ *
+ * Guest offset o lives in stripe s = o / size, on member s % n at
+ * offset (s / n) * size + o % size. The stripes a request covers on one
+ * member are adjacent in that member, so every request turns into at
+ * most one vectored transfer per member. These run in parallel on the
+ * threads of the members, except for the first one which the calling
+ * thread does itself. The state of a request lives on the stack of its
+ * caller, so requests from different threads do not wait for each
+ * other.
+ */
+
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if_be.h>
+
+#define STRIPE_SIZE_DEF (1024 * 1024)
+
+#ifndef OFF_MAX
+#define OFF_MAX ((off_t) (~0ULL >> 1))
+#endif
+
+/* Pieces a request can split into before they go to the heap */
+#define STRIPE_IOV_STACK 64
+
+enum stripe_op {
+	SOP_READ,
+	SOP_WRITE,
+	SOP_FLUSH
+};
+
+struct stripe_req;
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+/* The part of a request that falls on one member */
+struct stripe_sub {
+	struct stripe_req *ss_req;
+	struct iovec *ss_iov;
+	int ss_iovcnt;
+	off_t ss_off;
+	int ss_error;
+	STAILQ_ENTRY(stripe_sub) ss_link;
+};
+
+/* One request, on the stack of the calling thread */
+struct stripe_req {
+	enum stripe_op sr_op;
+	int sr_pending; /* subs still with the member threads */
+	struct stripe_sub sr_sub[BLOCKIF_STRIPE_MAX];
+};
+
+struct stripe_member {
+	int sm_fd;
+	pthread_t sm_tid;
+	struct blockif_stripe *sm_st;
+	pthread_cond_t sm_cond;
+	STAILQ_HEAD(, stripe_sub) sm_queue;
+	int sm_exit;
+};
+
+struct blockif_stripe {
+	int st_n;
+	int st_nthreads;
+	uint64_t st_size; /* stripe size */
+	struct stripe_member st_m[BLOCKIF_STRIPE_MAX];
+	pthread_mutex_t st_wmtx; /* member queues and sr_pending */
+	pthread_cond_t st_done;
+};
+#pragma clang diagnostic pop
+
+/*
+ * Run a member's part of the request, resuming short transfers.
+ */
+static int
+stripe_member_io(struct stripe_member *sm, struct stripe_sub *ss)
+{
+	struct iovec *v;
+	ssize_t len;
+	off_t off;
+	int cnt;
+
+	if (ss->ss_req->sr_op == SOP_FLUSH)
+		return (blockif_fdatasync(sm->sm_fd) ? errno : 0);
+
+	v = ss->ss_iov;
+	cnt = ss->ss_iovcnt;
+	off = ss->ss_off;
+	while (cnt > 0) {
+		if (ss->ss_req->sr_op == SOP_WRITE)
+			len = pwritev(sm->sm_fd, v, MIN(cnt, IOV_MAX), off);
+		else
+			len = preadv(sm->sm_fd, v, MIN(cnt, IOV_MAX), off);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			return (errno);
+		if (len == 0) {
+			/* Members are at least as long as their stripes */
+			return (EIO);
+		}
+		off += len;
+		while (cnt > 0 && len >= ((ssize_t) v->iov_len)) {
+			len -= v->iov_len;
+			v++;
+			cnt--;
+		}
+		if (len > 0) {
+			v->iov_base = ((uint8_t *) v->iov_base) + len;
+			v->iov_len -= ((size_t) len);
+		}
+	}
+	return (0);
+}
+
+static void *
+stripe_thread(void *arg)
+{
+	struct stripe_member *sm;
+	struct blockif_stripe *st;
+	struct stripe_sub *ss;
+	int err;
+
+	sm = arg;
+	st = sm->sm_st;
+	pthread_mutex_lock(&st->st_wmtx);
+	for (;;) {
+		while ((ss = STAILQ_FIRST(&sm->sm_queue)) == NULL &&
+		    !sm->sm_exit)
+			pthread_cond_wait(&sm->sm_cond, &st->st_wmtx);
+		if (ss == NULL)
+			break;
+		STAILQ_REMOVE_HEAD(&sm->sm_queue, ss_link);
+		pthread_mutex_unlock(&st->st_wmtx);
+		err = stripe_member_io(sm, ss);
+		pthread_mutex_lock(&st->st_wmtx);
+		ss->ss_error = err;
+		if (--ss->ss_req->sr_pending == 0)
+			pthread_cond_broadcast(&st->st_done);
+	}
+	pthread_mutex_unlock(&st->st_wmtx);
+	return (NULL);
+}
+
+static void
+stripe_sub_add(struct stripe_sub *ss, void *base, size_t len)
+{
+	struct iovec *v;
+
+	/* Merge with the previous piece when contiguous */
+	if (ss->ss_iovcnt > 0) {
+		v = &ss->ss_iov[ss->ss_iovcnt - 1];
+		if (((uint8_t *) v->iov_base) + v->iov_len == base) {
+			v->iov_len += len;
+			return;
+		}
+	}
+	ss->ss_iov[ss->ss_iovcnt].iov_base = base;
+	ss->ss_iov[ss->ss_iovcnt].iov_len = len;
+	ss->ss_iovcnt++;
+}
+
+/*
+ * Walk the request in pieces that do not cross a stripe. Without fill
+ * only count the pieces of every member, with it add them to the
+ * iovecs set up for that count.
+ */
+static void
+stripe_split(struct blockif_stripe *st, struct stripe_req *sr,
+	const struct iovec *iov, int iovcnt, off_t offset, int fill)
+{
+	struct stripe_sub *ss;
+	uint64_t n, off, s, soff;
+	size_t len, vlen;
+	uint8_t *p;
+	int i;
+
+	n = (uint64_t) st->st_n;
+	off = (uint64_t) offset;
+	for (i = 0; i < iovcnt; i++) {
+		p = iov[i].iov_base;
+		vlen = iov[i].iov_len;
+		while (vlen > 0) {
+			s = off / st->st_size;
+			soff = off % st->st_size;
+			len = (size_t) MIN(vlen, st->st_size - soff);
+			ss = &sr->sr_sub[s % n];
+			if (!fill) {
+				ss->ss_iovcnt++;
+			} else {
+				if (ss->ss_iovcnt == 0)
+					ss->ss_off = (off_t) ((s / n) *
+					    st->st_size + soff);
+				stripe_sub_add(ss, p, len);
+			}
+			p += len;
+			vlen -= len;
+			off += len;
+		}
+	}
+}
+
+/*
+ * Hand the subs with work to their member threads, except the first
+ * which runs here, and wait for them. A request that touches a single
+ * member never leaves the calling thread.
+ */
+static int
+stripe_run(struct blockif_stripe *st, struct stripe_req *sr)
+{
+	struct stripe_member *sm;
+	struct stripe_sub *ss;
+	int i, err, self, queued;
+
+	self = -1;
+	queued = 0;
+	for (i = 0; i < st->st_n; i++) {
+		ss = &sr->sr_sub[i];
+		ss->ss_req = sr;
+		ss->ss_error = 0;
+		if (sr->sr_op != SOP_FLUSH && ss->ss_iovcnt == 0)
+			continue;
+		if (self < 0) {
+			self = i;
+			continue;
+		}
+		sm = &st->st_m[i];
+		if (!queued) {
+			pthread_mutex_lock(&st->st_wmtx);
+			sr->sr_pending = 0;
+			queued = 1;
+		}
+		STAILQ_INSERT_TAIL(&sm->sm_queue, ss, ss_link);
+		sr->sr_pending++;
+		pthread_cond_signal(&sm->sm_cond);
+	}
+	if (queued)
+		pthread_mutex_unlock(&st->st_wmtx);
+
+	err = 0;
+	if (self >= 0)
+		err = stripe_member_io(&st->st_m[self], &sr->sr_sub[self]);
+	if (!queued)
+		return (err);
+
+	pthread_mutex_lock(&st->st_wmtx);
+	while (sr->sr_pending > 0)
+		pthread_cond_wait(&st->st_done, &st->st_wmtx);
+	pthread_mutex_unlock(&st->st_wmtx);
+	for (i = 0; i < st->st_n && err == 0; i++)
+		if (i != self)
+			err = sr->sr_sub[i].ss_error;
+	return (err);
+}
+
+static ssize_t
+stripe_rw(void *arg, const struct iovec *iov, int iovcnt, off_t offset,
+	enum stripe_op op)
+{
+	struct iovec stackiov[STRIPE_IOV_STACK], *iovbuf, *v;
+	struct blockif_stripe *st;
+	struct stripe_req sr;
+	ssize_t total;
+	int i, n, err;
+
+	st = arg;
+	sr.sr_op = op;
+	for (i = 0; i < st->st_n; i++)
+		sr.sr_sub[i].ss_iovcnt = 0;
+
+	/* Count the pieces of every member, then carve their iovecs */
+	stripe_split(st, &sr, iov, iovcnt, offset, 0);
+	n = 0;
+	for (i = 0; i < st->st_n; i++)
+		n += sr.sr_sub[i].ss_iovcnt;
+	iovbuf = stackiov;
+	if (n > STRIPE_IOV_STACK) {
+		iovbuf = malloc((size_t) n * sizeof(struct iovec));
+		if (iovbuf == NULL) {
+			errno = ENOMEM;
+			return (-1);
+		}
+	}
+	v = iovbuf;
+	for (i = 0; i < st->st_n; i++) {
+		sr.sr_sub[i].ss_iov = v;
+		v += sr.sr_sub[i].ss_iovcnt;
+		sr.sr_sub[i].ss_iovcnt = 0;
+	}
+	stripe_split(st, &sr, iov, iovcnt, offset, 1);
+
+	err = stripe_run(st, &sr);
+	if (iovbuf != stackiov)
+		free(iovbuf);
+	if (err) {
+		errno = err;
+		return (-1);
+	}
+	total = 0;
+	for (i = 0; i < iovcnt; i++)
+		total += (ssize_t) iov[i].iov_len;
+	return (total);
+}
+
+static ssize_t
+stripe_preadv(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return (stripe_rw(arg, iov, iovcnt, offset, SOP_READ));
+}
+
+static ssize_t
+stripe_pwritev(void *arg, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return (stripe_rw(arg, iov, iovcnt, offset, SOP_WRITE));
+}
+
+static int
+stripe_flush(void *arg)
+{
+	struct blockif_stripe *st;
+	struct stripe_req sr;
+
+	st = arg;
+	sr.sr_op = SOP_FLUSH;
+	return (stripe_run(st, &sr));
+}
+
+static void
+stripe_close(void *arg)
+{
+	struct blockif_stripe *st;
+	struct stripe_member *sm;
+	int i;
+
+	st = arg;
+	pthread_mutex_lock(&st->st_wmtx);
+	for (i = 0; i < st->st_nthreads; i++) {
+		st->st_m[i].sm_exit = 1;
+		pthread_cond_signal(&st->st_m[i].sm_cond);
+	}
+	pthread_mutex_unlock(&st->st_wmtx);
+	for (i = 0; i < st->st_n; i++) {
+		sm = &st->st_m[i];
+		if (i < st->st_nthreads)
+			pthread_join(sm->sm_tid, NULL);
+		if (sm->sm_fd >= 0)
+			close(sm->sm_fd);
+		pthread_cond_destroy(&sm->sm_cond);
+	}
+	pthread_mutex_destroy(&st->st_wmtx);
+	pthread_cond_destroy(&st->st_done);
+	free(st);
+}
+
+const struct blockif_backend blockif_stripe_backend = {
+	.bb_name = "stripe",
+	.bb_preadv = stripe_preadv,
+	.bb_pwritev = stripe_pwritev,
+	.bb_flush = stripe_flush,
+	.bb_close = stripe_close,
+};
+
+/*
+ * spec is "stripe" or "stripe:size=<bytes>[k|m|g]".
+ */
+static int
+stripe_parse_size(const char *spec, uint64_t *size)
+{
+	*size = STRIPE_SIZE_DEF;
+	if (strcmp(spec, "stripe") == 0)
+		return (0);
+	if (strncmp(spec, "stripe:size=", 12) != 0)
+		return (-1);
+	if (expand_number(spec + 12, size) != 0 || *size < 4096 ||
+	    !powerof2(*size))
+		return (-1);
+	return (0);
+}
+
+int
+blockif_stripe_probe(const char *path)
+{
+	return (strcmp(path, "stripe") == 0 ||
+	    strncmp(path, "stripe:", 7) == 0);
+}
+
+void *
+blockif_stripe_open(const char *spec, char **paths, int n, int ro,
+	int nocache, off_t *size)
+{
+	struct blockif_stripe *st;
+	struct stripe_member *sm;
+	struct stat sbuf;
+	off_t msize;
+	int i;
+
+	if (n < 1 || n > BLOCKIF_STRIPE_MAX) {
+		fprintf(stderr, "A stripe needs 1 to %d files\n",
+		    BLOCKIF_STRIPE_MAX);
+		return (NULL);
+	}
+	st = calloc(1, sizeof(struct blockif_stripe));
+	if (st == NULL)
+		return (NULL);
+	if (stripe_parse_size(spec, &st->st_size) < 0) {
+		fprintf(stderr, "Invalid stripe \"%s\"\n", spec);
+		free(st);
+		return (NULL);
+	}
+	st->st_n = n;
+	pthread_mutex_init(&st->st_wmtx, NULL);
+	pthread_cond_init(&st->st_done, NULL);
+	for (i = 0; i < n; i++) {
+		st->st_m[i].sm_fd = -1;
+		pthread_cond_init(&st->st_m[i].sm_cond, NULL);
+		STAILQ_INIT(&st->st_m[i].sm_queue);
+	}
+
+	/* The disk ends with the last stripe every member can hold */
+	msize = OFF_MAX;
+	for (i = 0; i < n; i++) {
+		sm = &st->st_m[i];
+		sm->sm_st = st;
+		sm->sm_fd = open(paths[i], ro ? O_RDONLY : O_RDWR);
+		if (sm->sm_fd < 0 || fstat(sm->sm_fd, &sbuf) < 0) {
+			perror(paths[i]);
+			goto err;
+		}
+#ifdef F_NOCACHE
+		if (nocache && fcntl(sm->sm_fd, F_NOCACHE, 1) < 0) {
+			perror(paths[i]);
+			goto err;
+		}
+#else
+		(void) nocache;
+#endif
+		msize = MIN(msize, sbuf.st_size);
+		if (pthread_create(&sm->sm_tid, NULL, stripe_thread, sm) != 0) {
+			perror("pthread_create");
+			goto err;
+		}
+		st->st_nthreads++;
+	}
+	*size = (off_t) (((uint64_t) msize / st->st_size) * st->st_size *
+	    (uint64_t) n);
+	if (*size == 0) {
+		fprintf(stderr, "Stripe files are smaller than one stripe\n");
+		goto err;
+	}
+	return (st);
+err:
+	stripe_close(st);
+	return (NULL);
+}
@@ -0,0 +1,235 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Capture of the requests to a disk.
+ *
+ *   trace=<file>
+ *
+ * Every request is recorded when it completes, with the time it was
+ * submitted, the number of requests in flight then and its latency, in
+ * the format of block_if_trace.h.  Records are collected in a buffer of
+ * TR_BUFRECS and written out whenever it fills up and on close, so
+ * tracing costs a clock read per request and a write per TR_BUFRECS.
+ * The write goes on outside the lock while records fill a second
+ * buffer, so requests completing meanwhile do not wait for it.
+ * blockif-replay issues a trace against any disk.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xhyve/support/misc.h>
+#include <xhyve/block_if_be.h>
+#include <xhyve/block_if_trace.h>
+
+#define TR_BUFRECS 4096
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+struct blockif_trace {
+	struct blockif_atexit tr_atexit;
+	char *tr_path;
+	int tr_fd;
+	int tr_failed;
+	uint64_t tr_start;
+	uint32_t tr_nrecs;
+	struct blockif_trace_rec *tr_buf;
+	struct blockif_trace_rec *tr_spare; /* NULL while being written */
+	pthread_mutex_t tr_mtx;
+	pthread_cond_t tr_cond;
+};
+#pragma clang diagnostic pop
+
+
+uint64_t
+blockif_trace_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec);
+}
+
+static int
+tr_write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return (-1);
+		buf = ((const uint8_t *) buf) + n;
+		len -= (size_t) n;
+	}
+	return (0);
+}
+
+/*
+ * Write out the buffer.  Called with tr_mtx held, which is dropped for
+ * the write once the spare buffer has taken over; one write is under
+ * way at a time, so records reach the file in order.  A trace that
+ * cannot be written is given up, the disk carries on.
+ */
+static void
+tr_drain(struct blockif_trace *tr)
+{
+	struct blockif_trace_rec *buf;
+	uint32_t n;
+
+	while (tr->tr_spare == NULL)
+		pthread_cond_wait(&tr->tr_cond, &tr->tr_mtx);
+	buf = tr->tr_buf;
+	n = tr->tr_nrecs;
+	tr->tr_buf = tr->tr_spare;
+	tr->tr_spare = NULL;
+	tr->tr_nrecs = 0;
+	pthread_mutex_unlock(&tr->tr_mtx);
+
+	/* tr_failed is only used by the one writer */
+	if (n > 0 && !tr->tr_failed && tr_write_full(tr->tr_fd, buf,
+	    n * sizeof(struct blockif_trace_rec)) < 0) {
+		perror(tr->tr_path);
+		tr->tr_failed = 1;
+	}
+
+	pthread_mutex_lock(&tr->tr_mtx);
+	tr->tr_spare = buf;
+	pthread_cond_broadcast(&tr->tr_cond);
+}
+
+/*
+ * Record a completed request submitted at start, a blockif_trace_clock()
+ * value, with qd requests in flight.
+ */
+void
+blockif_trace_record(struct blockif_trace *tr, int op, off_t off, size_t len,
+	uint64_t start, int qd, int err)
+{
+	struct blockif_trace_rec *rec;
+	uint64_t now;
+
+	now = blockif_trace_clock();
+	pthread_mutex_lock(&tr->tr_mtx);
+	/* Both buffers full, wait for the write */
+	while (tr->tr_nrecs == TR_BUFRECS)
+		pthread_cond_wait(&tr->tr_cond, &tr->tr_mtx);
+	rec = &tr->tr_buf[tr->tr_nrecs++];
+	memset(rec, 0, sizeof(*rec));
+	rec->tr_time = start - tr->tr_start;
+	rec->tr_off = (uint64_t) off;
+	rec->tr_len = (uint32_t) len;
+	rec->tr_lat = (uint32_t) MIN((now - start) / 1000, UINT32_MAX);
+	rec->tr_qd = (uint16_t) MIN(qd, UINT16_MAX);
+	rec->tr_op = (uint8_t) op;
+	rec->tr_err = (uint8_t) MIN(err, UINT8_MAX);
+	if (tr->tr_nrecs == TR_BUFRECS)
+		tr_drain(tr);
+	pthread_mutex_unlock(&tr->tr_mtx);
+}
+
+/*
+ * VMs exit without closing their disks, keep the tail of the traces.
+ */
+static void
+tr_exit(void *arg)
+{
+	struct blockif_trace *tr;
+
+	tr = arg;
+	pthread_mutex_lock(&tr->tr_mtx);
+	tr_drain(tr);
+	pthread_mutex_unlock(&tr->tr_mtx);
+}
+
+struct blockif_trace *
+blockif_trace_open(const char *path, off_t size, int sectsz)
+{
+	struct blockif_trace_header th;
+	struct blockif_trace *tr;
+
+	tr = calloc(1, sizeof(struct blockif_trace));
+	if (tr == NULL) {
+		perror("calloc");
+		return (NULL);
+	}
+	tr->tr_path = strdup(path);
+	tr->tr_buf = calloc(TR_BUFRECS, sizeof(struct blockif_trace_rec));
+	tr->tr_spare = calloc(TR_BUFRECS, sizeof(struct blockif_trace_rec));
+	tr->tr_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	memset(&th, 0, sizeof(th));
+	memcpy(th.th_magic, BLOCKIF_TRACE_MAGIC, sizeof(th.th_magic));
+	th.th_version = BLOCKIF_TRACE_VERSION;
+	th.th_sectsz = (uint32_t) sectsz;
+	th.th_size = (uint64_t) size;
+	th.th_time = (uint64_t) time(NULL);
+	if (tr->tr_path == NULL || tr->tr_buf == NULL ||
+	    tr->tr_spare == NULL || tr->tr_fd < 0 ||
+	    tr_write_full(tr->tr_fd, &th, sizeof(th)) < 0) {
+		perror(path);
+		if (tr->tr_fd >= 0)
+			close(tr->tr_fd);
+		free(tr->tr_path);
+		free(tr->tr_buf);
+		free(tr->tr_spare);
+		free(tr);
+		return (NULL);
+	}
+	tr->tr_start = blockif_trace_clock();
+	pthread_mutex_init(&tr->tr_mtx, NULL);
+	pthread_cond_init(&tr->tr_cond, NULL);
+	blockif_atexit_add(&tr->tr_atexit, tr_exit, tr);
+	return (tr);
+}
+
+void
+blockif_trace_close(struct blockif_trace *tr)
+{
+	blockif_atexit_remove(&tr->tr_atexit);
+
+	pthread_mutex_lock(&tr->tr_mtx);
+	tr_drain(tr);
+	pthread_mutex_unlock(&tr->tr_mtx);
+	pthread_cond_destroy(&tr->tr_cond);
+	pthread_mutex_destroy(&tr->tr_mtx);
+	close(tr->tr_fd);
+	free(tr->tr_path);
+	free(tr->tr_buf);
+	free(tr->tr_spare);
+	free(tr);
+}
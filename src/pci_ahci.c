@@ -54,7 +54,14 @@
 #include <xhyve/block_if.h>
 #include <xhyve/ahci.h>
 
-#define	MAX_PORTS	6	/* Intel ICH8 AHCI supports 6 ports */
+#define	MAX_PORTS	32	/* AHCI supports up to 32 ports */
+#define	DEF_PORTS	6	/* Intel ICH8 AHCI supports 6 ports */
+
+#define	AHCI_NCQ_USECS	100	/* default NCQ completion coalescing delay */
+
+#define	ATAPI_CACHE_SEG	(256 * 1024)	/* read cache segment */
+#define	ATAPI_CACHE_MB	8	/* default read cache size */
+#define	ATAPI_CACHE_RA	8	/* segments read ahead of the guest */
 
 #define	PxSIG_ATA	0x00000101 /* ATA drive */
 #define	PxSIG_ATAPI	0xeb140101 /* ATAPI drive */
@@ -131,6 +138,35 @@ struct ahci_ioreq {
 	int more;
 };
 
+/*
+ * ATAPI read cache, see atapi_cache_read(). Segments are direct mapped
+ * by their offset in the media and filled asynchronously through blockif.
+ */
+enum atapi_seg_state {
+	SEG_EMPTY,
+	SEG_FILLING,
+	SEG_VALID
+};
+
+struct atapi_cache_seg {
+	struct blockif_req acs_req;
+	struct ahci_port *acs_pr;
+	enum atapi_seg_state acs_state;
+	uint64_t acs_tag; /* media offset / ATAPI_CACHE_SEG */
+	size_t acs_len;
+	uint8_t *acs_buf;
+};
+
+struct atapi_cache {
+	int ac_nseg;
+	struct atapi_cache_seg *ac_seg;
+	uint64_t ac_next; /* end of the previous guest read */
+	/* the command waiting for a segment being filled */
+	int ac_wait;
+	int ac_wslot;
+	uint8_t *ac_wcfis;
+};
+
 #define AHCI_PORT_IDENT 20 + 1
 struct ahci_port {
 	struct blockif_ctxt *bctx;
@@ -148,6 +184,8 @@ struct ahci_port {
 	uint8_t asc;
 	u_int ccs;
 	uint32_t pending;
+	uint32_t sdb_done; /* NCQ tags completed but not yet reported */
+	struct atapi_cache *rcache;
 
 	uint32_t clb;
 	uint32_t clbu;
@@ -207,12 +245,22 @@ struct pci_ahci_softc {
 	uint32_t cap2;
 	uint32_t bohc;
 	uint32_t lintr;
+	int intr_hold; /* defer interrupts while several ports update */
+	int intr_held;
 	struct ahci_port port[MAX_PORTS];
+	/* NCQ completion coalescing, see ahci_ncq_done() */
+	int ncq_usecs;
+	int ncq_armed;
+	struct timespec ncq_delay;
+	pthread_cond_t ncq_cond;
+	pthread_t ncq_tid;
 };
 
 #pragma clang diagnostic pop
 
 static void ahci_handle_port(struct ahci_port *p);
+static void atapi_read(struct ahci_port *p, int slot, uint8_t *cfis,
+	uint32_t done);
 
 static inline void lba_to_msf(uint8_t *buf, int lba)
 {
@@ -238,11 +286,16 @@ ahci_generate_intr(struct pci_ahci_softc *sc)
 		struct ahci_port *pr;
 		pr = &sc->port[i];
 		if (pr->is & pr->ie)
-			sc->is |= (1 << i);
+			sc->is |= (1U << i);
 	}
 
 	DPRINTF("%s %x\n", __func__, sc->is);
 
+	if (sc->intr_hold) {
+		sc->intr_held = 1;
+		return;
+	}
+
 	if (sc->is && (sc->ghc & AHCI_GHC_IE)) {		
 		if (pci_msi_enabled(pi)) {
 			/*
@@ -320,6 +373,10 @@ ahci_write_fis_piosetup(struct ahci_port *p)
 	ahci_write_fis(p, FIS_TYPE_PIOSETUP, fis);
 }
 
+/*
+ * On success all tags collected in sdb_done are reported at once,
+ * on error only the failing slot is.
+ */
 static void
 ahci_write_fis_sdb(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 {
@@ -339,14 +396,81 @@ ahci_write_fis_sdb(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 		p->err_cfis[3] = error;
 		memcpy(&p->err_cfis[4], cfis + 4, 16);
 	} else {
-		*(uint32_t *)((void *) (fis + 4)) = (1 << slot);
-		p->sact &= ~(1 << slot);
+		*(uint32_t *)((void *) (fis + 4)) = p->sdb_done;
+		p->sact &= ~p->sdb_done;
+		p->sdb_done = 0;
 	}
 	p->tfd &= ~((unsigned) 0x77);
 	p->tfd |= tfd;
 	ahci_write_fis(p, FIS_TYPE_SETDEVBITS, fis);
 }
 
+static void
+ahci_ncq_flush(struct ahci_port *p)
+{
+	if (p->sdb_done != 0)
+		ahci_write_fis_sdb(p, 0, NULL, ATA_S_READY | ATA_S_DSC);
+}
+
+/*
+ * Complete an NCQ command.  Successful tags are collected and returned
+ * in a single Set Device Bits FIS, i.e. with one interrupt.  The FIS is
+ * sent right away once no other queued command is outstanding on the
+ * port (or if coalescing is disabled); otherwise the coalescing thread
+ * is armed to send it when the latency cap expires.  Errors flush the
+ * batch and are reported immediately.
+ */
+static void
+ahci_ncq_done(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
+{
+	struct pci_ahci_softc *sc;
+
+	sc = p->pr_sc;
+	if (tfd & ATA_S_ERROR) {
+		ahci_ncq_flush(p);
+		ahci_write_fis_sdb(p, slot, cfis, tfd);
+		return;
+	}
+	p->sdb_done |= (1U << slot);
+	if ((p->sact & ~p->sdb_done) == 0 || sc->ncq_usecs == 0)
+		ahci_ncq_flush(p);
+	else if (!sc->ncq_armed) {
+		sc->ncq_armed = 1;
+		pthread_cond_signal(&sc->ncq_cond);
+	}
+}
+
+static void *
+ahci_ncq_thread(void *arg)
+{
+	struct pci_ahci_softc *sc;
+	int i;
+
+	sc = arg;
+	pthread_mutex_lock(&sc->mtx);
+	for (;;) {
+		while (!sc->ncq_armed)
+			pthread_cond_wait(&sc->ncq_cond, &sc->mtx);
+		pthread_cond_timedwait_relative_np(&sc->ncq_cond, &sc->mtx,
+			&sc->ncq_delay);
+		/*
+		 * Ports flushed in the meantime have nothing to report, the
+		 * others share a single interrupt.
+		 */
+		sc->ncq_armed = 0;
+		sc->intr_hold = 1;
+		for (i = 0; i < sc->ports; i++)
+			ahci_ncq_flush(&sc->port[i]);
+		sc->intr_hold = 0;
+		if (sc->intr_held) {
+			sc->intr_held = 0;
+			ahci_generate_intr(sc);
+		}
+	}
+
+	return (NULL);
+}
+
 static void
 ahci_write_fis_d2h(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t tfd)
 {
@@ -426,6 +550,7 @@ ahci_check_stopped(struct ahci_port *p)
 			p->cmd &= ~((unsigned) (AHCI_P_CMD_CR | AHCI_P_CMD_CCS_MASK));
 			p->ci = 0;
 			p->sact = 0;
+			p->sdb_done = 0;
 			p->waitforclear = 0;
 		}
 	}
@@ -440,7 +565,11 @@ ahci_port_stop(struct ahci_port *p)
 	int ncq;
 	int error;
 
-	ncq = 0;
+	if (p->rcache != NULL && p->rcache->ac_wait) {
+		p->rcache->ac_wait = 0;
+		p->pending &= ~(1U << p->rcache->ac_wslot);
+		p->ci &= ~(1U << p->rcache->ac_wslot);
+	}
 
 	TAILQ_FOREACH(aior, &p->iobhd, io_blist) {
 		/*
@@ -450,6 +579,7 @@ ahci_port_stop(struct ahci_port *p)
 		if (error != 0)
 			continue;
 
+		ncq = 0;
 		slot = aior->slot;
 		cfis = aior->cfis;
 		if (cfis[2] == ATA_WRITE_FPDMA_QUEUED ||
@@ -488,6 +618,7 @@ ahci_port_reset(struct ahci_port *pr)
 {
 	pr->serr = 0;
 	pr->sact = 0;
+	pr->sdb_done = 0;
 	pr->xfermode = ATA_UDMA6;
 	pr->mult_sectors = 128;
 
@@ -961,20 +1092,26 @@ handle_identify(struct ahci_port *p, int slot, uint8_t *cfis)
 		buf[67] = 120;
 		buf[68] = 120;
 		buf[69] = 0;
-		buf[75] = 31;
+		buf[75] = (uint16_t) ((p->pr_sc->cap & AHCI_CAP_NCS) >>
+			AHCI_CAP_NCS_SHIFT);
 		buf[76] = (ATA_SATA_GEN1 | ATA_SATA_GEN2 | ATA_SATA_GEN3 |
 			   ATA_SUPPORT_NCQ);
 		buf[77] = (ATA_SUPPORT_RCVSND_FPDMA_QUEUED |
 			   (p->ssts & ATA_SS_SPD_MASK) >> 3);
 		buf[80] = 0x3f0;
 		buf[81] = 0x28;
-		buf[82] = (ATA_SUPPORT_POWERMGT | ATA_SUPPORT_WRITECACHE|
-			   ATA_SUPPORT_LOOKAHEAD | ATA_SUPPORT_NOP);
+		buf[82] = (ATA_SUPPORT_POWERMGT | ATA_SUPPORT_LOOKAHEAD |
+			   ATA_SUPPORT_NOP);
+		/* as virtio-blk: unsafe disks have no write cache to manage */
+		if (blockif_cache_mode(p->bctx) != BLOCKIF_CACHE_UNSAFE)
+			buf[82] |= ATA_SUPPORT_WRITECACHE;
 		buf[83] = (ATA_SUPPORT_ADDRESS48 | ATA_SUPPORT_FLUSHCACHE |
 			   ATA_SUPPORT_FLUSHCACHE48 | 1 << 14);
 		buf[84] = (1 << 14);
-		buf[85] = (ATA_SUPPORT_POWERMGT | ATA_SUPPORT_WRITECACHE|
-			   ATA_SUPPORT_LOOKAHEAD | ATA_SUPPORT_NOP);
+		buf[85] = (ATA_SUPPORT_POWERMGT | ATA_SUPPORT_LOOKAHEAD |
+			   ATA_SUPPORT_NOP);
+		if (blockif_get_wce(p->bctx))
+			buf[85] |= ATA_SUPPORT_WRITECACHE;
 		buf[86] = (ATA_SUPPORT_ADDRESS48 | ATA_SUPPORT_FLUSHCACHE |
 			   ATA_SUPPORT_FLUSHCACHE48 | 1 << 15);
 		buf[87] = (1 << 14);
@@ -1356,6 +1493,165 @@ atapi_report_luns(struct ahci_port *p, int slot, uint8_t *cfis)
 	ahci_write_fis_d2h(p, slot, cfis, ATA_S_READY | ATA_S_DSC);
 }
 
+static struct atapi_cache_seg *
+atapi_cache_seg(struct atapi_cache *ac, uint64_t tag)
+{
+	return (&ac->ac_seg[tag % ((uint64_t) ac->ac_nseg)]);
+}
+
+/*
+ * blockif callback for segment fills, runs in the blockif i/o thread
+ */
+static void
+atapi_cache_cb(struct blockif_req *br, int err)
+{
+	struct atapi_cache_seg *s;
+	struct atapi_cache *ac;
+	struct ahci_port *p;
+	struct pci_ahci_softc *sc;
+
+	s = br->br_param;
+	p = s->acs_pr;
+	ac = p->rcache;
+	sc = p->pr_sc;
+
+	pthread_mutex_lock(&sc->mtx);
+	s->acs_state = (err == 0 && br->br_resid == 0) ? SEG_VALID : SEG_EMPTY;
+	if (ac->ac_wait) {
+		/* Retry the waiting command, it may now be a hit */
+		ac->ac_wait = 0;
+		p->pending &= ~(1U << ac->ac_wslot);
+		atapi_read(p, ac->ac_wslot, ac->ac_wcfis, 0);
+		ahci_check_stopped(p);
+		ahci_handle_port(p);
+	}
+	pthread_mutex_unlock(&sc->mtx);
+}
+
+static void
+atapi_cache_fill(struct ahci_port *p, uint64_t tag)
+{
+	struct atapi_cache_seg *s;
+	struct blockif_req *br;
+	uint64_t off, size;
+
+	s = atapi_cache_seg(p->rcache, tag);
+	if (s->acs_state == SEG_FILLING ||
+	    (s->acs_state == SEG_VALID && s->acs_tag == tag))
+		return;
+	off = tag * ATAPI_CACHE_SEG;
+	size = (uint64_t) blockif_size(p->bctx);
+	if (off >= size)
+		return;
+
+	s->acs_tag = tag;
+	s->acs_len = (size_t) MIN(ATAPI_CACHE_SEG, size - off);
+	s->acs_state = SEG_FILLING;
+	br = &s->acs_req;
+	br->br_iov[0].iov_base = s->acs_buf;
+	br->br_iov[0].iov_len = s->acs_len;
+	br->br_iovcnt = 1;
+	br->br_offset = (off_t) off;
+	br->br_resid = (ssize_t) s->acs_len;
+	if (blockif_read(p->bctx, br) != 0)
+		s->acs_state = SEG_EMPTY;
+}
+
+/*
+ * Copy [off, off + len) from the cache straight into the PRDT segments
+ * of the command, return the number of bytes transferred.
+ */
+static uint32_t
+atapi_cache_copy(struct ahci_port *p, uint8_t *cfis, uint16_t prdtl,
+	uint64_t off, uint32_t len)
+{
+	struct ahci_prdt_entry *prdt;
+	struct atapi_cache_seg *s;
+	uint32_t dbcsz, n, done;
+	size_t soff;
+	uint8_t *ptr;
+	int i;
+
+	done = 0;
+	prdt = (struct ahci_prdt_entry *)((void *) (cfis + 0x80));
+	for (i = 0; i < prdtl && done < len; i++, prdt++) {
+		dbcsz = MIN((prdt->dbc & DBCMASK) + 1, len - done);
+		ptr = paddr_guest2host(prdt->dba, dbcsz);
+		while (dbcsz > 0) {
+			s = atapi_cache_seg(p->rcache, off / ATAPI_CACHE_SEG);
+			soff = (size_t) (off % ATAPI_CACHE_SEG);
+			n = (uint32_t) MIN(dbcsz, s->acs_len - soff);
+			memcpy(ptr, s->acs_buf + soff, n);
+			ptr += n;
+			off += n;
+			dbcsz -= n;
+			done += n;
+		}
+	}
+	return (done);
+}
+
+/*
+ * Serve a read from the cache if possible.  Sequential reads keep up to
+ * ATAPI_CACHE_RA segments beyond the guest's position being filled, so
+ * an install reading the media front to back mostly hits.  A read of
+ * segments that are still being filled waits for them rather than
+ * reading the same data again.  Returns 0 if the read has to go to
+ * blockif.
+ */
+static int
+atapi_cache_read(struct ahci_port *p, int slot, uint8_t *cfis, uint64_t off,
+	uint32_t len)
+{
+	struct atapi_cache *ac;
+	struct atapi_cache_seg *s;
+	struct ahci_cmd_hdr *hdr;
+	uint64_t tag, first, last;
+	int i, hit, filling, seq, ra;
+
+	ac = p->rcache;
+	seq = (off == ac->ac_next);
+	ac->ac_next = off + len;
+
+	first = off / ATAPI_CACHE_SEG;
+	last = (off + len - 1) / ATAPI_CACHE_SEG;
+	hit = (last - first) < ((uint64_t) ac->ac_nseg);
+	filling = 0;
+	for (tag = first; hit && tag <= last; tag++) {
+		s = atapi_cache_seg(ac, tag);
+		if (s->acs_tag != tag || s->acs_state == SEG_EMPTY)
+			hit = 0;
+		else if (s->acs_state == SEG_FILLING)
+			filling = 1;
+		else if (MIN(off + len, (tag + 1) * ATAPI_CACHE_SEG) >
+		    tag * ATAPI_CACHE_SEG + s->acs_len)
+			hit = 0;
+	}
+
+	if (hit && filling) {
+		ac->ac_wait = 1;
+		ac->ac_wslot = slot;
+		ac->ac_wcfis = cfis;
+		p->pending |= 1U << slot;
+	} else if (hit) {
+		hdr = (struct ahci_cmd_hdr *)
+			((void *) (p->cmd_lst + slot * AHCI_CL_SIZE));
+		hdr->prdbc = atapi_cache_copy(p, cfis, hdr->prdtl, off, len);
+		cfis[4] = (cfis[4] & ~7) | ATA_I_CMD | ATA_I_IN;
+		ahci_write_fis_d2h(p, slot, cfis, ATA_S_READY | ATA_S_DSC);
+	}
+
+	/* Read ahead without evicting what a waiting command needs */
+	if (seq || hit) {
+		ra = MIN(ATAPI_CACHE_RA, ac->ac_nseg / 2);
+		if (hit)
+			ra = MIN(ra, ac->ac_nseg - ((int) (last - first)) - 1);
+		for (i = 0; i < ra; i++)
+			atapi_cache_fill(p, last + 1 + ((uint64_t) i));
+	}
+	return (hit);
+}
+
 static void
 atapi_read(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t done)
 {
@@ -1382,10 +1678,15 @@ atapi_read(struct ahci_port *p, int slot, uint8_t *cfis, uint32_t done)
 	if (len == 0) {
 		cfis[4] = (cfis[4] & ~7) | ATA_I_CMD | ATA_I_IN;
 		ahci_write_fis_d2h(p, slot, cfis, ATA_S_READY | ATA_S_DSC);
+		return;
 	}
 	lba *= 2048;
 	len *= 2048;
 
+	if (done == 0 && p->rcache != NULL &&
+	    atapi_cache_read(p, slot, cfis, lba, len))
+		return;
+
 	/*
 	 * Pull request off free list
 	 */
@@ -1660,6 +1961,9 @@ ahci_handle_cmd(struct ahci_port *p, int slot, uint8_t *cfis)
 			break;
 		case ATA_SF_ENAB_WCACHE:
 		case ATA_SF_DIS_WCACHE:
+			blockif_set_wce(p->bctx, cfis[3] == ATA_SF_ENAB_WCACHE);
+			p->tfd = ATA_S_DSC | ATA_S_READY;
+			break;
 		case ATA_SF_ENAB_RCACHE:
 		case ATA_SF_DIS_RCACHE:
 			p->tfd = ATA_S_DSC | ATA_S_READY;
@@ -1904,7 +2208,7 @@ ata_ioreq_cb(struct blockif_req *br, int err)
 	else
 		tfd = (ATA_E_ABORT << 8) | ATA_S_READY | ATA_S_ERROR;
 	if (ncq)
-		ahci_write_fis_sdb(p, slot, cfis, tfd);
+		ahci_ncq_done(p, slot, cfis, tfd);
 	else
 		ahci_write_fis_d2h(p, slot, cfis, tfd);
 
@@ -2269,50 +2573,86 @@ pci_ahci_read(UNUSED int vcpu, struct pci_devinst *pi, int baridx,
 	return (value);
 }
 
+/*
+ * Options of a port handled here rather than by blockif_open(), see
+ * blockif_split_opts().
+ */
+struct pci_ahci_opts {
+	int ao_ncq_usecs;
+	int ao_cache_mb;
+};
+
 static int
-pci_ahci_init(struct pci_devinst *pi, char *opts, int atapi)
+pci_ahci_opt(const char *opt, void *arg)
 {
-	char bident[sizeof("XX:X:X")];
-	struct blockif_ctxt *bctxt;
-	struct pci_ahci_softc *sc;
-	int ret, slots;
-	MD5_CTX mdctx;
-	u_char digest[16];
+	struct pci_ahci_opts *ao = arg;
+	int r;
 
-	ret = 0;
+	if ((r = blockif_opt_int(opt, "coalesce", &ao->ao_ncq_usecs)) != 0)
+		return (r);
+	return (blockif_opt_int(opt, "cdcache", &ao->ao_cache_mb));
+}
 
-	if (opts == NULL) {
-		fprintf(stderr, "pci_ahci: backing device required\n");
-		return (1);
-	}
+static struct atapi_cache *
+atapi_cache_alloc(struct ahci_port *p, int cache_mb)
+{
+	struct atapi_cache *ac;
+	struct atapi_cache_seg *s;
+	int i;
 
-#ifdef AHCI_DEBUG
-	dbg = fopen("/tmp/log", "w+");
-#endif
+	ac = calloc(1, sizeof(struct atapi_cache));
+	ac->ac_nseg = MAX(2, (cache_mb * 1024 * 1024) / ATAPI_CACHE_SEG);
+	ac->ac_seg = calloc(((size_t) ac->ac_nseg),
+		sizeof(struct atapi_cache_seg));
+	for (i = 0; i < ac->ac_nseg; i++) {
+		s = &ac->ac_seg[i];
+		s->acs_pr = p;
+		s->acs_state = SEG_EMPTY;
+		s->acs_tag = UINT64_MAX;
+		s->acs_buf = malloc(ATAPI_CACHE_SEG);
+		s->acs_req.br_callback = atapi_cache_cb;
+		s->acs_req.br_param = s;
+	}
+	return (ac);
+}
 
-	sc = calloc(1, sizeof(struct pci_ahci_softc));
-	pi->pi_arg = sc;
-	sc->asc_pi = pi;
-	sc->ports = MAX_PORTS;
+/*
+ * Open the backing store of port and set up its request queue
+ */
+static int
+pci_ahci_port_init(struct pci_ahci_softc *sc, int port, const char *opts,
+	int atapi)
+{
+	char bident[sizeof("XXX:X:XX")];
+	struct blockif_ctxt *bctxt;
+	struct ahci_port *p;
+	MD5_CTX mdctx;
+	u_char digest[16];
+	struct pci_ahci_opts ao;
+	char *bopts;
 
-	/*
-	 * Only use port 0 for a backing device. All other ports will be
-	 * marked as unused
-	 */
-	sc->port[0].atapi = atapi;
+	ao.ao_ncq_usecs = sc->ncq_usecs;
+	ao.ao_cache_mb = ATAPI_CACHE_MB;
+	bopts = blockif_split_opts(opts, pci_ahci_opt, &ao);
+	if (bopts == NULL)
+		return (1);
+	sc->ncq_usecs = ao.ao_ncq_usecs;
 
 	/*
 	 * Attempt to open the backing image. Use the PCI
-	 * slot/func for the identifier string.
+	 * slot/func/port for the identifier string.
 	 */
-	snprintf(bident, sizeof(bident), "%d:%d", pi->pi_slot, pi->pi_func);
-	bctxt = blockif_open(opts, bident);
-	if (bctxt == NULL) {       	
-		ret = 1;
-		goto open_fail;
-	}	
-	sc->port[0].bctx = bctxt;
-	sc->port[0].pr_sc = sc;
+	snprintf(bident, sizeof(bident), "%d:%d:%d", sc->asc_pi->pi_slot,
+	    sc->asc_pi->pi_func, port);
+	bctxt = blockif_open(bopts, bident);
+	free(bopts);
+	if (bctxt == NULL)
+		return (1);
+
+	p = &sc->port[port];
+	p->bctx = bctxt;
+	p->pr_sc = sc;
+	p->atapi = atapi;
 
 	/*
 	 * Create an identifier for the backing file. Use parts of the
@@ -2320,22 +2660,45 @@ pci_ahci_init(struct pci_devinst *pi, char *opts, int atapi)
 	 */
 	MD5Init(&mdctx);
 	MD5Update(&mdctx, opts, ((unsigned int) strlen(opts)));
-	MD5Final(digest, &mdctx);	
-	snprintf(sc->port[0].ident, AHCI_PORT_IDENT, "BHYVE-%02X%02X-%02X%02X-%02X%02X",
+	MD5Final(digest, &mdctx);
+	snprintf(p->ident, AHCI_PORT_IDENT, "BHYVE-%02X%02X-%02X%02X-%02X%02X",
 	    digest[0], digest[1], digest[2], digest[3], digest[4], digest[5]);
 
 	/*
 	 * Allocate blockif request structures and add them
 	 * to the free list
 	 */
-	pci_ahci_ioreq_init(&sc->port[0]);
+	pci_ahci_ioreq_init(p);
 
-	pthread_mutex_init(&sc->mtx, NULL);
+	if (atapi && ao.ao_cache_mb > 0)
+		p->rcache = atapi_cache_alloc(p, ao.ao_cache_mb);
+	return (0);
+}
+
+/*
+ * Finish controller setup once its nports ports have been opened
+ */
+static void
+pci_ahci_attach(struct pci_ahci_softc *sc, int nports)
+{
+	struct pci_devinst *pi;
+	int i, slots, queued;
+
+	pi = sc->asc_pi;
+
+	/*
+	 * Keep the 6 ports of an ICH8 unless more are needed; ports
+	 * without a backing device report no device present.
+	 */
+	sc->ports = MAX(nports, DEF_PORTS);
 
 	/* Intel ICH8 AHCI */
-	slots = sc->port[0].ioqsz;
-	if (slots > 32)
-		slots = 32;
+	slots = 32;
+	queued = 0;
+	for (i = 0; i < nports; i++) {
+		slots = MIN(slots, sc->port[i].ioqsz);
+		queued |= !sc->port[i].atapi;
+	}
 	--slots;
 	sc->cap = AHCI_CAP_64BIT | AHCI_CAP_SNCQ | AHCI_CAP_SSNTF |
 	    AHCI_CAP_SMPS | AHCI_CAP_SSS | AHCI_CAP_SALP |
@@ -2344,8 +2707,8 @@ pci_ahci_init(struct pci_devinst *pi, char *opts, int atapi)
 	    (((unsigned) slots) << AHCI_CAP_NCS_SHIFT) | AHCI_CAP_SXS |
 	    (((unsigned) sc->ports) - 1);
 
-	/* Only port 0 implemented */
-	sc->pi = 1;
+	/* Only ports with a backing device are implemented */
+	sc->pi = (uint32_t) ((1ULL << nports) - 1);
 	sc->vs = 0x10300;
 	sc->cap2 = AHCI_CAP2_APST;
 	ahci_reset(sc);
@@ -2361,13 +2724,142 @@ pci_ahci_init(struct pci_devinst *pi, char *opts, int atapi)
 
 	pci_lintr_request(pi);
 
-open_fail:
-	if (ret) {
-		if (sc->port[0].bctx != NULL)
-			blockif_close(sc->port[0].bctx);
-		free(sc);
+	/* ATAPI devices do not queue commands */
+	if (queued && sc->ncq_usecs != 0)
+		pthread_create(&sc->ncq_tid, NULL, ahci_ncq_thread, sc);
+}
+
+static struct pci_ahci_softc *
+pci_ahci_alloc(struct pci_devinst *pi)
+{
+	struct pci_ahci_softc *sc;
+
+#ifdef AHCI_DEBUG
+	dbg = fopen("/tmp/log", "w+");
+#endif
+
+	sc = calloc(1, sizeof(struct pci_ahci_softc));
+	pi->pi_arg = sc;
+	sc->asc_pi = pi;
+	pthread_mutex_init(&sc->mtx, NULL);
+	sc->ncq_usecs = AHCI_NCQ_USECS;
+	pthread_cond_init(&sc->ncq_cond, NULL);
+	return (sc);
+}
+
+static void
+pci_ahci_free(struct pci_ahci_softc *sc)
+{
+	int i, j;
+
+	for (i = 0; i < MAX_PORTS; i++) {
+		if (sc->port[i].bctx != NULL)
+			blockif_close(sc->port[i].bctx);
+		free(sc->port[i].ioreq);
+		if (sc->port[i].rcache != NULL) {
+			for (j = 0; j < sc->port[i].rcache->ac_nseg; j++)
+				free(sc->port[i].rcache->ac_seg[j].acs_buf);
+			free(sc->port[i].rcache->ac_seg);
+			free(sc->port[i].rcache);
+		}
+	}
+	sc->asc_pi->pi_arg = NULL;
+	free(sc);
+}
+
+static void
+pci_ahci_set_delay(struct pci_ahci_softc *sc)
+{
+	sc->ncq_delay.tv_sec = sc->ncq_usecs / 1000000;
+	sc->ncq_delay.tv_nsec = (sc->ncq_usecs % 1000000) * 1000;
+}
+
+/*
+ * ahci-hd and ahci-cd: a controller with a single device on port 0
+ */
+static int
+pci_ahci_init(struct pci_devinst *pi, char *opts, int atapi)
+{
+	struct pci_ahci_softc *sc;
+
+	if (opts == NULL) {
+		fprintf(stderr, "pci_ahci: backing device required\n");
+		return (1);
 	}
 
+	sc = pci_ahci_alloc(pi);
+	if (pci_ahci_port_init(sc, 0, opts, atapi)) {
+		pci_ahci_free(sc);
+		return (1);
+	}
+	pci_ahci_set_delay(sc);
+	pci_ahci_attach(sc, 1);
+	return (0);
+}
+
+/*
+ * ahci: one device per port, e.g.
+ *
+ *	hd:/path/disk0.img,nocache,hd:/path/disk1.img,cd:/path/install.iso
+ *
+ * Options following a device apply to that device's port.
+ */
+static int
+pci_ahci_multi_init(struct pci_devinst *pi, char *opts)
+{
+	struct pci_ahci_softc *sc;
+	char *popts[MAX_PORTS];
+	int atapi[MAX_PORTS];
+	char *nopt, *xopts, *cp;
+	int i, nports, ret;
+
+	if (opts == NULL) {
+		fprintf(stderr, "pci_ahci: at least one hd: or cd: device "
+		    "required\n");
+		return (1);
+	}
+
+	ret = 1;
+	sc = NULL;
+	nports = 0;
+	nopt = xopts = strdup(opts);
+	while (xopts != NULL) {
+		cp = strsep(&xopts, ",");
+		if (!strncmp(cp, "hd:", 3) || !strncmp(cp, "cd:", 3)) {
+			if (nports == MAX_PORTS) {
+				fprintf(stderr, "pci_ahci: more than %d ports\n",
+				    MAX_PORTS);
+				goto done;
+			}
+			atapi[nports] = (cp[0] == 'c');
+			popts[nports++] = cp + 3;
+		} else if (nports == 0) {
+			fprintf(stderr, "pci_ahci: expected hd: or cd: device, "
+			    "got \"%s\"\n", cp);
+			goto done;
+		} else {
+			/* undo the split, the option belongs to this port */
+			cp[-1] = ',';
+		}
+	}
+	if (nports == 0) {
+		fprintf(stderr, "pci_ahci: at least one hd: or cd: device "
+		    "required\n");
+		goto done;
+	}
+
+	sc = pci_ahci_alloc(pi);
+	for (i = 0; i < nports; i++) {
+		if (pci_ahci_port_init(sc, i, popts[i], atapi[i]))
+			goto done;
+	}
+	pci_ahci_set_delay(sc);
+	pci_ahci_attach(sc, nports);
+	ret = 0;
+done:
+	if (ret && sc != NULL)
+		pci_ahci_free(sc);
+	free(nopt);
 	return (ret);
 }
 
@@ -2401,3 +2893,11 @@ static struct pci_devemu pci_de_ahci_cd = {
 	.pe_barread =	pci_ahci_read
 };
 PCI_EMUL_SET(pci_de_ahci_cd);
+
+static struct pci_devemu pci_de_ahci = {
+	.pe_emu =	"ahci",
+	.pe_init =	pci_ahci_multi_init,
+	.pe_barwrite =	pci_ahci_write,
+	.pe_barread =	pci_ahci_read
+};
+PCI_EMUL_SET(pci_de_ahci);
@@ -27,6 +27,7 @@
  * $FreeBSD$
  */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -43,6 +44,7 @@
 #include <sys/ioctl.h>
 #include <sys/disk.h>
 #include <xhyve/support/misc.h>
+#include <xhyve/support/atomic.h>
 #include <xhyve/support/linker_set.h>
 #include <xhyve/support/md5.h>
 #include <xhyve/xhyve.h>
@@ -52,6 +54,22 @@
 
 #define VTBLK_RINGSZ 64
 
+/*
+ * Default upper bound, in microseconds, on how long a completed request
+ * may sit in the completion batch before it is returned to the guest.
+ * Override with the "coalesce=<usecs>" option; 0 disables batching.
+ * With "intr=" interrupts are moderated instead: batching is then off
+ * by default and "coalesce=" refused, as the two delays would add up.
+ */
+#define VTBLK_CQ_USECS 100
+
+/*
+ * Default time, in microseconds, the I/O thread keeps polling the
+ * avail ring after the last request before it sleeps and asks the
+ * guest for notifications again.  See pci_vtblk_io_thread().
+ */
+#define VTBLK_POLL_USECS 50
+
 #define VTBLK_S_OK 0
 #define VTBLK_S_IOERR 1
 #define	VTBLK_S_UNSUPP 2
@@ -63,14 +81,15 @@
 #define	VTBLK_F_BLK_SIZE (1 << 6) /* cfg block size valid */
 #define	VTBLK_F_FLUSH (1 << 9) /* Cache flush support */
 #define	VTBLK_F_TOPOLOGY (1 << 10) /* Optimal I/O alignment */
+#define	VTBLK_F_CONFIG_WCE (1 << 11) /* Writeback mode in cfg */
 
 /*
- * Host capabilities
+ * Host capabilities, VTBLK_F_FLUSH and VTBLK_F_CONFIG_WCE are added
+ * according to the cache mode of the backing store
  */
 #define VTBLK_S_HOSTCAPS \
 	(VTBLK_F_SEG_MAX  | \
 	 VTBLK_F_BLK_SIZE | \
-	 VTBLK_F_FLUSH    | \
 	 VTBLK_F_TOPOLOGY | \
 	 VIRTIO_RING_F_INDIRECT_DESC) /* indirect descriptors */
 
@@ -128,6 +147,7 @@ struct pci_vtblk_ioreq {
 	struct pci_vtblk_softc *io_sc;
 	uint8_t *io_status;
 	uint16_t io_idx;
+	int io_gen; /* vbsc_gen when the request was issued */
 };
 
 /*
@@ -135,12 +155,28 @@ struct pci_vtblk_ioreq {
  */
 struct pci_vtblk_softc {
 	struct virtio_softc vbsc_vs;
+	struct virtio_consts vbsc_consts;
 	pthread_mutex_t vsc_mtx;
 	struct vqueue_info vbsc_vq;
 	struct vtblk_config vbsc_cfg;
 	struct blockif_ctxt *bc;
 	char vbsc_ident[VTBLK_BLK_ID_BYTES];
 	struct pci_vtblk_ioreq vbsc_ios[VTBLK_RINGSZ];
+	/* completion batching, see pci_vtblk_cq_kick() */
+	int vbsc_gen; /* device resets so far */
+	int vbsc_inflight;
+	int vbsc_cq_usecs;
+	int vbsc_cq_armed;
+	int vbsc_cq_cnt;
+	uint16_t vbsc_cq_idx[VTBLK_RINGSZ];
+	struct timespec vbsc_cq_delay;
+	pthread_cond_t vbsc_cq_cond;
+	pthread_t vbsc_cq_tid;
+	/* I/O thread, see pci_vtblk_io_thread() */
+	int vbsc_io_usecs; /* polling time, -1 without an I/O thread */
+	int vbsc_io_kicked;
+	pthread_cond_t vbsc_io_cond;
+	pthread_t vbsc_io_tid;
 };
 
 #pragma clang diagnostic pop
@@ -162,13 +198,103 @@ static struct virtio_consts vtblk_vi_consts = {
 	VTBLK_S_HOSTCAPS, /* our capabilities */
 };
 
+/*
+ * Advertise the cache mode of the backing store: writeback and
+ * writethrough disks let the guest see (and in the writeback case
+ * change) the write cache state, unsafe disks claim to have no
+ * volatile cache at all so the guest never bothers to flush.
+ */
+static void
+pci_vtblk_wce_init(struct pci_vtblk_softc *sc)
+{
+	if (blockif_cache_mode(sc->bc) == BLOCKIF_CACHE_UNSAFE) {
+		sc->vbsc_cfg.vbc_writeback = 0;
+		return;
+	}
+	blockif_set_wce(sc->bc,
+	    blockif_cache_mode(sc->bc) == BLOCKIF_CACHE_WRITEBACK);
+	sc->vbsc_cfg.vbc_writeback = (uint8_t) blockif_get_wce(sc->bc);
+}
+
 static void
 pci_vtblk_reset(void *vsc)
 {
 	struct pci_vtblk_softc *sc = vsc;
 
 	DPRINTF(("vtblk: device reset requested !\n"));
+	/*
+	 * Drop completions the guest is no longer waiting for, those of
+	 * requests still in blockif are dropped as they come in.
+	 */
+	sc->vbsc_gen++;
+	sc->vbsc_inflight = 0;
+	sc->vbsc_cq_cnt = 0;
+	sc->vbsc_cq_armed = 0;
 	vi_reset_dev(&sc->vbsc_vs);
+	/* the guest may have changed the cache mode */
+	pci_vtblk_wce_init(sc);
+}
+
+/*
+ * Return every batched completion to the guest with a single update
+ * of the used index, and at most one interrupt.
+ */
+static void
+pci_vtblk_cq_flush(struct pci_vtblk_softc *sc)
+{
+	int i;
+
+	for (i = 0; i < sc->vbsc_cq_cnt; i++) {
+		/* We wrote 1 byte (our status) to host. */
+		vq_relchain_prepare(&sc->vbsc_vq, sc->vbsc_cq_idx[i], 1);
+	}
+	vq_relchain_publish(&sc->vbsc_vq);
+	vq_endchains(&sc->vbsc_vq, 0);
+	sc->vbsc_cq_cnt = 0;
+	sc->vbsc_cq_armed = 0;
+}
+
+/*
+ * Decide what to do with the current completion batch.  It is
+ * flushed right away once nothing else is outstanding in blockif
+ * (i.e. the worker has drained its queue) or if batching is
+ * disabled; otherwise the coalescing thread is armed to flush it
+ * when the latency cap expires.
+ */
+static void
+pci_vtblk_cq_kick(struct pci_vtblk_softc *sc)
+{
+	if (sc->vbsc_cq_cnt == 0)
+		return;
+
+	if (sc->vbsc_inflight == 0 || sc->vbsc_cq_usecs == 0)
+		pci_vtblk_cq_flush(sc);
+	else if (!sc->vbsc_cq_armed) {
+		sc->vbsc_cq_armed = 1;
+		pthread_cond_signal(&sc->vbsc_cq_cond);
+	}
+}
+
+static void *
+pci_vtblk_cq_thread(void *param)
+{
+	struct pci_vtblk_softc *sc = param;
+
+	pthread_mutex_lock(&sc->vsc_mtx);
+	for (;;) {
+		while (!sc->vbsc_cq_armed)
+			pthread_cond_wait(&sc->vbsc_cq_cond, &sc->vsc_mtx);
+		pthread_cond_timedwait_relative_np(&sc->vbsc_cq_cond,
+			&sc->vsc_mtx, &sc->vbsc_cq_delay);
+		/*
+		 * The batch may have been flushed (and possibly a new one
+		 * started) while we slept; flushing early is harmless.
+		 */
+		if (sc->vbsc_cq_armed)
+			pci_vtblk_cq_flush(sc);
+	}
+
+	return (NULL);
 }
 
 /* xhyve: FIXME
@@ -190,13 +316,11 @@ pci_vtblk_done_locked(struct blockif_req *br, int err)
 		*io->io_status = VTBLK_S_OK;
 
 	/*
-	 * Return the descriptor back to the host.
-	 * We wrote 1 byte (our status) to host.
+	 * Queue the descriptor to be returned back to the host with
+	 * the rest of the batch, see pci_vtblk_cq_kick().
 	 */
-	//pthread_mutex_lock(&sc->vsc_mtx);
-	vq_relchain(&sc->vbsc_vq, io->io_idx, 1);
-	vq_endchains(&sc->vbsc_vq, 0);
-	//pthread_mutex_unlock(&sc->vsc_mtx);
+	assert(sc->vbsc_cq_cnt < VTBLK_RINGSZ);
+	sc->vbsc_cq_idx[sc->vbsc_cq_cnt++] = io->io_idx;
 }
 
 static void
@@ -205,16 +329,35 @@ pci_vtblk_done(struct blockif_req *br, int err) {
 	struct pci_vtblk_softc *sc = io->io_sc;
 
 	pthread_mutex_lock(&sc->vsc_mtx);
-	pci_vtblk_done_locked(br, err);
+	if (io->io_gen == sc->vbsc_gen) {
+		sc->vbsc_inflight--;
+		pci_vtblk_done_locked(br, err);
+		pci_vtblk_cq_kick(sc);
+	}
 	pthread_mutex_unlock(&sc->vsc_mtx);
 }
 
+/*
+ * Give back a chain that has no room for a status, the guest is told
+ * nothing was written.
+ */
+static void
+pci_vtblk_drop(struct vqueue_info *vq, uint16_t idx)
+{
+	fprintf(stderr, "virtio-block: malformed request dropped\r\n");
+	vq_relchain(vq, idx, 0);
+	vq_endchains(vq, 0);
+}
+
 static void
 pci_vtblk_proc(struct pci_vtblk_softc *sc, struct vqueue_info *vq)
 {
-	struct virtio_blk_hdr *vbh;
+	struct virtio_blk_hdr vbh;
 	struct pci_vtblk_ioreq *io;
-	int i, n;
+	struct iovec *dv;
+	uint8_t *p;
+	size_t len, c;
+	int i, n, dn, d0;
 	int err;
 	ssize_t iolen;
 	int writeop, type;
@@ -222,52 +365,76 @@ pci_vtblk_proc(struct pci_vtblk_softc *sc, struct vqueue_info *vq)
 	uint16_t idx, flags[BLOCKIF_IOV_MAX + 2];
 
 	n = vq_getchain(vq, &idx, iov, BLOCKIF_IOV_MAX + 2, flags);
+	/* A broken ring, as opposed to a broken request */
+	assert(n > 0);
+	if (n > BLOCKIF_IOV_MAX + 2) {
+		pci_vtblk_drop(vq, idx);
+		return;
+	}
 
 	/*
-	 * The first descriptor will be the read-only fixed header,
-	 * and the last is for status (hence +2 above and below).
-	 * The remaining iov's are the actual data I/O vectors.
-	 *
-	 * XXX - note - this fails on crash dump, which does a
-	 * VIRTIO_BLK_T_FLUSH with a zero transfer length
+	 * A request is the read-only fixed header, the data and a status
+	 * byte at the very end, laid out over the descriptors any way the
+	 * guest likes: the header may be split or share a descriptor with
+	 * the data, and the status may end the last data descriptor.
 	 */
-	assert(n >= 2 && n <= BLOCKIF_IOV_MAX + 2);
+	p = (uint8_t *) &vbh;
+	len = sizeof(vbh);
+	for (i = 0; i < n && len > 0 &&
+	    (flags[i] & VRING_DESC_F_WRITE) == 0; i++) {
+		c = MIN(len, iov[i].iov_len);
+		memcpy(p, iov[i].iov_base, c);
+		p += c;
+		len -= c;
+	}
+	if (len > 0 || iov[n - 1].iov_len == 0 ||
+	    (flags[n - 1] & VRING_DESC_F_WRITE) == 0) {
+		pci_vtblk_drop(vq, idx);
+		return;
+	}
 
 	io = &sc->vbsc_ios[idx];
-	assert((flags[0] & VRING_DESC_F_WRITE) == 0);
-	assert(iov[0].iov_len == sizeof(struct virtio_blk_hdr));
-	vbh = iov[0].iov_base;
-	memcpy(&io->io_req.br_iov, &iov[1],
-		sizeof(struct iovec) * (((size_t) n) - 2));
-	io->io_req.br_iovcnt = n - 2;
-	io->io_req.br_offset = (off_t) (vbh->vbh_sector * DEV_BSIZE);
-	io->io_status = iov[--n].iov_base;
-	assert(iov[n].iov_len == 1);
-	assert(flags[n] & VRING_DESC_F_WRITE);
+	io->io_gen = sc->vbsc_gen;
+	io->io_status = (uint8_t *) iov[n - 1].iov_base +
+	    iov[n - 1].iov_len - 1;
+	iov[n - 1].iov_len--;
+	dn = n;
+	dv = vq_iov_skip(iov, &dn, sizeof(vbh));
+	if (dn > 0 && dv[dn - 1].iov_len == 0)
+		dn--;
+	d0 = (int) (dv - iov);
 
 	/*
 	 * XXX
 	 * The guest should not be setting the BARRIER flag because
 	 * we don't advertise the capability.
 	 */
-	type = vbh->vbh_type & ~VBH_FLAG_BARRIER;
+	type = vbh.vbh_type & ~VBH_FLAG_BARRIER;
 	writeop = (type == VBH_OP_WRITE);
 
 	iolen = 0;
-	for (i = 1; i < n; i++) {
+	for (i = 0; i < dn; i++) {
 		/*
 		 * - write op implies read-only descriptor,
 		 * - read/ident op implies write-only descriptor,
 		 * therefore test the inverse of the descriptor bit
 		 * to the op.
 		 */
-		assert(((flags[i] & VRING_DESC_F_WRITE) == 0) == writeop);
-		iolen += iov[i].iov_len;
+		if (((flags[d0 + i] & VRING_DESC_F_WRITE) == 0) != writeop)
+			break;
+		iolen += dv[i].iov_len;
 	}
+	if (i < dn || dn > BLOCKIF_IOV_MAX) {
+		pci_vtblk_done_locked(&io->io_req, EINVAL);
+		return;
+	}
+	memcpy(&io->io_req.br_iov, dv, sizeof(struct iovec) * ((size_t) dn));
+	io->io_req.br_iovcnt = dn;
+	io->io_req.br_offset = (off_t) (vbh.vbh_sector * DEV_BSIZE);
 	io->io_req.br_resid = iolen;
 
 	DPRINTF(("virtio-block: %s op, %zd bytes, %d segs\n\r", 
-		 writeop ? "write" : "read/ident", iolen, i - 1));
+		 writeop ? "write" : "read/ident", iolen, dn));
 
 	switch (type) {
 	case VBH_OP_READ:
@@ -281,11 +448,15 @@ pci_vtblk_proc(struct pci_vtblk_softc *sc, struct vqueue_info *vq)
 		err = blockif_flush(sc->bc, &io->io_req);
 		break;
 	case VBH_OP_IDENT:
+		if (dn == 0) {
+			pci_vtblk_done_locked(&io->io_req, EINVAL);
+			return;
+		}
 		/* Assume a single buffer */
 		/* S/n equal to buffer is not zero-terminated. */
-		memset(iov[1].iov_base, 0, iov[1].iov_len);
-		strncpy(iov[1].iov_base, sc->vbsc_ident,
-		    MIN(iov[1].iov_len, sizeof(sc->vbsc_ident)));
+		memset(dv[0].iov_base, 0, dv[0].iov_len);
+		strncpy(dv[0].iov_base, sc->vbsc_ident,
+		    MIN(dv[0].iov_len, sizeof(sc->vbsc_ident)));
 		/* xhyve: FIXME */
 		pci_vtblk_done_locked(&io->io_req, 0);
 		return;
@@ -295,6 +466,74 @@ pci_vtblk_proc(struct pci_vtblk_softc *sc, struct vqueue_info *vq)
 		return;
 	}
 	assert(err == 0);
+	sc->vbsc_inflight++;
+}
+
+static uint64_t
+pci_vtblk_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec);
+}
+
+/*
+ * With an I/O thread the vCPU that took the notification only wakes
+ * the thread up.  The thread drains the avail ring with notifications
+ * suppressed, then keeps polling the ring for vbsc_io_usecs after the
+ * last request it found: a guest submitting steadily is served without
+ * a single exit.  Only once the ring stays empty are notifications
+ * turned back on and the thread goes to sleep.
+ */
+static void *
+pci_vtblk_io_thread(void *param)
+{
+	struct pci_vtblk_softc *sc = param;
+	struct vqueue_info *vq = &sc->vbsc_vq;
+	uint64_t poll, deadline;
+
+	poll = (uint64_t) sc->vbsc_io_usecs * 1000;
+	pthread_mutex_lock(&sc->vsc_mtx);
+	for (;;) {
+		while (!sc->vbsc_io_kicked)
+			pthread_cond_wait(&sc->vbsc_io_cond, &sc->vsc_mtx);
+		sc->vbsc_io_kicked = 0;
+
+		vq_kick_disable(vq);
+		deadline = pci_vtblk_nsecs() + poll;
+		for (;;) {
+			if (vq_has_descs(vq)) {
+				do {
+					pci_vtblk_proc(sc, vq);
+				} while (vq_has_descs(vq));
+				pci_vtblk_cq_kick(sc);
+				deadline = pci_vtblk_nsecs() + poll;
+			}
+			if (pci_vtblk_nsecs() >= deadline)
+				break;
+			/*
+			 * Spin without the lock so completions and the vCPUs
+			 * are not held up, the ring is checked again under the
+			 * lock above before anything is taken off it.
+			 */
+			pthread_mutex_unlock(&sc->vsc_mtx);
+			while (!vq_has_descs(vq) && pci_vtblk_nsecs() < deadline)
+				__asm __volatile("pause" : : : "memory");
+			pthread_mutex_lock(&sc->vsc_mtx);
+		}
+		vq_kick_enable(vq);
+
+		/*
+		 * The guest may have added a request after the last look
+		 * at the ring but before it saw notifications enabled.
+		 */
+		mb();
+		if (vq_has_descs(vq))
+			sc->vbsc_io_kicked = 1;
+	}
+
+	return (NULL);
 }
 
 static void
@@ -302,8 +541,46 @@ pci_vtblk_notify(void *vsc, struct vqueue_info *vq)
 {
 	struct pci_vtblk_softc *sc = vsc;
 
+	if (sc->vbsc_io_usecs >= 0) {
+		sc->vbsc_io_kicked = 1;
+		pthread_cond_signal(&sc->vbsc_io_cond);
+		return;
+	}
+
 	while (vq_has_descs(vq))
 		pci_vtblk_proc(sc, vq);
+
+	/* return requests completed synchronously above */
+	pci_vtblk_cq_kick(sc);
+}
+
+/*
+ * The virtio-blk specific options, see blockif_split_opts().
+ */
+struct pci_vtblk_opts {
+	int vo_cq_usecs;
+	int vo_io_usecs;
+	int vo_mod_frames;
+	int vo_mod_usecs;
+};
+
+static int
+pci_vtblk_opt(const char *opt, void *arg)
+{
+	struct pci_vtblk_opts *vo = arg;
+	int r;
+
+	if ((r = blockif_opt_int(opt, "coalesce", &vo->vo_cq_usecs)) != 0 ||
+	    (r = blockif_opt_int(opt, "iothread", &vo->vo_io_usecs)) != 0)
+		return (r);
+	if (!strcmp(opt, "iothread")) {
+		vo->vo_io_usecs = VTBLK_POLL_USECS;
+		return (1);
+	}
+	if (!strncmp(opt, "intr=", 5))
+		return (vi_parse_intr_mod(opt, &vo->vo_mod_frames,
+		    &vo->vo_mod_usecs) ? -1 : 1);
+	return (0);
 }
 
 static int
@@ -315,6 +592,8 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 	u_char digest[16];
 	struct pci_vtblk_softc *sc;
 	off_t size;
+	struct pci_vtblk_opts vo;
+	char *bopts;
 	int i, sectsz, sts, sto;
 
 	if (opts == NULL) {
@@ -322,11 +601,27 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 		return (1);
 	}
 
+	vo.vo_cq_usecs = -1;
+	vo.vo_io_usecs = -1;
+	vo.vo_mod_frames = vo.vo_mod_usecs = 0;
+	bopts = blockif_split_opts(opts, pci_vtblk_opt, &vo);
+	if (bopts == NULL)
+		return (1);
+	if (vo.vo_mod_usecs > 0 && vo.vo_cq_usecs > 0) {
+		printf("virtio-block: coalesce= and intr= both hold back "
+		    "completions, use one\n");
+		free(bopts);
+		return (1);
+	}
+	if (vo.vo_cq_usecs < 0)
+		vo.vo_cq_usecs = vo.vo_mod_usecs > 0 ? 0 : VTBLK_CQ_USECS;
+
 	/*
 	 * The supplied backing file has to exist
 	 */
 	snprintf(bident, sizeof(bident), "%d:%d", pi->pi_slot, pi->pi_func);
-	bctxt = blockif_open(opts, bident);
+	bctxt = blockif_open(bopts, bident);
+	free(bopts);
 	if (bctxt == NULL) {       	
 		perror("Could not open backing file");
 		return (1);
@@ -348,12 +643,26 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 
 	pthread_mutex_init(&sc->vsc_mtx, NULL);
 
+	sc->vbsc_cq_usecs = vo.vo_cq_usecs;
+	sc->vbsc_cq_delay.tv_sec = vo.vo_cq_usecs / 1000000;
+	sc->vbsc_cq_delay.tv_nsec = (vo.vo_cq_usecs % 1000000) * 1000;
+	pthread_cond_init(&sc->vbsc_cq_cond, NULL);
+
+	sc->vbsc_io_usecs = vo.vo_io_usecs;
+	pthread_cond_init(&sc->vbsc_io_cond, NULL);
+
+	/* feature bits depend on the cache mode of this disk */
+	sc->vbsc_consts = vtblk_vi_consts;
+	if (blockif_cache_mode(bctxt) != BLOCKIF_CACHE_UNSAFE)
+		sc->vbsc_consts.vc_hv_caps |= VTBLK_F_FLUSH | VTBLK_F_CONFIG_WCE;
+
 	/* init virtio softc and virtqueues */
-	vi_softc_linkup(&sc->vbsc_vs, &vtblk_vi_consts, sc, pi, &sc->vbsc_vq);
+	vi_softc_linkup(&sc->vbsc_vs, &sc->vbsc_consts, sc, pi, &sc->vbsc_vq);
 	sc->vbsc_vs.vs_mtx = &sc->vsc_mtx;
 
 	sc->vbsc_vq.vq_qsize = VTBLK_RINGSZ;
 	/* sc->vbsc_vq.vq_notify = we have no per-queue notify */
+	vi_set_intr_mod(&sc->vbsc_vs, 0, vo.vo_mod_frames, vo.vo_mod_usecs);
 
 	/*
 	 * Create an identifier for the backing file. Use parts of the
@@ -380,7 +689,7 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 	    (uint8_t) ((sto != 0) ? ((sts - sto) / sectsz) : 0);
 	sc->vbsc_cfg.vbc_topology.min_io_size = 0;
 	sc->vbsc_cfg.vbc_topology.opt_io_size = 0;
-	sc->vbsc_cfg.vbc_writeback = 0;
+	pci_vtblk_wce_init(sc);
 
 	/*
 	 * Should we move some of this into virtio.c?  Could
@@ -398,14 +707,27 @@ pci_vtblk_init(struct pci_devinst *pi, char *opts)
 		free(sc);
 		return (1);
 	}
+	if (vo.vo_cq_usecs != 0)
+		pthread_create(&sc->vbsc_cq_tid, NULL, pci_vtblk_cq_thread, sc);
+	if (vo.vo_io_usecs >= 0)
+		pthread_create(&sc->vbsc_io_tid, NULL, pci_vtblk_io_thread, sc);
 	vi_set_io_bar(&sc->vbsc_vs, 0);
+	vi_set_modern_bar(&sc->vbsc_vs, 2);
 	return (0);
 }
 
 static int
-pci_vtblk_cfgwrite(UNUSED void *vsc, int offset, UNUSED int size,
-	UNUSED uint32_t value)
+pci_vtblk_cfgwrite(void *vsc, int offset, int size, uint32_t value)
 {
+	struct pci_vtblk_softc *sc = vsc;
+
+	if (offset == ((int) offsetof(struct vtblk_config, vbc_writeback)) &&
+	    size == 1 &&
+	    (sc->vbsc_vs.vs_negotiated_caps & VTBLK_F_CONFIG_WCE)) {
+		blockif_set_wce(sc->bc, value != 0);
+		sc->vbsc_cfg.vbc_writeback = (uint8_t) blockif_get_wce(sc->bc);
+		return (0);
+	}
 	DPRINTF(("vtblk: write to readonly reg %d\n\r", offset));
 	return (1);
 }
@@ -345,17 +345,19 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 			 * entries.  Interrupt if needed/appropriate.
 			 */
 			vq_retchain(vq);
+			vq_relchain_publish(vq);
 			vq_endchains(vq, 0);
 			return;
 		}
 
 		/*
 		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
+		 * number of buffers if merged rx bufs were negotiated,
+		 * or always for modern drivers.
 		 */
 		memset(vrx, 0, sc->rx_vhdrlen);
 
-		if (sc->rx_merge) {
+		if (sc->rx_merge || (sc->vsc_features & VIRTIO_F_VERSION_1)) {
 			struct virtio_net_rxhdr *vrxh;
 
 			vrxh = vrx;
@@ -363,10 +365,14 @@ pci_vtnet_tap_rx(struct pci_vtnet_softc *sc)
 		}
 
 		/*
-		 * Release this chain and handle more chains.
+		 * Queue this chain for release and handle more chains,
+		 * they all go back to the guest with one used index
+		 * update.
 		 */
-		vq_relchain(vq, idx, ((uint32_t) (len + sc->rx_vhdrlen)));
+		vq_relchain_prepare(vq, idx,
+		    ((uint32_t) (len + sc->rx_vhdrlen)));
 	} while (vq_has_descs(vq));
+	vq_relchain_publish(vq);
 
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
 	vq_endchains(vq, 1);
@@ -427,14 +433,14 @@ pci_vtnet_ping_rxq(void *vsc, struct vqueue_info *vq)
 	 */
 	if (sc->vsc_rx_ready == 0) {
 		sc->vsc_rx_ready = 1;
-		vq->vq_used->vu_flags |= VRING_USED_F_NO_NOTIFY;
+		vq_kick_disable(vq);
 	}
 }
 
 static void
 pci_vtnet_proctx(struct pci_vtnet_softc *sc, struct vqueue_info *vq)
 {
-	struct iovec iov[VTNET_MAXSEGS + 1];
+	struct iovec iov[VTNET_MAXSEGS + 1], *riov;
 	int i, n;
 	int plen, tlen;
 	uint16_t idx;
@@ -443,21 +449,38 @@ pci_vtnet_proctx(struct pci_vtnet_softc *sc, struct vqueue_info *vq)
 	 * Obtain chain of descriptors.  The first one is
 	 * really the header descriptor, so we need to sum
 	 * up two lengths: packet length and transfer length.
+	 * Modern drivers may lay the header out any way they
+	 * like, sharing descriptors with the frame or not.
 	 */
 	n = vq_getchain(vq, &idx, iov, VTNET_MAXSEGS, NULL);
 	assert(n >= 1 && n <= VTNET_MAXSEGS);
-	plen = 0;
-	tlen = (int) iov[0].iov_len;
-	for (i = 1; i < n; i++) {
-		plen += iov[i].iov_len;
+	tlen = 0;
+	for (i = 0; i < n; i++)
 		tlen += iov[i].iov_len;
+	if (sc->vsc_features & VIRTIO_F_VERSION_1)
+		riov = vq_iov_skip(iov, &n, (size_t) sc->rx_vhdrlen);
+	else {
+		riov = &iov[1];
+		n--;
 	}
+	/* Dropped if there is no frame after the header */
+	if (riov == NULL || n == 0) {
+		DPRINTF(("virtio: short packet dropped, %d bytes\n\r", tlen));
+		vq_relchain_prepare(vq, idx, ((uint32_t) tlen));
+		return;
+	}
+	plen = 0;
+	for (i = 0; i < n; i++)
+		plen += riov[i].iov_len;
 
 	DPRINTF(("virtio: packet send, %d bytes, %d segs\n\r", plen, n));
-	pci_vtnet_tap_tx(sc, &iov[1], n - 1, plen);
+	pci_vtnet_tap_tx(sc, riov, n, plen);
 
-	/* chain is processed, release it and set tlen */
-	vq_relchain(vq, idx, ((uint32_t) tlen));
+	/*
+	 * chain is processed, queue it for release with tlen, the
+	 * tx thread publishes the batch
+	 */
+	vq_relchain_prepare(vq, idx, ((uint32_t) tlen));
 }
 
 static void
@@ -473,7 +496,7 @@ pci_vtnet_ping_txq(void *vsc, struct vqueue_info *vq)
 
 	/* Signal the tx thread for processing */
 	pthread_mutex_lock(&sc->tx_mtx);
-	vq->vq_used->vu_flags |= VRING_USED_F_NO_NOTIFY;
+	vq_kick_disable(vq);
 	if (sc->tx_in_progress == 0)
 		pthread_cond_signal(&sc->tx_cond);
 	pthread_mutex_unlock(&sc->tx_mtx);
@@ -502,7 +525,7 @@ pci_vtnet_tx_thread(void *param)
 	for (;;) {
 		/* note - tx mutex is locked here */
 		while (sc->resetting || !vq_has_descs(vq)) {
-			vq->vq_used->vu_flags &= ~VRING_USED_F_NO_NOTIFY;
+			vq_kick_enable(vq);
 			mb();
 			if (!sc->resetting && vq_has_descs(vq))
 				break;
@@ -511,7 +534,7 @@ pci_vtnet_tx_thread(void *param)
 			error = pthread_cond_wait(&sc->tx_cond, &sc->tx_mtx);
 			assert(error == 0);
 		}
-		vq->vq_used->vu_flags |= VRING_USED_F_NO_NOTIFY;
+		vq_kick_disable(vq);
 		sc->tx_in_progress = 1;
 		pthread_mutex_unlock(&sc->tx_mtx);
 
@@ -523,6 +546,7 @@ pci_vtnet_tx_thread(void *param)
 			 */
 			pci_vtnet_proctx(sc, vq);
 		} while (vq_has_descs(vq));
+		vq_relchain_publish(vq);
 
 		/*
 		 * Generate an interrupt if needed.
@@ -574,8 +598,8 @@ pci_vtnet_init(struct pci_devinst *pi, char *opts)
 	char nstr[80];
 	struct pci_vtnet_softc *sc;
 	char *devname;
-	char *vtopts;
-	int mac_provided;
+	char *vtopts, *cp;
+	int mac_provided, mod_frames, mod_usecs;
 #if !USE_MEVENT
 	pthread_t sthrd;
 #endif
@@ -601,6 +625,7 @@ pci_vtnet_init(struct pci_devinst *pi, char *opts)
 	 * if specified
 	 */
 	mac_provided = 0;
+	mod_frames = mod_usecs = 0;
 	sc->vsc_tapfd = -1;
 	if (opts != NULL) {
 		char tbuf[80];
@@ -609,14 +634,24 @@ pci_vtnet_init(struct pci_devinst *pi, char *opts)
 		devname = vtopts = strdup(opts);
 		(void) strsep(&vtopts, ",");
 
-		if (vtopts != NULL) {
-			err = pci_vtnet_parsemac(vtopts, sc->vsc_config.mac);
+		while ((cp = strsep(&vtopts, ",")) != NULL) {
+			if (!strncmp(cp, "intr=", 5)) {
+				if (vi_parse_intr_mod(cp, &mod_frames,
+				    &mod_usecs)) {
+					free(devname);
+					return (EINVAL);
+				}
+				continue;
+			}
+			err = pci_vtnet_parsemac(cp, sc->vsc_config.mac);
 			if (err != 0) {
 				free(devname);
 				return (err);
 			}
 			mac_provided = 1;
 		}
+		vi_set_intr_mod(&sc->vsc_vs, VTNET_RXQ, mod_frames, mod_usecs);
+		vi_set_intr_mod(&sc->vsc_vs, VTNET_TXQ, mod_frames, mod_usecs);
 
 		strcpy(tbuf, "/dev/");
 		strlcat(tbuf, devname, sizeof(tbuf));
@@ -696,6 +731,9 @@ pci_vtnet_init(struct pci_devinst *pi, char *opts)
 	/* use BAR 0 to map config regs in IO space */
 	vi_set_io_bar(&sc->vsc_vs, 0);
 
+	/* and BAR 2 for the modern transport in memory space */
+	vi_set_modern_bar(&sc->vsc_vs, 2);
+
 	sc->resetting = 0;
 
 	sc->rx_merge = 1;
@@ -756,8 +794,9 @@ pci_vtnet_neg_features(void *vsc, uint64_t negotiated_features)
 
 	if (!(sc->vsc_features & VIRTIO_NET_F_MRG_RXBUF)) {
 		sc->rx_merge = 0;
-		/* non-merge rx header is 2 bytes shorter */
-		sc->rx_vhdrlen -= 2;
+		/* non-merge rx header is 2 bytes shorter, except modern */
+		if (!(sc->vsc_features & VIRTIO_F_VERSION_1))
+			sc->rx_vhdrlen -= 2;
 	}
 }
 
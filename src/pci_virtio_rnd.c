@@ -124,10 +124,11 @@ pci_vtrnd_notify(void *vsc, struct vqueue_info *vq)
 		assert(len > 0);
 
 		/*
-		 * Release this chain and handle more
+		 * Queue this chain for release and handle more
 		 */
-		vq_relchain(vq, idx, ((uint32_t) len));
+		vq_relchain_prepare(vq, idx, ((uint32_t) len));
 	}
+	vq_relchain_publish(vq);
 	vq_endchains(vq, 1);	/* Generate interrupt if appropriate. */
 }
 
@@ -176,6 +177,7 @@ pci_vtrnd_init(struct pci_devinst *pi, UNUSED char *opts)
 	if (vi_intr_init(&sc->vrsc_vs, 1, fbsdrun_virtio_msix()))
 		return (1);
 	vi_set_io_bar(&sc->vrsc_vs, 0);
+	vi_set_modern_bar(&sc->vrsc_vs, 2);
 
 	return (0);
 }
@@ -0,0 +1,167 @@
+/*-
+ * Copyright (c) 2015 xhyve developers
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <xhyve/support/sha256.h>
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z) (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define S0(x) (ROTR((x), 2) ^ ROTR((x), 13) ^ ROTR((x), 22))
+#define S1(x) (ROTR((x), 6) ^ ROTR((x), 11) ^ ROTR((x), 25))
+#define s0(x) (ROTR((x), 7) ^ ROTR((x), 18) ^ ((x) >> 3))
+#define s1(x) (ROTR((x), 17) ^ ROTR((x), 19) ^ ((x) >> 10))
+
+static void
+SHA256_Transform(uint32_t state[8], const uint8_t block[64])
+{
+	uint32_t W[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		W[i] = ((uint32_t) block[4 * i] << 24) |
+		    ((uint32_t) block[4 * i + 1] << 16) |
+		    ((uint32_t) block[4 * i + 2] << 8) |
+		    (uint32_t) block[4 * i + 3];
+	for (; i < 64; i++)
+		W[i] = s1(W[i - 2]) + W[i - 7] + s0(W[i - 15]) + W[i - 16];
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + S1(e) + CH(e, f, g) + K[i] + W[i];
+		t2 = S0(a) + MAJ(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void
+SHA256_Init(SHA256_CTX *ctx)
+{
+	static const uint32_t H[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(ctx->state, H, sizeof(H));
+	ctx->count = 0;
+}
+
+void
+SHA256_Update(SHA256_CTX *ctx, const void *in, size_t len)
+{
+	const uint8_t *p;
+	size_t have, n;
+
+	p = in;
+	have = (size_t) (ctx->count % SHA256_BLOCK_LENGTH);
+	ctx->count += len;
+	if (have > 0) {
+		n = SHA256_BLOCK_LENGTH - have;
+		if (len < n) {
+			memcpy(ctx->buf + have, p, len);
+			return;
+		}
+		memcpy(ctx->buf + have, p, n);
+		SHA256_Transform(ctx->state, ctx->buf);
+		p += n;
+		len -= n;
+	}
+	for (; len >= SHA256_BLOCK_LENGTH; p += SHA256_BLOCK_LENGTH,
+	    len -= SHA256_BLOCK_LENGTH)
+		SHA256_Transform(ctx->state, p);
+	memcpy(ctx->buf, p, len);
+}
+
+void
+SHA256_Final(uint8_t digest[SHA256_DIGEST_LENGTH], SHA256_CTX *ctx)
+{
+	uint64_t bits;
+	size_t have;
+	int i;
+
+	bits = ctx->count * 8;
+	have = (size_t) (ctx->count % SHA256_BLOCK_LENGTH);
+	ctx->buf[have++] = 0x80;
+	if (have > SHA256_BLOCK_LENGTH - 8) {
+		memset(ctx->buf + have, 0, SHA256_BLOCK_LENGTH - have);
+		SHA256_Transform(ctx->state, ctx->buf);
+		have = 0;
+	}
+	memset(ctx->buf + have, 0, SHA256_BLOCK_LENGTH - 8 - have);
+	for (i = 0; i < 8; i++)
+		ctx->buf[SHA256_BLOCK_LENGTH - 1 - i] = (uint8_t) (bits >> (8 * i));
+	SHA256_Transform(ctx->state, ctx->buf);
+
+	for (i = 0; i < 8; i++) {
+		digest[4 * i] = (uint8_t) (ctx->state[i] >> 24);
+		digest[4 * i + 1] = (uint8_t) (ctx->state[i] >> 16);
+		digest[4 * i + 2] = (uint8_t) (ctx->state[i] >> 8);
+		digest[4 * i + 3] = (uint8_t) ctx->state[i];
+	}
+	memset(ctx, 0, sizeof(*ctx));
+}
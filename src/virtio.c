@@ -27,10 +27,14 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/param.h>
 #include <sys/uio.h>
 #include <xhyve/support/misc.h>
+#include <xhyve/support/atomic.h>
 #include <xhyve/xhyve.h>
 #include <xhyve/pci_emul.h>
 #include <xhyve/virtio.h>
@@ -47,6 +51,28 @@
  */
 #define DEV_SOFTC(vs) ((void *)(vs))
 
+/*
+ * Features offered through the modern transport, less those that only
+ * exist for legacy devices.
+ */
+#define VI_MODERN_CAPS(vc) \
+	(((vc)->vc_hv_caps & ~(uint64_t) VIRTIO_F_NOTIFY_ON_EMPTY) | \
+	VIRTIO_CORE_CAPS | VIRTIO_F_VERSION_1)
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wpadded"
+/*
+ * Interrupt moderation state of a device, allocated by the first
+ * vi_set_intr_mod().  im_mtx protects the vq_mod_* fields of its
+ * queues and is never held while interrupting the guest.
+ */
+struct vi_intr_mod {
+	pthread_mutex_t im_mtx;
+	pthread_cond_t im_cond;
+	pthread_t im_tid;
+};
+#pragma clang diagnostic pop
+
 /*
  * Link a virtio_softc to its constants, the device softc, and
  * the PCI emulation.
@@ -91,10 +117,30 @@ vi_reset_dev(struct virtio_softc *vs)
 		vq->vq_flags = 0;
 		vq->vq_last_avail = 0;
 		vq->vq_save_used = 0;
+		vq->vq_next_used = 0;
+		vq->vq_npend = 0;
 		vq->vq_pfn = 0;
 		vq->vq_msix_idx = VIRTIO_MSI_NO_VECTOR;
+		if (vq->vq_maxsize)
+			vq->vq_qsize = vq->vq_maxsize;
+		vq->vq_desc_addr = 0;
+		vq->vq_avail_addr = 0;
+		vq->vq_used_addr = 0;
+		/* Sized for the ring, which the driver sets up anew */
+		free(vq->vq_chainlen);
+		vq->vq_chainlen = NULL;
+	}
+	if (vs->vs_mod != NULL) {
+		pthread_mutex_lock(&vs->vs_mod->im_mtx);
+		for (vq = vs->vs_queues, i = 0; i < nvq; vq++, i++) {
+			vq->vq_mod_cnt = 0;
+			vq->vq_mod_deadline = 0;
+		}
+		pthread_mutex_unlock(&vs->vs_mod->im_mtx);
 	}
 	vs->vs_negotiated_caps = 0;
+	vs->vs_dfselect = 0;
+	vs->vs_gfselect = 0;
 	vs->vs_curq = 0;
 	/* vs->vs_status = 0; -- redundant */
 	if (vs->vs_isr)
@@ -119,6 +165,63 @@ vi_set_io_bar(struct virtio_softc *vs, int barnum)
 	pci_emul_alloc_bar(vs->vs_pi, barnum, PCIBAR_IO, size);
 }
 
+/*
+ * Offer the modern transport as well, with its registers in memory
+ * BAR barnum.  The queue sizes set by now are the largest the guest
+ * may ask for.
+ */
+void
+vi_set_modern_bar(struct virtio_softc *vs, int barnum)
+{
+	struct virtio_pci_notify_cap ncap;
+	struct virtio_pci_cap cap;
+	struct virtio_consts *vc;
+	int i, error;
+
+	vc = vs->vs_vc;
+	for (i = 0; i < vc->vc_nvq; i++)
+		vs->vs_queues[i].vq_maxsize = vs->vs_queues[i].vq_qsize;
+
+	memset(&cap, 0, sizeof(cap));
+	cap.cap_vndr = PCIY_VENDOR;
+	cap.cap_len = sizeof(cap);
+	cap.bar = (uint8_t) barnum;
+
+	cap.cfg_type = VIRTIO_PCI_CAP_COMMON_CFG;
+	cap.offset = VTMOD_COMMON;
+	cap.length = VTMOD_COMMON_SIZE;
+	error = pci_emul_add_capability(vs->vs_pi, (u_char *)&cap, sizeof(cap));
+
+	cap.cfg_type = VIRTIO_PCI_CAP_ISR_CFG;
+	cap.offset = VTMOD_ISR;
+	cap.length = 1;
+	error |= pci_emul_add_capability(vs->vs_pi, (u_char *)&cap, sizeof(cap));
+
+	if (vc->vc_cfgsize) {
+		cap.cfg_type = VIRTIO_PCI_CAP_DEVICE_CFG;
+		cap.offset = VTMOD_DEVICE;
+		cap.length = (uint32_t) vc->vc_cfgsize;
+		error |= pci_emul_add_capability(vs->vs_pi, (u_char *)&cap,
+		    sizeof(cap));
+	}
+
+	ncap.cap = cap;
+	ncap.cap.cap_len = sizeof(ncap);
+	ncap.cap.cfg_type = VIRTIO_PCI_CAP_NOTIFY_CFG;
+	ncap.cap.offset = VTMOD_NOTIFY;
+	ncap.cap.length = (uint32_t) (vc->vc_nvq * VTMOD_NOTIFY_MULT);
+	ncap.notify_off_multiplier = VTMOD_NOTIFY_MULT;
+	error |= pci_emul_add_capability(vs->vs_pi, (u_char *)&ncap,
+	    sizeof(ncap));
+
+	/* Config space has room for these next to MSI and MSI-X */
+	assert(error == 0);
+
+	pci_emul_alloc_bar(vs->vs_pi, barnum, PCIBAR_MEM32, VTMOD_BAR_SIZE);
+	vs->vs_modern_bar = barnum;
+	vs->vs_flags |= VIRTIO_MODERN;
+}
+
 /*
  * Initialize MSI-X vector capabilities if we're to use MSI-X,
  * or MSI capabilities if not.
@@ -151,6 +254,55 @@ vi_intr_init(struct virtio_softc *vs, int barnum, int use_msix)
 	return (0);
 }
 
+/*
+ * Initialize the currently-selected virtio queue (vs->vs_curq) from
+ * the guest physical addresses of its descriptors and of the avail
+ * and used rings, or with a packed ring, of the driver and device
+ * event suppression structures.  The layout follows the features
+ * the guest has negotiated by now.
+ */
+void
+vi_vq_init_rings(struct virtio_softc *vs, uint64_t desc, uint64_t avail,
+	uint64_t used)
+{
+	struct vqueue_info *vq;
+	size_t qsz;
+
+	vq = &vs->vs_queues[vs->vs_curq];
+	qsz = vq->vq_qsize;
+	vq->vq_last_avail = 0;
+	vq->vq_save_used = 0;
+	vq->vq_next_used = 0;
+	vq->vq_npend = 0;
+
+	if (vs->vs_negotiated_caps & VIRTIO_F_RING_PACKED) {
+		vq->vq_pdesc = paddr_guest2host(desc,
+		    qsz * sizeof(struct virtio_packed_desc));
+		vq->vq_drv_event = paddr_guest2host(avail,
+		    sizeof(struct vring_packed_event));
+		vq->vq_dev_event = paddr_guest2host(used,
+		    sizeof(struct vring_packed_event));
+		vq->vq_chainlen = realloc(vq->vq_chainlen,
+		    qsz * sizeof(uint16_t));
+		assert(vq->vq_chainlen != NULL);
+		vq->vq_avail_wrap = 1;
+		vq->vq_used_wrap = 1;
+		vq->vq_save_wrap = 1;
+		vq->vq_flags = VQ_ALLOC | VQ_PACKED;
+		return;
+	}
+
+	vq->vq_desc = paddr_guest2host(desc, qsz * sizeof(struct virtio_desc));
+	/* constant 3 below = va_flags, va_idx, va_used_event */
+	vq->vq_avail = paddr_guest2host(avail, (3 + qsz) * sizeof(uint16_t));
+	/* constant 3 below = vu_flags, vu_idx, vu_avail_event */
+	vq->vq_used = paddr_guest2host(used,
+	    3 * sizeof(uint16_t) + qsz * sizeof(struct virtio_used));
+
+	/* Mark queue as allocated, and start at 0 when we use it. */
+	vq->vq_flags = VQ_ALLOC;
+}
+
 /*
  * Initialize the currently-selected virtio queue (vs->vs_curq).
  * The guest just gave us a page frame number, from which we can
@@ -160,34 +312,23 @@ static void
 vi_vq_init(struct virtio_softc *vs, uint32_t pfn)
 {
 	struct vqueue_info *vq;
-	uint64_t phys;
-	size_t size;
-	char *base;
+	uint64_t desc, avail, used;
 
 	vq = &vs->vs_queues[vs->vs_curq];
 	vq->vq_pfn = pfn;
-	phys = (uint64_t)pfn << VRING_PFN;
-	size = vring_size(vq->vq_qsize);
-	base = paddr_guest2host(phys, size);
 
 	/* First page(s) are descriptors... */
-	vq->vq_desc = (struct virtio_desc *)base;
-	base += vq->vq_qsize * sizeof(struct virtio_desc);
+	desc = (uint64_t)pfn << VRING_PFN;
 
 	/* ... immediately followed by "avail" ring (entirely uint16_t's) */
-	vq->vq_avail = (struct vring_avail *)base;
-	base += (2 + vq->vq_qsize + 1) * sizeof(uint16_t);
+	avail = desc + vq->vq_qsize * sizeof(struct virtio_desc);
 
 	/* Then it's rounded up to the next page... */
-	base = (char *) roundup2(((uintptr_t) base), ((uintptr_t) VRING_ALIGN));
+	used = roundup2(avail + (2 + vq->vq_qsize + 1) * sizeof(uint16_t),
+	    ((uint64_t) VRING_ALIGN));
 
 	/* ... and the last page(s) are the used ring. */
-	vq->vq_used = (struct vring_used *)base;
-
-	/* Mark queue as allocated, and start at 0 when we use it. */
-	vq->vq_flags = VQ_ALLOC;
-	vq->vq_last_avail = 0;
-	vq->vq_save_used = 0;
+	vi_vq_init_rings(vs, desc, avail, used);
 }
 
 /*
@@ -195,18 +336,125 @@ vi_vq_init(struct virtio_softc *vs, uint32_t pfn)
  * descriptor.
  */
 static inline void
-_vq_record(int i, volatile struct virtio_desc *vd, struct iovec *iov, int n_iov,
-	uint16_t *flags)
+_vq_record(int i, uint64_t addr, uint32_t len, uint16_t vflags,
+	struct iovec *iov, int n_iov, uint16_t *flags)
 {
 	if (i >= n_iov)
 		return;
-	iov[i].iov_base = paddr_guest2host(vd->vd_addr, vd->vd_len);
-	iov[i].iov_len = vd->vd_len;
+	iov[i].iov_base = paddr_guest2host(addr, len);
+	iov[i].iov_len = len;
 	if (flags != NULL)
-		flags[i] = vd->vd_flags;
+		flags[i] = vflags;
 }
 #define	VQ_MAX_DESCRIPTORS	512	/* see below */
 
+/*
+ * vq_getchain() for packed rings.  The chain is the available
+ * descriptors from vq_last_avail on, up to the first without NEXT;
+ * *pidx is its buffer id rather than a descriptor index.
+ */
+static int
+vq_getchain_packed(struct vqueue_info *vq, uint16_t *pidx, struct iovec *iov,
+	int n_iov, uint16_t *flags)
+{
+	volatile struct virtio_packed_desc *vd, *vindir;
+	struct virtio_softc *vs;
+	const char *name;
+	u_int n, n_indir, nslots;
+	uint16_t pos, vflags, id;
+	uint8_t wrap;
+	int i;
+
+	vs = vq->vq_vs;
+	name = vs->vs_vc->vc_name;
+
+	if (!vq_has_descs(vq))
+		return (0);
+
+	/*
+	 * The driver makes the first descriptor of a chain available
+	 * last, so the rest of the chain is valid by now.  Like the
+	 * split ring, a bad chain is consumed, as far as we got.
+	 */
+	pos = vq->vq_last_avail;
+	wrap = vq->vq_avail_wrap;
+	i = 0;
+	id = 0;
+	for (nslots = 1;; nslots++) {
+		vd = &vq->vq_pdesc[pos];
+		vflags = vd->vpd_flags;
+		id = vd->vpd_id;
+		if (++pos == vq->vq_qsize) {
+			pos = 0;
+			wrap ^= 1;
+		}
+		if ((vflags & VRING_DESC_F_INDIRECT) == 0) {
+			_vq_record(i, vd->vpd_addr, vd->vpd_len,
+			    vflags & (VRING_DESC_F_NEXT | VRING_DESC_F_WRITE),
+			    iov, n_iov, flags);
+			i++;
+		} else if ((vs->vs_vc->vc_hv_caps &
+		    VIRTIO_RING_F_INDIRECT_DESC) == 0) {
+			fprintf(stderr,
+			    "%s: descriptor has forbidden INDIRECT flag, "
+			    "driver confused?\r\n",
+			    name);
+			goto bad;
+		} else {
+			n_indir = vd->vpd_len / 16;
+			if ((vd->vpd_len & 0xf) || n_indir == 0 ||
+			    (vflags & VRING_DESC_F_NEXT)) {
+				fprintf(stderr,
+				    "%s: invalid indir len 0x%x, "
+				    "driver confused?\r\n",
+				    name, (u_int)vd->vpd_len);
+				goto bad;
+			}
+			vindir = paddr_guest2host(vd->vpd_addr, vd->vpd_len);
+			for (n = 0; n < n_indir; n++) {
+				if (vindir[n].vpd_flags & VRING_DESC_F_INDIRECT) {
+					fprintf(stderr,
+					    "%s: indirect desc has INDIR flag,"
+					    " driver confused?\r\n",
+					    name);
+					goto bad;
+				}
+				_vq_record(i, vindir[n].vpd_addr,
+				    vindir[n].vpd_len, vindir[n].vpd_flags &
+				    VRING_DESC_F_WRITE, iov, n_iov, flags);
+				if (++i > VQ_MAX_DESCRIPTORS)
+					goto loopy;
+			}
+		}
+		if ((vflags & VRING_DESC_F_NEXT) == 0)
+			break;
+		if (i > VQ_MAX_DESCRIPTORS || nslots == vq->vq_qsize)
+			goto loopy;
+	}
+	vq->vq_last_avail = pos;
+	vq->vq_avail_wrap = wrap;
+	vq->vq_last_chain = (uint16_t) nslots;
+	if (id >= vq->vq_qsize) {
+		fprintf(stderr,
+		    "%s: buffer id %u out of range, driver confused?\r\n",
+		    name, id);
+		return (-1);
+	}
+	vq->vq_chainlen[id] = (uint16_t) nslots;
+	*pidx = id;
+	return (i);
+
+loopy:
+	fprintf(stderr,
+	    "%s: descriptor loop? count > %d - driver confused?\r\n",
+	    name, i);
+bad:
+	vq->vq_last_avail = pos;
+	vq->vq_avail_wrap = wrap;
+	vq->vq_last_chain = (uint16_t) nslots;
+	return (-1);
+}
+
 /*
  * Examine the chain of descriptors starting at the "next one" to
  * make sure that they describe a sensible request.  If so, return
@@ -257,6 +505,9 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx, struct iovec *iov,
 	struct virtio_softc *vs;
 	const char *name;
 
+	if (vq->vq_flags & VQ_PACKED)
+		return (vq_getchain_packed(vq, pidx, iov, n_iov, flags));
+
 	vs = vq->vq_vs;
 	name = vs->vs_vc->vc_name;
 
@@ -305,7 +556,8 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx, struct iovec *iov,
 		}
 		vdir = &vq->vq_desc[next];
 		if ((vdir->vd_flags & VRING_DESC_F_INDIRECT) == 0) {
-			_vq_record(i, vdir, iov, n_iov, flags);
+			_vq_record(i, vdir->vd_addr, vdir->vd_len,
+			    vdir->vd_flags, iov, n_iov, flags);
 			i++;
 		} else if ((vs->vs_vc->vc_hv_caps &
 		    VIRTIO_RING_F_INDIRECT_DESC) == 0) {
@@ -341,7 +593,8 @@ vq_getchain(struct vqueue_info *vq, uint16_t *pidx, struct iovec *iov,
 					    name);
 					return (-1);
 				}
-				_vq_record(i, vp, iov, n_iov, flags);
+				_vq_record(i, vp->vd_addr, vp->vd_len,
+				    vp->vd_flags, iov, n_iov, flags);
 				if (++i > VQ_MAX_DESCRIPTORS)
 					goto loopy;
 				if ((vp->vd_flags & VRING_DESC_F_NEXT) == 0)
@@ -366,6 +619,29 @@ loopy:
 	return (-1);
 }
 
+/*
+ * Skip len bytes at the front of a chain, e.g. a header a modern
+ * driver may spread over any number of descriptors, or share with the
+ * data.  Returns the rest of the chain with *niov updated, or NULL if
+ * the chain holds fewer than len bytes.
+ */
+struct iovec *
+vq_iov_skip(struct iovec *iov, int *niov, size_t len)
+{
+	int i;
+
+	for (i = 0; i < *niov && len >= iov[i].iov_len; i++)
+		len -= iov[i].iov_len;
+	if (i == *niov && len > 0)
+		return (NULL);
+	if (i < *niov) {
+		iov[i].iov_base = (void *) ((uintptr_t) iov[i].iov_base + len);
+		iov[i].iov_len -= len;
+	}
+	*niov -= i;
+	return (&iov[i]);
+}
+
 /*
  * Return the currently-first request chain back to the available queue.
  *
@@ -376,6 +652,14 @@ void
 vq_retchain(struct vqueue_info *vq)
 {
 
+	if (vq->vq_flags & VQ_PACKED) {
+		if (vq->vq_last_avail < vq->vq_last_chain) {
+			vq->vq_last_avail += vq->vq_qsize;
+			vq->vq_avail_wrap ^= 1;
+		}
+		vq->vq_last_avail -= vq->vq_last_chain;
+		return;
+	}
 	vq->vq_last_avail--;
 }
 
@@ -389,28 +673,270 @@ vq_retchain(struct vqueue_info *vq)
 void
 vq_relchain(struct vqueue_info *vq, uint16_t idx, uint32_t iolen)
 {
-	uint16_t uidx, mask;
-	volatile struct vring_used *vuh;
+
+	vq_relchain_prepare(vq, idx, iolen);
+	vq_relchain_publish(vq);
+}
+
+/*
+ * Fill in the next "used" ring entry without making it visible to
+ * the guest.  Any number of entries may be prepared this way; they
+ * all become visible at once with vq_relchain_publish().
+ */
+void
+vq_relchain_prepare(struct vqueue_info *vq, uint16_t idx, uint32_t iolen)
+{
+	uint16_t mask, uflags;
 	volatile struct virtio_used *vue;
+	volatile struct virtio_packed_desc *vd;
+
+	if (vq->vq_flags & VQ_PACKED) {
+		/*
+		 * The guest reads used descriptors in ring order and stops
+		 * at the first one not marked used, so holding back the
+		 * flags of the first prepared entry hides all of them.
+		 */
+		vd = &vq->vq_pdesc[vq->vq_next_used];
+		vd->vpd_id = idx;
+		vd->vpd_len = iolen;
+		uflags = vq->vq_used_wrap ?
+		    (VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED) : 0;
+		if (iolen != 0)
+			uflags |= VRING_DESC_F_WRITE;
+		if (vq->vq_npend++ == 0) {
+			vq->vq_pend_used = vq->vq_next_used;
+			vq->vq_pend_flags = uflags;
+		} else {
+			__compiler_membar();
+			vd->vpd_flags = uflags;
+		}
+		vq->vq_next_used += vq->vq_chainlen[idx];
+		if (vq->vq_next_used >= vq->vq_qsize) {
+			vq->vq_next_used -= vq->vq_qsize;
+			vq->vq_used_wrap ^= 1;
+		}
+		return;
+	}
 
 	/*
 	 * Notes:
 	 *  - mask is N-1 where N is a power of 2 so computes x % N
-	 *  - vuh points to the "used" data shared with guest
+	 *  - vq_next_used runs ahead of the guest-visible vu_idx
+	 *    by the number of entries not yet published
 	 *  - vue points to the "used" ring entry we want to update
-	 *  - head is the same value we compute in vq_iovecs().
 	 *
 	 * (I apologize for the two fields named vu_idx; the
 	 * virtio spec calls the one that vue points to, "id"...)
 	 */
 	mask = vq->vq_qsize - 1;
-	vuh = vq->vq_used;
-
-	uidx = vuh->vu_idx;
-	vue = &vuh->vu_ring[uidx++ & mask];
+	vue = &vq->vq_used->vu_ring[vq->vq_next_used++ & mask];
 	vue->vu_idx = idx;
 	vue->vu_tlen = iolen;
-	vuh->vu_idx = uidx;
+	vq->vq_npend++;
+}
+
+/*
+ * Make all prepared "used" entries visible to the guest with a
+ * single update of the shared used index.  The ring entries must
+ * be globally visible before the index that covers them.  With
+ * nothing prepared the guest's cache line is left alone.
+ */
+void
+vq_relchain_publish(struct vqueue_info *vq)
+{
+
+	if (vq->vq_npend == 0)
+		return;
+	vq->vq_npend = 0;
+	__compiler_membar();
+	if (vq->vq_flags & VQ_PACKED) {
+		vq->vq_pdesc[vq->vq_pend_used].vpd_flags = vq->vq_pend_flags;
+		return;
+	}
+	vq->vq_used->vu_idx = vq->vq_next_used;
+}
+
+static uint64_t
+vi_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec);
+}
+
+/*
+ * Delivers the interrupts held back by vq_intr_mod() once they are
+ * due.
+ */
+static void *
+vi_intr_mod_thread(void *param)
+{
+	struct virtio_softc *vs = param;
+	struct vi_intr_mod *im = vs->vs_mod;
+	struct vqueue_info *vq;
+	struct timespec ts;
+	uint64_t now, next;
+	int i, fired;
+
+	pthread_mutex_lock(&im->im_mtx);
+	for (;;) {
+		now = vi_nsecs();
+		next = 0;
+		fired = 0;
+		for (i = 0; i < vs->vs_vc->vc_nvq && !fired; i++) {
+			vq = &vs->vs_queues[i];
+			if (vq->vq_mod_deadline == 0)
+				continue;
+			if (vq->vq_mod_deadline > now) {
+				if (next == 0 || vq->vq_mod_deadline < next)
+					next = vq->vq_mod_deadline;
+				continue;
+			}
+			vq->vq_mod_deadline = 0;
+			vq->vq_mod_cnt = 0;
+			pthread_mutex_unlock(&im->im_mtx);
+			if (vq_ring_ready(vq))
+				vq_interrupt(vs, vq);
+			pthread_mutex_lock(&im->im_mtx);
+			fired = 1;
+		}
+		if (fired)
+			continue;
+		if (next == 0) {
+			pthread_cond_wait(&im->im_cond, &im->im_mtx);
+			continue;
+		}
+		ts.tv_sec = (time_t) ((next - now) / 1000000000);
+		ts.tv_nsec = (long) ((next - now) % 1000000000);
+		pthread_cond_timedwait_relative_np(&im->im_cond, &im->im_mtx, &ts);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Moderate the interrupt decision vq_endchains made for nused new
+ * used entries.  An interrupt is held back until the queue has added
+ * vq_mod_frames entries since the last one (never, if 0), and the
+ * moderation thread delivers it at the latest vq_mod_usecs after it
+ * was first held back.
+ */
+static int
+vq_intr_mod(struct vqueue_info *vq, int intr, int nused)
+{
+	struct vi_intr_mod *im;
+
+	im = vq->vq_vs->vs_mod;
+	pthread_mutex_lock(&im->im_mtx);
+	vq->vq_mod_cnt += (uint32_t) nused;
+	if (intr && vq->vq_mod_deadline == 0) {
+		vq->vq_mod_deadline = vi_nsecs() +
+		    (uint64_t) vq->vq_mod_usecs * 1000;
+		pthread_cond_signal(&im->im_cond);
+	}
+	intr = vq->vq_mod_deadline != 0 && vq->vq_mod_frames != 0 &&
+	    vq->vq_mod_cnt >= vq->vq_mod_frames;
+	if (intr) {
+		vq->vq_mod_deadline = 0;
+		vq->vq_mod_cnt = 0;
+	}
+	pthread_mutex_unlock(&im->im_mtx);
+	return (intr);
+}
+
+/*
+ * Parse a device's "intr=<frames>/<usecs>" option.
+ */
+int
+vi_parse_intr_mod(const char *opt, int *frames, int *usecs)
+{
+	if (sscanf(opt, "intr=%d/%d", frames, usecs) != 2 ||
+	    *frames < 0 || *frames > UINT16_MAX || *usecs < 0) {
+		fprintf(stderr, "Invalid interrupt moderation \"%s\", "
+		    "expected intr=<frames>/<usecs>\n", opt);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Moderate the interrupts of queue qnum: the guest is interrupted
+ * once frames used entries were added since the last interrupt, and
+ * never later than usecs after an interrupt became due.  usecs 0
+ * turns moderation off again.  Call after vi_softc_linkup().
+ */
+void
+vi_set_intr_mod(struct virtio_softc *vs, int qnum, int frames, int usecs)
+{
+	struct vi_intr_mod *im;
+	struct vqueue_info *vq;
+
+	assert(qnum >= 0 && qnum < vs->vs_vc->vc_nvq);
+	if (vs->vs_mod == NULL) {
+		if (usecs == 0)
+			return;
+		im = calloc(1, sizeof(struct vi_intr_mod));
+		assert(im != NULL);
+		pthread_mutex_init(&im->im_mtx, NULL);
+		pthread_cond_init(&im->im_cond, NULL);
+		vs->vs_mod = im;
+		pthread_create(&im->im_tid, NULL, vi_intr_mod_thread, vs);
+	}
+
+	pthread_mutex_lock(&vs->vs_mod->im_mtx);
+	vq = &vs->vs_queues[qnum];
+	vq->vq_mod_frames = (uint16_t) frames;
+	vq->vq_mod_usecs = (uint32_t) usecs;
+	vq->vq_mod_cnt = 0;
+	vq->vq_mod_deadline = 0;
+	pthread_mutex_unlock(&vs->vs_mod->im_mtx);
+}
+
+/*
+ * vq_endchains() for packed rings.  Ring slots are counted from the
+ * start of the current lap of vq_next_used, so the slot of the last
+ * interrupt check and the one the guest wants an event at may be
+ * negative.
+ */
+static void
+vq_endchains_packed(struct vqueue_info *vq, int used_all_avail)
+{
+	struct virtio_softc *vs;
+	uint16_t off_wrap, eflags;
+	int event, new_pos, old_pos, intr;
+
+	vs = vq->vq_vs;
+	new_pos = vq->vq_next_used;
+	old_pos = vq->vq_save_used;
+	if (vq->vq_save_wrap != vq->vq_used_wrap)
+		old_pos -= vq->vq_qsize;
+	vq->vq_save_used = vq->vq_next_used;
+	vq->vq_save_wrap = vq->vq_used_wrap;
+
+	/* Used descriptors before the guest's event flags */
+	mb();
+	eflags = vq->vq_drv_event->vpe_flags;
+	if (used_all_avail &&
+	    (vs->vs_negotiated_caps & VIRTIO_F_NOTIFY_ON_EMPTY))
+		intr = 1;
+	else if (new_pos == old_pos ||
+	    eflags == VRING_PACKED_EVENT_F_DISABLE)
+		intr = 0;
+	else if (eflags == VRING_PACKED_EVENT_F_DESC &&
+	    (vs->vs_negotiated_caps & VIRTIO_RING_F_EVENT_IDX)) {
+		off_wrap = vq->vq_drv_event->vpe_off_wrap;
+		event = off_wrap & ~VRING_PACKED_EVENT_WRAP;
+		if (((off_wrap & VRING_PACKED_EVENT_WRAP) != 0) !=
+		    vq->vq_used_wrap)
+			event -= vq->vq_qsize;
+		intr = event >= old_pos && event < new_pos;
+	} else
+		intr = 1;
+	if (vq->vq_mod_usecs)
+		intr = vq_intr_mod(vq, intr, new_pos - old_pos);
+	if (intr)
+		vq_interrupt(vs, vq);
 }
 
 /*
@@ -445,6 +971,10 @@ vq_endchains(struct vqueue_info *vq, int used_all_avail)
 	 * entire avail was processed, we need to interrupt always.
 	 */
 	vs = vq->vq_vs;
+	if (vq->vq_flags & VQ_PACKED) {
+		vq_endchains_packed(vq, used_all_avail);
+		return;
+	}
 	old_idx = vq->vq_save_used;
 	vq->vq_save_used = new_idx = vq->vq_used->vu_idx;
 	if (used_all_avail &&
@@ -462,6 +992,8 @@ vq_endchains(struct vqueue_info *vq, int used_all_avail)
 		intr = new_idx != old_idx &&
 		    !(vq->vq_avail->va_flags & VRING_AVAIL_F_NO_INTERRUPT);
 	}
+	if (vq->vq_mod_usecs)
+		intr = vq_intr_mod(vq, intr, (uint16_t) (new_idx - old_idx));
 	if (intr)
 		vq_interrupt(vs, vq);
 }
@@ -508,6 +1040,248 @@ vi_find_cr(int offset) {
 	return (NULL);
 }
 
+/*
+ * The guest kicked a queue.
+ */
+static void
+vi_qnotify(struct virtio_softc *vs, uint64_t qnum)
+{
+	struct virtio_consts *vc;
+	struct vqueue_info *vq;
+
+	vc = vs->vs_vc;
+	if (qnum >= ((uint64_t) vc->vc_nvq)) {
+		fprintf(stderr, "%s: queue %d notify out of range\r\n",
+			vc->vc_name, (int)qnum);
+		return;
+	}
+	vq = &vs->vs_queues[qnum];
+	if (vq->vq_notify)
+		(*vq->vq_notify)(DEV_SOFTC(vs), vq);
+	else if (vc->vc_qnotify)
+		(*vc->vc_qnotify)(DEV_SOFTC(vs), vq);
+	else
+		fprintf(stderr,
+		    "%s: qnotify queue %d: missing vq/vc notify\r\n",
+			vc->vc_name, (int)qnum);
+}
+
+/*
+ * Register reads from the modern BAR, with the softc locked.
+ */
+static uint32_t
+vi_modern_read(struct virtio_softc *vs, uint64_t offset, int size)
+{
+	struct virtio_consts *vc;
+	struct vqueue_info *vq;
+	uint32_t value;
+
+	vc = vs->vs_vc;
+	value = 0;
+	if (offset >= VTMOD_NOTIFY)
+		return (0);
+	if (offset >= VTMOD_DEVICE) {
+		offset -= VTMOD_DEVICE;
+		if (offset + ((unsigned) size) <= vc->vc_cfgsize)
+			(*vc->vc_cfgread)(DEV_SOFTC(vs), ((int) offset), size,
+			    &value);
+		return (value);
+	}
+	if (offset >= VTMOD_ISR) {
+		if (offset == VTMOD_ISR) {
+			value = vs->vs_isr;
+			vs->vs_isr = 0;		/* a read clears this flag */
+			if (value)
+				pci_lintr_deassert(vs->vs_pi);
+		}
+		return (value);
+	}
+
+	vq = vs->vs_curq < vc->vc_nvq ? &vs->vs_queues[vs->vs_curq] : NULL;
+	switch (offset) {
+	case VTMOD_R_DFSELECT:
+		value = vs->vs_dfselect;
+		break;
+	case VTMOD_R_DF:
+		if (vs->vs_dfselect < 2)
+			value = (uint32_t) (VI_MODERN_CAPS(vc) >>
+			    (32 * vs->vs_dfselect));
+		break;
+	case VTMOD_R_GFSELECT:
+		value = vs->vs_gfselect;
+		break;
+	case VTMOD_R_GF:
+		if (vs->vs_gfselect < 2)
+			value = (uint32_t) (vs->vs_negotiated_caps >>
+			    (32 * vs->vs_gfselect));
+		break;
+	case VTMOD_R_CFGVEC:
+		value = vs->vs_msix_cfg_idx;
+		break;
+	case VTMOD_R_NUMQ:
+		value = (uint32_t) vc->vc_nvq;
+		break;
+	case VTMOD_R_STATUS:
+		value = vs->vs_status;
+		break;
+	case VTMOD_R_QSEL:
+		value = (uint32_t) vs->vs_curq;
+		break;
+	case VTMOD_R_QSIZE:
+		value = vq ? vq->vq_qsize : 0;
+		break;
+	case VTMOD_R_QVEC:
+		value = vq ? vq->vq_msix_idx : VIRTIO_MSI_NO_VECTOR;
+		break;
+	case VTMOD_R_QENABLE:
+		value = vq ? (uint32_t) vq_ring_ready(vq) : 0;
+		break;
+	case VTMOD_R_QNOFF:
+		value = (uint32_t) vs->vs_curq;
+		break;
+	case VTMOD_R_QDESC_LO:
+	case VTMOD_R_QDESC_HI:
+		if (vq)
+			value = (uint32_t) (vq->vq_desc_addr >>
+			    (offset == VTMOD_R_QDESC_HI ? 32 : 0));
+		break;
+	case VTMOD_R_QAVAIL_LO:
+	case VTMOD_R_QAVAIL_HI:
+		if (vq)
+			value = (uint32_t) (vq->vq_avail_addr >>
+			    (offset == VTMOD_R_QAVAIL_HI ? 32 : 0));
+		break;
+	case VTMOD_R_QUSED_LO:
+	case VTMOD_R_QUSED_HI:
+		if (vq)
+			value = (uint32_t) (vq->vq_used_addr >>
+			    (offset == VTMOD_R_QUSED_HI ? 32 : 0));
+		break;
+	}
+	if (size < 4)
+		value &= (1u << (size * 8)) - 1;
+	return (value);
+}
+
+static void
+vi_set_addr(uint64_t *addr, uint64_t offset, uint64_t lo, uint32_t value)
+{
+	if (offset == lo)
+		*addr = (*addr & ~0xffffffffull) | value;
+	else
+		*addr = (*addr & 0xffffffffull) | ((uint64_t) value << 32);
+}
+
+/*
+ * Register writes to the modern BAR, with the softc locked.
+ * Queue notifications come first and go straight to the queue.
+ */
+static void
+vi_modern_write(struct virtio_softc *vs, uint64_t offset, int size,
+	uint32_t value)
+{
+	struct virtio_consts *vc;
+	struct vqueue_info *vq;
+	uint64_t caps, mask;
+
+	vc = vs->vs_vc;
+	if (offset >= VTMOD_NOTIFY) {
+		vi_qnotify(vs, (offset - VTMOD_NOTIFY) / VTMOD_NOTIFY_MULT);
+		return;
+	}
+	if (offset >= VTMOD_DEVICE) {
+		offset -= VTMOD_DEVICE;
+		if (offset + ((unsigned) size) <= vc->vc_cfgsize)
+			(*vc->vc_cfgwrite)(DEV_SOFTC(vs), ((int) offset), size,
+			    value);
+		return;
+	}
+	if (offset >= VTMOD_ISR)
+		return;
+
+	vq = vs->vs_curq < vc->vc_nvq ? &vs->vs_queues[vs->vs_curq] : NULL;
+	switch (offset) {
+	case VTMOD_R_DFSELECT:
+		vs->vs_dfselect = value;
+		break;
+	case VTMOD_R_GFSELECT:
+		vs->vs_gfselect = value;
+		break;
+	case VTMOD_R_GF:
+		if (vs->vs_gfselect >= 2 ||
+		    (vs->vs_status & VTCFG_STATUS_FEATURES_OK))
+			break;
+		mask = 0xffffffffull << (32 * vs->vs_gfselect);
+		caps = (vs->vs_negotiated_caps & ~mask) |
+		    (((uint64_t) value << (32 * vs->vs_gfselect)) & mask);
+		vs->vs_negotiated_caps = caps & VI_MODERN_CAPS(vc);
+		break;
+	case VTMOD_R_CFGVEC:
+		vs->vs_msix_cfg_idx = (uint16_t) value;
+		break;
+	case VTMOD_R_STATUS:
+		if (value == 0) {
+			vs->vs_status = 0;
+			(*vc->vc_reset)(DEV_SOFTC(vs));
+			break;
+		}
+		/*
+		 * The features are final once the guest says so. Without
+		 * VERSION_1 it is a legacy driver on the modern transport:
+		 * leave FEATURES_OK clear so that it gives up.
+		 */
+		if (!(vs->vs_negotiated_caps & VIRTIO_F_VERSION_1))
+			value &= ~(uint32_t) VTCFG_STATUS_FEATURES_OK;
+		if ((value & VTCFG_STATUS_FEATURES_OK) &&
+		    !(vs->vs_status & VTCFG_STATUS_FEATURES_OK) &&
+		    vc->vc_apply_features)
+			(*vc->vc_apply_features)(DEV_SOFTC(vs),
+			    vs->vs_negotiated_caps);
+		vs->vs_status = (uint8_t) value;
+		break;
+	case VTMOD_R_QSEL:
+		vs->vs_curq = (int) (value & 0xffff);
+		break;
+	case VTMOD_R_QSIZE:
+		/* Split rings are indexed by masking, see vq_getchain */
+		if (vq == NULL || vq_ring_ready(vq) || value == 0 ||
+		    value > vq->vq_maxsize ||
+		    (!(vs->vs_negotiated_caps & VIRTIO_F_RING_PACKED) &&
+		    (value & (value - 1))))
+			break;
+		vq->vq_qsize = (uint16_t) value;
+		break;
+	case VTMOD_R_QVEC:
+		if (vq)
+			vq->vq_msix_idx = (uint16_t) value;
+		break;
+	case VTMOD_R_QENABLE:
+		if (vq == NULL || vq_ring_ready(vq) || value != 1)
+			break;
+		vi_vq_init_rings(vs, vq->vq_desc_addr, vq->vq_avail_addr,
+		    vq->vq_used_addr);
+		break;
+	case VTMOD_R_QDESC_LO:
+	case VTMOD_R_QDESC_HI:
+		if (vq)
+			vi_set_addr(&vq->vq_desc_addr, offset,
+			    VTMOD_R_QDESC_LO, value);
+		break;
+	case VTMOD_R_QAVAIL_LO:
+	case VTMOD_R_QAVAIL_HI:
+		if (vq)
+			vi_set_addr(&vq->vq_avail_addr, offset,
+			    VTMOD_R_QAVAIL_LO, value);
+		break;
+	case VTMOD_R_QUSED_LO:
+	case VTMOD_R_QUSED_HI:
+		if (vq)
+			vi_set_addr(&vq->vq_used_addr, offset,
+			    VTMOD_R_QUSED_LO, value);
+		break;
+	}
+}
+
 /*
  * Handle pci config space reads.
  * If it's to the MSI-X info, do that.
@@ -534,6 +1308,13 @@ vi_pci_read(UNUSED int vcpu, struct pci_devinst *pi, int baridx,
 		}
 	}
 
+	if ((vs->vs_flags & VIRTIO_MODERN) && baridx == vs->vs_modern_bar) {
+		VS_LOCK(vs);
+		value = vi_modern_read(vs, offset, size);
+		VS_UNLOCK(vs);
+		return (value);
+	}
+
 	/* XXX probably should do something better than just assert() */
 	assert(baridx == 0);
 
@@ -585,10 +1366,10 @@ bad:
 
 	switch (offset) {
 	case VTCFG_R_HOSTCAP:
-		value = (uint32_t) vc->vc_hv_caps;
+		value = (uint32_t) (vc->vc_hv_caps | VIRTIO_CORE_CAPS);
 		break;
 	case VTCFG_R_GUESTCAP:
-		value = vs->vs_negotiated_caps;
+		value = (uint32_t) vs->vs_negotiated_caps;
 		break;
 	case VTCFG_R_PFN:
 		if (vs->vs_curq < vc->vc_nvq)
@@ -655,6 +1436,13 @@ vi_pci_write(UNUSED int vcpu, struct pci_devinst *pi, int baridx,
 		}
 	}
 
+	if ((vs->vs_flags & VIRTIO_MODERN) && baridx == vs->vs_modern_bar) {
+		VS_LOCK(vs);
+		vi_modern_write(vs, offset, size, ((uint32_t) value));
+		VS_UNLOCK(vs);
+		return;
+	}
+
 	/* XXX probably should do something better than just assert() */
 	assert(baridx == 0);
 
@@ -710,7 +1498,8 @@ bad:
 
 	switch (offset) {
 	case VTCFG_R_GUESTCAP:
-		vs->vs_negotiated_caps = (uint32_t) (value & vc->vc_hv_caps);
+		vs->vs_negotiated_caps = (uint32_t) (value &
+		    (vc->vc_hv_caps | VIRTIO_CORE_CAPS));
 		if (vc->vc_apply_features)
 			(*vc->vc_apply_features)(DEV_SOFTC(vs),
 			    vs->vs_negotiated_caps);
@@ -729,20 +1518,7 @@ bad:
 		vs->vs_curq = (int) value;
 		break;
 	case VTCFG_R_QNOTIFY:
-		if (value >= ((uint64_t) vc->vc_nvq)) {
-			fprintf(stderr, "%s: queue %d notify out of range\r\n",
-				name, (int)value);
-			goto done;
-		}
-		vq = &vs->vs_queues[value];
-		if (vq->vq_notify)
-			(*vq->vq_notify)(DEV_SOFTC(vs), vq);
-		else if (vc->vc_qnotify)
-			(*vc->vc_qnotify)(DEV_SOFTC(vs), vq);
-		else
-			fprintf(stderr,
-			    "%s: qnotify queue %d: missing vq/vc notify\r\n",
-				name, (int)value);
+		vi_qnotify(vs, value);
 		break;
 	case VTCFG_R_STATUS:
 		vs->vs_status = (uint8_t) value;
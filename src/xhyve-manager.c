@@ -15,10 +15,12 @@
 #include <stdarg.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <fcntl.h>
 #include <pwd.h>
 #include <assert.h>
 #include <errno.h>
+#include <libgen.h>
 #include <uuid/uuid.h>
 
 // Constants
@@ -33,6 +35,7 @@
 
 // Local
 #include <xhyve/xhyve.h>
+#include <xhyve/block_if_be.h>
 #include <xhyve-manager/xhyve-manager.h>
 #include <ini/ini.h>
 
@@ -123,6 +126,31 @@ void form_config_string(char **ret, const char* fmt, ...)
   va_end(args);
 }
 
+// A started machine holds an flock(2) on <machine-path>/.lock until
+// xhyve exits. Commands changing its disks take the same lock, so they
+// refuse to run while it is running and it cannot start meanwhile.
+// Returns the locked descriptor, to be kept open, or -1.
+static int lock_machine(const char *machine_name)
+{
+  char *path = NULL;
+  int fd;
+
+  asprintf(&path, "%s/.lock", get_machine_path(machine_name));
+  fd = open(path, O_RDONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    perror(path);
+  } else if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    if (errno == EWOULDBLOCK)
+      fprintf(stderr, "%s is running\n", machine_name);
+    else
+      perror(path);
+    close(fd);
+    fd = -1;
+  }
+  free(path);
+  return fd;
+}
+
 void start_machine(xhyve_virtual_machine_t *machine)
 {
   char *uuid = machine->machine_uuid;
@@ -194,6 +222,9 @@ void start_machine(xhyve_virtual_machine_t *machine)
     printf("%s\n", exec_args[i]);
   }
 
+  if (lock_machine(machine->machine_name) < 0)
+    exit(EXIT_FAILURE);
+
   char cwd[1024];
   chdir(get_machine_path(machine->machine_name));
   if (getcwd(cwd, sizeof(cwd)) != NULL)
@@ -451,6 +482,324 @@ void create_machine(xhyve_virtual_machine_t *machine)
   fflush(stdout);
 }
 
+// Snapshots are overlays stacked on the machine's internal disk, see
+// block_if_ov.c. Each lives next to the base image as <base>.<name>.ov
+// and the disk path in the config always points at the top one, with
+// format=ov. The format of every layer below is recorded in the one
+// above it.
+static xhyve_virtual_machine_t *load_snapshot_machine(const char *machine_name)
+{
+  xhyve_virtual_machine_t *machine = calloc(1, sizeof(xhyve_virtual_machine_t));
+  load_machine_config(machine, machine_name, 0);
+  if (MATCH(machine->machine_name, ""))
+    machine->machine_name = strdup(machine_name);
+  return machine;
+}
+
+// Disk image of the machine, relative paths being relative to the
+// machine directory like when it is started.
+static char *get_disk_path(xhyve_virtual_machine_t *machine)
+{
+  char *path = NULL;
+  size_t len = strcspn(machine->internal_storage_configinfo, ",");
+  if (machine->internal_storage_configinfo[0] == '/')
+    asprintf(&path, "%.*s", (int) len, machine->internal_storage_configinfo);
+  else
+    asprintf(&path, "%s/%.*s", get_machine_path(machine->machine_name), (int) len,
+             machine->internal_storage_configinfo);
+  return path;
+}
+
+// Format of the disk image of the machine as given by its format=
+// option, raw without one, or -1 if it names no format.
+static int get_disk_format(xhyve_virtual_machine_t *machine)
+{
+  char *opts = strdup(machine->internal_storage_configinfo);
+  char *next = opts, *cp;
+  int fmt = BLOCKIF_FMT_RAW;
+
+  strsep(&next, ",");
+  while ((cp = strsep(&next, ",")) != NULL)
+    if (strncmp(cp, "format=", 7) == 0)
+      fmt = blockif_fmt_parse(cp + 7);
+  free(opts);
+  return fmt;
+}
+
+// Point the machine at a new top of its snapshot chain, in format fmt,
+// keeping the other disk options after the path.
+static void set_disk_path(xhyve_virtual_machine_t *machine, const char *path, int fmt)
+{
+  char *configinfo = NULL;
+  char *opts = strdup(machine->internal_storage_configinfo);
+  char *next = opts, *cp;
+
+  if (fmt == BLOCKIF_FMT_RAW)
+    configinfo = strdup(path);
+  else
+    asprintf(&configinfo, "%s,format=%s", path, blockif_fmt_name(fmt));
+  strsep(&next, ",");
+  while ((cp = strsep(&next, ",")) != NULL) {
+    char *tmp = NULL;
+    if (strncmp(cp, "format=", 7) == 0)
+      continue;
+    asprintf(&tmp, "%s,%s", configinfo, cp);
+    free(configinfo);
+    configinfo = tmp;
+  }
+  free(opts);
+  machine->internal_storage_configinfo = configinfo;
+  write_machine_config(machine, get_config_path(machine->machine_name));
+}
+
+typedef struct {
+  char *path;
+  int fmt;
+  struct blockif_ov_info info;
+} disk_layer_t;
+
+// Read the whole snapshot chain of the machine, top first. Returns the
+// number of layers, or -1 if any of them cannot be read.
+static int read_disk_chain(xhyve_virtual_machine_t *machine, disk_layer_t **chain)
+{
+  disk_layer_t *layers = NULL;
+  char *path = get_disk_path(machine);
+  int fmt = get_disk_format(machine);
+  int n = 0;
+
+  if (fmt < 0) {
+    fprintf(stderr, "Unknown image format in %s\n", machine->internal_storage_configinfo);
+    return -1;
+  }
+  for (;;) {
+    if (n == BLOCKIF_OV_MAXLAYERS) {
+      fprintf(stderr, "Snapshot chain deeper than %d\n", BLOCKIF_OV_MAXLAYERS);
+      return -1;
+    }
+    layers = realloc(layers, (size_t) (n + 1) * sizeof(disk_layer_t));
+    layers[n].path = path;
+    layers[n].fmt = fmt;
+    if (blockif_ov_info(path, fmt, &layers[n].info) < 0) {
+      perror(path);
+      return -1;
+    }
+    if (!layers[n++].info.oi_overlay)
+      break;
+    path = strdup(layers[n - 1].info.oi_backing);
+    fmt = layers[n - 1].info.oi_backing_fmt;
+  }
+  *chain = layers;
+  return n;
+}
+
+// Index of the overlay created with snapshot name (the top one if name
+// is NULL), or -1.
+static int find_snapshot(disk_layer_t *chain, int n, const char *name)
+{
+  int i;
+
+  for (i = 0; i < n && chain[i].info.oi_overlay; i++)
+    if (name == NULL || MATCH(chain[i].info.oi_name, name))
+      return i;
+  return -1;
+}
+
+// Overlays are named after the base image of the chain
+static char *get_overlay_path(disk_layer_t *chain, int n, const char *name)
+{
+  char *path = NULL;
+  asprintf(&path, "%s.%s.ov", chain[n - 1].path, name);
+  return path;
+}
+
+static int create_snapshot(const char *machine_name, const char *name)
+{
+  xhyve_virtual_machine_t *machine = load_snapshot_machine(machine_name);
+  disk_layer_t *chain;
+  char *overlay = NULL;
+  int i, n;
+
+  if (strchr(name, '/') != NULL || strchr(name, ',') != NULL) {
+    fprintf(stderr, "Invalid snapshot name %s\n", name);
+    return EXIT_FAILURE;
+  }
+  if (lock_machine(machine_name) < 0 || (n = read_disk_chain(machine, &chain)) < 0)
+    return EXIT_FAILURE;
+  if ((i = find_snapshot(chain, n, name)) >= 0) {
+    fprintf(stderr, "Snapshot %s already exists in %s\n", name, chain[i].path);
+    return EXIT_FAILURE;
+  }
+
+  // The current top becomes read-only, writes go to the new overlay
+  overlay = get_overlay_path(chain, n, name);
+  if (blockif_ov_create(overlay, basename(strdup(chain[0].path)), chain[0].fmt, name) < 0)
+    return EXIT_FAILURE;
+  set_disk_path(machine, overlay, BLOCKIF_FMT_OV);
+  fprintf(stdout, "Snapshot %s of %s taken, writes now go to %s\n", name, machine_name, overlay);
+  return EXIT_SUCCESS;
+}
+
+static int list_snapshots(const char *machine_name)
+{
+  xhyve_virtual_machine_t *machine = load_snapshot_machine(machine_name);
+  disk_layer_t *chain;
+  int i, n;
+
+  if ((n = read_disk_chain(machine, &chain)) < 0)
+    return EXIT_FAILURE;
+  fprintf(stdout, "%-24s %10s  %s\n", "SNAPSHOT", "USED", "IMAGE");
+  for (i = 0; i < n; i++)
+    fprintf(stdout, "%-24s %9lldM  %s\n", chain[i].info.oi_overlay ? chain[i].info.oi_name : "(base)",
+            (long long) chain[i].info.oi_used >> 20, chain[i].path);
+  return EXIT_SUCCESS;
+}
+
+// Drop everything written since snapshot name was taken (the latest one
+// if name is NULL) by replacing its overlay and all above it by an
+// empty one. The new overlay replaces the reverted one in a single
+// rename and the config points at it before any overlay above is
+// deleted, so an interrupted revert leaves at worst unused files.
+static int revert_snapshot(const char *machine_name, const char *name)
+{
+  xhyve_virtual_machine_t *machine = load_snapshot_machine(machine_name);
+  disk_layer_t *chain, *backing;
+  char *path, *tmp = NULL;
+  int i, j, n;
+
+  if (lock_machine(machine_name) < 0 || (n = read_disk_chain(machine, &chain)) < 0)
+    return EXIT_FAILURE;
+  if ((i = find_snapshot(chain, n, name)) < 0) {
+    fprintf(stderr, "No snapshot %s in %s\n", name ? name : "", chain[0].path);
+    return EXIT_FAILURE;
+  }
+  name = chain[i].info.oi_name;
+  backing = &chain[i + 1];
+
+  path = chain[i].path;
+  asprintf(&tmp, "%s.new", path);
+  if (blockif_ov_create(tmp, basename(strdup(backing->path)), backing->fmt, name) < 0)
+    return EXIT_FAILURE;
+  if (rename(tmp, path) < 0) {
+    perror(path);
+    unlink(tmp);
+    return EXIT_FAILURE;
+  }
+  set_disk_path(machine, path, BLOCKIF_FMT_OV);
+  for (j = 0; j < i; j++)
+    if (unlink(chain[j].path) < 0)
+      perror(chain[j].path);
+  fprintf(stdout, "Reverted %s to snapshot %s\n", machine_name, name);
+  return EXIT_SUCCESS;
+}
+
+// Release the zeroed blocks of every image in the disk chain of a
+// machine, which must be stopped. Compressed and deduplicated images
+// have none.
+static int compact_machine(const char *machine_name)
+{
+  xhyve_virtual_machine_t *machine = load_snapshot_machine(machine_name);
+  disk_layer_t *chain;
+  int i, n;
+
+  if (lock_machine(machine_name) < 0 || (n = read_disk_chain(machine, &chain)) < 0)
+    return EXIT_FAILURE;
+  for (i = 0; i < n; i++)
+    if ((chain[i].fmt == BLOCKIF_FMT_RAW || chain[i].fmt == BLOCKIF_FMT_OV) &&
+        blockif_img_compact(chain[i].path, chain[i].fmt) < 0)
+      return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
+
+// Incremental backup through the dirty block bitmap of the disk of a
+// machine, which must be stopped
+static int backup_machine(const char *machine_name, const char *target)
+{
+  xhyve_virtual_machine_t *machine = load_snapshot_machine(machine_name);
+  char *path = get_disk_path(machine);
+  int fmt = get_disk_format(machine);
+
+  if (lock_machine(machine_name) < 0)
+    return EXIT_FAILURE;
+  if (fmt < 0) {
+    fprintf(stderr, "Unknown image format in %s\n", machine->internal_storage_configinfo);
+    return EXIT_FAILURE;
+  }
+  if (blockif_img_backup(path, fmt, target) < 0)
+    return EXIT_FAILURE;
+  fprintf(stdout, "%s backed up to %s\n", machine_name, target);
+  return EXIT_SUCCESS;
+}
+
+// Image arguments are <path>[,format=<fmt>], raw by default, like the
+// disk options. Returns -1 for an unknown format.
+static int get_image_format(char *arg)
+{
+  char *opt = strchr(arg, ',');
+  int fmt;
+
+  if (opt == NULL)
+    return BLOCKIF_FMT_RAW;
+  if (strncmp(opt, ",format=", 8) != 0 || (fmt = blockif_fmt_parse(opt + 8)) < 0) {
+    fprintf(stderr, "Unknown image format in %s\n", arg);
+    return -1;
+  }
+  *opt = '\0';
+  return fmt;
+}
+
+// Commands operating on disk images rather than machines.
+// Returns -1 if command is not one of them.
+int run_disk_command(const char *command, int argc, char **argv)
+{
+  if (MATCH(command, "compress")) {
+    if (argc != 2) print_usage();
+    if (blockif_cz_create(argv[0], argv[1], 0) < 0)
+      return EXIT_FAILURE;
+    fprintf(stdout, "Compressed image written to %s\n", argv[1]);
+    return EXIT_SUCCESS;
+  } else if (MATCH(command, "convert")) {
+    if (argc != 2 && argc != 3) print_usage();
+    const char *ext = strrchr(argv[1], '.');
+    const char *fmt = argc == 3 ? argv[2] : (ext && MATCH(ext, ".cz")) ? "cz" : "raw";
+    int srcfmt = get_image_format(argv[0]);
+    if (srcfmt < 0 || blockif_img_convert(argv[0], srcfmt, argv[1], fmt) < 0)
+      return EXIT_FAILURE;
+    fprintf(stdout, "%s image written to %s\n", fmt, argv[1]);
+    return EXIT_SUCCESS;
+  } else if (MATCH(command, "copy")) {
+    if (argc != 2) print_usage();
+    int srcfmt = get_image_format(argv[0]);
+    if (srcfmt < 0 || blockif_img_copy(argv[0], srcfmt, argv[1]) < 0)
+      return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+  } else if (MATCH(command, "compact")) {
+    if (argc != 1) print_usage();
+    return compact_machine(argv[0]);
+  } else if (MATCH(command, "gc")) {
+    if (argc != 1) print_usage();
+    return blockif_dd_gc(argv[0]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  } else if (MATCH(command, "register")) {
+    if (argc != 1) print_usage();
+    return blockif_dd_register(argv[0]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  } else if (MATCH(command, "unregister")) {
+    if (argc != 2) print_usage();
+    return blockif_dd_unregister(argv[0], argv[1]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  } else if (MATCH(command, "backup")) {
+    if (argc != 2) print_usage();
+    return backup_machine(argv[0], argv[1]);
+  } else if (MATCH(command, "snapshot")) {
+    if (argc != 2) print_usage();
+    return create_snapshot(argv[0], argv[1]);
+  } else if (MATCH(command, "snapshot-list")) {
+    if (argc != 1) print_usage();
+    return list_snapshots(argv[0]);
+  } else if (MATCH(command, "revert")) {
+    if (argc != 1 && argc != 2) print_usage();
+    return revert_snapshot(argv[0], argc == 2 ? argv[1] : NULL);
+  }
+  return -1;
+}
+
 void parse_args(xhyve_virtual_machine_t *machine, const char *command, const char *param)
 {
   if (command && !param) {
@@ -490,14 +839,25 @@ void parse_args(xhyve_virtual_machine_t *machine, const char *command, const cha
 
 int print_usage(void)
 {
-  fprintf(stderr, "Usage: %s <command> <machine-name>\n", program_exec);
+  fprintf(stderr, "Usage: %s <command> [<machine-name>|<disk-image>...]\n", program_exec);
   fprintf(stderr, "\tcommands:\n");
-  fprintf(stderr, "\t  info: show info about VM\n");
-  fprintf(stderr, "\t  start: start VM (needs root)\n");
-  fprintf(stderr, "\t  edit: edit the configuration for VM\n");
+  fprintf(stderr, "\t  info <machine-name>: show info about VM\n");
+  fprintf(stderr, "\t  start <machine-name>: start VM (needs root)\n");
+  fprintf(stderr, "\t  edit <machine-name>: edit the configuration for VM\n");
   fprintf(stderr, "\t  create: create a VM\n");
-  fprintf(stderr, "\t  extract: extract the needed boot images for Linux vms\n");
+  fprintf(stderr, "\t  extract <iso>: extract the needed boot images for Linux vms\n");
   fprintf(stderr, "\t  setup: setup host machine NFS and directories\n");
+  fprintf(stderr, "\t  compress <raw> <out>: make a compressed read-only copy of an image\n");
+  fprintf(stderr, "\t  convert <src>[,format=<fmt>] <dst> [raw|cz|dedup:<store>]: write the contents of an image in another format\n");
+  fprintf(stderr, "\t  copy <src>[,format=<fmt>] <dst>: copy an image, skipping holes and zeroes\n");
+  fprintf(stderr, "\t  compact <machine-name>: release zeroed blocks of the disk of VM\n");
+  fprintf(stderr, "\t  gc <store>: delete the chunks of a dedup store no image references\n");
+  fprintf(stderr, "\t  register <image>: add a moved dedup image to its store\n");
+  fprintf(stderr, "\t  unregister <store> <image>: forget a deleted or moved dedup image, so gc frees its chunks\n");
+  fprintf(stderr, "\t  backup <machine-name> <file>: update a backup of the disk of VM with the blocks changed since\n");
+  fprintf(stderr, "\t  snapshot <machine-name> <name>: snapshot the disk of VM\n");
+  fprintf(stderr, "\t  snapshot-list <machine-name>: show the snapshot chain of VM\n");
+  fprintf(stderr, "\t  revert <machine-name> [name]: discard disk changes since a snapshot\n");
   exit(EXIT_FAILURE);
 }
 
@@ -527,6 +887,10 @@ int main(int argc, char **argv)
   char *machine_name = argv[2];
   xhyve_virtual_machine_t *machine = NULL;
 
+  int ret;
+  if (command && (ret = run_disk_command(command, argc - 2, argv + 2)) >= 0)
+    exit(ret);
+
   parse_args(machine, command, machine_name);
   exit(EXIT_SUCCESS);
 }
@@ -637,63 +637,6 @@ num_vcpus_allowed(void)
 	return (VM_MAXCPU);
 }
 
-static int
-expand_number(const char *buf, uint64_t *num)
-{
-	char *endptr;
-	uintmax_t umaxval;
-	uint64_t number;
-	unsigned shift;
-	int serrno;
-
-	serrno = errno;
-	errno = 0;
-	umaxval = strtoumax(buf, &endptr, 0);
-	if (umaxval > UINT64_MAX)
-		errno = ERANGE;
-	if (errno != 0)
-		return (-1);
-	errno = serrno;
-	number = umaxval;
-
-	switch (tolower((unsigned char)*endptr)) {
-	case 'e':
-		shift = 60;
-		break;
-	case 'p':
-		shift = 50;
-		break;
-	case 't':
-		shift = 40;
-		break;
-	case 'g':
-		shift = 30;
-		break;
-	case 'm':
-		shift = 20;
-		break;
-	case 'k':
-		shift = 10;
-		break;
-	case 'b':
-	case '\0': /* No unit. */
-		*num = number;
-		return (0);
-	default:
-		/* Unrecognized unit. */
-		errno = EINVAL;
-		return (-1);
-	}
-
-	if ((number << shift) >> shift != number) {
-		/* Overflow */
-		errno = ERANGE;
-		return (-1);
-	}
-	*num = number << shift;
-	return (0);
-}
-
 static int
 parse_memsize(const char *opt, size_t *ret_memsize)
 {